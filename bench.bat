@@ -0,0 +1,57 @@
+@REM Copyright 2020 Suhail Alhegry
+@REM
+@REM  Permission is hereby granted, free of charge, to any person or organization
+@REM  obtaining a copy of the software and accompanying documentation covered by
+@REM  this license (the "Software") to use, reproduce, display, distribute,
+@REM  execute, and transmit the Software, and to prepare derivative works of the
+@REM  Software, and to permit third-parties to whom the Software is furnished to
+@REM  do so, all subject to the following:
+@REM  The copyright notices in the Software and this entire statement, including
+@REM  the above license grant, this restriction and the following disclaimer,
+@REM  must be included in all copies of the Software, in whole or in part, and
+@REM  all derivative works of the Software, unless such copies or derivative
+@REM  works are solely in the form of machine-executable object code generated by
+@REM  a source language processor.
+@REM  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+@REM  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+@REM  FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+@REM  SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+@REM  FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+@REM  ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+@REM  DEALINGS IN THE SOFTWARE.
+
+
+@echo off
+@REM PREBARING BUILD
+IF NOT EXIST build mkdir build
+pushd build
+IF NOT EXIST win32_bench mkdir win32_bench
+
+@REM BUILD SETTINGS
+@REM benchmarks are always built with optimizations on
+set CommonFlags=/W3 /MD /nologo /std:c++14 /wd"4200" /Zc:__cplusplus /EHa /O2 /Ot
+set CommonIncludes=/I../inc /I../src /I../test
+set CommonSourceFiles=../test/bench.cpp
+set CommonLinks=/link /incremental:NO /libpath:../lib shlwapi.lib 
+set BuildDir=win32_bench
+set UseClang=false
+
+IF [%~1] == [-c] (
+    set UseClang=true
+)
+
+IF [%UseClang%] == [true] (
+    @echo on
+    clang-cl %CommonFlags% %CommonIncludes% /Fe%BuildDir%/ /Fo%BuildDir%/ %CommonSourceFiles% %CommonLinks%
+    @echo off
+) ELSE (
+    @echo on
+    cl %CommonFlags% %CommonIncludes% /Fe%BuildDir%/ /Fo%BuildDir%/ %CommonSourceFiles% %CommonLinks%
+    @echo off
+)
+@echo off
+pushd %BuildDir%
+set BuildDir=
+bench.exe
+popd
+popd
@@ -40,12 +40,70 @@
 #include <string.h>
 #include <stdlib.h>
 #include <utility>
+#include <memory>
+#include <new>
+#include <type_traits>
 #include <ostream>
+#include <iterator>
+
+// utf8string_shared_pool needs <mutex>, define RYUK_UTF8_SHARED_POOL before including the header to get it
+#if defined(RYUK_UTF8_SHARED_POOL)
+    #include <mutex>
+#endif
+
+// utf8string_mapped_file needs threads and file io, define RYUK_UTF8_MAPPED_FILE before including the header to
+// get it, files are mapped with mmap where there is one, read into memory elsewhere
+#if defined(RYUK_UTF8_MAPPED_FILE)
+    #include <thread>
+    #include <atomic>
+    #include <stdio.h>
+    #if defined(__unix__) || defined(__APPLE__)
+        #define RYUK_UTF8_MMAP 1
+        #include <sys/mman.h>
+        #include <sys/stat.h>
+        #include <fcntl.h>
+        #include <unistd.h>
+    #endif
+#endif
+
+// define RYUK_UTF8_NO_SIMD to force the portable scalar code paths
+#if !defined(RYUK_UTF8_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86))
+    #define RYUK_UTF8_X86 1
+    #include <immintrin.h>
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+    #endif
+    // sse2 is part of x86-64, so code that only needs sse2 needs no dispatch there, 32 bit builds have to enable it
+    #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+        #define RYUK_UTF8_SSE2 1
+    #endif
+#endif
+
+// gcc and clang only allow intrinsics of instruction sets that are enabled for the function,
+// msvc allows them everywhere
+#if defined(__GNUC__) || defined(__clang__)
+    #define RYUK_UTF8_TARGET(isa) __attribute__((target(isa)))
+#else
+    #define RYUK_UTF8_TARGET(isa)
+#endif
+
+// msvc only gives the first empty base class no room unless it's told otherwise
+#if defined(_MSC_VER)
+    #define RYUK_UTF8_EMPTY_BASES __declspec(empty_bases)
+#else
+    #define RYUK_UTF8_EMPTY_BASES
+#endif
 
 namespace ryuk {
     using u8char_t = unsigned char;
     using u32char_t = char32_t;
 
+    // the order of the two octets of a UTF-16 code unit in memory
+    enum UTF16ByteOrder {
+        UTF16ByteOrder_LittleEndian,
+        UTF16ByteOrder_BigEndian,
+    };
+
     namespace internal {
         constexpr u32char_t CODE_POINT_MAX = 0x0010ffffu;
 
@@ -118,134 +176,252 @@ namespace ryuk {
             UTF8Error_InvalidCodePoint,
         };
 
-        UTF8Error increase_safely(u8char_t *&itr, u8char_t *end) {
-            if (++itr == end) {
-                return UTF8Error_NotEnoughRoom;
-            }
-            
-            if (!is_trail(*itr)) {
-                return UTF8Error_IncompleteSequence;
-            }
+        /*
+            validate_next decodes with a shift based state machine, every octet maps to a 64 bit row
+            that holds the next state for each current state, so a step is a load, a shift and a mask.
+            The row load only depends on the octet, not on the previous state, so the only chain between
+            octets is the shift, and there's no branching on the sequence length or on which check failed.
+
+            The row layout is
+                bits  0..53: next state (a shift amount) for each of the 9 states, 6 bits each
+                bits 56..63: the bits of the octet that belong to the code point
+
+            Ascii octets skip the machine, the branch is well predicted on mostly ascii text.
+            The machine only tells valid from invalid, classify_error finds the exact error afterwards.
+            Encoded surrogates are accepted, like they always were.
+        */
+        enum DFAState {
+            DFAState_Start = 0,
+            DFAState_Done = 6,
+            DFAState_Error = 12,
+            DFAState_Need1 = 18,
+            DFAState_Need2 = 24,
+            DFAState_Need3 = 30,
+            DFAState_AfterE0 = 36,
+            DFAState_AfterF0 = 42,
+            DFAState_AfterF4 = 48,
+        };
 
-            return UTF8Error_None;
+        constexpr uint64_t dfa_transition(DFAState from, DFAState to) {
+            return static_cast<uint64_t>(to) << from;
         }
 
-        UTF8Error get_sequence1(u8char_t *&itr, u8char_t *end, u32char_t &c) {
-            if (itr == end) {
-                return UTF8Error_NotEnoughRoom;
-            }
+        // the rows are built at compile time, with single expressions since a c++11 constexpr function is only a return
+        // the transitions out of a lead or a continuation, the states it doesn't continue are left at 0 (Start)
+        constexpr uint64_t dfa_transitions(u8char_t octet) {
+            return octet < 0x80 ? dfa_transition(DFAState_Start, DFAState_Done)
+                : octet < 0xC0 ? dfa_transition(DFAState_Need1, DFAState_Done)
+                    | dfa_transition(DFAState_Need2, DFAState_Need1)
+                    | dfa_transition(DFAState_Need3, DFAState_Need2)
+                    | dfa_transition(DFAState_AfterE0, octet >= 0xA0 ? DFAState_Need1 : DFAState_Error)
+                    | dfa_transition(DFAState_AfterF0, octet >= 0x90 ? DFAState_Need2 : DFAState_Error)
+                    | dfa_transition(DFAState_AfterF4, octet < 0x90 ? DFAState_Need2 : DFAState_Error)
+                : octet < 0xE0 ? dfa_transition(DFAState_Start, octet >= 0xC2 ? DFAState_Need1 : DFAState_Error)
+                : octet < 0xF0 ? dfa_transition(DFAState_Start, octet == 0xE0 ? DFAState_AfterE0 : DFAState_Need2)
+                : octet < 0xF5 ? dfa_transition(DFAState_Start,
+                    octet == 0xF0 ? DFAState_AfterF0 : (octet == 0xF4 ? DFAState_AfterF4 : DFAState_Need3))
+                : 0;
+        }
 
-            c = mask(*itr);
-            
-            return UTF8Error_None;
+        constexpr uint64_t dfa_lead_mask(u8char_t octet) {
+            return octet < 0x80 ? 0x7F : octet < 0xC0 ? 0x3F : octet < 0xE0 ? 0x1F : octet < 0xF0 ? 0x0F : octet < 0xF5 ? 0x07 : 0x3F;
         }
 
-        #define increase_safely_and_return_on_error(itr, end)\
-                {\
-                    UTF8Error result = increase_safely(itr, end);\
-                    if (result != UTF8Error_None) {\
-                        return result;\
-                    }\
-                }
+        // unset transitions are 0 (Start), make them go to Error instead, Done and Error are set already
+        constexpr uint64_t dfa_unset_to_error(uint64_t row, int state) {
+            return state > DFAState_AfterF4 ? row
+                : dfa_unset_to_error((state == DFAState_Done || state == DFAState_Error || ((row >> state) & 63) != 0)
+                    ? row : row | dfa_transition(static_cast<DFAState>(state), DFAState_Error), state + 6);
+        }
 
-        UTF8Error get_sequence2(u8char_t *&itr, u8char_t *end, u32char_t &c) {
-            if (itr == end) {
-                return UTF8Error_NotEnoughRoom;
-            }
+        constexpr uint64_t dfa_row(u8char_t octet) {
+            return dfa_unset_to_error(dfa_transitions(octet)
+                | dfa_transition(DFAState_Done, DFAState_Done) | dfa_transition(DFAState_Error, DFAState_Error), DFAState_Start)
+                | (dfa_lead_mask(octet) << 56);
+        }
 
-            c = mask(*itr);
+        // 0, 1, ..., N - 1 as a parameter pack, to fill the tables below at compile time
+        template<size_t... I>
+        struct index_list {
+            typedef index_list type;
+        };
 
-            increase_safely_and_return_on_error(itr, end);
+        template<typename FIRST, typename SECOND>
+        struct concat_index_list;
 
-            c = ((c << 6) & 0x7FF) + ((*itr) & 0x3F);
+        template<size_t... FIRST, size_t... SECOND>
+        struct concat_index_list<index_list<FIRST...>, index_list<SECOND...>> : index_list<FIRST..., (sizeof...(FIRST) + SECOND)...> {};
 
-            return UTF8Error_None;
-        }
+        // halves N at every step, so even the large tables don't go deep into template instantiations
+        template<size_t N>
+        struct make_index_list : concat_index_list<typename make_index_list<N / 2>::type, typename make_index_list<N - N / 2>::type> {};
 
-        UTF8Error get_sequence3(u8char_t *&itr, u8char_t *end, u32char_t &c) {
-            if (itr == end) {
-                return UTF8Error_NotEnoughRoom;
-            }
+        template<>
+        struct make_index_list<0> : index_list<> {};
 
-            c = mask(*itr);
+        template<>
+        struct make_index_list<1> : index_list<0> {};
 
-            increase_safely_and_return_on_error(itr, end);
+        struct dfa_table {
+            uint64_t rows[256];
+        };
 
-            c = ((c << 12) & 0xFFFF) + ((mask(*itr) << 6) & 0xFFF);
+        template<size_t... I>
+        constexpr dfa_table make_dfa_table(index_list<I...>) {
+            return dfa_table { { dfa_row(static_cast<u8char_t>(I))... } };
+        }
 
-            increase_safely_and_return_on_error(itr, end);
+        constexpr dfa_table DFA = make_dfa_table(make_index_list<256>::type());
+
+        /*
+            The shift machine only knows valid and invalid, this second machine runs once a sequence
+            has failed to find out why. The states that cannot lead to a valid code point anymore keep
+            consuming continuation octets, so the reported error is the same one the length based
+            decoder used to report.
+        */
+        constexpr u8char_t ERROR_CLASS[256] = {
+             0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, // 00
+             0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, // 10
+             0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, // 20
+             0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, // 30
+             0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, // 40
+             0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, // 50
+             0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, // 60
+             0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, // 70
+             1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1, // 80
+             2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2, // 90
+             3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3, // A0
+             3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3, // B0
+             4,  4,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5, // C0
+             5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5, // D0
+             6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7, // E0
+             8,  9,  9,  9, 10, 11, 11, 11, 12, 12, 12, 12, 12, 12, 12, 12, // F0
+        };
 
-            c += (*itr) & 0x3F;
+        enum ErrorState {
+            ErrorState_Accept,
+            // final states
+            ErrorState_InvalidLead,
+            ErrorState_Incomplete,
+            ErrorState_Overlong,
+            ErrorState_InvalidCodePoint,
+            // everything from here on still expects continuation octets
+            ErrorState_Need1,
+            ErrorState_Need2,
+            ErrorState_Need3,
+            ErrorState_AfterE0,
+            ErrorState_AfterF0,
+            ErrorState_AfterF4,
+            ErrorState_Overlong1,
+            ErrorState_Overlong2,
+            ErrorState_TooLarge1,
+            ErrorState_TooLarge2,
+            ErrorState_TooLarge3,
+        };
 
-            return UTF8Error_None;
-        }
+        //   classes: 00..7F, 80..8F, 90..9F, A0..BF, C0..C1, C2..DF, E0, E1..EF, F0, F1..F3, F4, F5..F7, F8..FF
+        constexpr u8char_t ERROR_TRANSITIONS[16 * 16] = {
+            // Accept
+            ErrorState_Accept, ErrorState_InvalidLead, ErrorState_InvalidLead, ErrorState_InvalidLead,
+            ErrorState_Overlong1, ErrorState_Need1, ErrorState_AfterE0, ErrorState_Need2,
+            ErrorState_AfterF0, ErrorState_Need3, ErrorState_AfterF4, ErrorState_TooLarge3,
+            ErrorState_InvalidLead, ErrorState_InvalidLead, ErrorState_InvalidLead, ErrorState_InvalidLead,
+            // InvalidLead, Incomplete, Overlong and InvalidCodePoint are never left
+            1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+            2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+            3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+            4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+            // Need1
+            2, ErrorState_Accept, ErrorState_Accept, ErrorState_Accept, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+            // Need2
+            2, ErrorState_Need1, ErrorState_Need1, ErrorState_Need1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+            // Need3
+            2, ErrorState_Need2, ErrorState_Need2, ErrorState_Need2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+            // AfterE0, 80..9F would encode a code point below U+0800
+            2, ErrorState_Overlong1, ErrorState_Overlong1, ErrorState_Need1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+            // AfterF0, 80..8F would encode a code point below U+10000
+            2, ErrorState_Overlong2, ErrorState_Need2, ErrorState_Need2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+            // AfterF4, 90..BF would encode a code point above U+10FFFF
+            2, ErrorState_Need2, ErrorState_TooLarge2, ErrorState_TooLarge2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+            // Overlong1
+            2, ErrorState_Overlong, ErrorState_Overlong, ErrorState_Overlong, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+            // Overlong2
+            2, ErrorState_Overlong1, ErrorState_Overlong1, ErrorState_Overlong1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+            // TooLarge1
+            2, ErrorState_InvalidCodePoint, ErrorState_InvalidCodePoint, ErrorState_InvalidCodePoint, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+            // TooLarge2
+            2, ErrorState_TooLarge1, ErrorState_TooLarge1, ErrorState_TooLarge1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+            // TooLarge3
+            2, ErrorState_TooLarge2, ErrorState_TooLarge2, ErrorState_TooLarge2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+        };
 
-        UTF8Error get_sequence4(u8char_t *&itr, u8char_t *end, u32char_t &c) {
-            if (itr == end) {
-                return UTF8Error_NotEnoughRoom;
-            }
+        constexpr UTF8Error ERROR_STATE_ERROR[5] = {
+            UTF8Error_None,
+            UTF8Error_InvalidLead,
+            UTF8Error_IncompleteSequence,
+            UTF8Error_OverlongSequence,
+            UTF8Error_InvalidCodePoint,
+        };
 
-            c = mask(*itr);
+        inline UTF8Error classify_error(const u8char_t *itr, const u8char_t *end) {
+            uint32_t state = ErrorState_Accept;
 
-            increase_safely_and_return_on_error(itr, end);
+            do {
+                if (itr == end) {
+                    return UTF8Error_NotEnoughRoom;
+                }
 
-            c = ((c << 18) & 0x1FFFFF) + ((mask(*itr) << 12) & 0x3FFFF);
+                state = ERROR_TRANSITIONS[state * 16 + ERROR_CLASS[*(itr++)]];
+            } while (state >= ErrorState_Need1);
 
-            increase_safely_and_return_on_error(itr, end);
+            return ERROR_STATE_ERROR[state];
+        }
 
-            c += (mask(*itr) << 6) & 0xFFF;
+        inline UTF8Error validate_next_multibyte(u8char_t *&itr, u8char_t *end, u32char_t &c) {
+            u8char_t *current = itr;
+            u32char_t cp = 0;
+            uint64_t state = DFAState_Start;
+
+            if (end - current >= 4) {
+                do {
+                    const u8char_t octet = *(current++);
+                    const uint64_t row = DFA.rows[octet];
+                    cp = (cp << 6) | (octet & (row >> 56));
+                    state = (row >> state) & 63;
+                } while (state >= DFAState_Need1);
+            } else {
+                do {
+                    if (current == end) {
+                        return UTF8Error_NotEnoughRoom;
+                    }
 
-            increase_safely_and_return_on_error(itr, end);
+                    const u8char_t octet = *(current++);
+                    const uint64_t row = DFA.rows[octet];
+                    cp = (cp << 6) | (octet & (row >> 56));
+                    state = (row >> state) & 63;
+                } while (state >= DFAState_Need1);
+            }
 
-            c += (*itr) & 0x3F;
+            if (state != DFAState_Done) {
+                return classify_error(itr, end);
+            }
 
+            c = cp;
+            itr = current;
             return UTF8Error_None;
         }
 
-        UTF8Error validate_next(u8char_t *&itr, u8char_t *end, u32char_t &c) {
+        inline UTF8Error validate_next(u8char_t *&itr, u8char_t *end, u32char_t &c) {
             if (itr == end) {
                 return UTF8Error_NotEnoughRoom;
             }
 
-            u8char_t *original = itr;
-            u32char_t cp = 0;
-
-            const uint8_t length = sequence_length(*itr);
-
-            UTF8Error result = UTF8Error_None;
-
-            switch (length) {
-                case 0: return UTF8Error_InvalidLead;
-                case 1: {
-                    result = get_sequence1(itr, end, cp);
-                } break;
-                case 2: {
-                    result = get_sequence2(itr, end, cp);
-                } break;
-                case 3: {
-                    result = get_sequence3(itr, end, cp);
-                } break;
-                case 4: {
-                    result = get_sequence4(itr, end, cp);
-                } break;
-            }
-
-            if (result == UTF8Error_None) {
-                if (is_code_point_valid(cp)) {
-                    if (!is_overlong_sequence(cp, length)) {
-                        c = cp;
-                        ++itr;
-                        return UTF8Error_None;
-                    }
-
-                    result = UTF8Error_OverlongSequence;
-                } else {
-                    result = UTF8Error_InvalidCodePoint;
-                }
+            if (*itr < 0x80) {
+                c = *(itr++);
+                return UTF8Error_None;
             }
 
-            itr = original;
-            return result;
+            return validate_next_multibyte(itr, end, c);
         }
 
         inline UTF8Error validate_next(u8char_t *&itr, u8char_t* end) {
@@ -254,713 +430,6918 @@ namespace ryuk {
         }
 
         constexpr u8char_t BOM[] = { 0xEF, 0xBB, 0xBF };
+        constexpr char16_t UTF16_BOM = 0xFEFF;
 
-        u8char_t *find_invalid(u8char_t *start, u8char_t *end) {
-            u8char_t *result = start;
+        enum SIMDLevel {
+            SIMDLevel_None,
+            SIMDLevel_SSE42,
+            SIMDLevel_AVX2,
+            SIMDLevel_AVX512,
+        };
 
-            while (result != end) {
-                UTF8Error error = validate_next(result, end);
-                if (error != UTF8Error_None) {
-                    return result;
-                }
+        inline SIMDLevel detect_simd_level() {
+        #if defined(RYUK_UTF8_X86)
+        #if defined(_MSC_VER)
+            int info[4];
+            __cpuid(info, 0);
+            const int maxLeaf = info[0];
+
+            __cpuid(info, 1);
+            const bool sse42 = (info[2] & (1 << 20)) != 0;
+            const bool osxsave = (info[2] & (1 << 27)) != 0;
+
+            if (!sse42) {
+                return SIMDLevel_None;
             }
 
-            return result;
-        }
+            if (!osxsave || maxLeaf < 7) {
+                return SIMDLevel_SSE42;
+            }
 
-        inline bool is_valid(u8char_t *start, u8char_t *end) {
-            return (find_invalid(start, end) == end);
+            // the os has to save the ymm (and zmm) registers on context switches
+            const unsigned long long xcr0 = _xgetbv(0);
+            __cpuidex(info, 7, 0);
+            const bool avx2 = ((xcr0 & 0x6) == 0x6) && (info[1] & (1 << 5)) != 0;
+            const bool avx512 = ((xcr0 & 0xE6) == 0xE6) && (info[1] & (1 << 16)) != 0 && (info[1] & (1 << 30)) != 0;
+        #else
+            __builtin_cpu_init();
+            const bool sse42 = __builtin_cpu_supports("sse4.2");
+            const bool avx2 = __builtin_cpu_supports("avx2");
+            const bool avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+
+            if (!sse42) {
+                return SIMDLevel_None;
+            }
+        #endif
+            if (avx512) {
+                return SIMDLevel_AVX512;
+            } else if (avx2) {
+                return SIMDLevel_AVX2;
+            }
+
+            return SIMDLevel_SSE42;
+        #else
+            return SIMDLevel_None;
+        #endif
         }
 
-        inline bool starts_with_bom(u8char_t *itr, u8char_t *end) {
-            return (
-                ((itr != end) && (mask(*itr++)) == BOM[0]) &&
-                ((itr != end) && (mask(*itr++)) == BOM[1]) &&
-                ((itr != end) && (mask(*itr)) == BOM[2])
-            );
+        inline SIMDLevel simd_level() {
+            static const SIMDLevel level = detect_simd_level();
+            return level;
         }
 
-        u8char_t *append(u32char_t cp, u8char_t *result) {
-            if (!is_code_point_valid(cp)) {
-                return result;
+        // the block that failed the vectorized check may have been entered in the middle of a sequence,
+        // so the scalar validator has to resume from the start of the sequence that contains pos[-1]
+        inline u8char_t *sequence_start_before(u8char_t *start, u8char_t *pos) {
+            if (pos == start) {
+                return start;
             }
 
-            if (cp < 0x80) {
-                *(result++) = static_cast<u8char_t>(  cp);
-            } else if (cp < 0x800) {
-                *(result++) = static_cast<u8char_t>( (cp  >>    6)          | 0xc0);
-                *(result++) = static_cast<u8char_t>( (cp  &  0x3f)          | 0x80);
-            } else if (cp < 0x10000) {
-                *(result++) = static_cast<u8char_t>( (cp  >>   12)          | 0xe0);
-                *(result++) = static_cast<u8char_t>(((cp  >>    6) & 0x3f)  | 0x80);
-                *(result++) = static_cast<u8char_t>( (cp  &  0x3f)          | 0x80);
-            } else {
-                *(result++) = static_cast<u8char_t>( (cp  >>   18)          | 0xf0);
-                *(result++) = static_cast<u8char_t>(((cp  >>   12)  & 0x3f) | 0x80);
-                *(result++) = static_cast<u8char_t>(((cp  >>    6)  & 0x3f) | 0x80);
-                *(result++) = static_cast<u8char_t>( (cp  &  0x3f)          | 0x80);
+            u8char_t *itr = pos - 1;
+            for (int i = 0; i < 3 && itr != start && is_trail(*itr); ++i) {
+                --itr;
             }
-            
-            return result;
-        }
 
-        u32char_t next(u8char_t *&itr, u8char_t *end) {
-            u32char_t result = 0;
-            validate_next(itr, end, result);
-            return result;
+            return itr;
         }
 
-        u32char_t peek_next(u8char_t *itr, u8char_t *end) {
-            return next(itr, end);
+    #if defined(RYUK_UTF8_X86)
+        /*
+            The vectorized validators classify every byte together with the three bytes before it
+            using nibble lookup tables (John Keiser, Daniel Lemire, "Validating UTF-8 In Less Than One
+            Instruction Per Byte"). They only tell whether a block is valid, the exact error and its
+            position are always recovered by validate_next, so the semantics match the scalar path.
+            Unlike the paper we accept encoded surrogates, because validate_next does too.
+        */
+        constexpr u8char_t SIMD_TOO_SHORT = 1 << 0;
+        constexpr u8char_t SIMD_TOO_LONG = 1 << 1;
+        constexpr u8char_t SIMD_OVERLONG_3 = 1 << 2;
+        constexpr u8char_t SIMD_TOO_LARGE = 1 << 3;
+        constexpr u8char_t SIMD_OVERLONG_2 = 1 << 5;
+        constexpr u8char_t SIMD_TOO_LARGE_1000 = 1 << 6;
+        constexpr u8char_t SIMD_OVERLONG_4 = 1 << 6;
+        constexpr u8char_t SIMD_TWO_CONTS = 1 << 7;
+        constexpr u8char_t SIMD_CARRY = SIMD_TOO_SHORT | SIMD_TOO_LONG | SIMD_TWO_CONTS;
+
+        // indexed by the high nibble of the first byte
+        constexpr u8char_t SIMD_BYTE_1_HIGH[16] = {
+            // 0_______ ________ <ascii>
+            SIMD_TOO_LONG, SIMD_TOO_LONG, SIMD_TOO_LONG, SIMD_TOO_LONG,
+            SIMD_TOO_LONG, SIMD_TOO_LONG, SIMD_TOO_LONG, SIMD_TOO_LONG,
+            // 10______ ________ <continuation>
+            SIMD_TWO_CONTS, SIMD_TWO_CONTS, SIMD_TWO_CONTS, SIMD_TWO_CONTS,
+            // 1100____ ________ <two byte lead>
+            SIMD_TOO_SHORT | SIMD_OVERLONG_2,
+            // 1101____ ________ <two byte lead>
+            SIMD_TOO_SHORT,
+            // 1110____ ________ <three byte lead>
+            SIMD_TOO_SHORT | SIMD_OVERLONG_3,
+            // 1111____ ________ <four byte lead>
+            SIMD_TOO_SHORT | SIMD_TOO_LARGE | SIMD_TOO_LARGE_1000 | SIMD_OVERLONG_4,
+        };
+
+        // indexed by the low nibble of the first byte
+        constexpr u8char_t SIMD_BYTE_1_LOW[16] = {
+            // ____0000 ________
+            SIMD_CARRY | SIMD_OVERLONG_2 | SIMD_OVERLONG_3 | SIMD_OVERLONG_4,
+            // ____0001 ________
+            SIMD_CARRY | SIMD_OVERLONG_2,
+            // ____001_ ________
+            SIMD_CARRY,
+            SIMD_CARRY,
+            // ____0100 ________
+            SIMD_CARRY | SIMD_TOO_LARGE,
+            // ____0101 ________ and above
+            SIMD_CARRY | SIMD_TOO_LARGE | SIMD_TOO_LARGE_1000,
+            SIMD_CARRY | SIMD_TOO_LARGE | SIMD_TOO_LARGE_1000,
+            SIMD_CARRY | SIMD_TOO_LARGE | SIMD_TOO_LARGE_1000,
+            SIMD_CARRY | SIMD_TOO_LARGE | SIMD_TOO_LARGE_1000,
+            SIMD_CARRY | SIMD_TOO_LARGE | SIMD_TOO_LARGE_1000,
+            SIMD_CARRY | SIMD_TOO_LARGE | SIMD_TOO_LARGE_1000,
+            SIMD_CARRY | SIMD_TOO_LARGE | SIMD_TOO_LARGE_1000,
+            SIMD_CARRY | SIMD_TOO_LARGE | SIMD_TOO_LARGE_1000,
+            SIMD_CARRY | SIMD_TOO_LARGE | SIMD_TOO_LARGE_1000,
+            SIMD_CARRY | SIMD_TOO_LARGE | SIMD_TOO_LARGE_1000,
+            SIMD_CARRY | SIMD_TOO_LARGE | SIMD_TOO_LARGE_1000,
+        };
+
+        // indexed by the high nibble of the second byte
+        constexpr u8char_t SIMD_BYTE_2_HIGH[16] = {
+            // ________ 0_______ <ascii>
+            SIMD_TOO_SHORT, SIMD_TOO_SHORT, SIMD_TOO_SHORT, SIMD_TOO_SHORT,
+            SIMD_TOO_SHORT, SIMD_TOO_SHORT, SIMD_TOO_SHORT, SIMD_TOO_SHORT,
+            // ________ 1000____
+            SIMD_TOO_LONG | SIMD_OVERLONG_2 | SIMD_TWO_CONTS | SIMD_OVERLONG_3 | SIMD_TOO_LARGE_1000 | SIMD_OVERLONG_4,
+            // ________ 1001____
+            SIMD_TOO_LONG | SIMD_OVERLONG_2 | SIMD_TWO_CONTS | SIMD_OVERLONG_3 | SIMD_TOO_LARGE,
+            // ________ 101_____
+            SIMD_TOO_LONG | SIMD_OVERLONG_2 | SIMD_TWO_CONTS | SIMD_TOO_LARGE,
+            SIMD_TOO_LONG | SIMD_OVERLONG_2 | SIMD_TWO_CONTS | SIMD_TOO_LARGE,
+            // ________ 11______
+            SIMD_TOO_SHORT, SIMD_TOO_SHORT, SIMD_TOO_SHORT, SIMD_TOO_SHORT,
+        };
+
+        // a block that ends with one of these lead bytes continues in the next block
+        constexpr u8char_t SIMD_INCOMPLETE_MAX[64] = {
+            0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+            0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+            0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+            0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1,
+        };
+
+        RYUK_UTF8_TARGET("sse4.2")
+        inline __m128i classify_sse42(__m128i input, __m128i prev1) {
+            const __m128i nibble = _mm_set1_epi8(0x0F);
+            const __m128i byte1High = _mm_shuffle_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(SIMD_BYTE_1_HIGH)),
+                _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+            const __m128i byte1Low = _mm_shuffle_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(SIMD_BYTE_1_LOW)),
+                _mm_and_si128(prev1, nibble));
+            const __m128i byte2High = _mm_shuffle_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(SIMD_BYTE_2_HIGH)),
+                _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+            return _mm_and_si128(_mm_and_si128(byte1High, byte1Low), byte2High);
         }
 
-        u32char_t previous(u8char_t *&itr, u8char_t *start) {
-            if (itr == start) {
-                return 0;
-            }
-            
-            u8char_t *end = itr;
+        RYUK_UTF8_TARGET("sse4.2")
+        inline u8char_t *validate_prefix_sse42(u8char_t *start, u8char_t *end) {
+            const __m128i incompleteMax = _mm_loadu_si128(reinterpret_cast<const __m128i *>(SIMD_INCOMPLETE_MAX + 48));
+            // third and fourth bytes of a sequence must be continuations
+            const __m128i thirdByte = _mm_set1_epi8(static_cast<char>(0xE0 - 0x80));
+            const __m128i fourthByte = _mm_set1_epi8(static_cast<char>(0xF0 - 0x80));
+            const __m128i highBit = _mm_set1_epi8(static_cast<char>(0x80));
+            __m128i previous = _mm_setzero_si128();
+            __m128i previousIncomplete = _mm_setzero_si128();
+            u8char_t *itr = start;
+
+            while (end - itr >= 16) {
+                const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr));
+                __m128i error;
+
+                if (_mm_movemask_epi8(input) == 0) {
+                    error = previousIncomplete;
+                    previousIncomplete = _mm_setzero_si128();
+                } else {
+                    const __m128i prev1 = _mm_alignr_epi8(input, previous, 15);
+                    const __m128i prev2 = _mm_alignr_epi8(input, previous, 14);
+                    const __m128i prev3 = _mm_alignr_epi8(input, previous, 13);
+                    const __m128i special = classify_sse42(input, prev1);
+                    const __m128i must23 = _mm_and_si128(_mm_or_si128(
+                        _mm_subs_epu8(prev2, thirdByte),
+                        _mm_subs_epu8(prev3, fourthByte)), highBit);
+                    error = _mm_xor_si128(must23, special);
+                    previousIncomplete = _mm_subs_epu8(input, incompleteMax);
+                }
 
-            while (is_trail(*(--itr))) {
-                if (itr == start) {
-                    return 0;
+                if (!_mm_testz_si128(error, error)) {
+                    return sequence_start_before(start, itr);
                 }
+
+                previous = input;
+                itr += 16;
             }
 
-            return peek_next(itr, end);
+            return sequence_start_before(start, itr);
         }
 
-        void advance(u8char_t *&itr, u8char_t *end, size_t count) {
-            for (size_t i = 0; i < count; ++i) {
-                next(itr, end);
+        RYUK_UTF8_TARGET("avx2")
+        inline __m256i previous_avx2(__m256i input, __m256i previous, int count) {
+            // the alignr shift has to be an immediate
+            const __m256i shifted = _mm256_permute2x128_si256(previous, input, 0x21);
+            switch (count) {
+                case 1: return _mm256_alignr_epi8(input, shifted, 15);
+                case 2: return _mm256_alignr_epi8(input, shifted, 14);
+                default: return _mm256_alignr_epi8(input, shifted, 13);
             }
         }
 
-        void revert(u8char_t *&itr, u8char_t *start, size_t count) {
-            for (size_t i = count; i > 0; --i) {
-                previous(itr, start);
-            }
+        RYUK_UTF8_TARGET("avx2")
+        inline __m256i load_table_avx2(const u8char_t *table) {
+            return _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(table)));
         }
 
-        size_t distance(u8char_t *first, u8char_t *last) {
-            size_t result;
+        RYUK_UTF8_TARGET("avx2")
+        inline u8char_t *validate_prefix_avx2(u8char_t *start, u8char_t *end) {
+            const __m256i byte1HighTable = load_table_avx2(SIMD_BYTE_1_HIGH);
+            const __m256i byte1LowTable = load_table_avx2(SIMD_BYTE_1_LOW);
+            const __m256i byte2HighTable = load_table_avx2(SIMD_BYTE_2_HIGH);
+            const __m256i incompleteMax = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(SIMD_INCOMPLETE_MAX + 32));
+            const __m256i nibble = _mm256_set1_epi8(0x0F);
+            const __m256i thirdByte = _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80));
+            const __m256i fourthByte = _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80));
+            const __m256i highBit = _mm256_set1_epi8(static_cast<char>(0x80));
+            __m256i previous = _mm256_setzero_si256();
+            __m256i previousIncomplete = _mm256_setzero_si256();
+            u8char_t *itr = start;
+
+            while (end - itr >= 32) {
+                const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(itr));
+                __m256i error;
+
+                if (_mm256_movemask_epi8(input) == 0) {
+                    error = previousIncomplete;
+                    previousIncomplete = _mm256_setzero_si256();
+                } else {
+                    const __m256i prev1 = previous_avx2(input, previous, 1);
+                    const __m256i prev2 = previous_avx2(input, previous, 2);
+                    const __m256i prev3 = previous_avx2(input, previous, 3);
+                    const __m256i byte1High = _mm256_shuffle_epi8(byte1HighTable, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+                    const __m256i byte1Low = _mm256_shuffle_epi8(byte1LowTable, _mm256_and_si256(prev1, nibble));
+                    const __m256i byte2High = _mm256_shuffle_epi8(byte2HighTable, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+                    const __m256i special = _mm256_and_si256(_mm256_and_si256(byte1High, byte1Low), byte2High);
+                    const __m256i must23 = _mm256_and_si256(_mm256_or_si256(
+                        _mm256_subs_epu8(prev2, thirdByte),
+                        _mm256_subs_epu8(prev3, fourthByte)), highBit);
+                    error = _mm256_xor_si256(must23, special);
+                    previousIncomplete = _mm256_subs_epu8(input, incompleteMax);
+                }
 
-            for (result = 0; first < last; ++result) {
-                if (next(first, last) == 0) {
-                    return 0;
+                if (!_mm256_testz_si256(error, error)) {
+                    return sequence_start_before(start, itr);
                 }
+
+                previous = input;
+                itr += 32;
             }
 
-            return result;
+            return sequence_start_before(start, itr);
         }
 
-        u8char_t *utf32_to_utf8(u32char_t *start, u32char_t *end, u8char_t *result) {
-            while (start != end) {
-                result = append(*(start++), result);
+        RYUK_UTF8_TARGET("avx512f,avx512bw")
+        inline __m512i previous_avx512(__m512i input, __m512i previous, int count) {
+            // every 128 bit lane is paired with the lane before it, the first one with the last lane of previous
+            const __m512i shifted = _mm512_permutex2var_epi64(previous, _mm512_set_epi64(13, 12, 11, 10, 9, 8, 7, 6), input);
+            switch (count) {
+                case 1: return _mm512_alignr_epi8(input, shifted, 15);
+                case 2: return _mm512_alignr_epi8(input, shifted, 14);
+                default: return _mm512_alignr_epi8(input, shifted, 13);
             }
+        }
 
-            return result;
+        // the zero masked forms of broadcast and extract, the plain ones pass an undefined vector through and gcc
+        // warns that it's used uninitialized
+        RYUK_UTF8_TARGET("avx512f,avx512bw")
+        inline __m512i load_table_avx512(const u8char_t *table) {
+            return _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_loadu_si128(reinterpret_cast<const __m128i *>(table)));
         }
 
-        u32char_t *utf8_to_utf32(u8char_t *start, u8char_t *end, u32char_t *result) {
-            while (start < end) {
-                *(result++) = next(start, end);
+        RYUK_UTF8_TARGET("avx512f,avx512bw")
+        inline u8char_t *validate_prefix_avx512(u8char_t *start, u8char_t *end) {
+            const __m512i byte1HighTable = load_table_avx512(SIMD_BYTE_1_HIGH);
+            const __m512i byte1LowTable = load_table_avx512(SIMD_BYTE_1_LOW);
+            const __m512i byte2HighTable = load_table_avx512(SIMD_BYTE_2_HIGH);
+            const __m512i incompleteMax = _mm512_loadu_si512(SIMD_INCOMPLETE_MAX);
+            const __m512i nibble = _mm512_set1_epi8(0x0F);
+            const __m512i thirdByte = _mm512_set1_epi8(static_cast<char>(0xE0 - 0x80));
+            const __m512i fourthByte = _mm512_set1_epi8(static_cast<char>(0xF0 - 0x80));
+            const __m512i highBit = _mm512_set1_epi8(static_cast<char>(0x80));
+            __m512i previous = _mm512_setzero_si512();
+            __m512i previousIncomplete = _mm512_setzero_si512();
+            u8char_t *itr = start;
+
+            while (end - itr >= 64) {
+                const __m512i input = _mm512_loadu_si512(itr);
+                __m512i error;
+
+                if (_mm512_movepi8_mask(input) == 0) {
+                    error = previousIncomplete;
+                    previousIncomplete = _mm512_setzero_si512();
+                } else {
+                    const __m512i prev1 = previous_avx512(input, previous, 1);
+                    const __m512i prev2 = previous_avx512(input, previous, 2);
+                    const __m512i prev3 = previous_avx512(input, previous, 3);
+                    const __m512i byte1High = _mm512_shuffle_epi8(byte1HighTable, _mm512_and_si512(_mm512_srli_epi16(prev1, 4), nibble));
+                    const __m512i byte1Low = _mm512_shuffle_epi8(byte1LowTable, _mm512_and_si512(prev1, nibble));
+                    const __m512i byte2High = _mm512_shuffle_epi8(byte2HighTable, _mm512_and_si512(_mm512_srli_epi16(input, 4), nibble));
+                    const __m512i special = _mm512_and_si512(_mm512_and_si512(byte1High, byte1Low), byte2High);
+                    const __m512i must23 = _mm512_and_si512(_mm512_or_si512(
+                        _mm512_subs_epu8(prev2, thirdByte),
+                        _mm512_subs_epu8(prev3, fourthByte)), highBit);
+                    error = _mm512_xor_si512(must23, special);
+                    previousIncomplete = _mm512_subs_epu8(input, incompleteMax);
+                }
+
+                if (_mm512_test_epi64_mask(error, error) != 0) {
+                    return sequence_start_before(start, itr);
+                }
+
+                previous = input;
+                itr += 64;
             }
 
-            return result;
+            return sequence_start_before(start, itr);
+        }
+    #endif
+
+        // returns the position up to which the input is known to be valid, always on a sequence boundary
+        inline u8char_t *validate_prefix(u8char_t *start, u8char_t *end) {
+        #if defined(RYUK_UTF8_X86)
+            switch (simd_level()) {
+                case SIMDLevel_AVX512: return validate_prefix_avx512(start, end);
+                case SIMDLevel_AVX2: return validate_prefix_avx2(start, end);
+                case SIMDLevel_SSE42: return validate_prefix_sse42(start, end);
+                default: break;
+            }
+        #else
+            (void)end;
+        #endif
+            return start;
         }
-    };
-
-    class basic_utf8string_iterator {
-    private:
-        u8char_t *_begin;
-        u8char_t *_end;
-        u8char_t *_current;
 
-    public:
-        basic_utf8string_iterator(u8char_t *begin, u8char_t *end) : _begin(begin), _end(end) {
-            assert(begin);
-            assert(end);
-            _current = begin;
+        inline bool is_ascii_word(const u8char_t *itr) {
+            uint64_t word;
+            memcpy(&word, itr, sizeof(word));
+            return (word & 0x8080808080808080ull) == 0;
         }
 
-        ~basic_utf8string_iterator() = default;
-        basic_utf8string_iterator(const basic_utf8string_iterator &) = default;
-        basic_utf8string_iterator(basic_utf8string_iterator &&) = default;
-        basic_utf8string_iterator & operator=(const basic_utf8string_iterator &) = default;
-        basic_utf8string_iterator & operator=(basic_utf8string_iterator &&) = default;
+        inline bool is_ascii_scalar(const u8char_t *itr, const u8char_t *end) {
+            for (; end - itr >= 8; itr += 8) {
+                if (!is_ascii_word(itr)) {
+                    return false;
+                }
+            }
 
-        bool operator==(const basic_utf8string_iterator &other) {
-            return (_current == other._current);
-        }
+            for (; itr != end; ++itr) {
+                if (*itr >= 0x80) {
+                    return false;
+                }
+            }
 
-        bool operator!=(const basic_utf8string_iterator &other) {
-            return !(operator==(other));
+            return true;
         }
 
-        basic_utf8string_iterator & operator++() {
-            internal::next(_current, _end);
-            return *this;
-        }
+    #if defined(RYUK_UTF8_X86)
+        RYUK_UTF8_TARGET("sse4.2")
+        inline bool is_ascii_sse42(const u8char_t *itr, const u8char_t *end) {
+            for (; end - itr >= 64; itr += 64) {
+                const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr));
+                const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr + 16));
+                const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr + 32));
+                const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr + 48));
+                if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d))) != 0) {
+                    return false;
+                }
+            }
 
-        basic_utf8string_iterator operator++(int) {
-            basic_utf8string_iterator temp = *this;
-            internal::next(_current, _end);
-            return temp;
+            return is_ascii_scalar(itr, end);
         }
 
-        basic_utf8string_iterator & operator--() {
-            internal::previous(_current, _begin);
-            return *this;
-        }
+        RYUK_UTF8_TARGET("avx2")
+        inline bool is_ascii_avx2(const u8char_t *itr, const u8char_t *end) {
+            for (; end - itr >= 128; itr += 128) {
+                const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(itr));
+                const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(itr + 32));
+                const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(itr + 64));
+                const __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(itr + 96));
+                if (_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d))) != 0) {
+                    return false;
+                }
+            }
 
-        basic_utf8string_iterator operator--(int) {
-            basic_utf8string_iterator temp = *this;
-            internal::previous(_current, _begin);
-            return temp;
+            return is_ascii_sse42(itr, end);
         }
 
-        u32char_t operator*() {
-            return internal::peek_next(_current, _end);
-        }
+        RYUK_UTF8_TARGET("avx512f,avx512bw")
+        inline bool is_ascii_avx512(const u8char_t *itr, const u8char_t *end) {
+            for (; end - itr >= 256; itr += 256) {
+                const __m512i a = _mm512_loadu_si512(itr);
+                const __m512i b = _mm512_loadu_si512(itr + 64);
+                const __m512i c = _mm512_loadu_si512(itr + 128);
+                const __m512i d = _mm512_loadu_si512(itr + 192);
+                if (_mm512_movepi8_mask(_mm512_or_si512(_mm512_or_si512(a, b), _mm512_or_si512(c, d))) != 0) {
+                    return false;
+                }
+            }
 
-        bool operator<(const basic_utf8string_iterator &other) {
-            return (_current < other._current);
+            return is_ascii_sse42(itr, end);
+        }
+    #endif
+
+        // whether every octet is below 0x80, which makes every octet a code point of its own
+        inline bool is_ascii(const u8char_t *start, const u8char_t *end) {
+        #if defined(RYUK_UTF8_X86)
+            if (end - start >= 64) {
+                switch (simd_level()) {
+                    case SIMDLevel_AVX512: return is_ascii_avx512(start, end);
+                    case SIMDLevel_AVX2: return is_ascii_avx2(start, end);
+                    case SIMDLevel_SSE42: return is_ascii_sse42(start, end);
+                    default: break;
+                }
+            }
+        #endif
+            return is_ascii_scalar(start, end);
         }
 
-        bool operator>(const basic_utf8string_iterator &other) {
-            return (_current > other._current);
+    #if defined(RYUK_UTF8_X86)
+        // more than a block of the widest validator and a sequence it rewinds to
+        constexpr size_t SIMD_TAIL = 128;
+    #endif
+
+        inline u8char_t *find_invalid(u8char_t *start, u8char_t *end, UTF8Error &error) {
+        #if defined(RYUK_UTF8_X86)
+            u8char_t *result = (end - start < static_cast<ptrdiff_t>(SIMD_TAIL)) ? start : validate_prefix(start, end);
+
+            // the vectorized validators leave less than a block, a copy padded with ascii validates it without
+            // the scalar loop, which short inputs (and the chunks of utf8string_decoder) would spend most time in
+            if (result != end && end - result < static_cast<ptrdiff_t>(SIMD_TAIL) && simd_level() != SIMDLevel_None) {
+                const size_t length = static_cast<size_t>(end - result);
+                u8char_t padded[SIMD_TAIL] = {};
+                memcpy(padded, result, length);
+                // an invalid or cut sequence makes it stop at or before the block it's in
+                if (validate_prefix(padded, padded + SIMD_TAIL) >= padded + length) {
+                    error = UTF8Error_None;
+                    return end;
+                }
+            }
+        #else
+            u8char_t *result = validate_prefix(start, end);
+        #endif
+
+            while (result != end) {
+                if (end - result >= 8 && is_ascii_word(result)) {
+                    result += 8;
+                    continue;
+                }
+
+                error = validate_next(result, end);
+                if (error != UTF8Error_None) {
+                    return result;
+                }
+            }
+
+            error = UTF8Error_None;
+            return result;
         }
 
-        bool operator<=(const basic_utf8string_iterator &other) {
-            return (_current <= other._current);
+        inline u8char_t *find_invalid(u8char_t *start, u8char_t *end) {
+            UTF8Error ignored;
+            return find_invalid(start, end, ignored);
         }
 
-        bool operator>=(const basic_utf8string_iterator &other) {
-            return (_current >= other._current);
+        inline bool is_valid(u8char_t *start, u8char_t *end) {
+            return (find_invalid(start, end) == end);
         }
 
-        u8char_t *begin() {
-            return _begin;
+        /*
+            Counting code points in valid UTF-8 doesn't need decoding, every octet that isn't a
+            continuation (10xxxxxx) starts a code point. As signed bytes continuations are -128..-65,
+            so the vectorized counters compare against -65 and add up the matches in per byte
+            counters, which are summed (psadbw) before they can overflow, every 255 blocks.
+            Invalid input is counted as well, it just doesn't mean much.
+        */
+        inline size_t count_leads_in_word(const u8char_t *itr) {
+            uint64_t word;
+            memcpy(&word, itr, sizeof(word));
+            // the high bit of every continuation octet, bit 6 is shifted into bit 7 of the same octet
+            const uint64_t continuations = (word & ~(word << 1)) & 0x8080808080808080ull;
+            return 8 - static_cast<size_t>(((continuations >> 7) * 0x0101010101010101ull) >> 56);
         }
 
-        u8char_t *end() {
-            return _end;
+        inline size_t count_code_points_scalar(const u8char_t *itr, const u8char_t *end) {
+            size_t result = 0;
+
+            while (end - itr >= 8) {
+                result += count_leads_in_word(itr);
+                itr += 8;
+            }
+
+            while (itr != end) {
+                result += !is_trail(*(itr++));
+            }
+
+            return result;
         }
-    };
 
-    class basic_utf8string_reverse_iterator {
-    private:
-        u8char_t *_rbegin;
-        u8char_t *_rend;
-        u8char_t *_current;
+    #if defined(RYUK_UTF8_X86)
+        constexpr size_t SIMD_COUNTER_BLOCKS = 255;
 
-    public:
-        basic_utf8string_reverse_iterator(u8char_t *rbegin, u8char_t *rend) : _rbegin(rbegin), _rend(rend) {
-            assert(rbegin);
-            assert(rend);
-            _current = rbegin;
+        RYUK_UTF8_TARGET("sse4.2")
+        inline size_t sum_counters_sse42(__m128i counters) {
+            const __m128i sums = _mm_sad_epu8(counters, _mm_setzero_si128());
+            return static_cast<size_t>(_mm_cvtsi128_si32(sums)) + static_cast<size_t>(_mm_cvtsi128_si32(_mm_srli_si128(sums, 8)));
         }
 
-        ~basic_utf8string_reverse_iterator() = default;
-        basic_utf8string_reverse_iterator(const basic_utf8string_reverse_iterator &) = default;
-        basic_utf8string_reverse_iterator(basic_utf8string_reverse_iterator &&) = default;
+        RYUK_UTF8_TARGET("sse4.2")
+        inline size_t count_code_points_sse42(const u8char_t *itr, const u8char_t *end) {
+            const __m128i lastContinuation = _mm_set1_epi8(-65);
+            size_t result = 0;
+
+            while (end - itr >= 16) {
+                size_t blocks = static_cast<size_t>(end - itr) / 16;
+                if (blocks > SIMD_COUNTER_BLOCKS) {
+                    blocks = SIMD_COUNTER_BLOCKS;
+                }
+
+                __m128i counters = _mm_setzero_si128();
+                for (size_t i = 0; i < blocks; ++i) {
+                    const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr));
+                    // matches are -1, so subtracting them counts up
+                    counters = _mm_sub_epi8(counters, _mm_cmpgt_epi8(input, lastContinuation));
+                    itr += 16;
+                }
+
+                result += sum_counters_sse42(counters);
+            }
+
+            return result + count_code_points_scalar(itr, end);
+        }
+
+        RYUK_UTF8_TARGET("avx2")
+        inline size_t sum_counters_avx2(__m256i counters) {
+            const __m256i sums = _mm256_sad_epu8(counters, _mm256_setzero_si256());
+            const __m128i halves = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+            return static_cast<size_t>(_mm_cvtsi128_si32(halves)) + static_cast<size_t>(_mm_cvtsi128_si32(_mm_srli_si128(halves, 8)));
+        }
+
+        RYUK_UTF8_TARGET("avx2")
+        inline size_t count_code_points_avx2(const u8char_t *itr, const u8char_t *end) {
+            const __m256i lastContinuation = _mm256_set1_epi8(-65);
+            size_t result = 0;
+
+            while (end - itr >= 32) {
+                size_t blocks = static_cast<size_t>(end - itr) / 32;
+                if (blocks > SIMD_COUNTER_BLOCKS) {
+                    blocks = SIMD_COUNTER_BLOCKS;
+                }
+
+                __m256i counters = _mm256_setzero_si256();
+                for (size_t i = 0; i < blocks; ++i) {
+                    const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(itr));
+                    counters = _mm256_sub_epi8(counters, _mm256_cmpgt_epi8(input, lastContinuation));
+                    itr += 32;
+                }
+
+                result += sum_counters_avx2(counters);
+            }
+
+            return result + count_code_points_scalar(itr, end);
+        }
+
+        RYUK_UTF8_TARGET("avx512f,avx512bw")
+        inline size_t count_code_points_avx512(const u8char_t *itr, const u8char_t *end) {
+            const __m512i lastContinuation = _mm512_set1_epi8(-65);
+            const __m512i one = _mm512_set1_epi8(1);
+            size_t result = 0;
+
+            while (end - itr >= 64) {
+                size_t blocks = static_cast<size_t>(end - itr) / 64;
+                if (blocks > SIMD_COUNTER_BLOCKS) {
+                    blocks = SIMD_COUNTER_BLOCKS;
+                }
+
+                __m512i counters = _mm512_setzero_si512();
+                for (size_t i = 0; i < blocks; ++i) {
+                    const __m512i input = _mm512_loadu_si512(itr);
+                    const __mmask64 leads = _mm512_cmpgt_epi8_mask(input, lastContinuation);
+                    counters = _mm512_mask_add_epi8(counters, leads, counters, one);
+                    itr += 64;
+                }
+
+                const __m512i sums = _mm512_sad_epu8(counters, _mm512_setzero_si512());
+                const __m256i quarters = _mm256_add_epi64(_mm512_maskz_extracti64x4_epi64(0xFF, sums, 0), _mm512_maskz_extracti64x4_epi64(0xFF, sums, 1));
+                const __m128i halves = _mm_add_epi64(_mm256_castsi256_si128(quarters), _mm256_extracti128_si256(quarters, 1));
+                result += static_cast<size_t>(_mm_cvtsi128_si32(halves)) + static_cast<size_t>(_mm_cvtsi128_si32(_mm_srli_si128(halves, 8)));
+            }
+
+            return result + count_code_points_scalar(itr, end);
+        }
+    #endif
+
+        // returns the start of the n-th code point after itr, or end if there are fewer, expects valid UTF-8
+        inline const u8char_t *skip_code_points(const u8char_t *itr, const u8char_t *end, size_t n) {
+            // whole words as long as the code point doesn't start in them
+            while (end - itr >= 8) {
+                const size_t leads = count_leads_in_word(itr);
+                if (leads > n) {
+                    break;
+                }
+
+                n -= leads;
+                itr += 8;
+            }
+
+            for (; itr != end; ++itr) {
+                if (!is_trail(*itr)) {
+                    if (n == 0) {
+                        return itr;
+                    }
+
+                    --n;
+                }
+            }
+
+            return end;
+        }
+
+        // counts the code points of valid UTF-8, see distance for a validating count
+        inline size_t count_code_points(const u8char_t *start, const u8char_t *end) {
+        #if defined(RYUK_UTF8_X86)
+            if (end - start >= 16) {
+                switch (simd_level()) {
+                    case SIMDLevel_AVX512: return count_code_points_avx512(start, end);
+                    case SIMDLevel_AVX2: return count_code_points_avx2(start, end);
+                    case SIMDLevel_SSE42: return count_code_points_sse42(start, end);
+                    default: break;
+                }
+            }
+        #endif
+            return count_code_points_scalar(start, end);
+        }
+
+        inline size_t count_newlines_scalar(const u8char_t *start, const u8char_t *end) {
+            size_t result = 0;
+            while (end - start >= 8) {
+                uint64_t word;
+                memcpy(&word, start, sizeof(word));
+                // newlines become zero octets, the high bit of every octet that isn't zero is set after the add
+                word ^= 0x0A0A0A0A0A0A0A0Aull;
+                const uint64_t zeros = ~(((word & 0x7F7F7F7F7F7F7F7Full) + 0x7F7F7F7F7F7F7F7Full) | word) & 0x8080808080808080ull;
+                result += static_cast<size_t>(((zeros >> 7) * 0x0101010101010101ull) >> 56);
+                start += 8;
+            }
+
+            for (; start != end; ++start) {
+                result += (*start == '\n');
+            }
+
+            return result;
+        }
+
+    #if defined(RYUK_UTF8_X86)
+        // the same per byte counters as count_code_points, counting octets equal to '\n'
+        RYUK_UTF8_TARGET("sse4.2")
+        inline size_t count_newlines_sse42(const u8char_t *itr, const u8char_t *end) {
+            const __m128i newline = _mm_set1_epi8('\n');
+            size_t result = 0;
+
+            while (end - itr >= 16) {
+                size_t blocks = static_cast<size_t>(end - itr) / 16;
+                if (blocks > SIMD_COUNTER_BLOCKS) {
+                    blocks = SIMD_COUNTER_BLOCKS;
+                }
+
+                __m128i counters = _mm_setzero_si128();
+                for (size_t i = 0; i < blocks; ++i) {
+                    const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr));
+                    counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(input, newline));
+                    itr += 16;
+                }
+
+                result += sum_counters_sse42(counters);
+            }
+
+            return result + count_newlines_scalar(itr, end);
+        }
+
+        RYUK_UTF8_TARGET("avx2")
+        inline size_t count_newlines_avx2(const u8char_t *itr, const u8char_t *end) {
+            const __m256i newline = _mm256_set1_epi8('\n');
+            size_t result = 0;
+
+            while (end - itr >= 32) {
+                size_t blocks = static_cast<size_t>(end - itr) / 32;
+                if (blocks > SIMD_COUNTER_BLOCKS) {
+                    blocks = SIMD_COUNTER_BLOCKS;
+                }
+
+                __m256i counters = _mm256_setzero_si256();
+                for (size_t i = 0; i < blocks; ++i) {
+                    const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(itr));
+                    counters = _mm256_sub_epi8(counters, _mm256_cmpeq_epi8(input, newline));
+                    itr += 32;
+                }
+
+                result += sum_counters_avx2(counters);
+            }
+
+            return result + count_newlines_sse42(itr, end);
+        }
+    #endif
+
+        inline size_t count_newlines(const u8char_t *start, const u8char_t *end) {
+        #if defined(RYUK_UTF8_X86)
+            if (end - start >= 16) {
+                switch (simd_level()) {
+                    case SIMDLevel_AVX512:
+                    case SIMDLevel_AVX2: return count_newlines_avx2(start, end);
+                    case SIMDLevel_SSE42: return count_newlines_sse42(start, end);
+                    default: break;
+                }
+            }
+        #endif
+            return count_newlines_scalar(start, end);
+        }
+
+        inline uint64_t hash_mix(uint64_t hash) {
+            hash ^= hash >> 33;
+            hash *= 0xFF51AFD7ED558CCDull;
+            hash ^= hash >> 33;
+            hash *= 0xC4CEB9FE1A85EC53ull;
+            return hash ^ (hash >> 33);
+        }
+
+        /*
+            Long strings are hashed in stripes of 64 octets into 8 accumulators, the way xxh3 does: every word is
+            xored with a key, the product of its halves goes into its own accumulator and the word itself into its
+            neighbour's. The accumulators are scrambled every HASH_SCRAMBLE_STRIPES stripes so no bits get stuck.
+            It's all 32x32 bit multiplies and 64 bit adds, which vectorize, and every path gives the same result.
+        */
+        constexpr size_t HASH_STRIPE = 64;
+        constexpr size_t HASH_SCRAMBLE_STRIPES = 16;
+        constexpr size_t HASH_LONG = 256;
+
+        alignas(64) constexpr uint64_t HASH_KEYS[8] = {
+            0xBE4BA423396CFEB8ull, 0x1CAD21F72C81017Cull, 0xDB979083E96DD4DEull, 0x1F67B3B7A4A44072ull,
+            0x78E5C0CC4EE679CBull, 0x2172FFCC7DD05A82ull, 0x8E2443F7744608B8ull, 0x4C263A81E69035E0ull,
+        };
+
+        constexpr uint64_t HASH_SCRAMBLE_PRIME = 0x9E3779B1ull;
+
+        inline void hash_stripes_scalar(const u8char_t *itr, size_t stripes, uint64_t *accumulators) {
+            for (size_t stripe = 0; stripe < stripes; ++stripe, itr += HASH_STRIPE) {
+                for (size_t i = 0; i < 8; ++i) {
+                    uint64_t word;
+                    memcpy(&word, itr + i * 8, sizeof(word));
+                    const uint64_t keyed = word ^ HASH_KEYS[i];
+                    accumulators[i ^ 1] += word;
+                    accumulators[i] += (keyed & 0xFFFFFFFFull) * (keyed >> 32);
+                }
+            }
+        }
+
+        inline void hash_scramble_scalar(uint64_t *accumulators) {
+            for (size_t i = 0; i < 8; ++i) {
+                accumulators[i] = (accumulators[i] ^ (accumulators[i] >> 47) ^ HASH_KEYS[i]) * HASH_SCRAMBLE_PRIME;
+            }
+        }
+
+    #if defined(RYUK_UTF8_X86)
+        RYUK_UTF8_TARGET("sse4.2")
+        inline void hash_stripes_sse42(const u8char_t *itr, size_t stripes, uint64_t *accumulators) {
+            __m128i lanes[4];
+            for (size_t i = 0; i < 4; ++i) {
+                lanes[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(accumulators + i * 2));
+            }
+
+            for (size_t stripe = 0; stripe < stripes; ++stripe, itr += HASH_STRIPE) {
+                for (size_t i = 0; i < 4; ++i) {
+                    const __m128i words = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr + i * 16));
+                    const __m128i keyed = _mm_xor_si128(words, _mm_load_si128(reinterpret_cast<const __m128i *>(HASH_KEYS + i * 2)));
+                    // the words trade places with their neighbours
+                    lanes[i] = _mm_add_epi64(lanes[i], _mm_shuffle_epi32(words, _MM_SHUFFLE(1, 0, 3, 2)));
+                    lanes[i] = _mm_add_epi64(lanes[i], _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32)));
+                }
+            }
+
+            for (size_t i = 0; i < 4; ++i) {
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(accumulators + i * 2), lanes[i]);
+            }
+        }
+
+        RYUK_UTF8_TARGET("avx2")
+        inline void hash_stripes_avx2(const u8char_t *itr, size_t stripes, uint64_t *accumulators) {
+            __m256i lanes[2];
+            for (size_t i = 0; i < 2; ++i) {
+                lanes[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(accumulators + i * 4));
+            }
+
+            for (size_t stripe = 0; stripe < stripes; ++stripe, itr += HASH_STRIPE) {
+                for (size_t i = 0; i < 2; ++i) {
+                    const __m256i words = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(itr + i * 32));
+                    const __m256i keyed = _mm256_xor_si256(words, _mm256_load_si256(reinterpret_cast<const __m256i *>(HASH_KEYS + i * 4)));
+                    lanes[i] = _mm256_add_epi64(lanes[i], _mm256_shuffle_epi32(words, _MM_SHUFFLE(1, 0, 3, 2)));
+                    lanes[i] = _mm256_add_epi64(lanes[i], _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32)));
+                }
+            }
+
+            for (size_t i = 0; i < 2; ++i) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(accumulators + i * 4), lanes[i]);
+            }
+        }
+    #endif
+
+        inline void hash_stripes(const u8char_t *itr, size_t stripes, uint64_t *accumulators) {
+        #if defined(RYUK_UTF8_X86)
+            switch (simd_level()) {
+                case SIMDLevel_AVX512:
+                case SIMDLevel_AVX2: hash_stripes_avx2(itr, stripes, accumulators); return;
+                case SIMDLevel_SSE42: hash_stripes_sse42(itr, stripes, accumulators); return;
+                default: break;
+            }
+        #endif
+            hash_stripes_scalar(itr, stripes, accumulators);
+        }
+
+        // at least HASH_LONG octets, the last stripe is the last 64 octets, overlapping the one before it
+        inline uint64_t hash_long(const u8char_t *start, size_t size) {
+            uint64_t accumulators[8] = {
+                0xC2B2AE3Dull, 0x9E3779B185EBCA87ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull,
+                0x85EBCA77C2B2AE63ull, 0x85EBCA77ull, 0x27D4EB2F165667C5ull, 0x9E3779B1ull,
+            };
+
+            const size_t stripes = (size - 1) / HASH_STRIPE;
+            for (size_t done = 0; done < stripes; done += HASH_SCRAMBLE_STRIPES) {
+                const size_t block = (stripes - done < HASH_SCRAMBLE_STRIPES) ? stripes - done : HASH_SCRAMBLE_STRIPES;
+                hash_stripes(start + done * HASH_STRIPE, block, accumulators);
+                if (block == HASH_SCRAMBLE_STRIPES) {
+                    hash_scramble_scalar(accumulators);
+                }
+            }
+            hash_stripes(start + size - HASH_STRIPE, 1, accumulators);
+
+            uint64_t hash = size * 0x9E3779B97F4A7C15ull;
+            for (size_t i = 0; i < 8; ++i) {
+                hash = (hash ^ hash_mix(accumulators[i] ^ HASH_KEYS[7 - i])) * 0x87C37B91114253D5ull;
+            }
+
+            return hash_mix(hash);
+        }
+
+        // shorter strings go two words at a time in independent lanes, with the final mix of murmur3, the size is
+        // mixed in first so tails that are loaded as overlapping words don't collide with shorter strings
+        inline uint64_t hash_octets(const u8char_t *start, size_t size) {
+            if (size >= HASH_LONG) {
+                return hash_long(start, size);
+            }
+
+            uint64_t first = 0x9E3779B97F4A7C15ull ^ (size * 0xC2B2AE3D27D4EB4Full);
+            uint64_t second = 0x165667B19E3779F9ull;
+            for (; size >= 16; size -= 16, start += 16) {
+                uint64_t words[2];
+                memcpy(words, start, sizeof(words));
+                first = (first ^ words[0]) * 0x87C37B91114253D5ull;
+                second = (second ^ words[1]) * 0x4CF5AD432745937Full;
+                first ^= first >> 31;
+                second ^= second >> 29;
+            }
+
+            // the tail as two words that may overlap, with fixed size loads
+            uint64_t words[2] = {};
+            if (size >= 8) {
+                memcpy(&words[0], start, 8);
+                memcpy(&words[1], start + size - 8, 8);
+            } else if (size >= 4) {
+                uint32_t halves[2];
+                memcpy(&halves[0], start, 4);
+                memcpy(&halves[1], start + size - 4, 4);
+                words[0] = halves[0] | static_cast<uint64_t>(halves[1]) << 32;
+            } else if (size) {
+                words[0] = start[0] | static_cast<uint64_t>(start[size / 2]) << 8 | static_cast<uint64_t>(start[size - 1]) << 16;
+            }
+
+            first = (first ^ words[0]) * 0x87C37B91114253D5ull;
+            second = (second ^ words[1]) * 0x4CF5AD432745937Full;
+            return hash_mix(first ^ (second >> 32 | second << 32));
+        }
+
+        inline bool starts_with_bom(u8char_t *itr, u8char_t *end) {
+            return (
+                ((itr != end) && (mask(*itr++)) == BOM[0]) &&
+                ((itr != end) && (mask(*itr++)) == BOM[1]) &&
+                ((itr != end) && (mask(*itr)) == BOM[2])
+            );
+        }
+
+        inline u8char_t *append(u32char_t cp, u8char_t *result) {
+            if (!is_code_point_valid(cp)) {
+                return result;
+            }
+
+            if (cp < 0x80) {
+                *(result++) = static_cast<u8char_t>(  cp);
+            } else if (cp < 0x800) {
+                *(result++) = static_cast<u8char_t>( (cp  >>    6)          | 0xc0);
+                *(result++) = static_cast<u8char_t>( (cp  &  0x3f)          | 0x80);
+            } else if (cp < 0x10000) {
+                *(result++) = static_cast<u8char_t>( (cp  >>   12)          | 0xe0);
+                *(result++) = static_cast<u8char_t>(((cp  >>    6) & 0x3f)  | 0x80);
+                *(result++) = static_cast<u8char_t>( (cp  &  0x3f)          | 0x80);
+            } else {
+                *(result++) = static_cast<u8char_t>( (cp  >>   18)          | 0xf0);
+                *(result++) = static_cast<u8char_t>(((cp  >>   12)  & 0x3f) | 0x80);
+                *(result++) = static_cast<u8char_t>(((cp  >>    6)  & 0x3f) | 0x80);
+                *(result++) = static_cast<u8char_t>( (cp  &  0x3f)          | 0x80);
+            }
+            
+            return result;
+        }
+
+        inline u32char_t next(u8char_t *&itr, u8char_t *end) {
+            u32char_t result = 0;
+            validate_next(itr, end, result);
+            return result;
+        }
+
+        inline u32char_t peek_next(u8char_t *itr, u8char_t *end) {
+            return next(itr, end);
+        }
+
+        inline u32char_t previous(u8char_t *&itr, u8char_t *start) {
+            if (itr == start) {
+                return 0;
+            }
+            
+            u8char_t *end = itr;
+
+            while (is_trail(*(--itr))) {
+                if (itr == start) {
+                    return 0;
+                }
+            }
+
+            return peek_next(itr, end);
+        }
+
+        inline void advance(u8char_t *&itr, u8char_t *end, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                next(itr, end);
+            }
+        }
+
+        inline void revert(u8char_t *&itr, u8char_t *start, size_t count) {
+            for (size_t i = count; i > 0; --i) {
+                previous(itr, start);
+            }
+        }
+
+        inline size_t distance(u8char_t *first, u8char_t *last) {
+            size_t result;
+
+            for (result = 0; first < last; ++result) {
+                if (next(first, last) == 0) {
+                    return 0;
+                }
+            }
+
+            return result;
+        }
+
+        inline u8char_t *utf32_to_utf8(u32char_t *start, u32char_t *end, u8char_t *result) {
+            while (start != end) {
+                result = append(*(start++), result);
+            }
+
+            return result;
+        }
+
+
+        /*
+            Bulk transcoding between UTF-8 and UTF-32 or UTF-16.
+
+            UTF-8 to UTF-32 looks at 16 octets at a time, an ascii block is widened as a whole, up to 8
+            octets of one and two octet sequences and four three octet sequences in a row (12 octets)
+            are decoded in vector registers, everything else goes through validate_next one code point
+            at a time. The vector paths don't validate, the checked variants validate with find_invalid
+            first, which is vectorized too.
+
+            UTF-8 to UTF-16 is the same decoder, the lanes are narrowed to 16 bits instead of widened to
+            32 bits, none of the vector paths ever sees a code point above U+FFFF. SWAP is whether the
+            requested byte order isn't the one of the host, the code units are then byte swapped with a
+            shuffle on the way out (or in).
+
+            UTF-32 to UTF-8 does the opposite with blocks of four code points, that are either all below
+            U+0800 or all take three octets (16 code points at a time for ascii). UTF-16 to UTF-8 widens
+            four code units to 32 bits when none of them is a surrogate and encodes them the same way
+            (8 code units at a time for ascii), surrogate pairs go through the scalar path.
+
+            Every path writes exactly one code point (or code unit, two for a surrogate pair) per lead octet,
+            or exactly sequence_length octets per code point, so the output lengths can be computed up front
+            and nothing is ever written past them, even for invalid input.
+        */
+        inline bool is_host_big_endian() {
+            const uint16_t probe = 1;
+            u8char_t first;
+            memcpy(&first, &probe, 1);
+            return (first == 0);
+        }
+
+        inline bool swaps(UTF16ByteOrder order) {
+            return ((order == UTF16ByteOrder_BigEndian) != is_host_big_endian());
+        }
+
+        inline char16_t swap_unit(char16_t unit) {
+            return static_cast<char16_t>((unit >> 8) | (unit << 8));
+        }
+
+        template<bool SWAP>
+        inline u32char_t load_unit(const char16_t *itr) {
+            return SWAP ? swap_unit(*itr) : *itr;
+        }
+
+        template<bool SWAP>
+        inline void store_unit(char16_t *result, u32char_t unit) {
+            const char16_t value = static_cast<char16_t>(unit);
+            *result = SWAP ? swap_unit(value) : value;
+        }
+
+        template<bool SWAP>
+        inline u32char_t *put_code_point(u32char_t c, u32char_t *result) {
+            *result = c;
+            return result + 1;
+        }
+
+        // code points above U+FFFF take a surrogate pair
+        template<bool SWAP>
+        inline char16_t *put_code_point(u32char_t c, char16_t *result) {
+            if (c < 0x10000) {
+                store_unit<SWAP>(result, c);
+                return result + 1;
+            }
+
+            c -= 0x10000;
+            store_unit<SWAP>(result, 0xD800 + (c >> 10));
+            store_unit<SWAP>(result + 1, 0xDC00 + (c & 0x3FF));
+            return result + 2;
+        }
+
+        template<bool SWAP, typename UNIT>
+        inline const u8char_t *utf8_decode_one(const u8char_t *itr, const u8char_t *end, UNIT *&result) {
+            u8char_t *current = const_cast<u8char_t *>(itr);
+            u32char_t c = 0;
+            if (validate_next(current, const_cast<u8char_t *>(end), c) == UTF8Error_None) {
+                result = put_code_point<SWAP>(c, result);
+                return current;
+            }
+
+            // trusted input that isn't valid, the octet is dropped
+            return itr + 1;
+        }
+
+        template<bool SWAP, typename UNIT>
+        inline UNIT *utf8_decode_scalar(const u8char_t *itr, const u8char_t *end, UNIT *result) {
+            while (itr != end) {
+                if (end - itr >= 8 && is_ascii_word(itr)) {
+                    for (int i = 0; i < 8; ++i) {
+                        result = put_code_point<SWAP>(*(itr++), result);
+                    }
+                    continue;
+                }
+
+                itr = utf8_decode_one<SWAP>(itr, end, result);
+            }
+
+            return result;
+        }
+
+        inline u8char_t *utf32_to_utf8_scalar(const u32char_t *itr, const u32char_t *end, u8char_t *result, const u32char_t *&stop) {
+            for (; itr != end; ++itr) {
+                if (!is_code_point_valid(*itr)) {
+                    break;
+                }
+
+                result = append(*itr, result);
+            }
+
+            stop = itr;
+            return result;
+        }
+
+        inline size_t utf8_length_of_scalar(const u32char_t *itr, const u32char_t *end) {
+            size_t result = 0;
+            for (; itr != end; ++itr) {
+                result += is_code_point_valid(*itr) ? sequence_length(*itr) : 0;
+            }
+
+            return result;
+        }
+
+        // decodes the code point at itr and moves past it, surrogates that aren't paired are errors the way
+        // stray octets are in UTF-8, a trail surrogate can't start one, a lead surrogate needs a trail one next
+        template<bool SWAP>
+        inline UTF8Error utf16_next(const char16_t *&itr, const char16_t *end, u32char_t &c) {
+            const u32char_t unit = load_unit<SWAP>(itr);
+            if ((unit & 0xF800) != 0xD800) {
+                c = unit;
+                ++itr;
+                return UTF8Error_None;
+            }
+
+            if (unit >= 0xDC00) {
+                return UTF8Error_InvalidLead;
+            }
+
+            if (end - itr < 2) {
+                return UTF8Error_NotEnoughRoom;
+            }
+
+            const u32char_t trail = load_unit<SWAP>(itr + 1);
+            if ((trail & 0xFC00) != 0xDC00) {
+                return UTF8Error_IncompleteSequence;
+            }
+
+            c = 0x10000 + ((unit - 0xD800) << 10) + (trail - 0xDC00);
+            itr += 2;
+            return UTF8Error_None;
+        }
+
+        template<bool SWAP>
+        inline u8char_t *utf16_to_utf8_scalar(const char16_t *itr, const char16_t *end, u8char_t *result, const char16_t *&stop) {
+            while (itr != end) {
+                u32char_t c = 0;
+                if (utf16_next<SWAP>(itr, end, c) != UTF8Error_None) {
+                    break;
+                }
+
+                result = append(c, result);
+            }
+
+            stop = itr;
+            return result;
+        }
+
+        // each half of a surrogate pair counts for two octets, lone surrogates are counted too
+        template<bool SWAP>
+        inline size_t utf8_length_of_scalar(const char16_t *itr, const char16_t *end) {
+            size_t result = 0;
+            for (; itr != end; ++itr) {
+                const u32char_t unit = load_unit<SWAP>(itr);
+                if (unit < 0x80) {
+                    result += 1;
+                } else if (unit < 0x800 || (unit & 0xF800) == 0xD800) {
+                    result += 2;
+                } else {
+                    result += 3;
+                }
+            }
+
+            return result;
+        }
+
+        // the lead octets of four octet sequences (and the invalid octets above them), their code points take two UTF-16 code units
+        inline size_t count_four_octet_leads_scalar(const u8char_t *itr, const u8char_t *end) {
+            size_t result = 0;
+
+            while (end - itr >= 8) {
+                uint64_t word;
+                memcpy(&word, itr, sizeof(word));
+                // the high bit of every octet whose four high bits are set
+                const uint64_t leads = word & (word << 1) & (word << 2) & (word << 3) & 0x8080808080808080ull;
+                result += static_cast<size_t>(((leads >> 7) * 0x0101010101010101ull) >> 56);
+                itr += 8;
+            }
+
+            while (itr != end) {
+                result += (*(itr++) >= 0xF0);
+            }
+
+            return result;
+        }
+
+    #if defined(RYUK_UTF8_X86)
+        /*
+            Octets of one and two octet sequences are gathered into 16 bit lanes by a shuffle that is looked up
+            with the lead octets among the first 9 octets (the 9th tells whether the 8th ends a sequence).
+            The first octet of a lane is the low one, one octet sequences get a zero high octet, so every lane
+            decodes to (lane & 0x7F) | ((lane >> 2) & 0x7C0). A table entry covers the complete sequences up to
+            the first one that is longer than two octets, it has no code points if the first one is.
+        */
+        // the next lead after position, or 9 if there's none in the 9 octets
+        constexpr int two_octet_next_lead(int leads, int next) {
+            return (next <= 8 && !((leads >> next) & 1)) ? two_octet_next_lead(leads, next + 1) : next;
+        }
+
+        constexpr int two_octet_end_of(int position, int next) {
+            return (next > 8 || next - position > 2) ? -1 : next;
+        }
+
+        // where the sequence at position ends, or -1 if it isn't a complete sequence of one or two octets
+        constexpr int two_octet_end(int leads, int position) {
+            return ((leads & 1) && position < 8) ? two_octet_end_of(position, two_octet_next_lead(leads, position + 1)) : -1;
+        }
+
+        constexpr int two_octet_count(int leads, int position) {
+            return two_octet_end(leads, position) < 0 ? 0 : 1 + two_octet_count(leads, two_octet_end(leads, position));
+        }
+
+        constexpr int two_octet_consumed(int leads, int position) {
+            return two_octet_end(leads, position) < 0 ? position : two_octet_consumed(leads, two_octet_end(leads, position));
+        }
+
+        // where the sequence of the code point at index starts
+        constexpr int two_octet_start(int leads, int index) {
+            return index == 0 ? 0 : two_octet_end(leads, two_octet_start(leads, index - 1));
+        }
+
+        constexpr u8char_t two_octet_lane(int lane, int position, int next) {
+            return static_cast<u8char_t>((lane & 1) == 0 ? next - 1 : (next - position == 2 ? position : 0x80));
+        }
+
+        constexpr u8char_t two_octet_shuffle(int leads, int lane) {
+            return lane / 2 >= two_octet_count(leads, 0) ? 0x80
+                : two_octet_lane(lane, two_octet_start(leads, lane / 2), two_octet_end(leads, two_octet_start(leads, lane / 2)));
+        }
+
+        struct two_octet_shuffles {
+            u8char_t lanes[16];
+        };
+
+        template<size_t... LANE>
+        constexpr two_octet_shuffles make_two_octet_shuffles(int leads, index_list<LANE...>) {
+            return two_octet_shuffles { { two_octet_shuffle(leads, static_cast<int>(LANE))... } };
+        }
+
+        struct utf8_two_octet_table {
+            two_octet_shuffles shuffles[512];
+            u8char_t codePoints[512];
+            u8char_t consumed[512];
+        };
+
+        template<size_t... LEADS>
+        constexpr utf8_two_octet_table make_utf8_two_octet_table(index_list<LEADS...>) {
+            return utf8_two_octet_table {
+                { make_two_octet_shuffles(static_cast<int>(LEADS), make_index_list<16>::type())... },
+                { static_cast<u8char_t>(two_octet_count(static_cast<int>(LEADS), 0))... },
+                { static_cast<u8char_t>(two_octet_consumed(static_cast<int>(LEADS), 0))... },
+            };
+        }
+
+        constexpr utf8_two_octet_table UTF8_TWO_OCTET_TABLE = make_utf8_two_octet_table(make_index_list<512>::type());
+
+        inline int popcount16(uint32_t bits) {
+            bits = bits - ((bits >> 1) & 0x5555);
+            bits = (bits & 0x3333) + ((bits >> 2) & 0x3333);
+            bits = (bits + (bits >> 4)) & 0x0F0F;
+            return static_cast<int>((bits + (bits >> 8)) & 0x1F);
+        }
+
+        RYUK_UTF8_TARGET("sse4.2")
+        inline __m128i swap_units_sse42(__m128i units) {
+            return _mm_shuffle_epi8(units, _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14));
+        }
+
+        // 16 ascii octets
+        template<bool SWAP>
+        RYUK_UTF8_TARGET("sse4.2")
+        inline void store_ascii_sse42(u32char_t *result, __m128i octets) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(result), _mm_cvtepu8_epi32(octets));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(result + 4), _mm_cvtepu8_epi32(_mm_srli_si128(octets, 4)));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(result + 8), _mm_cvtepu8_epi32(_mm_srli_si128(octets, 8)));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(result + 12), _mm_cvtepu8_epi32(_mm_srli_si128(octets, 12)));
+        }
+
+        template<bool SWAP>
+        RYUK_UTF8_TARGET("sse4.2")
+        inline void store_ascii_sse42(char16_t *result, __m128i octets) {
+            __m128i low = _mm_cvtepu8_epi16(octets);
+            __m128i high = _mm_cvtepu8_epi16(_mm_srli_si128(octets, 8));
+            if (SWAP) {
+                low = swap_units_sse42(low);
+                high = swap_units_sse42(high);
+            }
+
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(result), low);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(result + 8), high);
+        }
+
+        // 8 code points in 16 bit lanes
+        template<bool SWAP>
+        RYUK_UTF8_TARGET("sse4.2")
+        inline void store_lanes16_sse42(u32char_t *result, __m128i lanes) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(result), _mm_cvtepu16_epi32(lanes));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(result + 4), _mm_cvtepu16_epi32(_mm_srli_si128(lanes, 8)));
+        }
+
+        template<bool SWAP>
+        RYUK_UTF8_TARGET("sse4.2")
+        inline void store_lanes16_sse42(char16_t *result, __m128i lanes) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(result), SWAP ? swap_units_sse42(lanes) : lanes);
+        }
+
+        // 4 code points below U+10000 in 32 bit lanes
+        template<bool SWAP>
+        RYUK_UTF8_TARGET("sse4.2")
+        inline void store_lanes32_sse42(u32char_t *result, __m128i lanes) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(result), lanes);
+        }
+
+        template<bool SWAP>
+        RYUK_UTF8_TARGET("sse4.2")
+        inline void store_lanes32_sse42(char16_t *result, __m128i lanes) {
+            const __m128i units = _mm_packus_epi32(lanes, lanes);
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(result), SWAP ? swap_units_sse42(units) : units);
+        }
+
+        // one step of the vectorized decoder, needs 16 readable octets
+        template<bool SWAP, typename UNIT>
+        RYUK_UTF8_TARGET("sse4.2")
+        inline const u8char_t *utf8_decode_step_sse42(const u8char_t *itr, const u8char_t *end, UNIT *&result) {
+            const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr));
+
+            if (_mm_movemask_epi8(input) == 0) {
+                store_ascii_sse42<SWAP>(result, input);
+                result += 16;
+                return itr + 16;
+            }
+
+            // all 8 lanes are stored, which only stays within the output if at least 8 code points are left
+            const int leads = _mm_movemask_epi8(_mm_cmpgt_epi8(input, _mm_set1_epi8(-65)));
+            const int index = leads & 0x1FF;
+            if (UTF8_TWO_OCTET_TABLE.codePoints[index] != 0 && popcount16(static_cast<uint32_t>(leads)) >= 8) {
+                const __m128i shuffle = _mm_loadu_si128(reinterpret_cast<const __m128i *>(UTF8_TWO_OCTET_TABLE.shuffles[index].lanes));
+                const __m128i lanes = _mm_shuffle_epi8(input, shuffle);
+                const __m128i decoded = _mm_or_si128(
+                    _mm_and_si128(lanes, _mm_set1_epi16(0x7F)),
+                    _mm_and_si128(_mm_srli_epi16(lanes, 2), _mm_set1_epi16(0x7C0)));
+                store_lanes16_sse42<SWAP>(result, decoded);
+                result += UTF8_TWO_OCTET_TABLE.codePoints[index];
+                return itr + UTF8_TWO_OCTET_TABLE.consumed[index];
+            }
+
+            // 1110xxxx 10xxxxxx 10xxxxxx four times
+            const __m128i threeMask = _mm_setr_epi8(
+                static_cast<char>(0xF0), static_cast<char>(0xC0), static_cast<char>(0xC0),
+                static_cast<char>(0xF0), static_cast<char>(0xC0), static_cast<char>(0xC0),
+                static_cast<char>(0xF0), static_cast<char>(0xC0), static_cast<char>(0xC0),
+                static_cast<char>(0xF0), static_cast<char>(0xC0), static_cast<char>(0xC0), 0, 0, 0, 0);
+            const __m128i threeExpected = _mm_setr_epi8(
+                static_cast<char>(0xE0), static_cast<char>(0x80), static_cast<char>(0x80),
+                static_cast<char>(0xE0), static_cast<char>(0x80), static_cast<char>(0x80),
+                static_cast<char>(0xE0), static_cast<char>(0x80), static_cast<char>(0x80),
+                static_cast<char>(0xE0), static_cast<char>(0x80), static_cast<char>(0x80), 0, 0, 0, 0);
+            const int three = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(input, threeMask), threeExpected));
+            if ((three & 0x0FFF) == 0x0FFF) {
+                // every code point into its own 32 bit lane, the last octet lowest
+                const __m128i lanes = _mm_shuffle_epi8(input, _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1));
+                const __m128i low = _mm_and_si128(lanes, _mm_set1_epi32(0x3F));
+                const __m128i middle = _mm_and_si128(_mm_srli_epi32(lanes, 2), _mm_set1_epi32(0xFC0));
+                const __m128i high = _mm_and_si128(_mm_srli_epi32(lanes, 4), _mm_set1_epi32(0xF000));
+                store_lanes32_sse42<SWAP>(result, _mm_or_si128(_mm_or_si128(low, middle), high));
+                result += 4;
+                return itr + 12;
+            }
+
+            return utf8_decode_one<SWAP>(itr, end, result);
+        }
+
+        template<bool SWAP, typename UNIT>
+        RYUK_UTF8_TARGET("sse4.2")
+        inline UNIT *utf8_decode_sse42(const u8char_t *itr, const u8char_t *end, UNIT *result) {
+            while (end - itr >= 16) {
+                itr = utf8_decode_step_sse42<SWAP>(itr, end, result);
+            }
+
+            return utf8_decode_scalar<SWAP>(itr, end, result);
+        }
+
+        // 32 ascii octets
+        template<bool SWAP>
+        RYUK_UTF8_TARGET("avx2")
+        inline void store_ascii_avx2(u32char_t *result, __m256i octets) {
+            const __m128i low = _mm256_castsi256_si128(octets);
+            const __m128i high = _mm256_extracti128_si256(octets, 1);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(result), _mm256_cvtepu8_epi32(low));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(result + 8), _mm256_cvtepu8_epi32(_mm_srli_si128(low, 8)));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(result + 16), _mm256_cvtepu8_epi32(high));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(result + 24), _mm256_cvtepu8_epi32(_mm_srli_si128(high, 8)));
+        }
+
+        template<bool SWAP>
+        RYUK_UTF8_TARGET("avx2")
+        inline void store_ascii_avx2(char16_t *result, __m256i octets) {
+            __m256i low = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(octets));
+            __m256i high = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(octets, 1));
+            if (SWAP) {
+                const __m256i swap = _mm256_setr_epi8(
+                    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+                low = _mm256_shuffle_epi8(low, swap);
+                high = _mm256_shuffle_epi8(high, swap);
+            }
+
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(result), low);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(result + 16), high);
+        }
+
+        template<bool SWAP, typename UNIT>
+        RYUK_UTF8_TARGET("avx2")
+        inline UNIT *utf8_decode_avx2(const u8char_t *itr, const u8char_t *end, UNIT *result) {
+            while (end - itr >= 32) {
+                const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(itr));
+                if (_mm256_movemask_epi8(input) != 0) {
+                    itr = utf8_decode_step_sse42<SWAP>(itr, end, result);
+                    continue;
+                }
+
+                store_ascii_avx2<SWAP>(result, input);
+                itr += 32;
+                result += 32;
+            }
+
+            return utf8_decode_sse42<SWAP>(itr, end, result);
+        }
+
+        // the octets of four code points below U+0800 in 16 bit lanes, indexed by which of them take two octets
+        // the octet at position of the shuffle, every lane from lane on takes one octet, or two if its bit is set
+        constexpr u8char_t utf32_two_octet_shuffle(int twoOctets, int lane, int position) {
+            return lane == 4 ? 0x80
+                : position == 0 ? static_cast<u8char_t>(lane * 2)
+                : (position == 1 && ((twoOctets >> lane) & 1)) ? static_cast<u8char_t>(lane * 2 + 1)
+                : utf32_two_octet_shuffle(twoOctets, lane + 1, position - 1 - ((twoOctets >> lane) & 1));
+        }
+
+        struct utf32_two_octet_table {
+            u8char_t shuffles[16 * 16];
+            u8char_t lengths[16];
+        };
+
+        template<size_t... POSITION, size_t... TWO_OCTETS>
+        constexpr utf32_two_octet_table make_utf32_two_octet_table(index_list<POSITION...>, index_list<TWO_OCTETS...>) {
+            return utf32_two_octet_table {
+                { utf32_two_octet_shuffle(static_cast<int>(POSITION / 16), 0, static_cast<int>(POSITION % 16))... },
+                { static_cast<u8char_t>(4 + (TWO_OCTETS & 1) + ((TWO_OCTETS >> 1) & 1) + ((TWO_OCTETS >> 2) & 1) + ((TWO_OCTETS >> 3) & 1))... },
+            };
+        }
+
+        constexpr utf32_two_octet_table UTF32_TWO_OCTET_TABLE = make_utf32_two_octet_table(make_index_list<16 * 16>::type(), make_index_list<16>::type());
+
+        RYUK_UTF8_TARGET("sse4.2")
+        inline __m128i at_least_sse42(__m128i input, uint32_t threshold) {
+            const __m128i limit = _mm_set1_epi32(static_cast<int>(threshold));
+            return _mm_cmpeq_epi32(_mm_max_epu32(input, limit), input);
+        }
+
+        // four code points below U+0800 as the code point or 110xxxxx 10xxxxxx in the low 16 bits of every lane,
+        // packed together, length is how many octets that is
+        RYUK_UTF8_TARGET("sse4.2")
+        inline __m128i encode_two_octets_sse42(__m128i input, size_t &length) {
+            const __m128i twoOctets = at_least_sse42(input, 0x80);
+            const __m128i lead = _mm_or_si128(_mm_srli_epi32(input, 6), _mm_set1_epi32(0xC0));
+            const __m128i trail = _mm_or_si128(_mm_and_si128(input, _mm_set1_epi32(0x3F)), _mm_set1_epi32(0x80));
+            const __m128i lanes = _mm_blendv_epi8(input, _mm_or_si128(lead, _mm_slli_epi32(trail, 8)), twoOctets);
+            const int index = _mm_movemask_ps(_mm_castsi128_ps(twoOctets));
+            const __m128i shuffle = _mm_loadu_si128(reinterpret_cast<const __m128i *>(UTF32_TWO_OCTET_TABLE.shuffles + index * 16));
+            length = UTF32_TWO_OCTET_TABLE.lengths[index];
+            return _mm_shuffle_epi8(_mm_packus_epi32(lanes, lanes), shuffle);
+        }
+
+        // four code points from U+0800 to U+FFFF, stores exactly 12 octets
+        RYUK_UTF8_TARGET("sse4.2")
+        inline void encode_three_octets_sse42(__m128i input, u8char_t *result) {
+            const __m128i trailMask = _mm_set1_epi32(0x3F);
+            const __m128i trailBits = _mm_set1_epi32(0x80);
+            // 1110xxxx 10xxxxxx 10xxxxxx in the low 24 bits of every lane, then next to each other
+            const __m128i lead = _mm_or_si128(_mm_srli_epi32(input, 12), _mm_set1_epi32(0xE0));
+            const __m128i middle = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(input, 6), trailMask), trailBits);
+            const __m128i trail = _mm_or_si128(_mm_and_si128(input, trailMask), trailBits);
+            const __m128i lanes = _mm_or_si128(_mm_or_si128(lead, _mm_slli_epi32(middle, 8)), _mm_slli_epi32(trail, 16));
+            const __m128i octets = _mm_shuffle_epi8(lanes, _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(result), octets);
+            const int last = _mm_cvtsi128_si32(_mm_srli_si128(octets, 8));
+            memcpy(result + 8, &last, 4);
+        }
+
+        // all 8 octets are only stored when there's room for them, the rest of the block is written either way
+        RYUK_UTF8_TARGET("sse4.2")
+        inline void store_two_octets_sse42(u8char_t *result, __m128i octets, size_t length, bool room) {
+            if (room) {
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(result), octets);
+            } else {
+                u8char_t buffer[16];
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(buffer), octets);
+                memcpy(result, buffer, length);
+            }
+        }
+
+        RYUK_UTF8_TARGET("sse4.2")
+        inline u8char_t *utf32_to_utf8_sse42(const u32char_t *itr, const u32char_t *end, u8char_t *result, const u32char_t *&stop) {
+            const __m128i notAscii = _mm_set1_epi32(~0x7F);
+            const __m128i notTwo = _mm_set1_epi32(~0x7FF);
+            const __m128i notThree = _mm_set1_epi32(~0xFFFF);
+
+            while (end - itr >= 4) {
+                if (end - itr >= 16) {
+                    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr));
+                    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr + 4));
+                    const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr + 8));
+                    const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr + 12));
+                    if (_mm_testz_si128(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)), notAscii)) {
+                        const __m128i octets = _mm_packus_epi16(_mm_packus_epi32(a, b), _mm_packus_epi32(c, d));
+                        _mm_storeu_si128(reinterpret_cast<__m128i *>(result), octets);
+                        itr += 16;
+                        result += 16;
+                        continue;
+                    }
+                }
+
+                const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr));
+                if (_mm_testz_si128(input, notAscii)) {
+                    const __m128i octets = _mm_packus_epi16(_mm_packus_epi32(input, input), input);
+                    const int packed = _mm_cvtsi128_si32(octets);
+                    memcpy(result, &packed, 4);
+                    itr += 4;
+                    result += 4;
+                    continue;
+                }
+
+                if (_mm_testz_si128(input, notTwo)) {
+                    size_t length = 0;
+                    const __m128i octets = encode_two_octets_sse42(input, length);
+                    // the next four code points take at least 4 more octets when they are valid
+                    const bool room = end - itr >= 8 && _mm_movemask_epi8(at_least_sse42(_mm_loadu_si128(reinterpret_cast<const __m128i *>(itr + 4)), CODE_POINT_MAX + 1)) == 0;
+                    store_two_octets_sse42(result, octets, length, room);
+                    itr += 4;
+                    result += length;
+                    continue;
+                }
+
+                if (_mm_testz_si128(input, notThree) && _mm_movemask_epi8(at_least_sse42(input, 0x800)) == 0xFFFF) {
+                    encode_three_octets_sse42(input, result);
+                    itr += 4;
+                    result += 12;
+                    continue;
+                }
+
+                if (!is_code_point_valid(*itr)) {
+                    stop = itr;
+                    return result;
+                }
+
+                result = append(*(itr++), result);
+            }
+
+            return utf32_to_utf8_scalar(itr, end, result, stop);
+        }
+
+        template<bool SWAP>
+        RYUK_UTF8_TARGET("sse4.2")
+        inline u8char_t *utf16_to_utf8_sse42(const char16_t *itr, const char16_t *end, u8char_t *result, const char16_t *&stop) {
+            const __m128i notAscii = _mm_set1_epi16(static_cast<short>(0xFF80));
+            const __m128i notTwo = _mm_set1_epi32(~0x7FF);
+            const __m128i surrogateMask = _mm_set1_epi16(static_cast<short>(0xF800));
+            const __m128i surrogateBits = _mm_set1_epi16(static_cast<short>(0xD800));
+
+            while (end - itr >= 8) {
+                __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr));
+                if (SWAP) {
+                    input = swap_units_sse42(input);
+                }
+
+                if (_mm_testz_si128(input, notAscii)) {
+                    _mm_storel_epi64(reinterpret_cast<__m128i *>(result), _mm_packus_epi16(input, input));
+                    itr += 8;
+                    result += 8;
+                    continue;
+                }
+
+                // two bits per code unit
+                const int surrogates = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(input, surrogateMask), surrogateBits));
+                if ((surrogates & 0xFF) == 0) {
+                    const __m128i block = _mm_cvtepu16_epi32(input);
+                    if (_mm_testz_si128(block, notTwo)) {
+                        size_t length = 0;
+                        const __m128i octets = encode_two_octets_sse42(block, length);
+                        // the next four code units aren't surrogates, so they take at least 4 more octets
+                        store_two_octets_sse42(result, octets, length, surrogates == 0);
+                        itr += 4;
+                        result += length;
+                        continue;
+                    }
+
+                    if (_mm_movemask_epi8(at_least_sse42(block, 0x800)) == 0xFFFF) {
+                        encode_three_octets_sse42(block, result);
+                        itr += 4;
+                        result += 12;
+                        continue;
+                    }
+                }
+
+                u32char_t c = 0;
+                if (utf16_next<SWAP>(itr, end, c) != UTF8Error_None) {
+                    stop = itr;
+                    return result;
+                }
+
+                result = append(c, result);
+            }
+
+            return utf16_to_utf8_scalar<SWAP>(itr, end, result, stop);
+        }
+
+        // the UTF-8 length of every lane, 0 for code points that aren't valid
+        RYUK_UTF8_TARGET("sse4.2")
+        inline __m128i utf8_lengths_sse42(__m128i input) {
+            // the comparisons are -1 where they hold
+            __m128i length = _mm_sub_epi32(_mm_set1_epi32(1), at_least_sse42(input, 0x80));
+            length = _mm_sub_epi32(length, at_least_sse42(input, 0x800));
+            length = _mm_sub_epi32(length, at_least_sse42(input, 0x10000));
+            return _mm_andnot_si128(at_least_sse42(input, CODE_POINT_MAX + 1), length);
+        }
+
+        RYUK_UTF8_TARGET("sse4.2")
+        inline size_t utf8_length_of_sse42(const u32char_t *itr, const u32char_t *end) {
+            const __m128i notAscii = _mm_set1_epi32(~0x7F);
+            size_t result = 0;
+
+            while (end - itr >= 4) {
+                // at most 4 octets per lane and block, the 32 bit lanes are summed long before they could overflow
+                size_t blocks = static_cast<size_t>(end - itr) / 4;
+                if (blocks > 4096) {
+                    blocks = 4096;
+                }
+
+                __m128i lengths = _mm_setzero_si128();
+                size_t i = 0;
+                for (; i + 4 <= blocks; i += 4) {
+                    const __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr));
+                    const __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr + 4));
+                    const __m128i third = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr + 8));
+                    const __m128i fourth = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr + 12));
+                    itr += 16;
+
+                    // ascii runs are an octet per code point, without the comparisons
+                    if (_mm_testz_si128(_mm_or_si128(_mm_or_si128(first, second), _mm_or_si128(third, fourth)), notAscii)) {
+                        result += 16;
+                        continue;
+                    }
+
+                    lengths = _mm_add_epi32(lengths, _mm_add_epi32(utf8_lengths_sse42(first), utf8_lengths_sse42(second)));
+                    lengths = _mm_add_epi32(lengths, _mm_add_epi32(utf8_lengths_sse42(third), utf8_lengths_sse42(fourth)));
+                }
+
+                for (; i < blocks; ++i) {
+                    lengths = _mm_add_epi32(lengths, utf8_lengths_sse42(_mm_loadu_si128(reinterpret_cast<const __m128i *>(itr))));
+                    itr += 4;
+                }
+
+                const __m128i pairs = _mm_add_epi32(lengths, _mm_srli_si128(lengths, 8));
+                result += static_cast<size_t>(_mm_cvtsi128_si32(pairs)) + static_cast<size_t>(_mm_cvtsi128_si32(_mm_srli_si128(pairs, 4)));
+            }
+
+            return result + utf8_length_of_scalar(itr, end);
+        }
+
+        template<bool SWAP>
+        RYUK_UTF8_TARGET("sse4.2")
+        inline size_t utf8_length_of_sse42(const char16_t *itr, const char16_t *end) {
+            const __m128i surrogateMask = _mm_set1_epi16(static_cast<short>(0xF800));
+            const __m128i surrogateBits = _mm_set1_epi16(static_cast<short>(0xD800));
+            const __m128i twoOctets = _mm_set1_epi16(0x80);
+            const __m128i threeOctets = _mm_set1_epi16(0x800);
+            size_t result = 0;
+
+            while (end - itr >= 8) {
+                // at most 2 extra octets per lane and block, the 16 bit lanes can't overflow
+                size_t blocks = static_cast<size_t>(end - itr) / 8;
+                if (blocks > 4096) {
+                    blocks = 4096;
+                }
+
+                __m128i extra = _mm_setzero_si128();
+                for (size_t i = 0; i < blocks; ++i) {
+                    __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr));
+                    if (SWAP) {
+                        input = swap_units_sse42(input);
+                    }
+
+                    // the comparisons are -1 where they hold, surrogates take two octets per code unit
+                    const __m128i surrogate = _mm_cmpeq_epi16(_mm_and_si128(input, surrogateMask), surrogateBits);
+                    extra = _mm_sub_epi16(extra, _mm_cmpeq_epi16(_mm_max_epu16(input, twoOctets), input));
+                    extra = _mm_sub_epi16(extra, _mm_andnot_si128(surrogate, _mm_cmpeq_epi16(_mm_max_epu16(input, threeOctets), input)));
+                    itr += 8;
+                }
+
+                const __m128i sums = _mm_madd_epi16(extra, _mm_set1_epi16(1));
+                const __m128i pairs = _mm_add_epi32(sums, _mm_srli_si128(sums, 8));
+                result += blocks * 8 + static_cast<size_t>(_mm_cvtsi128_si32(pairs)) + static_cast<size_t>(_mm_cvtsi128_si32(_mm_srli_si128(pairs, 4)));
+            }
+
+            return result + utf8_length_of_scalar<SWAP>(itr, end);
+        }
+
+        RYUK_UTF8_TARGET("sse4.2")
+        inline size_t count_four_octet_leads_sse42(const u8char_t *itr, const u8char_t *end) {
+            const __m128i firstFourOctetLead = _mm_set1_epi8(static_cast<char>(0xF0));
+            size_t result = 0;
+
+            while (end - itr >= 16) {
+                size_t blocks = static_cast<size_t>(end - itr) / 16;
+                if (blocks > SIMD_COUNTER_BLOCKS) {
+                    blocks = SIMD_COUNTER_BLOCKS;
+                }
+
+                __m128i counters = _mm_setzero_si128();
+                for (size_t i = 0; i < blocks; ++i) {
+                    const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr));
+                    // unsigned, at least 0xF0 is where the maximum doesn't change the octet
+                    counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(_mm_max_epu8(input, firstFourOctetLead), input));
+                    itr += 16;
+                }
+
+                result += sum_counters_sse42(counters);
+            }
+
+            return result + count_four_octet_leads_scalar(itr, end);
+        }
+
+        RYUK_UTF8_TARGET("avx2")
+        inline size_t count_four_octet_leads_avx2(const u8char_t *itr, const u8char_t *end) {
+            const __m256i firstFourOctetLead = _mm256_set1_epi8(static_cast<char>(0xF0));
+            size_t result = 0;
+
+            while (end - itr >= 32) {
+                size_t blocks = static_cast<size_t>(end - itr) / 32;
+                if (blocks > SIMD_COUNTER_BLOCKS) {
+                    blocks = SIMD_COUNTER_BLOCKS;
+                }
+
+                __m256i counters = _mm256_setzero_si256();
+                for (size_t i = 0; i < blocks; ++i) {
+                    const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(itr));
+                    counters = _mm256_sub_epi8(counters, _mm256_cmpeq_epi8(_mm256_max_epu8(input, firstFourOctetLead), input));
+                    itr += 32;
+                }
+
+                result += sum_counters_avx2(counters);
+            }
+
+            return result + count_four_octet_leads_scalar(itr, end);
+        }
+    #endif
+
+        inline u32char_t *transcode_utf8_to_utf32(const u8char_t *start, const u8char_t *end, u32char_t *result) {
+        #if defined(RYUK_UTF8_X86)
+            if (end - start >= 16) {
+                switch (simd_level()) {
+                    case SIMDLevel_AVX512:
+                    case SIMDLevel_AVX2: return utf8_decode_avx2<false>(start, end, result);
+                    case SIMDLevel_SSE42: return utf8_decode_sse42<false>(start, end, result);
+                    default: break;
+                }
+            }
+        #endif
+            return utf8_decode_scalar<false>(start, end, result);
+        }
+
+        template<bool SWAP>
+        inline char16_t *transcode_utf8_to_utf16(const u8char_t *start, const u8char_t *end, char16_t *result) {
+        #if defined(RYUK_UTF8_X86)
+            if (end - start >= 16) {
+                switch (simd_level()) {
+                    case SIMDLevel_AVX512:
+                    case SIMDLevel_AVX2: return utf8_decode_avx2<SWAP>(start, end, result);
+                    case SIMDLevel_SSE42: return utf8_decode_sse42<SWAP>(start, end, result);
+                    default: break;
+                }
+            }
+        #endif
+            return utf8_decode_scalar<SWAP>(start, end, result);
+        }
+
+        // stops at the first code point that isn't valid, stop is where it stopped
+        inline u8char_t *transcode_utf32_to_utf8(const u32char_t *start, const u32char_t *end, u8char_t *result, const u32char_t *&stop) {
+        #if defined(RYUK_UTF8_X86)
+            if (end - start >= 4 && simd_level() != SIMDLevel_None) {
+                return utf32_to_utf8_sse42(start, end, result, stop);
+            }
+        #endif
+            return utf32_to_utf8_scalar(start, end, result, stop);
+        }
+
+        inline size_t utf8_length_of(const u32char_t *start, const u32char_t *end) {
+        #if defined(RYUK_UTF8_X86)
+            if (end - start >= 4 && simd_level() != SIMDLevel_None) {
+                return utf8_length_of_sse42(start, end);
+            }
+        #endif
+            return utf8_length_of_scalar(start, end);
+        }
+
+        // stops at the first surrogate that isn't paired, stop is where it stopped
+        template<bool SWAP>
+        inline u8char_t *transcode_utf16_to_utf8(const char16_t *start, const char16_t *end, u8char_t *result, const char16_t *&stop) {
+        #if defined(RYUK_UTF8_X86)
+            if (end - start >= 8 && simd_level() != SIMDLevel_None) {
+                return utf16_to_utf8_sse42<SWAP>(start, end, result, stop);
+            }
+        #endif
+            return utf16_to_utf8_scalar<SWAP>(start, end, result, stop);
+        }
+
+        template<bool SWAP>
+        inline size_t utf8_length_of(const char16_t *start, const char16_t *end) {
+        #if defined(RYUK_UTF8_X86)
+            if (end - start >= 8 && simd_level() != SIMDLevel_None) {
+                return utf8_length_of_sse42<SWAP>(start, end);
+            }
+        #endif
+            return utf8_length_of_scalar<SWAP>(start, end);
+        }
+
+        inline size_t count_four_octet_leads(const u8char_t *start, const u8char_t *end) {
+        #if defined(RYUK_UTF8_X86)
+            if (end - start >= 16) {
+                switch (simd_level()) {
+                    case SIMDLevel_AVX512:
+                    case SIMDLevel_AVX2: return count_four_octet_leads_avx2(start, end);
+                    case SIMDLevel_SSE42: return count_four_octet_leads_sse42(start, end);
+                    default: break;
+                }
+            }
+        #endif
+            return count_four_octet_leads_scalar(start, end);
+        }
+
+        inline u32char_t *utf8_to_utf32(u8char_t *start, u8char_t *end, u32char_t *result) {
+            return transcode_utf8_to_utf32(start, end, result);
+        }
+
+        /*
+            Substring search. UTF-8 is self synchronizing, a valid needle can only match at code point
+            boundaries of a valid haystack, so searching octets is enough.
+
+            Two-Way (Crochemore and Perrin) is the fallback that guarantees linear time with constant
+            space. The needle is split at a critical factorization, the right part is matched first left
+            to right, then the left part right to left, and a mismatch shifts by the period of the needle
+            (remembering the prefix that is known to match when the needle is periodic) or past the part
+            that matched. REVERSE runs it on the reversed strings, which finds the last match.
+
+            The vectorized search compares the first and the last octet of the needle against 16 or 32
+            positions at once and only checks the rest where both match. That is much faster on real text,
+            but quadratic when the pair keeps matching (aaaa...ab in aaaa...), so it hands over to Two-Way
+            once it has compared more octets than it has scanned, plus some slack.
+        */
+        template<bool REVERSE>
+        inline u8char_t octet_at(const u8char_t *base, ptrdiff_t length, ptrdiff_t index) {
+            return REVERSE ? base[length - 1 - index] : base[index];
+        }
+
+        // the start of the maximal suffix of the needle (minus one) and its period, under the order or the reversed order
+        template<bool REVERSE>
+        inline ptrdiff_t maximal_suffix(const u8char_t *needle, ptrdiff_t length, bool reversedOrder, ptrdiff_t &period) {
+            ptrdiff_t suffix = -1;
+            ptrdiff_t j = 0;
+            ptrdiff_t k = 1;
+            period = 1;
+
+            while (j + k < length) {
+                const u8char_t a = octet_at<REVERSE>(needle, length, j + k);
+                const u8char_t b = octet_at<REVERSE>(needle, length, suffix + k);
+                if (reversedOrder ? (a > b) : (a < b)) {
+                    j += k;
+                    k = 1;
+                    period = j - suffix;
+                } else if (a == b) {
+                    if (k != period) {
+                        ++k;
+                    } else {
+                        j += period;
+                        k = 1;
+                    }
+                } else {
+                    suffix = j;
+                    j = suffix + 1;
+                    k = period = 1;
+                }
+            }
+
+            return suffix;
+        }
+
+        // the position of the first match, -1 if there is none
+        template<bool REVERSE>
+        inline ptrdiff_t two_way_search(const u8char_t *haystack, ptrdiff_t n, const u8char_t *needle, ptrdiff_t m) {
+            ptrdiff_t period = 0;
+            ptrdiff_t otherPeriod = 0;
+            ptrdiff_t split = maximal_suffix<REVERSE>(needle, m, false, period);
+            const ptrdiff_t otherSplit = maximal_suffix<REVERSE>(needle, m, true, otherPeriod);
+            if (otherSplit > split) {
+                split = otherSplit;
+                period = otherPeriod;
+            }
+
+            bool periodic = (period + split + 1 <= m);
+            for (ptrdiff_t i = 0; periodic && i <= split; ++i) {
+                periodic = octet_at<REVERSE>(needle, m, i) == octet_at<REVERSE>(needle, m, i + period);
+            }
+
+            auto haystackAt = [haystack, n](ptrdiff_t index) { return octet_at<REVERSE>(haystack, n, index); };
+            auto needleAt = [needle, m](ptrdiff_t index) { return octet_at<REVERSE>(needle, m, index); };
+            if (periodic) {
+                // the first memory octets of the needle are known to match
+                ptrdiff_t memory = -1;
+                for (ptrdiff_t j = 0; j <= n - m;) {
+                    ptrdiff_t i = ((split > memory) ? split : memory) + 1;
+                    while (i < m && needleAt(i) == haystackAt(i + j)) {
+                        ++i;
+                    }
+
+                    if (i < m) {
+                        j += i - split;
+                        memory = -1;
+                        continue;
+                    }
+
+                    i = split;
+                    while (i > memory && needleAt(i) == haystackAt(i + j)) {
+                        --i;
+                    }
+
+                    if (i <= memory) {
+                        return j;
+                    }
+
+                    j += period;
+                    memory = m - period - 1;
+                }
+            } else {
+                period = ((split + 1 > m - split - 1) ? split + 1 : m - split - 1) + 1;
+                for (ptrdiff_t j = 0; j <= n - m;) {
+                    ptrdiff_t i = split + 1;
+                    while (i < m && needleAt(i) == haystackAt(i + j)) {
+                        ++i;
+                    }
+
+                    if (i < m) {
+                        j += i - split;
+                        continue;
+                    }
+
+                    i = split;
+                    while (i >= 0 && needleAt(i) == haystackAt(i + j)) {
+                        --i;
+                    }
+
+                    if (i < 0) {
+                        return j;
+                    }
+
+                    j += period;
+                }
+            }
+
+            return -1;
+        }
+
+        constexpr ptrdiff_t SEARCH_SLACK = 1024;
+
+    #if defined(RYUK_UTF8_X86)
+        inline int lowest_set_bit(uint32_t bits) {
+        #if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanForward(&index, bits);
+            return static_cast<int>(index);
+        #else
+            return __builtin_ctz(bits);
+        #endif
+        }
+
+        // checks the candidates in matches, where the first and the last octet of the needle match at itr + bit
+        inline const u8char_t *verify_candidates(const u8char_t *itr, uint32_t matches, const u8char_t *needle, size_t m, ptrdiff_t &compared) {
+            while (matches != 0) {
+                const u8char_t *candidate = itr + lowest_set_bit(matches);
+                if (memcmp(candidate + 1, needle + 1, m - 2) == 0) {
+                    return candidate;
+                }
+
+                compared += static_cast<ptrdiff_t>(m);
+                matches &= matches - 1;
+            }
+
+            return nullptr;
+        }
+
+        // returns the first match or where Two-Way has to take over, needs m >= 2
+        RYUK_UTF8_TARGET("sse4.2")
+        inline const u8char_t *search_sse42(const u8char_t *itr, const u8char_t *end, const u8char_t *needle, size_t m, bool &found) {
+            const __m128i first = _mm_set1_epi8(static_cast<char>(needle[0]));
+            const __m128i last = _mm_set1_epi8(static_cast<char>(needle[m - 1]));
+            const u8char_t *start = itr;
+            ptrdiff_t compared = 0;
+
+            while (end - itr >= static_cast<ptrdiff_t>(m + 15) && compared <= (itr - start) + SEARCH_SLACK) {
+                const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr));
+                const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(itr + m - 1));
+                const uint32_t matches = static_cast<uint32_t>(_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last))));
+                const u8char_t *match = verify_candidates(itr, matches, needle, m, compared);
+                if (match) {
+                    found = true;
+                    return match;
+                }
+
+                itr += 16;
+            }
+
+            found = false;
+            return itr;
+        }
+
+        RYUK_UTF8_TARGET("avx2")
+        inline const u8char_t *search_avx2(const u8char_t *itr, const u8char_t *end, const u8char_t *needle, size_t m, bool &found) {
+            const __m256i first = _mm256_set1_epi8(static_cast<char>(needle[0]));
+            const __m256i last = _mm256_set1_epi8(static_cast<char>(needle[m - 1]));
+            const u8char_t *start = itr;
+            ptrdiff_t compared = 0;
+
+            while (end - itr >= static_cast<ptrdiff_t>(m + 31) && compared <= (itr - start) + SEARCH_SLACK) {
+                const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(itr));
+                const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(itr + m - 1));
+                const uint32_t matches = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last))));
+                const u8char_t *match = verify_candidates(itr, matches, needle, m, compared);
+                if (match) {
+                    found = true;
+                    return match;
+                }
+
+                itr += 32;
+            }
+
+            if (compared > (itr - start) + SEARCH_SLACK) {
+                found = false;
+                return itr;
+            }
+
+            return search_sse42(itr, end, needle, m, found);
+        }
+    #endif
+
+        // the first occurrence of the needle, nullptr if there is none, an empty needle is found at start
+        inline const u8char_t *find_substring(const u8char_t *start, const u8char_t *end, const u8char_t *needle, size_t m) {
+            if (m == 0) {
+                return start;
+            }
+
+            if (static_cast<size_t>(end - start) < m) {
+                return nullptr;
+            }
+
+            if (m == 1) {
+                return static_cast<const u8char_t *>(memchr(start, needle[0], static_cast<size_t>(end - start)));
+            }
+
+        #if defined(RYUK_UTF8_X86)
+            bool found = false;
+            switch (simd_level()) {
+                case SIMDLevel_AVX512:
+                case SIMDLevel_AVX2: start = search_avx2(start, end, needle, m, found); break;
+                case SIMDLevel_SSE42: start = search_sse42(start, end, needle, m, found); break;
+                default: break;
+            }
+
+            if (found) {
+                return start;
+            }
+        #endif
+            const ptrdiff_t position = two_way_search<false>(start, end - start, needle, static_cast<ptrdiff_t>(m));
+            return (position < 0) ? nullptr : start + position;
+        }
+
+        // the last occurrence of the needle, nullptr if there is none, an empty needle is found at end
+        inline const u8char_t *rfind_substring(const u8char_t *start, const u8char_t *end, const u8char_t *needle, size_t m) {
+            if (static_cast<size_t>(end - start) < m) {
+                return nullptr;
+            }
+
+            if (m == 1) {
+                for (const u8char_t *itr = end; itr != start;) {
+                    if (*(--itr) == needle[0]) {
+                        return itr;
+                    }
+                }
+
+                return nullptr;
+            }
+
+            const ptrdiff_t position = two_way_search<true>(start, end - start, needle, static_cast<ptrdiff_t>(m));
+            return (position < 0) ? nullptr : end - position - m;
+        }
+
+        // allocators with a reallocate member (like utf8string_allocator) can grow a block in place,
+        // any other allocator gets a new block and the old one is copied over and deallocated
+        template<typename ALLOCATOR>
+        auto reallocate(ALLOCATOR &allocator, typename ALLOCATOR::value_type *block, size_t oldSize, size_t newSize, int)
+            -> decltype(allocator.reallocate(block, oldSize, newSize)) {
+            return allocator.reallocate(block, oldSize, newSize);
+        }
+
+        template<typename ALLOCATOR>
+        typename ALLOCATOR::value_type *reallocate(ALLOCATOR &allocator, typename ALLOCATOR::value_type *block, size_t oldSize, size_t newSize, long) {
+            typename ALLOCATOR::value_type *grown = std::allocator_traits<ALLOCATOR>::allocate(allocator, newSize);
+            if (grown) {
+                memcpy(grown, block, (oldSize < newSize ? oldSize : newSize) * sizeof(typename ALLOCATOR::value_type));
+                std::allocator_traits<ALLOCATOR>::deallocate(allocator, block, oldSize);
+            }
+
+            return grown;
+        }
+
+        template<typename ALLOCATOR>
+        typename ALLOCATOR::value_type *reallocate(ALLOCATOR &allocator, typename ALLOCATOR::value_type *block, size_t oldSize, size_t newSize) {
+            return reallocate(allocator, block, oldSize, newSize, 0);
+        }
+
+        // allocators say so with is_always_equal, the ones that don't are equal if they have no state
+        template<typename ALLOCATOR, typename = void>
+        struct is_always_equal : std::is_empty<ALLOCATOR> {};
+
+        template<typename ALLOCATOR>
+        struct is_always_equal<ALLOCATOR, typename std::conditional<true, void, typename ALLOCATOR::is_always_equal>::type>
+            : std::integral_constant<bool, ALLOCATOR::is_always_equal::value> {};
+
+        template<typename T>
+        T *relocate(T *first, T *last, T *result, std::true_type) {
+            const size_t count = static_cast<size_t>(last - first);
+            memcpy(static_cast<void *>(result), static_cast<const void *>(first), count * sizeof(T));
+            return result + count;
+        }
+
+        template<typename T>
+        T *relocate(T *first, T *last, T *result, std::false_type) {
+            for (; first != last; ++first, ++result) {
+                new (result) T(std::move(*first));
+                first->~T();
+            }
+
+            return result;
+        }
+
+        // keeps the allocator of a string, allocators without state take no room (empty base optimization), final
+        // ones can't be a base (std::is_final is c++14, the intrinsic behind it is there in c++11 compilers too)
+        template<typename ALLOCATOR, bool EMPTY = std::is_empty<ALLOCATOR>::value && !__is_final(ALLOCATOR)>
+        class allocator_holder : private ALLOCATOR {
+        protected:
+            allocator_holder() = default;
+            explicit allocator_holder(const ALLOCATOR &allocator) : ALLOCATOR(allocator) {}
+
+            ALLOCATOR & allocator() { return *this; }
+            const ALLOCATOR & allocator() const { return *this; }
+        };
+
+        template<typename ALLOCATOR>
+        class allocator_holder<ALLOCATOR, false> {
+        private:
+            ALLOCATOR _allocator;
+        protected:
+            allocator_holder() = default;
+            explicit allocator_holder(const ALLOCATOR &allocator) : _allocator(allocator) {}
+
+            ALLOCATOR & allocator() { return _allocator; }
+            const ALLOCATOR & allocator() const { return _allocator; }
+        };
+
+        // keeps the hash of a string whose hash policy caches it, 0 is a hash that isn't known
+        template<bool CACHED>
+        class hash_holder {
+        protected:
+            size_t cached_hash() const { return 0; }
+            void set_cached_hash(size_t) const {}
+        };
+
+        template<>
+        class hash_holder<true> {
+        private:
+            mutable size_t _hash = 0;
+        protected:
+            size_t cached_hash() const { return _hash; }
+            void set_cached_hash(size_t hash) const { _hash = hash; }
+        };
+
+        /*
+            The storage of basic_utf8string, picked by its layout policy. Both layouts keep the octets, the length
+            (including the null terminator), the capacity, the cached code point count and the code point index
+            of heap strings, they only differ in where.
+
+            A heap buffer is allocated header_size octets before its data, to_heap() switches an sso string to a
+            buffer its content was already copied to, to_sso() switches back before the content is copied in.
+        */
+        template<size_t SSO_SIZE>
+        class wide_storage {
+        private:
+            u8char_t *_data = nullptr;
+            // mutable because heap strings keep the lazily built code point index in it
+            mutable u8char_t _ssoData[SSO_SIZE] = {};
+            size_t _capacity = SSO_SIZE;
+            size_t _length = 1;
+            mutable size_t _count = 0;
+
+            static_assert(SSO_SIZE >= sizeof(size_t *), "heap strings keep their code point index in the sso buffer");
+        public:
+            static constexpr size_t sso_size = SSO_SIZE;
+            static constexpr size_t header_size = 0;
+
+            bool is_sso() const {
+                return _capacity == SSO_SIZE;
+            }
+
+            u8char_t *data() const {
+                return is_sso() ? _ssoData : _data;
+            }
+
+            size_t length() const {
+                return _length;
+            }
+
+            void set_length(size_t length) {
+                _length = length;
+            }
+
+            size_t capacity() const {
+                return _capacity;
+            }
+
+            size_t count() const {
+                return _count;
+            }
+
+            void set_count(size_t count) const {
+                _count = count;
+            }
+
+            size_t *index() const {
+                size_t *index;
+                memcpy(&index, _ssoData, sizeof(index));
+                return index;
+            }
+
+            void set_index(size_t *index) const {
+                memcpy(_ssoData, &index, sizeof(index));
+            }
+
+            u8char_t *block() const {
+                return _data;
+            }
+
+            void to_heap(u8char_t *block, size_t capacity) {
+                _data = block;
+                _capacity = capacity;
+                set_index(nullptr);
+            }
+
+            void move_heap(u8char_t *block, size_t capacity) {
+                _data = block;
+                _capacity = capacity;
+            }
+
+            void to_sso() {
+                _data = nullptr;
+                _capacity = SSO_SIZE;
+            }
+
+            // copies what's live, the content of sso strings and the index pointer of heap strings
+            void move_from(const wide_storage &other) {
+                _data = other._data;
+                _capacity = other._capacity;
+                _length = other._length;
+                _count = other._count;
+                memcpy(_ssoData, other._ssoData, other.is_sso() ? other._length : sizeof(size_t *));
+            }
+
+            void reset() {
+                _data = nullptr;
+                _capacity = SSO_SIZE;
+                _length = 1;
+                _count = 0;
+                _ssoData[0] = '\0';
+            }
+        };
+
+        /*
+            Three words, heap strings keep { data, length, capacity } in them, and the count and the index in
+            the header of their buffer. Sso strings use all but the last two octets for content, the octet
+            before last for the count (0xFF when it isn't known) and the last one for the length. The top bit
+            of the last octet is set for heap strings, it's the top bit of the capacity on little endian hosts,
+            big endian hosts keep the capacity shifted up an octet.
+        */
+        template<size_t SSO_SIZE>
+        class compact_storage {
+        private:
+            static constexpr size_t raw_size = sizeof(u8char_t *) + 2 * sizeof(size_t);
+            static constexpr size_t length_offset = sizeof(u8char_t *);
+            static constexpr size_t capacity_offset = length_offset + sizeof(size_t);
+            static constexpr size_t count_octet = raw_size - 2;
+            static constexpr size_t length_octet = raw_size - 1;
+            static constexpr u8char_t heap_tag = 0x80;
+            static constexpr u8char_t sso_unknown_count = 0xFF;
+
+            static_assert(SSO_SIZE == raw_size - 2, "compact strings have room for exactly sizeof(size_t) * 3 - 2 octets inline");
+
+            alignas(size_t) mutable u8char_t _raw[raw_size] = {};
+
+            size_t load(size_t offset) const {
+                size_t word;
+                memcpy(&word, &_raw[offset], sizeof(word));
+                return word;
+            }
+
+            void store(size_t offset, size_t word) {
+                memcpy(&_raw[offset], &word, sizeof(word));
+            }
+
+            u8char_t *heap_data() const {
+                u8char_t *data;
+                memcpy(&data, _raw, sizeof(data));
+                return data;
+            }
+
+            static size_t encode_capacity(size_t capacity) {
+                return is_host_big_endian()
+                    ? (capacity << 8) | heap_tag
+                    : capacity | (static_cast<size_t>(heap_tag) << (8 * (sizeof(size_t) - 1)));
+            }
+
+            static size_t decode_capacity(size_t word) {
+                return is_host_big_endian()
+                    ? word >> 8
+                    : word & ~(static_cast<size_t>(heap_tag) << (8 * (sizeof(size_t) - 1)));
+            }
+        public:
+            static constexpr size_t sso_size = SSO_SIZE;
+            // the count and the index pointer
+            static constexpr size_t header_size = 2 * sizeof(size_t);
+
+            compact_storage() {
+                reset();
+            }
+
+            bool is_sso() const {
+                return (_raw[length_octet] & heap_tag) == 0;
+            }
+
+            u8char_t *data() const {
+                return is_sso() ? _raw : heap_data();
+            }
+
+            size_t length() const {
+                return is_sso() ? _raw[length_octet] : load(length_offset);
+            }
+
+            void set_length(size_t length) {
+                if (is_sso()) {
+                    _raw[length_octet] = static_cast<u8char_t>(length);
+                } else {
+                    store(length_offset, length);
+                }
+            }
+
+            size_t capacity() const {
+                return is_sso() ? SSO_SIZE : decode_capacity(load(capacity_offset));
+            }
+
+            size_t count() const {
+                if (is_sso()) {
+                    return (_raw[count_octet] == sso_unknown_count) ? SIZE_MAX : _raw[count_octet];
+                }
+
+                size_t count;
+                memcpy(&count, heap_data() - header_size, sizeof(count));
+                return count;
+            }
+
+            void set_count(size_t count) const {
+                if (is_sso()) {
+                    _raw[count_octet] = (count == SIZE_MAX) ? sso_unknown_count : static_cast<u8char_t>(count);
+                } else {
+                    memcpy(heap_data() - header_size, &count, sizeof(count));
+                }
+            }
+
+            size_t *index() const {
+                size_t *index;
+                memcpy(&index, heap_data() - sizeof(index), sizeof(index));
+                return index;
+            }
+
+            void set_index(size_t *index) const {
+                memcpy(heap_data() - sizeof(index), &index, sizeof(index));
+            }
+
+            u8char_t *block() const {
+                return heap_data() - header_size;
+            }
+
+            void to_heap(u8char_t *block, size_t capacity) {
+                const size_t length = this->length();
+                const size_t count = this->count();
+                u8char_t *data = block + header_size;
+                memcpy(_raw, &data, sizeof(data));
+                store(length_offset, length);
+                store(capacity_offset, encode_capacity(capacity));
+                set_count(count);
+                set_index(nullptr);
+            }
+
+            void move_heap(u8char_t *block, size_t capacity) {
+                u8char_t *data = block + header_size;
+                memcpy(_raw, &data, sizeof(data));
+                store(capacity_offset, encode_capacity(capacity));
+            }
+
+            void to_sso() {
+                const size_t length = this->length();
+                const size_t count = this->count();
+                _raw[length_octet] = static_cast<u8char_t>(length);
+                set_count(count);
+            }
+
+            // every octet is live in either mode
+            void move_from(const compact_storage &other) {
+                memcpy(_raw, other._raw, raw_size);
+            }
+
+            void reset() {
+                _raw[0] = '\0';
+                _raw[count_octet] = 0;
+                _raw[length_octet] = 1;
+            }
+        };
+    };
+
+    // the outcome of a checked conversion, read and written are in code units of the input and the output,
+    // on an error read is where the invalid input starts
+    struct transcode_result {
+        internal::UTF8Error error;
+        size_t read;
+        size_t written;
+    };
+
+    // the exact number of code points valid UTF-8 decodes to
+    inline size_t utf32_length_of(const u8char_t *start, const u8char_t *end) {
+        return internal::count_code_points(start, end);
+    }
+
+    // the exact number of octets the code points encode to, invalid code points don't take any
+    inline size_t utf8_length_of(const u32char_t *start, const u32char_t *end) {
+        return internal::utf8_length_of(start, end);
+    }
+
+    // result needs room for utf32_length_of(start, end) code points, invalid input is dropped and never overflows it
+    inline size_t convert_utf8_to_utf32_trusted(const u8char_t *start, const u8char_t *end, u32char_t *result) {
+        return static_cast<size_t>(internal::transcode_utf8_to_utf32(start, end, result) - result);
+    }
+
+    // converts up to the first invalid sequence
+    inline transcode_result convert_utf8_to_utf32(const u8char_t *start, const u8char_t *end, u32char_t *result) {
+        transcode_result outcome;
+        u8char_t *valid = internal::find_invalid(const_cast<u8char_t *>(start), const_cast<u8char_t *>(end), outcome.error);
+        outcome.read = static_cast<size_t>(valid - start);
+        outcome.written = convert_utf8_to_utf32_trusted(start, valid, result);
+        return outcome;
+    }
+
+    // result needs room for utf8_length_of(start, end) octets, invalid code points are dropped
+    inline size_t convert_utf32_to_utf8_trusted(const u32char_t *start, const u32char_t *end, u8char_t *result) {
+        u8char_t *written = result;
+        const u32char_t *stop = start;
+
+        while (stop != end) {
+            written = internal::transcode_utf32_to_utf8(stop, end, written, stop);
+            if (stop != end) {
+                ++stop;
+            }
+        }
+
+        return static_cast<size_t>(written - result);
+    }
+
+    // converts up to the first code point that isn't valid
+    inline transcode_result convert_utf32_to_utf8(const u32char_t *start, const u32char_t *end, u8char_t *result) {
+        transcode_result outcome;
+        const u32char_t *stop = start;
+        outcome.written = static_cast<size_t>(internal::transcode_utf32_to_utf8(start, end, result, stop) - result);
+        outcome.read = static_cast<size_t>(stop - start);
+        outcome.error = (stop == end) ? internal::UTF8Error_None : internal::UTF8Error_InvalidCodePoint;
+        return outcome;
+    }
+
+    // the exact number of UTF-16 code units valid UTF-8 decodes to, code points above U+FFFF take two
+    inline size_t utf16_length_of(const u8char_t *start, const u8char_t *end) {
+        return internal::count_code_points(start, end) + internal::count_four_octet_leads(start, end);
+    }
+
+    // the exact number of octets valid UTF-16 encodes to, lone surrogates are counted as if they were paired
+    inline size_t utf8_length_of(const char16_t *start, const char16_t *end, UTF16ByteOrder order = UTF16ByteOrder_LittleEndian) {
+        return internal::swaps(order) ? internal::utf8_length_of<true>(start, end) : internal::utf8_length_of<false>(start, end);
+    }
+
+    // skips a byte order mark and takes the byte order from it, order is left alone when there isn't one
+    inline const char16_t *skip_utf16_bom(const char16_t *start, const char16_t *end, UTF16ByteOrder &order) {
+        if (start == end) {
+            return start;
+        }
+
+        if (*start == internal::UTF16_BOM) {
+            order = internal::is_host_big_endian() ? UTF16ByteOrder_BigEndian : UTF16ByteOrder_LittleEndian;
+            return start + 1;
+        } else if (*start == internal::swap_unit(internal::UTF16_BOM)) {
+            order = internal::is_host_big_endian() ? UTF16ByteOrder_LittleEndian : UTF16ByteOrder_BigEndian;
+            return start + 1;
+        }
+
+        return start;
+    }
+
+    inline char16_t *write_utf16_bom(char16_t *result, UTF16ByteOrder order) {
+        *result = internal::swaps(order) ? internal::swap_unit(internal::UTF16_BOM) : internal::UTF16_BOM;
+        return result + 1;
+    }
+
+    // result needs room for utf16_length_of(start, end) code units, invalid input is dropped and never overflows it
+    inline size_t convert_utf8_to_utf16_trusted(const u8char_t *start, const u8char_t *end, char16_t *result, UTF16ByteOrder order = UTF16ByteOrder_LittleEndian) {
+        char16_t *written = internal::swaps(order)
+            ? internal::transcode_utf8_to_utf16<true>(start, end, result)
+            : internal::transcode_utf8_to_utf16<false>(start, end, result);
+        return static_cast<size_t>(written - result);
+    }
+
+    // converts up to the first invalid sequence
+    inline transcode_result convert_utf8_to_utf16(const u8char_t *start, const u8char_t *end, char16_t *result, UTF16ByteOrder order = UTF16ByteOrder_LittleEndian) {
+        transcode_result outcome;
+        u8char_t *valid = internal::find_invalid(const_cast<u8char_t *>(start), const_cast<u8char_t *>(end), outcome.error);
+        outcome.read = static_cast<size_t>(valid - start);
+        outcome.written = convert_utf8_to_utf16_trusted(start, valid, result, order);
+        return outcome;
+    }
+
+    // converts up to the first surrogate that isn't paired, the error tells why it isn't
+    inline transcode_result convert_utf16_to_utf8(const char16_t *start, const char16_t *end, u8char_t *result, UTF16ByteOrder order = UTF16ByteOrder_LittleEndian) {
+        transcode_result outcome;
+        const char16_t *stop = start;
+        u32char_t ignored = 0;
+        if (internal::swaps(order)) {
+            outcome.written = static_cast<size_t>(internal::transcode_utf16_to_utf8<true>(start, end, result, stop) - result);
+            outcome.error = (stop == end) ? internal::UTF8Error_None : internal::utf16_next<true>(stop, end, ignored);
+        } else {
+            outcome.written = static_cast<size_t>(internal::transcode_utf16_to_utf8<false>(start, end, result, stop) - result);
+            outcome.error = (stop == end) ? internal::UTF8Error_None : internal::utf16_next<false>(stop, end, ignored);
+        }
+
+        outcome.read = static_cast<size_t>(stop - start);
+        return outcome;
+    }
+
+    // result needs room for utf8_length_of(start, end, order) octets, surrogates that aren't paired are dropped
+    inline size_t convert_utf16_to_utf8_trusted(const char16_t *start, const char16_t *end, u8char_t *result, UTF16ByteOrder order = UTF16ByteOrder_LittleEndian) {
+        u8char_t *written = result;
+        const char16_t *stop = start;
+        const bool swap = internal::swaps(order);
+
+        while (stop != end) {
+            written = swap
+                ? internal::transcode_utf16_to_utf8<true>(stop, end, written, stop)
+                : internal::transcode_utf16_to_utf8<false>(stop, end, written, stop);
+            if (stop != end) {
+                ++stop;
+            }
+        }
+
+        return static_cast<size_t>(written - result);
+    }
+
+    class basic_utf8string_iterator {
+    private:
+        u8char_t *_begin;
+        u8char_t *_end;
+        u8char_t *_current;
+
+    public:
+        basic_utf8string_iterator(u8char_t *begin, u8char_t *end) : _begin(begin), _end(end) {
+            assert(begin);
+            assert(end);
+            _current = begin;
+        }
+
+        ~basic_utf8string_iterator() = default;
+        basic_utf8string_iterator(const basic_utf8string_iterator &) = default;
+        basic_utf8string_iterator(basic_utf8string_iterator &&) = default;
+        basic_utf8string_iterator & operator=(const basic_utf8string_iterator &) = default;
+        basic_utf8string_iterator & operator=(basic_utf8string_iterator &&) = default;
+
+        bool operator==(const basic_utf8string_iterator &other) {
+            return (_current == other._current);
+        }
+
+        bool operator!=(const basic_utf8string_iterator &other) {
+            return !(operator==(other));
+        }
+
+        basic_utf8string_iterator & operator++() {
+            internal::next(_current, _end);
+            return *this;
+        }
+
+        basic_utf8string_iterator operator++(int) {
+            basic_utf8string_iterator temp = *this;
+            internal::next(_current, _end);
+            return temp;
+        }
+
+        basic_utf8string_iterator & operator--() {
+            internal::previous(_current, _begin);
+            return *this;
+        }
+
+        basic_utf8string_iterator operator--(int) {
+            basic_utf8string_iterator temp = *this;
+            internal::previous(_current, _begin);
+            return temp;
+        }
+
+        u32char_t operator*() {
+            return internal::peek_next(_current, _end);
+        }
+
+        bool operator<(const basic_utf8string_iterator &other) {
+            return (_current < other._current);
+        }
+
+        bool operator>(const basic_utf8string_iterator &other) {
+            return (_current > other._current);
+        }
+
+        bool operator<=(const basic_utf8string_iterator &other) {
+            return (_current <= other._current);
+        }
+
+        bool operator>=(const basic_utf8string_iterator &other) {
+            return (_current >= other._current);
+        }
+
+        u8char_t *begin() {
+            return _begin;
+        }
+
+        u8char_t *end() {
+            return _end;
+        }
+    };
+
+    class basic_utf8string_reverse_iterator {
+    private:
+        u8char_t *_rbegin;
+        u8char_t *_rend;
+        u8char_t *_current;
+        // one past the last code point, the decoder needs to know where the data stops
+        u8char_t *_end;
+        // every octet is a code point, so stepping and reading don't need to decode
+        bool _ascii;
+
+        void step_back() {
+            // _rend is one before the first code point and must never be read
+            if (_ascii || _current == _rend + 1) {
+                --_current;
+            } else {
+                internal::previous(_current, _rend + 1);
+            }
+        }
+
+        void step_forward() {
+            if (_ascii) {
+                ++_current;
+            } else {
+                internal::next(_current, _end);
+            }
+        }
+
+    public:
+        basic_utf8string_reverse_iterator(u8char_t *rbegin, u8char_t *rend, bool ascii = false) : _rbegin(rbegin), _rend(rend), _ascii(ascii) {
+            assert(rbegin);
+            assert(rend);
+            _current = rbegin;
+            _end = rbegin;
+            if (rbegin != rend) {
+                uint8_t length = internal::sequence_length(*rbegin);
+                _end += length ? length : 1;
+            }
+        }
+
+        ~basic_utf8string_reverse_iterator() = default;
+        basic_utf8string_reverse_iterator(const basic_utf8string_reverse_iterator &) = default;
+        basic_utf8string_reverse_iterator(basic_utf8string_reverse_iterator &&) = default;
         basic_utf8string_reverse_iterator & operator=(const basic_utf8string_reverse_iterator &) = default;
         basic_utf8string_reverse_iterator & operator=(basic_utf8string_reverse_iterator &&) = default;
 
-        bool operator==(const basic_utf8string_reverse_iterator &other) {
-            return (_current == other._current);
+        bool operator==(const basic_utf8string_reverse_iterator &other) {
+            return (_current == other._current);
+        }
+
+        bool operator!=(const basic_utf8string_reverse_iterator &other) {
+            return !(operator==(other));
+        }
+
+        basic_utf8string_reverse_iterator & operator++() {
+            step_back();
+            return *this;
+        }
+
+        basic_utf8string_reverse_iterator operator++(int) {
+            basic_utf8string_reverse_iterator temp = *this;
+            step_back();
+            return temp;
+        }
+
+        basic_utf8string_reverse_iterator & operator--() {
+            step_forward();
+            return *this;
+        }
+
+        basic_utf8string_reverse_iterator operator--(int) {
+            basic_utf8string_reverse_iterator temp = *this;
+            step_forward();
+            return temp;
+        }
+
+        u32char_t operator*() {
+            if (_ascii) {
+                return *_current;
+            }
+
+            return internal::peek_next(_current, _end);
+        }
+
+        bool operator<(const basic_utf8string_reverse_iterator &other) {
+            return (_current > other._current);
+        }
+
+        bool operator>(const basic_utf8string_reverse_iterator &other) {
+            return (_current < other._current);
+        }
+
+        bool operator<=(const basic_utf8string_reverse_iterator &other) {
+            return (_current >= other._current);
+        }
+
+        bool operator>=(const basic_utf8string_reverse_iterator &other) {
+            return (_current <= other._current);
+        }
+
+        u8char_t *begin() {
+            return _rbegin;
+        }
+
+        u8char_t *end() {
+            return _rend;
+        }
+    };
+
+    class utf8string_split;
+
+    /*
+        A read only window into UTF-8 that somebody else owns, a pointer and a length in octets. It isn't
+        null terminated, so it slices without copying, and it remembers its code point count once it knows
+        it (a view of a string gets the count of the string when the string has one).
+
+        Every basic_utf8string converts to a view implicitly, so does a c-string, which is how the read only
+        functions of basic_utf8string take their arguments. The owner has to outlive the view, and any change
+        to a string invalidates the views into it.
+    */
+    class utf8string_view {
+    public:
+        static constexpr size_t unknown_count = SIZE_MAX;
+
+    private:
+        const u8char_t *_data = reinterpret_cast<const u8char_t *>("");
+        size_t _size = 0;
+        mutable size_t _count = 0;
+
+        u8char_t *get_storage() const {
+            return const_cast<u8char_t *>(_data);
+        }
+
+        size_t offset_of(size_t index) const {
+            if (_count == _size) {
+                return index < _size ? index : _size;
+            }
+
+            return static_cast<size_t>(internal::skip_code_points(_data, _data + _size, index) - _data);
+        }
+
+        basic_utf8string_iterator match_at(const u8char_t *found, size_t length) const {
+            if (!found) return end();
+
+            u8char_t *begin = get_storage() + (found - _data);
+            return basic_utf8string_iterator(begin, begin + length);
+        }
+
+    public:
+        utf8string_view() = default;
+
+        utf8string_view(const char *cstring) {
+            assert(cstring);
+            _data = reinterpret_cast<const u8char_t *>(cstring);
+            _size = strlen(cstring);
+            _count = unknown_count;
+        }
+
+        utf8string_view(const char *data, size_t size) : utf8string_view(reinterpret_cast<const u8char_t *>(data), size) {
+        }
+
+        // count is the number of code points in data, if the caller knows it
+        utf8string_view(const u8char_t *data, size_t size, size_t count = unknown_count) : _data(data), _size(size), _count(count) {
+            assert(data || size == 0);
+            if (!data) {
+                _data = reinterpret_cast<const u8char_t *>("");
+                _count = 0;
+            }
+        }
+
+        ~utf8string_view() = default;
+        utf8string_view(const utf8string_view &) = default;
+        utf8string_view(utf8string_view &&) = default;
+        utf8string_view & operator=(const utf8string_view &) = default;
+        utf8string_view & operator=(utf8string_view &&) = default;
+
+        const u8char_t *get_raw() const {
+            return _data;
+        }
+
+        size_t size() const {
+            return _size;
+        }
+
+        bool empty() const {
+            return _size == 0;
+        }
+
+        // counts lead octets once, the content is expected to be valid UTF-8
+        size_t count() const {
+            if (_count == unknown_count) {
+                _count = internal::count_code_points(_data, _data + _size);
+            }
+
+            return _count;
+        }
+
+        // the count if it's known already, unknown_count otherwise
+        size_t known_count() const {
+            return _count;
+        }
+
+        size_t checked_count() const {
+            return internal::distance(get_storage(), get_storage() + _size);
+        }
+
+        bool is_ascii() const {
+            return count() == _size;
+        }
+
+        basic_utf8string_iterator begin() const {
+            return basic_utf8string_iterator(get_storage(), get_storage() + _size);
+        }
+
+        basic_utf8string_iterator end() const {
+            u8char_t *end = get_storage() + _size;
+            return basic_utf8string_iterator(end, end);
+        }
+
+        basic_utf8string_reverse_iterator rbegin() const {
+            u8char_t *data = get_storage();
+            u8char_t *last = data + _size;
+            if (last == data) {
+                return rend();
+            }
+
+            if (_count == _size) {
+                return basic_utf8string_reverse_iterator(last - 1, data - 1, true);
+            }
+
+            internal::previous(last, data);
+            return basic_utf8string_reverse_iterator(last, data - 1);
+        }
+
+        basic_utf8string_reverse_iterator rend() const {
+            u8char_t *end = get_storage() - 1;
+            return basic_utf8string_reverse_iterator(end, end);
+        }
+
+        u8char_t octet_at(size_t index) const {
+            assert(index < _size);
+            return _data[index];
+        }
+
+        // walks from the start, unlike basic_utf8string::at there is no index to jump ahead with
+        u32char_t at(size_t index) const {
+            const size_t offset = offset_of(index);
+            if (offset == _size) {
+                return 0;
+            }
+
+            u8char_t *itr = get_storage() + offset;
+            return internal::peek_next(itr, get_storage() + _size);
+        }
+
+        u32char_t operator[](size_t index) const {
+            return at(index);
+        }
+
+        // the octets from first up to last, both are clamped to the view and should be code point boundaries
+        utf8string_view slice(size_t first, size_t last = SIZE_MAX) const {
+            if (last > _size) last = _size;
+            if (first > last) first = last;
+            return utf8string_view(_data + first, last - first, (_count == _size) ? last - first : unknown_count);
+        }
+
+        // (at most) count code points starting at the code point at index
+        utf8string_view substr(size_t index, size_t count = SIZE_MAX) const {
+            const size_t first = offset_of(index);
+            const u8char_t *last = internal::skip_code_points(_data + first, _data + _size, count);
+            const size_t length = static_cast<size_t>(last - _data) - first;
+            const bool counted = (_count == _size) || last != _data + _size;
+            return utf8string_view(_data + first, length, counted ? ((_count == _size) ? length : count) : unknown_count);
+        }
+
+        // the first occurrence of substring at or after the octet offset from, the iterator spans the match,
+        // an empty substring is never found
+        basic_utf8string_iterator find(utf8string_view substring, size_t from = 0) const {
+            if (substring.empty() || from > _size) return end();
+            return match_at(internal::find_substring(_data + from, _data + _size, substring._data, substring._size), substring._size);
+        }
+
+        basic_utf8string_iterator rfind(utf8string_view substring) const {
+            if (substring.empty()) return end();
+            return match_at(internal::rfind_substring(_data, _data + _size, substring._data, substring._size), substring._size);
+        }
+
+        bool contains(utf8string_view substring) const {
+            return find(substring) != end();
+        }
+
+        // every view starts and ends with an empty one
+        bool starts_with(utf8string_view prefix) const {
+            return prefix._size <= _size && memcmp(_data, prefix._data, prefix._size) == 0;
+        }
+
+        bool ends_with(utf8string_view suffix) const {
+            return suffix._size <= _size && memcmp(_data + _size - suffix._size, suffix._data, suffix._size) == 0;
+        }
+
+        // occurrences that don't overlap, counted from the start
+        size_t count_occurrences(utf8string_view substring) const {
+            if (substring.empty()) return 0;
+
+            const u8char_t *itr = _data;
+            const u8char_t *end = _data + _size;
+            size_t result = 0;
+            while ((itr = internal::find_substring(itr, end, substring._data, substring._size)) != nullptr) {
+                ++result;
+                itr += substring._size;
+            }
+
+            return result;
+        }
+
+        // the same hash as a string with the same octets, whatever its policies
+        size_t hash() const {
+            return static_cast<size_t>(internal::hash_octets(_data, _size));
+        }
+
+        bool operator==(utf8string_view other) const {
+            return _size == other._size && memcmp(_data, other._data, _size) == 0;
+        }
+
+        bool operator!=(utf8string_view other) const {
+            return !operator==(other);
+        }
+
+        // the pieces between occurrences of delimiter, see utf8string_split
+        utf8string_split split(utf8string_view delimiter) const;
+        utf8string_split split(u32char_t delimiter) const;
+
+        friend std::ostream & operator<<(std::ostream &os, utf8string_view view) {
+            return os.write(reinterpret_cast<const char *>(view._data), static_cast<std::streamsize>(view._size));
+        }
+    };
+
+    /*
+        Iterates the pieces of a text between occurrences of a delimiter, as views into the text. Every delimiter
+        ends a piece, so there's always one more piece than there are delimiters, some of them empty
+        ("a,,b," is "a", "", "b" and ""). An empty delimiter doesn't split at all.
+
+        Delimiters are found with the same vectorized search as find(), a one octet delimiter with memchr.
+    */
+    class utf8string_split_iterator {
+    private:
+        const u8char_t *_start = nullptr;
+        const u8char_t *_stop = nullptr;
+        const u8char_t *_end = nullptr;
+        const u8char_t *_delimiter = nullptr;
+        size_t _delimiterSize = 0;
+
+        const u8char_t *find_delimiter(const u8char_t *from) const {
+            if (_delimiterSize == 0) {
+                return _end;
+            }
+
+            const u8char_t *found = internal::find_substring(from, _end, _delimiter, _delimiterSize);
+            return found ? found : _end;
+        }
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = utf8string_view;
+        using difference_type = ptrdiff_t;
+        using pointer = const utf8string_view *;
+        using reference = utf8string_view;
+
+        // the end of every split
+        utf8string_split_iterator() = default;
+
+        utf8string_split_iterator(const u8char_t *start, const u8char_t *end, const u8char_t *delimiter, size_t delimiterSize)
+            : _start(start), _end(end), _delimiter(delimiter), _delimiterSize(delimiterSize) {
+            _stop = find_delimiter(start);
+        }
+
+        utf8string_view operator*() const {
+            return utf8string_view(_start, static_cast<size_t>(_stop - _start));
+        }
+
+        utf8string_split_iterator & operator++() {
+            if (_stop == _end) {
+                _start = nullptr;
+                _stop = nullptr;
+            } else {
+                _start = _stop + _delimiterSize;
+                _stop = find_delimiter(_start);
+            }
+
+            return *this;
+        }
+
+        utf8string_split_iterator operator++(int) {
+            utf8string_split_iterator result = *this;
+            ++(*this);
+            return result;
+        }
+
+        bool operator==(const utf8string_split_iterator &other) const {
+            return _start == other._start;
+        }
+
+        bool operator!=(const utf8string_split_iterator &other) const {
+            return _start != other._start;
+        }
+    };
+
+    // the pieces of a text, its iterators point into it, so it should outlive them
+    class utf8string_split {
+    private:
+        utf8string_view _text;
+        utf8string_view _delimiter;
+        // a code point delimiter is encoded here, _delimiter is empty then
+        u8char_t _encoded[4];
+        uint8_t _encodedSize = 0;
+
+        const u8char_t *delimiter() const {
+            return _encodedSize ? _encoded : _delimiter.get_raw();
+        }
+
+        size_t delimiter_size() const {
+            return _encodedSize ? _encodedSize : _delimiter.size();
+        }
+    public:
+        using iterator = utf8string_split_iterator;
+
+        utf8string_split(utf8string_view text, utf8string_view delimiter) : _text(text), _delimiter(delimiter) {}
+
+        // code points that aren't valid don't split
+        utf8string_split(utf8string_view text, u32char_t delimiter) : _text(text) {
+            if (internal::is_code_point_valid(delimiter)) {
+                _encodedSize = static_cast<uint8_t>(internal::append(delimiter, _encoded) - _encoded);
+            }
+        }
+
+        utf8string_split_iterator begin() const {
+            return utf8string_split_iterator(_text.get_raw(), _text.get_raw() + _text.size(), delimiter(), delimiter_size());
+        }
+
+        utf8string_split_iterator end() const {
+            return utf8string_split_iterator();
+        }
+    };
+
+    // the pieces of [start, end) between occurrences of delimiter
+    inline utf8string_split split(const u8char_t *start, const u8char_t *end, utf8string_view delimiter) {
+        return utf8string_split(utf8string_view(start, static_cast<size_t>(end - start)), delimiter);
+    }
+
+    inline utf8string_split split(const u8char_t *start, const u8char_t *end, u32char_t delimiter) {
+        return utf8string_split(utf8string_view(start, static_cast<size_t>(end - start)), delimiter);
+    }
+
+    inline utf8string_split utf8string_view::split(utf8string_view delimiter) const {
+        return utf8string_split(*this, delimiter);
+    }
+
+    inline utf8string_split utf8string_view::split(u32char_t delimiter) const {
+        return utf8string_split(*this, delimiter);
+    }
+
+    namespace internal {
+        // the pieces of utf8string_concat, they all know their octets, their count if they can and how to copy themselves
+        struct concat_octets {
+            utf8string_view view;
+
+            size_t size() const {
+                return view.size();
+            }
+
+            size_t known_count() const {
+                return view.known_count();
+            }
+
+            u8char_t *write(u8char_t *result) const {
+                memcpy(result, view.get_raw(), view.size());
+                return result + view.size();
+            }
+
+            bool overlaps(const u8char_t *first, const u8char_t *last) const {
+                return view.get_raw() < last && view.get_raw() + view.size() > first;
+            }
+        };
+
+        // code points that aren't valid take no octets, like push() drops them
+        struct concat_code_point {
+            u8char_t octets[4];
+            uint8_t length;
+
+            explicit concat_code_point(u32char_t c) {
+                // you should not concatenate a null character!
+                assert(c);
+                length = is_code_point_valid(c) ? static_cast<uint8_t>(append(c, octets) - octets) : 0;
+            }
+
+            size_t size() const {
+                return length;
+            }
+
+            size_t known_count() const {
+                return length ? 1 : 0;
+            }
+
+            u8char_t *write(u8char_t *result) const {
+                memcpy(result, octets, length);
+                return result + length;
+            }
+
+            bool overlaps(const u8char_t *, const u8char_t *) const {
+                return false;
+            }
+        };
+    };
+
+    template<typename LEFT, typename RIGHT>
+    class utf8string_concat;
+
+    namespace internal {
+        // pieces are copied into the concatenation, the concatenations they are part of refer to it
+        template<typename T>
+        struct concat_member { using type = T; };
+
+        template<typename LEFT, typename RIGHT>
+        struct concat_member<utf8string_concat<LEFT, RIGHT>> { using type = const utf8string_concat<LEFT, RIGHT> &; };
+    };
+
+    /*
+        A lazy concatenation of strings, views, c-strings and code points, operator+ builds it. Nothing is copied
+        until it's assigned, appended or converted to a basic_utf8string, which adds up the octets, grows once and
+        copies every piece with a single memcpy. The count is known without counting if every piece knows its own.
+
+        It only keeps views of its pieces and refers to the concatenations it's made of, which are temporaries, so it's
+        meant to be used where it's built, utf8string line = a + b + c; and line += a + b; are fine, keeping
+        a + b + c in an auto variable isn't.
+    */
+    template<typename LEFT, typename RIGHT>
+    class utf8string_concat {
+    private:
+        typename internal::concat_member<LEFT>::type _left;
+        typename internal::concat_member<RIGHT>::type _right;
+    public:
+        utf8string_concat(const LEFT &left, const RIGHT &right) : _left(left), _right(right) {}
+
+        size_t size() const {
+            return _left.size() + _right.size();
+        }
+
+        // SIZE_MAX if a piece doesn't know its count
+        size_t known_count() const {
+            const size_t left = _left.known_count();
+            const size_t right = _right.known_count();
+            return (left == SIZE_MAX || right == SIZE_MAX) ? SIZE_MAX : left + right;
+        }
+
+        // writes size() octets to result, returns their end
+        u8char_t *write(u8char_t *result) const {
+            return _right.write(_left.write(result));
+        }
+
+        // whether a piece views octets in [first, last)
+        bool overlaps(const u8char_t *first, const u8char_t *last) const {
+            return _left.overlaps(first, last) || _right.overlaps(first, last);
+        }
+    };
+
+    inline utf8string_concat<internal::concat_octets, internal::concat_octets> operator+(utf8string_view left, utf8string_view right) {
+        return { internal::concat_octets{ left }, internal::concat_octets{ right } };
+    }
+
+    inline utf8string_concat<internal::concat_octets, internal::concat_code_point> operator+(utf8string_view left, u32char_t right) {
+        return { internal::concat_octets{ left }, internal::concat_code_point(right) };
+    }
+
+    inline utf8string_concat<internal::concat_code_point, internal::concat_octets> operator+(u32char_t left, utf8string_view right) {
+        return { internal::concat_code_point(left), internal::concat_octets{ right } };
+    }
+
+    template<typename LEFT, typename RIGHT>
+    utf8string_concat<utf8string_concat<LEFT, RIGHT>, internal::concat_octets> operator+(const utf8string_concat<LEFT, RIGHT> &left, utf8string_view right) {
+        return { left, internal::concat_octets{ right } };
+    }
+
+    template<typename LEFT, typename RIGHT>
+    utf8string_concat<utf8string_concat<LEFT, RIGHT>, internal::concat_code_point> operator+(const utf8string_concat<LEFT, RIGHT> &left, u32char_t right) {
+        return { left, internal::concat_code_point(right) };
+    }
+
+    template<typename LEFT, typename RIGHT>
+    utf8string_concat<internal::concat_octets, utf8string_concat<LEFT, RIGHT>> operator+(utf8string_view left, const utf8string_concat<LEFT, RIGHT> &right) {
+        return { internal::concat_octets{ left }, right };
+    }
+
+    template<typename LEFT, typename RIGHT>
+    utf8string_concat<internal::concat_code_point, utf8string_concat<LEFT, RIGHT>> operator+(u32char_t left, const utf8string_concat<LEFT, RIGHT> &right) {
+        return { internal::concat_code_point(left), right };
+    }
+
+    template<typename LEFT_A, typename RIGHT_A, typename LEFT_B, typename RIGHT_B>
+    utf8string_concat<utf8string_concat<LEFT_A, RIGHT_A>, utf8string_concat<LEFT_B, RIGHT_B>> operator+(const utf8string_concat<LEFT_A, RIGHT_A> &left, const utf8string_concat<LEFT_B, RIGHT_B> &right) {
+        return { left, right };
+    }
+
+    /*
+        Count policies of basic_utf8string, both keep the code point count next to the length, so count() is O(1)
+        as long as the count is known.
+
+        utf8string_lazy_count only keeps the count when a mutation can update it for free (push, pop, appending
+        another string whose count is known), anything else forgets it and the next count() counts it again.
+
+        utf8string_eager_count counts whatever gets appended or assigned right away, so count() never scans.
+    */
+    struct utf8string_lazy_count {
+        static constexpr bool eager = false;
+    };
+
+    struct utf8string_eager_count {
+        static constexpr bool eager = true;
+    };
+
+    /*
+        Layout policies of basic_utf8string.
+
+        utf8string_wide_layout keeps a pointer, an SSO_SIZE octets sso buffer, the capacity, the length and the count
+        side by side, heap strings keep their code point index in the sso buffer.
+
+        utf8string_compact_layout fits a string in three words (24 octets on 64 bit), the heap pointer, the length
+        and the capacity share their octets with the sso buffer, so SSO_SIZE has to be sso_size (22 on 64 bit).
+        Heap strings keep the count and the index in front of their buffer, and a tag bit in the last octet tells
+        them apart from sso strings.
+    */
+    struct utf8string_wide_layout {
+        template<size_t SSO_SIZE>
+        using storage = internal::wide_storage<SSO_SIZE>;
+    };
+
+    struct utf8string_compact_layout {
+        static constexpr size_t sso_size = sizeof(u8char_t *) + 2 * sizeof(size_t) - 2;
+
+        template<size_t SSO_SIZE>
+        using storage = internal::compact_storage<SSO_SIZE>;
+    };
+
+    /*
+        Growth policies of basic_utf8string, next_capacity() picks the capacity a string grows to from capacity when
+        it needs at least required octets (both count the null terminator). reserve() and resize_for_overwrite()
+        don't ask the policy, they allocate exactly what they're asked for.
+
+        utf8string_geometric_growth multiplies the capacity by NUMERATOR / DENOMINATOR (and adds 8) until it's enough,
+        the default 5 / 2 is what strings always did.
+
+        utf8string_paged_growth grows geometrically up to THRESHOLD octets, past that by half and rounded up to
+        PAGE_SIZE, so large strings overshoot by at most half and the allocator gets whole pages.
+
+        utf8string_exact_growth allocates what's required and nothing more.
+    */
+    template<size_t NUMERATOR = 5, size_t DENOMINATOR = 2>
+    struct utf8string_geometric_growth {
+        static_assert(NUMERATOR > DENOMINATOR, "strings have to grow");
+
+        static size_t next_capacity(size_t capacity, size_t required) {
+            while (capacity < required) {
+                capacity = capacity * NUMERATOR / DENOMINATOR + 8;
+            }
+
+            return capacity;
+        }
+    };
+
+    template<size_t PAGE_SIZE = 4096, size_t THRESHOLD = 64 * 1024>
+    struct utf8string_paged_growth {
+        static_assert((PAGE_SIZE & (PAGE_SIZE - 1)) == 0, "the page size should be a power of two");
+
+        static size_t next_capacity(size_t capacity, size_t required) {
+            if (required < THRESHOLD) {
+                return utf8string_geometric_growth<>::next_capacity(capacity, required);
+            }
+
+            const size_t grown = capacity + capacity / 2;
+            return ((grown > required ? grown : required) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        }
+    };
+
+    struct utf8string_exact_growth {
+        static size_t next_capacity(size_t, size_t required) {
+            return required;
+        }
+    };
+
+    /*
+        Hash policies of basic_utf8string, both hash the octets the same way a utf8string_view with them does.
+
+        utf8string_uncached_hash hashes the string every time hash() is called.
+
+        utf8string_cached_hash keeps the hash in the string (one more size_t) after the first hash(), every mutation
+        forgets it. Strings that are looked up over and over without changing, keys of a map that are hashed again
+        whenever it rehashes for example, only pay for hashing once.
+    */
+    struct utf8string_uncached_hash {
+        static constexpr bool cached = false;
+    };
+
+    struct utf8string_cached_hash {
+        static constexpr bool cached = true;
+    };
+
+    /*
+        The default allocator of basic_utf8string, malloc and free, with realloc to grow heap buffers in place.
+        Like the rest of the library it doesn't throw, allocate returns nullptr when memory runs out.
+
+        Any allocator works as the third template parameter of basic_utf8string (std::pmr::polymorphic_allocator
+        included), it's rebound to size_t for the code point index and propagated on copy, move and swap as
+        std::allocator_traits says.
+    */
+    template<typename T>
+    struct utf8string_allocator {
+        using value_type = T;
+        using propagate_on_container_move_assignment = std::true_type;
+        using is_always_equal = std::true_type;
+
+        utf8string_allocator() = default;
+
+        template<typename U>
+        utf8string_allocator(const utf8string_allocator<U> &) {}
+
+        T *allocate(size_t count) {
+            return reinterpret_cast<T *>(malloc(count * sizeof(T)));
+        }
+
+        T *reallocate(T *block, size_t, size_t count) {
+            return reinterpret_cast<T *>(realloc(block, count * sizeof(T)));
+        }
+
+        void deallocate(T *block, size_t) {
+            free(block);
+        }
+
+        template<typename U>
+        bool operator==(const utf8string_allocator<U> &) const {
+            return true;
+        }
+
+        template<typename U>
+        bool operator!=(const utf8string_allocator<U> &) const {
+            return false;
+        }
+    };
+
+    template<size_t SSO_SIZE, typename COUNT_POLICY = utf8string_lazy_count, typename ALLOCATOR = utf8string_allocator<u8char_t>, typename LAYOUT = utf8string_wide_layout,
+             typename GROWTH_POLICY = utf8string_geometric_growth<>, typename HASH_POLICY = utf8string_uncached_hash>
+    class RYUK_UTF8_EMPTY_BASES basic_utf8string : private internal::allocator_holder<ALLOCATOR>, private internal::hash_holder<HASH_POLICY::cached> {
+    public:
+        using allocator_type = ALLOCATOR;
+    private:
+        using allocator_traits = std::allocator_traits<ALLOCATOR>;
+        using index_allocator = typename allocator_traits::template rebind_alloc<size_t>;
+        using index_allocator_traits = std::allocator_traits<index_allocator>;
+
+        static_assert(std::is_same<typename allocator_traits::value_type, u8char_t>::value, "the allocator should allocate octets");
+
+        static constexpr size_t unknown_count = SIZE_MAX;
+        static constexpr size_t index_stride = 64;
+
+        using storage_type = typename LAYOUT::template storage<SSO_SIZE>;
+
+        storage_type _storage;
+
+        bool is_sso() const {
+            return _storage.is_sso();
+        }
+
+        // the length includes the null terminator
+        size_t stored_length() const {
+            return _storage.length();
+        }
+
+        // every mutation sets the length, so it's where the cached hash is forgotten
+        void set_stored_length(size_t length) {
+            _storage.set_length(length);
+            this->set_cached_hash(0);
+        }
+
+        size_t cached_count() const {
+            return _storage.count();
+        }
+
+        void set_cached_count(size_t count) const {
+            _storage.set_count(count);
+        }
+
+        /*
+            Heap strings keep a sparse index of the octet offsets of every index_stride-th code point,
+            so at() walks at most index_stride code points. It's built by the first at() that needs it,
+            only as far as it was asked for, and the layout keeps it where heap strings have room for it.
+            Mutations drop the entries after the offset they changed, an entry that points right at the
+            changed offset stays correct.
+
+            The index buffer is { entries, capacity, offsets... }, the first offset is always 0.
+        */
+        size_t *get_index() const {
+            return _storage.index();
+        }
+
+        void set_index(size_t *index) const {
+            _storage.set_index(index);
+        }
+
+        void truncate_index(size_t offset) {
+            if (is_sso()) {
+                return;
+            }
+
+            size_t *index = get_index();
+            if (index) {
+                while (index[0] > 1 && index[2 + index[0] - 1] > offset) {
+                    --index[0];
+                }
+            }
+        }
+
+        void free_index() {
+            if (!is_sso()) {
+                size_t *index = get_index();
+                if (index) {
+                    index_allocator indexAllocator(this->allocator());
+                    index_allocator_traits::deallocate(indexAllocator, index, 2 + index[1]);
+                    set_index(nullptr);
+                }
+            }
+        }
+
+        // returns the number of entries, they cover block unless the string is too short or memory ran out
+        size_t build_index(size_t block) const {
+            index_allocator indexAllocator(this->allocator());
+            size_t *index = get_index();
+            if (!index) {
+                index = index_allocator_traits::allocate(indexAllocator, 2 + 16);
+                if (!index) {
+                    return 0;
+                }
+
+                index[0] = 1;
+                index[1] = 16;
+                index[2] = 0;
+                set_index(index);
+            }
+
+            const u8char_t *data = get_storage();
+            const u8char_t *end = data + size();
+            while (index[0] <= block) {
+                const u8char_t *next = internal::skip_code_points(data + index[2 + index[0] - 1], end, index_stride);
+                if (next == end) {
+                    break;
+                }
+
+                if (index[0] == index[1]) {
+                    size_t *grown = internal::reallocate(indexAllocator, index, 2 + index[1], 2 + index[1] * 2);
+                    if (!grown) {
+                        break;
+                    }
+
+                    index = grown;
+                    index[1] *= 2;
+                    set_index(index);
+                }
+
+                index[2 + index[0]++] = static_cast<size_t>(next - data);
+            }
+
+            return index[0];
+        }
+
+        // octet offset of the code point at index, or size() if there are fewer code points
+        size_t offset_of(size_t index) const {
+            if (known_ascii()) {
+                return index < size() ? index : size();
+            }
+
+            const u8char_t *data = get_storage();
+            const u8char_t *start = data;
+
+            if (!is_sso() && index >= index_stride) {
+                size_t block = index / index_stride;
+                size_t entries = build_index(block);
+                if (entries > 0) {
+                    if (block >= entries) {
+                        block = entries - 1;
+                    }
+
+                    start = data + get_index()[2 + block];
+                    index -= block * index_stride;
+                }
+            }
+
+            return static_cast<size_t>(internal::skip_code_points(start, data + size(), index) - data);
+        }
+
+        u8char_t *get_storage() const {
+            return _storage.data();
+        }
+
+        void copy_other(const void *other, size_t otherLength) {
+            if (otherLength > _storage.capacity()) {
+                // the old content doesn't need to survive the reallocation
+                set_stored_length(1);
+                if (!ensure_capacity(otherLength)) {
+                    get_storage()[0] = '\0';
+                    return;
+                }
+            }
+
+            u8char_t *data = get_storage();
+            memcpy(data, other, otherLength * sizeof(u8char_t));
+            set_stored_length(otherLength);
+            truncate_index(0);
+        }
+
+        // the storage of both layouts holds no pointers into itself, so the live part of it can be copied as it is
+        void move_other(basic_utf8string &&other) {
+            _storage.move_from(other._storage);
+            other._storage.reset();
+            this->set_cached_hash(other.cached_hash());
+            other.set_cached_hash(0);
+        }
+
+        // otherLength doesn't include a null terminator, other may point into this string
+        void append_other(const void *other, size_t otherLength) {
+            if (!ensure_capacity(stored_length() + otherLength)) {
+                return;
+            }
+
+            u8char_t *data = get_storage();
+            //                 overwrite the null terminator
+            memcpy(&data[stored_length() - 1], other, otherLength * sizeof(u8char_t));
+            set_stored_length(stored_length() + otherLength);
+            data[stored_length() - 1] = '\0';
+        }
+
+        // the length octets at offset become the octets of text with one memmove of the tail, text may not point into this string
+        void replace_octets(size_t offset, size_t length, utf8string_view text) {
+            assert(offset + length <= size());
+            u8char_t *data = get_storage();
+            const size_t oldLength = stored_length();
+            const size_t newLength = oldLength - length + text.size();
+            size_t removed = 0;
+            if (cached_count() != unknown_count) {
+                removed = known_ascii() ? length : internal::count_code_points(&data[offset], &data[offset + length]);
+            }
+
+            if (!ensure_capacity(newLength)) {
+                return;
+            }
+
+            data = get_storage();
+            //      the tail and the null terminator
+            memmove(&data[offset + text.size()], &data[offset + length], (oldLength - offset - length) * sizeof(u8char_t));
+            memcpy(&data[offset], text.get_raw(), text.size() * sizeof(u8char_t));
+            set_stored_length(newLength);
+            truncate_index(offset);
+
+            if (cached_count() != unknown_count) {
+                set_cached_count(cached_count() - removed);
+                if (text.known_count() != utf8string_view::unknown_count) {
+                    set_cached_count(cached_count() + text.known_count());
+                } else {
+                    count_appended(&data[offset], &data[offset + text.size()]);
+                }
+            }
+        }
+
+        size_t offset_in(basic_utf8string_iterator position) const {
+            assert(position.begin() >= get_storage() && position.begin() <= get_storage() + size());
+            return static_cast<size_t>(position.begin() - get_storage());
+        }
+
+        bool points_into(utf8string_view text) const {
+            const u8char_t *data = get_storage();
+            return text.get_raw() < data + stored_length() && text.get_raw() + text.size() > data;
+        }
+
+        // appended is the part of the content that was just appended,
+        // the lazy policy still keeps the count if it's ascii, which is cheaper to find out than the count
+        void count_appended(const u8char_t *appended, const u8char_t *end) {
+            if (COUNT_POLICY::eager) {
+                set_cached_count(cached_count() + internal::count_code_points(appended, end));
+            } else if (cached_count() != unknown_count && internal::is_ascii(appended, end)) {
+                set_cached_count(cached_count() + static_cast<size_t>(end - appended));
+            } else {
+                set_cached_count(unknown_count);
+            }
+        }
+
+        // octets were written after the content, they hold codePoints code points
+        void appended_code_points(size_t octets, size_t codePoints) {
+            u8char_t *data = get_storage();
+            set_stored_length(stored_length() + octets);
+            data[stored_length() - 1] = '\0';
+
+            if (cached_count() != unknown_count) {
+                set_cached_count(cached_count() + codePoints);
+            }
+        }
+
+        // the buffer has room for utf8_length_of(start, end) more octets, the valid code points of [start, end) are
+        // encoded after the content, counting them on the way instead of scanning the octets afterwards
+        void encode_appended(const u32char_t *start, const u32char_t *end) {
+            u8char_t *appended = &get_storage()[stored_length() - 1];
+            u8char_t *written = appended;
+            size_t codePoints = 0;
+            const u32char_t *stop = start;
+            while (start != end) {
+                written = internal::transcode_utf32_to_utf8(start, end, written, stop);
+                codePoints += static_cast<size_t>(stop - start);
+                // skip the code point that isn't valid
+                start = (stop == end) ? end : stop + 1;
+            }
+
+            appended_code_points(static_cast<size_t>(written - appended), codePoints);
+        }
+
+        template<typename POINTER>
+        void append_code_points(POINTER first, POINTER last, std::true_type) {
+            append_utf32_trusted(first, last);
+        }
+
+        template<typename ITERATOR>
+        void append_code_points(ITERATOR first, ITERATOR last, std::false_type) {
+            constexpr size_t blockSize = 256;
+            u32char_t block[blockSize];
+            while (first != last) {
+                size_t staged = 0;
+                for (; staged < blockSize && first != last; ++first) {
+                    block[staged++] = *first;
+                }
+
+                append_utf32_trusted(block, block + staged);
+            }
+        }
+
+        // a string is all ascii exactly when it has as many code points as octets, an unknown count never matches
+        bool known_ascii() const {
+            return cached_count() == size();
+        }
+
+        void count_assigned() {
+            set_cached_count(0);
+            u8char_t *data = get_storage();
+            count_appended(data, &data[stored_length() - 1]);
+        }
+
+        // returns false if the buffer couldn't be grown
+        bool ensure_capacity(size_t capacity) {
+            assert(capacity != SIZE_MAX);
+            if (capacity > _storage.capacity()) {
+                grow(capacity - _storage.capacity());
+            }
+
+            return capacity <= _storage.capacity();
+        }
+
+        void resize(size_t newCapacity) {
+            if (newCapacity == _storage.capacity()) { return; }
+            assert(newCapacity >= stored_length());
+            // heap buffers are always larger than the sso buffer, otherwise they would look like it
+            assert(newCapacity > storage_type::sso_size);
+
+            constexpr size_t header = storage_type::header_size;
+            if (is_sso()) {
+                u8char_t *block = allocator_traits::allocate(this->allocator(), header + newCapacity);
+                if (block) {
+                    memcpy(block + header, get_storage(), stored_length() * sizeof(u8char_t));
+                    _storage.to_heap(block, newCapacity);
+                }
+            } else {
+                u8char_t *block = internal::reallocate(this->allocator(), _storage.block(), header + _storage.capacity(), header + newCapacity);
+                if (block) {
+                    _storage.move_heap(block, newCapacity);
+                }
+            }
+        }
+
+        void release() {
+            if (!is_sso()) {
+                free_index();
+                allocator_traits::deallocate(this->allocator(), _storage.block(), storage_type::header_size + _storage.capacity());
+            }
+
+            _storage.reset();
+        }
+
+        // the buffer is released first, it belongs to the allocator being replaced
+        void propagate_allocator(const ALLOCATOR &other, std::true_type) {
+            if (this->allocator() != other) {
+                release();
+            }
+
+            this->allocator() = other;
+        }
+
+        void propagate_allocator(const ALLOCATOR &, std::false_type) {}
+
+        void swap_allocator(basic_utf8string &other, std::true_type) {
+            using std::swap;
+            swap(this->allocator(), other.allocator());
+        }
+
+        void swap_allocator(basic_utf8string &other, std::false_type) {
+            // strings that don't swap their allocators can only swap buffers they can both free
+            assert(this->allocator() == other.allocator());
+            (void)other;
+        }
+    public:
+        static constexpr size_t sso_capacity = SSO_SIZE;
+
+        allocator_type get_allocator() const {
+            return this->allocator();
+        }
+
+        // grows the buffer to fit (at least) amount more octets, as much as the growth policy says
+        void grow(size_t amount) {
+            assert(amount != SIZE_MAX);
+            const size_t capacity = _storage.capacity();
+            resize(GROWTH_POLICY::next_capacity(capacity, capacity + amount));
+        }
+
+        // makes room for exactly size octets (and the null terminator) if there isn't enough already
+        void reserve(size_t size) {
+            assert(size != SIZE_MAX);
+            if (size + 1 > _storage.capacity()) {
+                resize(size + 1);
+            }
+        }
+
+        /*
+            Makes room for exactly size octets like reserve() and returns the buffer, so the caller can write the
+            octets after size() directly to it and commit_overwrite() how many there are. The string keeps its
+            content until then, returns nullptr if the buffer couldn't be grown.
+        */
+        u8char_t *resize_for_overwrite(size_t size) {
+            reserve(size);
+            return (size + 1 <= _storage.capacity()) ? get_storage() : nullptr;
+        }
+
+        // the string has size octets now, the ones after the old size were written to the buffer resize_for_overwrite()
+        // returned, they are counted like appended octets
+        void commit_overwrite(size_t size) {
+            assert(size + 1 <= _storage.capacity());
+            const size_t oldSize = this->size();
+            u8char_t *data = get_storage();
+            data[size] = '\0';
+            set_stored_length(size + 1);
+
+            if (size >= oldSize) {
+                count_appended(&data[oldSize], &data[size]);
+            } else {
+                truncate_index(size);
+                count_assigned();
+            }
+        }
+
+        void shrink_to_fit() {
+            if (is_sso()) {
+                return;
+            }
+
+            if (stored_length() > sso_capacity) {
+                resize(stored_length());
+                return;
+            }
+
+            free_index();
+            u8char_t *block = _storage.block();
+            const size_t blockSize = storage_type::header_size + _storage.capacity();
+            const u8char_t *data = get_storage();
+            _storage.to_sso();
+            memcpy(get_storage(), data, stored_length() * sizeof(u8char_t));
+            allocator_traits::deallocate(this->allocator(), block, blockSize);
+        }
+
+        const u8char_t *get_raw() const {
+            return get_storage();
+        }
+
+        basic_utf8string_iterator begin() const {
+            u8char_t *data = get_storage();
+            return basic_utf8string_iterator(data, data + size());
+        }
+
+        basic_utf8string_iterator end() const {
+            u8char_t *end = get_storage() + size();
+            return basic_utf8string_iterator(end, end);
+        }
+
+        basic_utf8string_reverse_iterator rbegin() const {
+            u8char_t *data = get_storage();
+            u8char_t *last = data + size();
+            if (last == data) {
+                return rend();
+            }
+
+            if (known_ascii()) {
+                return basic_utf8string_reverse_iterator(last - 1, data - 1, true);
+            }
+
+            internal::previous(last, data);
+            return basic_utf8string_reverse_iterator(last, data - 1);
+        }
+
+        basic_utf8string_reverse_iterator rend() const {
+            u8char_t *end = get_storage() - 1;
+            return basic_utf8string_reverse_iterator(end, end);
+        }
+
+        size_t size() const {
+            return stored_length() - 1;
+        }
+
+        size_t capacity() const {
+            return _storage.capacity() - 1;
+        }
+
+        // whether every code point is ascii, which is O(1) whenever count() is
+        bool is_ascii() const {
+            return count() == size();
+        }
+
+        // hashes the octets, the same as the hash of a view of them, the hash policy decides whether it's kept
+        size_t hash() const {
+            size_t hash = this->cached_hash();
+            if (hash == 0) {
+                hash = static_cast<size_t>(internal::hash_octets(get_storage(), size()));
+                this->set_cached_hash(hash);
+            }
+
+            return hash;
+        }
+
+        // counts lead octets without decoding, the content is expected to be valid UTF-8
+        size_t count() const {
+            if (!COUNT_POLICY::eager && cached_count() == unknown_count) {
+                u8char_t *data = get_storage();
+                set_cached_count(internal::count_code_points(data, &data[stored_length() - 1]));
+            }
+
+            return cached_count();
+        }
+
+        // decodes and validates every code point, returns 0 if the content isn't valid UTF-8
+        size_t checked_count() const {
+            u8char_t *data = get_storage();
+            return internal::distance(data, &data[stored_length() - 1]);
+        }
+
+        void clear() {
+            set_stored_length(1);
+            set_cached_count(0);
+            get_storage()[0] = '\0';
+            truncate_index(0);
+        }
+
+        void push(u32char_t c) {
+            // you should not push a null character!
+            assert(c);
+            if (!internal::is_code_point_valid(c)) {
+                return;
+            }
+
+            size_t seqlen = internal::sequence_length(c);
+            if (!ensure_capacity(stored_length() + seqlen)) {
+                return;
+            }
+
+            // overwrite the null terminator
+            u8char_t *data = get_storage();
+            internal::append(c, &data[stored_length() - 1]);
+            set_stored_length(stored_length() + seqlen);
+            data[stored_length() - 1] = '\0';
+
+            if (cached_count() != unknown_count) {
+                set_cached_count(cached_count() + 1);
+            }
+        }
+
+        void push(u8char_t c) {
+            push(static_cast<u32char_t>(c));
+        }
+
+        void push(char c) {
+            push(static_cast<u32char_t>(c));
+        }
+
+        u32char_t pop() {
+            if (stored_length() == 1) {
+                return 0;
+            }
+
+            u8char_t *data = get_storage();
+            if (known_ascii()) {
+                u32char_t result = data[stored_length() - 2];
+                data[stored_length() - 2] = '\0';
+                set_stored_length(stored_length() - 1);
+                set_cached_count(cached_count() - 1);
+                truncate_index(size());
+                return result;
+            }
+
+            u8char_t *pos = &data[stored_length() - 1];
+            u32char_t result = internal::previous(pos, data);
+            if (result != 0) {
+                // the last code point starts at pos, the null terminator goes there
+                *pos = '\0';
+                set_stored_length(static_cast<size_t>(pos - data) + 1);
+                truncate_index(size());
+
+                if (cached_count() != unknown_count) {
+                    set_cached_count(cached_count() - 1);
+                }
+            }
+            return result;
+        }
+
+        // inserts text before the octet at offset, which should be a code point boundary, the tail moves once
+        void insert(size_t offset, utf8string_view text) {
+            replace(offset, 0, text);
+        }
+
+        void insert(basic_utf8string_iterator position, utf8string_view text) {
+            replace(offset_in(position), 0, text);
+        }
+
+        void insert(size_t offset, u32char_t c) {
+            u8char_t octets[4];
+            const size_t length = internal::is_code_point_valid(c) ? static_cast<size_t>(internal::append(c, octets) - octets) : 0;
+            replace(offset, 0, utf8string_view(octets, length, length ? 1 : 0));
+        }
+
+        // removes (at most) length octets starting at offset, both should be on code point boundaries
+        void erase(size_t offset, size_t length = SIZE_MAX) {
+            replace(offset, length, utf8string_view());
+        }
+
+        // removes the code points from first up to last
+        void erase(basic_utf8string_iterator first, basic_utf8string_iterator last) {
+            replace(first, last, utf8string_view());
+        }
+
+        // the (at most) length octets at offset become text, which may be a view of this string
+        void replace(size_t offset, size_t length, utf8string_view text) {
+            if (offset > size()) offset = size();
+            if (length > size() - offset) length = size() - offset;
+
+            if (points_into(text)) {
+                // the buffer moves while it's rewritten
+                replace(offset, length, basic_utf8string(text, this->allocator()));
+                return;
+            }
+
+            replace_octets(offset, length, text);
+        }
+
+        void replace(basic_utf8string_iterator first, basic_utf8string_iterator last, utf8string_view text) {
+            const size_t offset = offset_in(first);
+            replace(offset, offset_in(last) - offset, text);
+        }
+
+        /*
+            Replaces every occurrence of needle (that doesn't overlap an earlier one) with replacement and returns how many
+            there were, in a single forward pass over the buffer. When replacement is longer, the occurrences are counted
+            first, the buffer grows once and the content moves to its end, so the writes trail the reads.
+        */
+        size_t replace_all(utf8string_view needle, utf8string_view replacement) {
+            if (needle.empty()) {
+                return 0;
+            }
+
+            if (points_into(needle) || points_into(replacement)) {
+                return replace_all(basic_utf8string(needle, this->allocator()), basic_utf8string(replacement, this->allocator()));
+            }
+
+            const size_t oldLength = stored_length();
+            size_t shift = 0;
+            if (replacement.size() > needle.size()) {
+                const size_t occurrences = count_occurrences(needle);
+                if (occurrences == 0) {
+                    return 0;
+                }
+
+                shift = occurrences * (replacement.size() - needle.size());
+                if (!ensure_capacity(oldLength + shift)) {
+                    return 0;
+                }
+
+                memmove(&get_storage()[shift], get_storage(), oldLength * sizeof(u8char_t));
+            }
+
+            u8char_t *data = get_storage();
+            const u8char_t *read = &data[shift];
+            const u8char_t *end = &data[shift + oldLength - 1];
+            u8char_t *write = data;
+            const u8char_t *found = internal::find_substring(read, end, needle.get_raw(), needle.size());
+            if (!found) {
+                return 0;
+            }
+
+            truncate_index(static_cast<size_t>(found - read));
+            size_t occurrences = 0;
+            while (found) {
+                const size_t kept = static_cast<size_t>(found - read);
+                memmove(write, read, kept * sizeof(u8char_t));
+                write += kept;
+                memcpy(write, replacement.get_raw(), replacement.size() * sizeof(u8char_t));
+                write += replacement.size();
+                read = found + needle.size();
+                found = internal::find_substring(read, end, needle.get_raw(), needle.size());
+                ++occurrences;
+            }
+
+            // the tail and the null terminator
+            memmove(write, read, static_cast<size_t>(end - read + 1) * sizeof(u8char_t));
+            set_stored_length(static_cast<size_t>(write - data) + static_cast<size_t>(end - read + 1));
+
+            if (cached_count() != unknown_count) {
+                set_cached_count(cached_count() - occurrences * needle.count() + occurrences * replacement.count());
+            }
+
+            return occurrences;
+        }
+
+        void append(const char *other) {
+            size_t length = strlen(other);
+            size_t oldSize = size();
+            append_other(other, length);
+
+            u8char_t *data = get_storage();
+            count_appended(&data[oldSize], &data[stored_length() - 1]);
+        }
+
+        // the view may point into this string
+        void append(utf8string_view other) {
+            const size_t oldSize = size();
+            const size_t otherCount = other.known_count();
+            const u8char_t *data = get_storage();
+            if (other.get_raw() >= data && other.get_raw() <= data + oldSize) {
+                // the buffer may move while growing
+                const size_t offset = static_cast<size_t>(other.get_raw() - data);
+                if (!ensure_capacity(stored_length() + other.size())) {
+                    return;
+                }
+
+                other = utf8string_view(get_storage() + offset, other.size(), otherCount);
+            }
+            append_other(other.get_raw(), other.size());
+
+            if (cached_count() != unknown_count && otherCount != utf8string_view::unknown_count) {
+                set_cached_count(cached_count() + otherCount);
+            } else {
+                u8char_t *content = get_storage();
+                count_appended(&content[oldSize], &content[stored_length() - 1]);
+            }
+        }
+
+        // grows once and copies every piece, pieces may view this string
+        template<typename LEFT, typename RIGHT>
+        void append(const utf8string_concat<LEFT, RIGHT> &other) {
+            const u8char_t *data = get_storage();
+            if (other.overlaps(data, data + size())) {
+                // the buffer may move while growing
+                append(basic_utf8string(other, this->allocator()));
+                return;
+            }
+
+            const size_t oldSize = size();
+            const size_t otherSize = other.size();
+            const size_t otherCount = other.known_count();
+            if (!ensure_capacity(stored_length() + otherSize)) {
+                return;
+            }
+
+            u8char_t *content = get_storage();
+            other.write(&content[oldSize]);
+            set_stored_length(stored_length() + otherSize);
+            content[stored_length() - 1] = '\0';
+
+            if (cached_count() != unknown_count && otherCount != unknown_count) {
+                set_cached_count(cached_count() + otherCount);
+            } else {
+                count_appended(&content[oldSize], &content[stored_length() - 1]);
+            }
+        }
+
+        // only the appended octets are counted when a count isn't known, the view keeps the count of other and
+        // takes care of other being this string
+        void append(const basic_utf8string &other) {
+            append(other.view());
+        }
+
+        // writes count() code points to result, the content is expected to be valid UTF-8
+        size_t to_utf32(u32char_t *result) const {
+            const u8char_t *data = get_storage();
+            return convert_utf8_to_utf32_trusted(data, data + size(), result);
+        }
+
+        // result needs room for count() code points, stops at the first invalid sequence
+        transcode_result to_utf32_checked(u32char_t *result) const {
+            const u8char_t *data = get_storage();
+            return convert_utf8_to_utf32(data, data + size(), result);
+        }
+
+        // appends the code points before the first one that isn't valid, growing the buffer once
+        transcode_result append_utf32(const u32char_t *start, const u32char_t *end) {
+            transcode_result outcome = { internal::UTF8Error_None, 0, 0 };
+            const size_t length = utf8_length_of(start, end);
+            if (!ensure_capacity(stored_length() + length)) {
+                outcome.error = internal::UTF8Error_NotEnoughRoom;
+                return outcome;
+            }
+
+            u8char_t *data = get_storage();
+            outcome = convert_utf32_to_utf8(start, end, &data[stored_length() - 1]);
+            appended_code_points(outcome.written, outcome.read);
+            return outcome;
+        }
+
+        // code points that aren't valid are dropped
+        void append_utf32_trusted(const u32char_t *start, const u32char_t *end) {
+            const size_t length = utf8_length_of(start, end);
+            if (!ensure_capacity(stored_length() + length)) {
+                return;
+            }
+
+            encode_appended(start, end);
+        }
+
+        // appends count code points, they are measured first so the buffer grows once, invalid ones are dropped
+        void append(const u32char_t *codePoints, size_t count) {
+            append_utf32_trusted(codePoints, codePoints + count);
+        }
+
+        // appends the code points of [first, last), from any iterator that yields u32char_t (the iterators of
+        // another string too), they are staged in blocks that are measured and encoded like append_utf32_trusted
+        template<typename ITERATOR, typename = typename std::enable_if<std::is_same<typename std::decay<decltype(*std::declval<ITERATOR &>())>::type, u32char_t>::value>::type>
+        void append(ITERATOR first, ITERATOR last) {
+            append_code_points(first, last, std::is_pointer<ITERATOR>());
+        }
+
+        static basic_utf8string from_utf32(const u32char_t *start, const u32char_t *end, const ALLOCATOR &allocator = ALLOCATOR()) {
+            basic_utf8string result(allocator);
+            result.append_utf32_trusted(start, end);
+            return result;
+        }
+
+        // the exact number of code units to_utf16 writes, not counting the byte order mark
+        size_t utf16_length() const {
+            const u8char_t *data = get_storage();
+            return count() + internal::count_four_octet_leads(data, data + size());
+        }
+
+        // writes utf16_length() code units to result, after a byte order mark when bom is set,
+        // the content is expected to be valid UTF-8
+        size_t to_utf16(char16_t *result, UTF16ByteOrder order = UTF16ByteOrder_LittleEndian, bool bom = false) const {
+            const u8char_t *data = get_storage();
+            char16_t *units = bom ? write_utf16_bom(result, order) : result;
+            return static_cast<size_t>(units - result) + convert_utf8_to_utf16_trusted(data, data + size(), units, order);
+        }
+
+        // result needs room for utf16_length() code units (and the byte order mark), stops at the first invalid sequence
+        transcode_result to_utf16_checked(char16_t *result, UTF16ByteOrder order = UTF16ByteOrder_LittleEndian, bool bom = false) const {
+            const u8char_t *data = get_storage();
+            char16_t *units = bom ? write_utf16_bom(result, order) : result;
+            transcode_result outcome = convert_utf8_to_utf16(data, data + size(), units, order);
+            outcome.written += static_cast<size_t>(units - result);
+            return outcome;
+        }
+
+        // appends the code points before the first surrogate that isn't paired, growing the buffer once,
+        // a byte order mark at the start overrides order and isn't appended
+        transcode_result append_utf16(const char16_t *start, const char16_t *end, UTF16ByteOrder order = UTF16ByteOrder_LittleEndian) {
+            transcode_result outcome = { internal::UTF8Error_None, 0, 0 };
+            const char16_t *units = skip_utf16_bom(start, end, order);
+            const size_t length = utf8_length_of(units, end, order);
+            if (!ensure_capacity(stored_length() + length)) {
+                outcome.error = internal::UTF8Error_NotEnoughRoom;
+                return outcome;
+            }
+
+            u8char_t *data = get_storage();
+            outcome = convert_utf16_to_utf8(units, end, &data[stored_length() - 1], order);
+            outcome.read += static_cast<size_t>(units - start);
+            appended_code_points(outcome.written, internal::count_code_points(&data[stored_length() - 1], &data[stored_length() - 1 + outcome.written]));
+            return outcome;
+        }
+
+        // surrogates that aren't paired are dropped
+        void append_utf16_trusted(const char16_t *start, const char16_t *end, UTF16ByteOrder order = UTF16ByteOrder_LittleEndian) {
+            const char16_t *units = skip_utf16_bom(start, end, order);
+            const size_t length = utf8_length_of(units, end, order);
+            if (!ensure_capacity(stored_length() + length)) {
+                return;
+            }
+
+            u8char_t *data = get_storage();
+            const size_t written = convert_utf16_to_utf8_trusted(units, end, &data[stored_length() - 1], order);
+            appended_code_points(written, internal::count_code_points(&data[stored_length() - 1], &data[stored_length() - 1 + written]));
+        }
+
+        static basic_utf8string from_utf16(const char16_t *start, const char16_t *end, UTF16ByteOrder order = UTF16ByteOrder_LittleEndian, const ALLOCATOR &allocator = ALLOCATOR()) {
+            basic_utf8string result(allocator);
+            result.append_utf16_trusted(start, end, order);
+            return result;
+        }
+
+        u8char_t octet_at(size_t index) const {
+            assert(index < stored_length());
+            return get_storage()[index];
+        }
+
+        u32char_t at(size_t index) const {
+            assert(index < stored_length());
+            u8char_t *data = get_storage();
+            if (known_ascii()) {
+                return index < size() ? data[index] : 0;
+            }
+
+            u8char_t *end = data + size();
+            u8char_t *itr = data + offset_of(index);
+
+            if (itr == end) {
+                return 0;
+            }
+
+            return internal::peek_next(itr, end);
+        }
+
+        // the string of (at most) count code points starting at the code point at index
+        basic_utf8string substr_by_codepoints(size_t index, size_t count) const {
+            const u8char_t *data = get_storage();
+            const size_t first = offset_of(index);
+            const size_t last = (count > SIZE_MAX - index) ? size() : offset_of(index + count);
+
+            basic_utf8string result(reinterpret_cast<const char *>(data + first), last - first, this->allocator());
+            if (last < size()) {
+                result.set_cached_count(count);
+            }
+            return result;
+        }
+
+        // the view knows the count when the string does
+        utf8string_view view() const {
+            return utf8string_view(get_storage(), size(), cached_count());
+        }
+
+        operator utf8string_view() const {
+            return view();
+        }
+
+        // a view of the octets from first up to last, like utf8string_view::slice
+        utf8string_view slice(size_t first, size_t last = SIZE_MAX) const {
+            return view().slice(first, last);
+        }
+
+        // a view of (at most) count code points starting at the code point at index, without copying
+        utf8string_view substr(size_t index, size_t count = SIZE_MAX) const {
+            const u8char_t *data = get_storage();
+            const size_t first = offset_of(index);
+            const size_t last = (count > SIZE_MAX - index) ? size() : offset_of(index + count);
+            const bool counted = known_ascii() || last < size();
+            return utf8string_view(data + first, last - first, counted ? (known_ascii() ? last - first : count) : utf8string_view::unknown_count);
+        }
+
+        // the first occurrence of substring at or after the octet offset from, the iterator spans the match,
+        // an empty substring is never found
+        basic_utf8string_iterator find(utf8string_view substring, size_t from = 0) const {
+            return view().find(substring, from);
+        }
+
+        // the last occurrence of substring
+        basic_utf8string_iterator rfind(utf8string_view substring) const {
+            return view().rfind(substring);
+        }
+
+        bool contains(utf8string_view substring) const {
+            return view().contains(substring);
+        }
+
+        // every string starts and ends with an empty one
+        bool starts_with(utf8string_view prefix) const {
+            return view().starts_with(prefix);
+        }
+
+        bool ends_with(utf8string_view suffix) const {
+            return view().ends_with(suffix);
+        }
+
+        // occurrences that don't overlap, counted from the start
+        size_t count_occurrences(utf8string_view substring) const {
+            return view().count_occurrences(substring);
+        }
+
+        // the pieces between occurrences of delimiter as views into this string, see utf8string_split
+        utf8string_split split(utf8string_view delimiter) const {
+            return view().split(delimiter);
+        }
+
+        utf8string_split split(u32char_t delimiter) const {
+            return view().split(delimiter);
+        }
+
+        u32char_t operator[](size_t index) const {
+            return at(index);
+        }
+
+        bool operator==(utf8string_view other) const {
+            return view() == other;
+        }
+
+        bool operator!=(utf8string_view other) const {
+            return !operator==(other);
+        }
+
+        basic_utf8string & operator+=(u32char_t c) {
+            push(c);
+            return *this;
+        }
+
+        basic_utf8string & operator+=(u8char_t c) {
+            push(static_cast<u32char_t>(c));
+            return *this;
+        }
+
+        basic_utf8string & operator+=(char c) {
+            push(static_cast<u32char_t>(c));
+            return *this;
+        }
+
+        basic_utf8string & operator+=(const char *other) {
+            assert(other);
+            append(other);
+            return *this;            
+        }
+
+        basic_utf8string & operator+=(const basic_utf8string &other) {
+            append(other);
+            return *this;
+        }
+
+        basic_utf8string & operator+=(utf8string_view other) {
+            append(other);
+            return *this;
+        }
+
+        template<typename LEFT, typename RIGHT>
+        basic_utf8string & operator+=(const utf8string_concat<LEFT, RIGHT> &other) {
+            append(other);
+            return *this;
+        }
+
+        // keeps the buffer when it's big enough
+        template<typename LEFT, typename RIGHT>
+        basic_utf8string & operator=(const utf8string_concat<LEFT, RIGHT> &other) {
+            const u8char_t *data = get_storage();
+            if (other.overlaps(data, data + size())) {
+                *this = basic_utf8string(other, this->allocator());
+            } else {
+                clear();
+                append(other);
+            }
+            return *this;
+        }
+
+        basic_utf8string & operator=(const char *other) {
+            copy_other(other, strlen(other) + 1);
+            count_assigned();
+            return *this;
+        }
+
+        basic_utf8string & operator=(const basic_utf8string &other) {
+            if (&other != this) {
+                propagate_allocator(other.allocator(), typename allocator_traits::propagate_on_container_copy_assignment());
+                copy_other(other.get_storage(), other.stored_length());
+                set_cached_count(other.cached_count());
+            }
+            return *this;
+        }
+
+        // a string whose allocator doesn't propagate and differs from the other one copies its content instead
+        basic_utf8string & operator=(basic_utf8string&& other)
+            noexcept(allocator_traits::propagate_on_container_move_assignment::value || internal::is_always_equal<ALLOCATOR>::value) {
+            if (&other != this) {
+                if (allocator_traits::propagate_on_container_move_assignment::value || this->allocator() == other.allocator()) {
+                    release();
+                    propagate_allocator(other.allocator(), typename allocator_traits::propagate_on_container_move_assignment());
+                    move_other(std::move(other));
+                } else {
+                    copy_other(other.get_storage(), other.stored_length());
+                    set_cached_count(other.cached_count());
+                }
+            }
+            return *this;
+        }
+
+        // the allocators are swapped if they propagate on swap, otherwise they have to be equal
+        void swap(basic_utf8string &other) noexcept {
+            if (&other == this) {
+                return;
+            }
+
+            swap_allocator(other, typename allocator_traits::propagate_on_container_swap());
+
+            storage_type storage;
+            storage.move_from(_storage);
+            _storage.move_from(other._storage);
+            other._storage.move_from(storage);
+
+            const size_t hash = this->cached_hash();
+            this->set_cached_hash(other.cached_hash());
+            other.set_cached_hash(hash);
+        }
+
+        friend void swap(basic_utf8string &a, basic_utf8string &b) noexcept {
+            a.swap(b);
+        }
+
+        basic_utf8string() = default;
+
+        explicit basic_utf8string(const ALLOCATOR &allocator) : internal::allocator_holder<ALLOCATOR>(allocator) {}
+
+        basic_utf8string(const char *other, const ALLOCATOR &allocator = ALLOCATOR()) : internal::allocator_holder<ALLOCATOR>(allocator) {
+            copy_other(other, strlen(other) + 1);
+            count_assigned();
+        }
+
+        // length octets of other, which doesn't have to be null terminated
+        basic_utf8string(const char *other, size_t length, const ALLOCATOR &allocator = ALLOCATOR()) : internal::allocator_holder<ALLOCATOR>(allocator) {
+            append_other(other, length);
+            count_assigned();
+        }
+
+        template<typename LEFT, typename RIGHT>
+        basic_utf8string(const utf8string_concat<LEFT, RIGHT> &other, const ALLOCATOR &allocator = ALLOCATOR()) : internal::allocator_holder<ALLOCATOR>(allocator) {
+            append(other);
+        }
+
+        // copies the viewed octets
+        explicit basic_utf8string(utf8string_view other, const ALLOCATOR &allocator = ALLOCATOR()) : internal::allocator_holder<ALLOCATOR>(allocator) {
+            append(other);
+        }
+
+        basic_utf8string(const basic_utf8string &other)
+            : internal::allocator_holder<ALLOCATOR>(allocator_traits::select_on_container_copy_construction(other.allocator())) {
+            copy_other(other.get_storage(), other.stored_length());
+            set_cached_count(other.cached_count());
+        }
+
+        basic_utf8string(const basic_utf8string &other, const ALLOCATOR &allocator) : internal::allocator_holder<ALLOCATOR>(allocator) {
+            copy_other(other.get_storage(), other.stored_length());
+            set_cached_count(other.cached_count());
+        }
+
+        basic_utf8string(basic_utf8string &&other) noexcept : internal::allocator_holder<ALLOCATOR>(other.allocator()) {
+            move_other(std::move(other));
+        }
+
+        // takes the buffer of other only if the allocators are equal
+        basic_utf8string(basic_utf8string &&other, const ALLOCATOR &allocator) : internal::allocator_holder<ALLOCATOR>(allocator) {
+            if (this->allocator() == other.allocator()) {
+                move_other(std::move(other));
+            } else {
+                copy_other(other.get_storage(), other.stored_length());
+                set_cached_count(other.cached_count());
+            }
+        }
+
+        ~basic_utf8string() {
+            release();
+        }
+
+        friend std::ostream & operator<<(std::ostream &os, const basic_utf8string &str) {
+            return os << reinterpret_cast<const char *>(str.get_storage());
+        }
+    };
+
+    using utf8string = basic_utf8string<32>;
+    using compact_utf8string = basic_utf8string<utf8string_compact_layout::sso_size, utf8string_lazy_count, utf8string_allocator<u8char_t>, utf8string_compact_layout>;
+
+    /*
+        Whether objects of a type can be moved to another address with memcpy, leaving nothing behind to destroy.
+        It's opt in, types other than trivially copyable ones have to specialize it. Strings of either layout
+        hold no pointers into themselves, so they are as long as their allocator is trivially copyable.
+    */
+    template<typename T>
+    struct is_trivially_relocatable : std::is_trivially_copyable<T> {};
+
+    template<size_t SSO_SIZE, typename COUNT_POLICY, typename ALLOCATOR, typename LAYOUT, typename GROWTH_POLICY, typename HASH_POLICY>
+    struct is_trivially_relocatable<basic_utf8string<SSO_SIZE, COUNT_POLICY, ALLOCATOR, LAYOUT, GROWTH_POLICY, HASH_POLICY>> : std::is_trivially_copyable<ALLOCATOR> {};
+
+    /*
+        Joins the pieces of [first, last) (anything that converts to utf8string_view) with separator between them.
+        It goes over the pieces twice, measuring them first, so the result is allocated exactly once and the pieces
+        are copied straight into it.
+    */
+    template<typename STRING = utf8string, typename ITERATOR>
+    STRING join(ITERATOR first, ITERATOR last, utf8string_view separator, const typename STRING::allocator_type &allocator = typename STRING::allocator_type()) {
+        STRING result(allocator);
+        if (first == last) {
+            return result;
+        }
+
+        size_t size = 0;
+        size_t pieces = 0;
+        for (ITERATOR itr = first; itr != last; ++itr) {
+            size += utf8string_view(*itr).size();
+            ++pieces;
+        }
+
+        size += (pieces - 1) * separator.size();
+        u8char_t *data = result.resize_for_overwrite(size);
+        if (!data) {
+            return result;
+        }
+
+        utf8string_view piece(*first);
+        memcpy(data, piece.get_raw(), piece.size());
+        data += piece.size();
+        for (++first; first != last; ++first) {
+            memcpy(data, separator.get_raw(), separator.size());
+            data += separator.size();
+            piece = utf8string_view(*first);
+            memcpy(data, piece.get_raw(), piece.size());
+            data += piece.size();
+        }
+
+        result.commit_overwrite(size);
+        return result;
+    }
+
+    template<typename STRING = utf8string, typename RANGE>
+    STRING join(const RANGE &pieces, utf8string_view separator, const typename STRING::allocator_type &allocator = typename STRING::allocator_type()) {
+        using std::begin;
+        using std::end;
+        return join<STRING>(begin(pieces), end(pieces), separator, allocator);
+    }
+
+    // moves the objects of [first, last) to the uninitialized memory at result, which doesn't overlap them, and
+    // ends their lifetime, a single memcpy for trivially relocatable types, returns the end of the moved objects
+    template<typename T>
+    T *relocate(T *first, T *last, T *result) {
+        return internal::relocate(first, last, result, is_trivially_relocatable<T>());
+    }
+    using utf8string_iterator = basic_utf8string_iterator;
+    using utf8string_reverse_iterator = basic_utf8string_reverse_iterator;
+
+    // an occurrence of a pattern, offset and length are in octets
+    struct utf8string_match {
+        size_t pattern;
+        size_t offset;
+        size_t length;
+    };
+
+    /*
+        Aho-Corasick over octets, matches of valid patterns in valid text always start and end on code
+        point boundaries, like they do for find.
+
+        The trie is compiled into a complete automaton, the failure links are folded into the transitions,
+        so every octet is exactly one table load and nothing ever walks back. Octets are mapped to classes
+        first (the octets that appear in no pattern all share one), which keeps the table at classes
+        columns per state instead of 256, a few dozen for Arabic and ascii patterns. Transitions hold the
+        row offset of the next state rather than its index, the high bit tells whether a pattern ends there,
+        so the scan loop doesn't multiply and only looks at the outputs when there is something to report.
+
+        The patterns ending in a state are its own (the first of duplicates) and the ones of the states
+        reachable through output links, the nearest proper suffixes that are patterns.
+
+        A matcher that ran out of memory while compiling has no patterns and never matches.
+    */
+    class utf8string_matcher {
+    private:
+        static constexpr uint32_t none = UINT32_MAX;
+        static constexpr uint32_t match_bit = 0x80000000u;
+
+        uint8_t _classes[256] = {};
+        uint32_t _classCount = 1;
+        // state count * class count row offsets, with match_bit set when the target state has outputs
+        uint32_t *_transitions = nullptr;
+        uint32_t _stateCount = 0;
+        uint32_t _stateCapacity = 0;
+        // per state
+        uint32_t *_patterns = nullptr;
+        uint32_t *_outputLinks = nullptr;
+        uint32_t *_depths = nullptr;
+        size_t _patternCount = 0;
+        size_t _longestPattern = 0;
+
+        bool reserve_states(uint32_t count) {
+            if (count <= _stateCapacity) {
+                return true;
+            }
+
+            uint32_t capacity = _stateCapacity ? _stateCapacity : 64;
+            while (capacity < count) {
+                capacity *= 2;
+            }
+
+            if (static_cast<uint64_t>(capacity) * _classCount >= match_bit) {
+                return false;
+            }
+
+            uint32_t *transitions = static_cast<uint32_t *>(realloc(_transitions, sizeof(uint32_t) * capacity * _classCount));
+            if (transitions) _transitions = transitions;
+            uint32_t *patterns = static_cast<uint32_t *>(realloc(_patterns, sizeof(uint32_t) * capacity));
+            if (patterns) _patterns = patterns;
+            uint32_t *outputLinks = static_cast<uint32_t *>(realloc(_outputLinks, sizeof(uint32_t) * capacity));
+            if (outputLinks) _outputLinks = outputLinks;
+            uint32_t *depths = static_cast<uint32_t *>(realloc(_depths, sizeof(uint32_t) * capacity));
+            if (depths) _depths = depths;
+
+            if (!transitions || !patterns || !outputLinks || !depths) {
+                return false;
+            }
+
+            _stateCapacity = capacity;
+            return true;
+        }
+
+        uint32_t add_state(uint32_t depth) {
+            if (!reserve_states(_stateCount + 1)) {
+                return none;
+            }
+
+            const uint32_t state = _stateCount++;
+            memset(&_transitions[state * _classCount], 0, sizeof(uint32_t) * _classCount);
+            _patterns[state] = none;
+            _outputLinks[state] = none;
+            _depths[state] = depth;
+            return state;
+        }
+
+        void release() {
+            free(_transitions);
+            free(_patterns);
+            free(_outputLinks);
+            free(_depths);
+            _transitions = _patterns = _outputLinks = _depths = nullptr;
+            _stateCount = _stateCapacity = 0;
+            _patternCount = _longestPattern = 0;
+        }
+
+        // the trie has no edges into the root, so 0 is no edge until the automaton is complete
+        bool add_pattern(const u8char_t *itr, const u8char_t *end, uint32_t pattern) {
+            uint32_t state = 0;
+            for (; itr != end; ++itr) {
+                uint32_t &next = _transitions[state * _classCount + _classes[*itr]];
+                if (next == 0) {
+                    const uint32_t added = add_state(_depths[state] + 1);
+                    if (added == none) {
+                        return false;
+                    }
+
+                    // add_state may have moved the table
+                    _transitions[state * _classCount + _classes[*itr]] = added;
+                    state = added;
+                } else {
+                    state = next;
+                }
+            }
+
+            if (_patterns[state] == none) {
+                _patterns[state] = pattern;
+            }
+
+            return true;
+        }
+
+        // breadth first, a state's failure target is always complete before the state itself
+        bool compile() {
+            uint32_t *failures = static_cast<uint32_t *>(malloc(sizeof(uint32_t) * _stateCount));
+            uint32_t *queue = static_cast<uint32_t *>(malloc(sizeof(uint32_t) * _stateCount));
+            if (!failures || !queue) {
+                free(failures);
+                free(queue);
+                return false;
+            }
+
+            size_t head = 0;
+            size_t tail = 0;
+            failures[0] = 0;
+            for (uint32_t c = 0; c < _classCount; ++c) {
+                const uint32_t child = _transitions[c];
+                if (child != 0) {
+                    failures[child] = 0;
+                    queue[tail++] = child;
+                }
+            }
+
+            while (head != tail) {
+                const uint32_t state = queue[head++];
+                const uint32_t failure = failures[state];
+                _outputLinks[state] = (_patterns[failure] != none) ? failure : _outputLinks[failure];
+
+                for (uint32_t c = 0; c < _classCount; ++c) {
+                    uint32_t &next = _transitions[state * _classCount + c];
+                    const uint32_t fallback = _transitions[failure * _classCount + c];
+                    if (next != 0) {
+                        failures[next] = fallback;
+                        queue[tail++] = next;
+                    } else {
+                        next = fallback;
+                    }
+                }
+            }
+
+            // state indices to row offsets, flagged when there are outputs
+            const size_t cells = static_cast<size_t>(_stateCount) * _classCount;
+            for (size_t i = 0; i < cells; ++i) {
+                const uint32_t next = _transitions[i];
+                const bool outputs = _patterns[next] != none || _outputLinks[next] != none;
+                _transitions[i] = next * _classCount | (outputs ? match_bit : 0);
+            }
+
+            free(failures);
+            free(queue);
+            return true;
+        }
+
+        template<typename STRING>
+        void build(const STRING *patterns, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                const u8char_t *data = patterns[i].get_raw();
+                for (size_t j = 0; j < patterns[i].size(); ++j) {
+                    if (_classes[data[j]] == 0) {
+                        _classes[data[j]] = static_cast<uint8_t>(_classCount++);
+                    }
+                }
+            }
+
+            // empty patterns are never reported, like find never finds them
+            if (add_state(0) == none) {
+                release();
+                return;
+            }
+
+            for (size_t i = 0; i < count; ++i) {
+                const u8char_t *data = patterns[i].get_raw();
+                if (!add_pattern(data, data + patterns[i].size(), static_cast<uint32_t>(i))) {
+                    release();
+                    return;
+                }
+
+                if (patterns[i].size() > _longestPattern) {
+                    _longestPattern = patterns[i].size();
+                }
+            }
+
+            _patternCount = count;
+            _patterns[0] = none;
+            if (!compile()) {
+                release();
+            }
+        }
+
+        // reports every pattern that ends at the octet before itr in state
+        template<typename CALLBACK>
+        size_t report(uint32_t state, const u8char_t *start, const u8char_t *itr, CALLBACK &onMatch) const {
+            size_t result = 0;
+            for (uint32_t output = (_patterns[state] != none) ? state : _outputLinks[state]; output != none; output = _outputLinks[output]) {
+                const utf8string_match match = { _patterns[output], static_cast<size_t>(itr - start) - _depths[output], _depths[output] };
+                onMatch(match);
+                ++result;
+            }
+
+            return result;
+        }
+
+    public:
+        utf8string_matcher() = default;
+
+        // patterns are basic_utf8strings or utf8string_views, the pattern index of a match is its position in patterns
+        template<typename STRING>
+        utf8string_matcher(const STRING *patterns, size_t count) {
+            assert(count < none);
+            build(patterns, count);
+        }
+
+        utf8string_matcher(const utf8string_matcher &) = delete;
+        utf8string_matcher & operator=(const utf8string_matcher &) = delete;
+
+        utf8string_matcher(utf8string_matcher &&other) noexcept {
+            *this = std::move(other);
+        }
+
+        utf8string_matcher & operator=(utf8string_matcher &&other) noexcept {
+            if (this != &other) {
+                release();
+                memcpy(_classes, other._classes, sizeof(_classes));
+                _classCount = other._classCount;
+                _transitions = other._transitions;
+                _stateCount = other._stateCount;
+                _stateCapacity = other._stateCapacity;
+                _patterns = other._patterns;
+                _outputLinks = other._outputLinks;
+                _depths = other._depths;
+                _patternCount = other._patternCount;
+                _longestPattern = other._longestPattern;
+                other._transitions = other._patterns = other._outputLinks = other._depths = nullptr;
+                other.release();
+            }
+
+            return *this;
+        }
+
+        ~utf8string_matcher() {
+            release();
+        }
+
+        size_t pattern_count() const {
+            return _patternCount;
+        }
+
+        size_t state_count() const {
+            return _stateCount;
+        }
+
+        // calls onMatch for every occurrence of every pattern, overlapping ones included, ordered by where they end
+        // (longest first when they end at the same octet), returns how many there were
+        template<typename CALLBACK>
+        size_t find_all(const u8char_t *start, const u8char_t *end, CALLBACK &&onMatch) const {
+            if (_patternCount == 0) {
+                return 0;
+            }
+
+            const uint32_t classCount = _classCount;
+            size_t result = 0;
+            uint32_t row = 0;
+            for (const u8char_t *itr = start; itr != end;) {
+                const uint32_t next = _transitions[row + _classes[*(itr++)]];
+                row = next & ~match_bit;
+                if (next & match_bit) {
+                    result += report(row / classCount, start, itr, onMatch);
+                }
+            }
+
+            return result;
+        }
+
+        template<typename CALLBACK>
+        size_t find_all(utf8string_view text, CALLBACK &&onMatch) const {
+            return find_all(text.get_raw(), text.get_raw() + text.size(), onMatch);
+        }
+
+        /*
+            Non overlapping matches, each one starts as early as possible and is the longest pattern that
+            starts there. They are picked out of the overlapping matches, the best one so far is final once
+            the state (the longest suffix of the text that is a prefix of a pattern) starts after it, no
+            later match can start at or before it then. Matches before its end are ignored from then on,
+            the scan only starts over at its end when a match past it was passed over while waiting.
+        */
+        template<typename CALLBACK>
+        size_t find_leftmost_longest(const u8char_t *start, const u8char_t *end, CALLBACK &&onMatch) const {
+            if (_patternCount == 0) {
+                return 0;
+            }
+
+            const uint32_t classCount = _classCount;
+            size_t result = 0;
+            size_t cursor = 0;
+            size_t passedOver = 0;
+            utf8string_match best = { 0, SIZE_MAX, 0 };
+            auto consider = [&](const utf8string_match &match) {
+                if (match.offset < cursor) {
+                    return;
+                }
+
+                if (match.offset < best.offset || (match.offset == best.offset && match.length > best.length)) {
+                    if (best.offset != SIZE_MAX && best.offset > passedOver) {
+                        passedOver = best.offset;
+                    }
+                    best = match;
+                } else if (match.offset > passedOver) {
+                    passedOver = match.offset;
+                }
+            };
+
+            uint32_t row = 0;
+            const u8char_t *itr = start;
+            while (true) {
+                const bool done = (itr == end);
+                if (best.offset != SIZE_MAX && (done || static_cast<size_t>(itr - start) - _depths[row / classCount] > best.offset)) {
+                    onMatch(static_cast<const utf8string_match &>(best));
+                    ++result;
+                    cursor = best.offset + best.length;
+                    if (passedOver >= cursor) {
+                        itr = start + cursor;
+                        row = 0;
+                    }
+
+                    best.offset = SIZE_MAX;
+                    passedOver = 0;
+                    continue;
+                }
+
+                if (done) {
+                    return result;
+                }
+
+                const uint32_t next = _transitions[row + _classes[*(itr++)]];
+                row = next & ~match_bit;
+                if (next & match_bit) {
+                    report(row / classCount, start, itr, consider);
+                }
+            }
+        }
+
+        template<typename CALLBACK>
+        size_t find_leftmost_longest(utf8string_view text, CALLBACK &&onMatch) const {
+            return find_leftmost_longest(text.get_raw(), text.get_raw() + text.size(), onMatch);
+        }
+    };
+
+    /*
+        A rope for large text that is edited in the middle, a treap of chunks of up to chunk_size octets, ordered by
+        position. Every node caches the octets, code points and newlines of its chunk and of its whole subtree, so
+        insert, erase, code point indexing and line lookup descend the tree once, O(log n) expected, plus the work
+        inside one chunk. Chunks always end on code point boundaries, offsets are in octets and should be too.
+
+        Edits that fit in a single chunk are a memmove in that chunk. Larger ones split the tree at the edit (cutting
+        at most one chunk in two), build the inserted text into a tree of its own and merge the pieces back, then merge
+        the chunks on either side of the seams when they fit in one, so editing doesn't leave a trail of tiny chunks.
+        Text is built into chunks that are three quarters full, which leaves room for typing into them.
+
+        Nodes come from malloc like the matcher's tables, a rope that runs out of memory leaves the edit undone.
+    */
+    class utf8rope {
+    public:
+        static constexpr size_t chunk_size = 1024;
+
+    private:
+        static constexpr size_t fill_size = chunk_size * 3 / 4;
+
+        struct node {
+            node *left;
+            node *right;
+            uint32_t priority;
+            uint32_t octets;
+            size_t codePoints;
+            size_t newlines;
+            // of the subtree, this node included
+            size_t totalOctets;
+            size_t totalCodePoints;
+            size_t totalNewlines;
+            u8char_t data[chunk_size];
+        };
+
+        node *_root = nullptr;
+        uint32_t _seed = 0x9E3779B9u;
+
+        // xorshift, the priorities only have to look random to keep the tree balanced
+        uint32_t random() {
+            _seed ^= _seed << 13;
+            _seed ^= _seed >> 17;
+            _seed ^= _seed << 5;
+            return _seed;
+        }
+
+        static size_t octets_of(const node *n) { return n ? n->totalOctets : 0; }
+        static size_t code_points_of(const node *n) { return n ? n->totalCodePoints : 0; }
+        static size_t newlines_of(const node *n) { return n ? n->totalNewlines : 0; }
+
+        static bool heap_ordered(const node *n) {
+            return !n || ((!n->left || n->left->priority <= n->priority) && (!n->right || n->right->priority <= n->priority)
+                && heap_ordered(n->left) && heap_ordered(n->right));
+        }
+
+        static size_t depth_of(const node *n) {
+            if (!n) {
+                return 0;
+            }
+
+            const size_t left = depth_of(n->left);
+            const size_t right = depth_of(n->right);
+            return 1 + (left > right ? left : right);
+        }
+
+        static void update(node *n) {
+            n->totalOctets = octets_of(n->left) + n->octets + octets_of(n->right);
+            n->totalCodePoints = code_points_of(n->left) + n->codePoints + code_points_of(n->right);
+            n->totalNewlines = newlines_of(n->left) + n->newlines + newlines_of(n->right);
+        }
+
+        // pos itself when it isn't within a sequence, or there is no lead octet where there should be one
+        static const u8char_t *boundary_before(const u8char_t *start, const u8char_t *pos) {
+            const u8char_t *itr = pos;
+            while (itr > start && pos - itr < 3 && internal::is_trail(*itr)) {
+                --itr;
+            }
+
+            return internal::is_trail(*itr) ? pos : itr;
+        }
+
+        node *make_node(const u8char_t *start, size_t length, uint32_t priority) {
+            assert(length <= chunk_size);
+            node *n = static_cast<node *>(malloc(sizeof(node)));
+            if (!n) {
+                return nullptr;
+            }
+
+            n->left = n->right = nullptr;
+            n->priority = priority;
+            n->octets = static_cast<uint32_t>(length);
+            memcpy(n->data, start, length);
+            n->codePoints = internal::count_code_points(start, start + length);
+            n->newlines = internal::count_newlines(start, start + length);
+            update(n);
+            return n;
+        }
+
+        static void destroy(node *n) {
+            if (n) {
+                destroy(n->left);
+                destroy(n->right);
+                free(n);
+            }
+        }
+
+        static node *clone(const node *n, bool &failed) {
+            if (!n || failed) {
+                return nullptr;
+            }
+
+            node *copy = static_cast<node *>(malloc(sizeof(node)));
+            if (!copy) {
+                failed = true;
+                return nullptr;
+            }
+
+            memcpy(copy, n, sizeof(node));
+            copy->left = clone(n->left, failed);
+            copy->right = clone(n->right, failed);
+            return copy;
+        }
+
+        // every chunk of left comes before every chunk of right
+        static node *merge(node *left, node *right) {
+            if (!left) return right;
+            if (!right) return left;
+
+            if (left->priority > right->priority) {
+                left->right = merge(left->right, right);
+                update(left);
+                return left;
+            }
+
+            right->left = merge(left, right->left);
+            update(right);
+            return right;
+        }
+
+        // left gets the first offset octets of n, right the rest, a chunk that offset is in the middle of is cut in two,
+        // returns false and leaves n as it was when that chunk couldn't be allocated
+        bool split(node *n, size_t offset, node *&left, node *&right) {
+            if (!n) {
+                left = right = nullptr;
+                return true;
+            }
+
+            const size_t before = octets_of(n->left);
+            node *first = nullptr;
+            node *second = nullptr;
+            if (offset <= before) {
+                if (!split(n->left, offset, first, second)) return false;
+                n->left = second;
+                update(n);
+                left = first;
+                right = n;
+            } else if (offset >= before + n->octets) {
+                if (!split(n->right, offset - before - n->octets, first, second)) return false;
+                n->right = first;
+                update(n);
+                left = n;
+                right = second;
+            } else {
+                // the tail goes up in place of n, so it can't have a higher priority than n had
+                const size_t at = offset - before;
+                node *tail = make_node(&n->data[at], n->octets - at, static_cast<uint32_t>(random() % (static_cast<uint64_t>(n->priority) + 1)));
+                if (!tail) return false;
+
+                n->octets = static_cast<uint32_t>(at);
+                n->codePoints -= tail->codePoints;
+                n->newlines -= tail->newlines;
+                right = merge(tail, n->right);
+                n->right = nullptr;
+                update(n);
+                left = n;
+            }
+
+            return true;
+        }
+
+        // a treap of the chunks of [first, last) whose priorities look like random ones would, none above limit
+        node *build(const u8char_t *first, const u8char_t *last, uint32_t limit, bool &failed) {
+            if (first == last || failed) {
+                return nullptr;
+            }
+
+            // the largest of pieces random priorities is about this close to the top
+            const size_t size = static_cast<size_t>(last - first);
+            const size_t pieces = size / fill_size + 1;
+            uint32_t priority = UINT32_MAX - static_cast<uint32_t>(random() % (static_cast<uint64_t>(UINT32_MAX) / pieces + 1));
+            if (priority > limit) {
+                priority = limit;
+            }
+
+            const u8char_t *start = first;
+            const u8char_t *stop = last;
+            if (size > fill_size) {
+                // the middle chunk, the halves on either side become the subtrees
+                start = boundary_before(first, first + (size - fill_size) / 2);
+                stop = boundary_before(start, start + fill_size);
+                if (stop == start) {
+                    stop = start + fill_size;
+                }
+            }
+
+            node *n = make_node(start, static_cast<size_t>(stop - start), priority);
+            if (!n) {
+                failed = true;
+                return nullptr;
+            }
+
+            n->left = build(first, start, priority, failed);
+            n->right = build(stop, last, priority, failed);
+            update(n);
+            return n;
+        }
+
+        // inserts into the chunk that ends at or contains offset (the first one for offset 0) when text fits in it,
+        // returns false and changes nothing otherwise
+        static bool insert_in_chunk(node *n, size_t offset, utf8string_view text, size_t codePoints, size_t newlines) {
+            if (!n) {
+                return false;
+            }
+
+            const size_t before = octets_of(n->left);
+            bool inserted = false;
+            if (n->left && offset <= before) {
+                inserted = insert_in_chunk(n->left, offset, text, codePoints, newlines);
+            } else if (offset <= before + n->octets) {
+                if (n->octets + text.size() > chunk_size) {
+                    return false;
+                }
+
+                u8char_t *at = &n->data[offset - before];
+                memmove(at + text.size(), at, n->octets - (offset - before));
+                memcpy(at, text.get_raw(), text.size());
+                n->octets += static_cast<uint32_t>(text.size());
+                n->codePoints += codePoints;
+                n->newlines += newlines;
+                inserted = true;
+            } else {
+                inserted = insert_in_chunk(n->right, offset - before - n->octets, text, codePoints, newlines);
+            }
+
+            if (inserted) {
+                update(n);
+            }
+            return inserted;
+        }
+
+        // erases from the chunk that holds all of [offset, offset + length) when it doesn't empty it,
+        // returns false and changes nothing otherwise
+        static bool erase_in_chunk(node *n, size_t offset, size_t length) {
+            if (!n) {
+                return false;
+            }
+
+            const size_t before = octets_of(n->left);
+            bool erased = false;
+            if (offset + length <= before) {
+                erased = erase_in_chunk(n->left, offset, length);
+            } else if (offset >= before + n->octets) {
+                erased = erase_in_chunk(n->right, offset - before - n->octets, length);
+            } else if (offset >= before && offset + length <= before + n->octets && length < n->octets) {
+                u8char_t *at = &n->data[offset - before];
+                n->codePoints -= internal::count_code_points(at, at + length);
+                n->newlines -= internal::count_newlines(at, at + length);
+                memmove(at, at + length, n->octets - (offset - before) - length);
+                n->octets -= static_cast<uint32_t>(length);
+                erased = true;
+            }
+
+            if (erased) {
+                update(n);
+            }
+            return erased;
+        }
+
+        // the node whose chunk holds the octet at offset, start is where that chunk starts
+        static const node *chunk_at(const node *n, size_t offset, size_t &start) {
+            start = 0;
+            while (n) {
+                const size_t before = octets_of(n->left);
+                if (offset < before) {
+                    n = n->left;
+                } else if (offset < before + n->octets) {
+                    start += before;
+                    return n;
+                } else {
+                    offset -= before + n->octets;
+                    start += before + n->octets;
+                    n = n->right;
+                }
+            }
+
+            return nullptr;
+        }
+
+        // merges the chunk that starts at offset into the one that ends there when both fit in one
+        void coalesce(size_t offset) {
+            size_t start = 0;
+            size_t previousStart = 0;
+            const node *second = (offset > 0) ? chunk_at(_root, offset, start) : nullptr;
+            const node *first = second ? chunk_at(_root, offset - 1, previousStart) : nullptr;
+            if (!second || start != offset || first->octets + second->octets > chunk_size) {
+                return;
+            }
+
+            u8char_t octets[chunk_size];
+            const size_t length = second->octets;
+            const size_t codePoints = second->codePoints;
+            const size_t newlines = second->newlines;
+            memcpy(octets, second->data, length);
+
+            // both cuts are on chunk boundaries, nothing is allocated
+            node *left = nullptr;
+            node *middle = nullptr;
+            node *right = nullptr;
+            split(_root, offset, left, middle);
+            split(middle, length, middle, right);
+            destroy(middle);
+            _root = merge(left, right);
+            insert_in_chunk(_root, offset, utf8string_view(octets, length, codePoints), codePoints, newlines);
+        }
+
+        template<typename FUNCTION>
+        static void for_each_chunk(const node *n, size_t first, size_t last, FUNCTION &onChunk) {
+            if (!n || first >= last) {
+                return;
+            }
+
+            const size_t before = octets_of(n->left);
+            if (first < before) {
+                for_each_chunk(n->left, first, last, onChunk);
+            }
+
+            const size_t start = (first > before) ? first - before : 0;
+            const size_t stop = (last - before < n->octets) ? last - before : n->octets;
+            if (last > before && start < stop) {
+                const bool whole = (start == 0 && stop == n->octets);
+                onChunk(utf8string_view(&n->data[start], stop - start, whole ? n->codePoints : utf8string_view::unknown_count));
+            }
+
+            if (last > before + n->octets) {
+                const size_t skipped = before + n->octets;
+                for_each_chunk(n->right, (first > skipped) ? first - skipped : 0, last - skipped, onChunk);
+            }
+        }
+
+    public:
+        // walks the code points like basic_utf8string_iterator, finding the next chunk when it's done with one
+        class iterator {
+        private:
+            const utf8rope *_rope = nullptr;
+            const node *_chunk = nullptr;
+            size_t _start = 0;
+            size_t _offset = 0;
+
+            friend class utf8rope;
+
+            iterator(const utf8rope *rope, size_t offset) : _rope(rope) {
+                _chunk = chunk_at(rope->_root, offset, _start);
+                _offset = _chunk ? offset - _start : 0;
+            }
+
+        public:
+            iterator() = default;
+
+            u32char_t operator*() const {
+                u8char_t *data = const_cast<u8char_t *>(_chunk->data);
+                return internal::peek_next(data + _offset, data + _chunk->octets);
+            }
+
+            iterator & operator++() {
+                u8char_t *data = const_cast<u8char_t *>(_chunk->data);
+                u8char_t *itr = data + _offset;
+                internal::next(itr, data + _chunk->octets);
+                _offset = static_cast<size_t>(itr - data);
+                if (_offset == _chunk->octets) {
+                    *this = iterator(_rope, _start + _chunk->octets);
+                }
+
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator temp = *this;
+                ++(*this);
+                return temp;
+            }
+
+            bool operator==(const iterator &other) const {
+                return _chunk == other._chunk && _offset == other._offset;
+            }
+
+            bool operator!=(const iterator &other) const {
+                return !operator==(other);
+            }
+
+            // the octet offset of the code point in the rope
+            size_t offset() const {
+                return _chunk ? _start + _offset : _rope->size();
+            }
+        };
+
+        utf8rope() = default;
+
+        explicit utf8rope(utf8string_view text) {
+            insert(0, text);
+        }
+
+        // a rope that runs out of memory while copying is empty
+        utf8rope(const utf8rope &other) : _seed(other._seed) {
+            bool failed = false;
+            _root = clone(other._root, failed);
+            if (failed) {
+                destroy(_root);
+                _root = nullptr;
+            }
+        }
+
+        utf8rope & operator=(const utf8rope &other) {
+            if (this != &other) {
+                utf8rope copy(other);
+                swap(copy);
+            }
+
+            return *this;
+        }
+
+        utf8rope(utf8rope &&other) noexcept : _root(other._root), _seed(other._seed) {
+            other._root = nullptr;
+        }
+
+        utf8rope & operator=(utf8rope &&other) noexcept {
+            if (this != &other) {
+                destroy(_root);
+                _root = other._root;
+                _seed = other._seed;
+                other._root = nullptr;
+            }
+
+            return *this;
+        }
+
+        ~utf8rope() {
+            destroy(_root);
+        }
+
+        void swap(utf8rope &other) noexcept {
+            std::swap(_root, other._root);
+            std::swap(_seed, other._seed);
+        }
+
+        size_t size() const {
+            return octets_of(_root);
+        }
+
+        bool empty() const {
+            return _root == nullptr;
+        }
+
+        size_t count() const {
+            return code_points_of(_root);
+        }
+
+        // newlines plus one, the last line doesn't need to end with one
+        size_t line_count() const {
+            return newlines_of(_root) + 1;
+        }
+
+        // no chunk has a higher priority than its parent, the order that keeps the tree about log(chunks) deep
+        bool is_heap_ordered() const {
+            return heap_ordered(_root);
+        }
+
+        // the chunks on the longest path from the root, 0 for an empty rope
+        size_t depth() const {
+            return depth_of(_root);
+        }
+
+        // inserts text before the octet at offset
+        void insert(size_t offset, utf8string_view text) {
+            if (text.empty()) {
+                return;
+            }
+
+            if (offset > size()) offset = size();
+
+            if (text.size() <= chunk_size) {
+                const size_t newlines = internal::count_newlines(text.get_raw(), text.get_raw() + text.size());
+                if (insert_in_chunk(_root, offset, text, text.count(), newlines)) {
+                    return;
+                }
+            }
+
+            bool failed = false;
+            node *middle = build(text.get_raw(), text.get_raw() + text.size(), UINT32_MAX, failed);
+            node *left = nullptr;
+            node *right = nullptr;
+            if (failed || !split(_root, offset, left, right)) {
+                destroy(middle);
+                return;
+            }
+
+            _root = merge(merge(left, middle), right);
+            coalesce(offset + text.size());
+            coalesce(offset);
+        }
+
+        void append(utf8string_view text) {
+            insert(size(), text);
+        }
+
+        // removes (at most) length octets starting at offset
+        void erase(size_t offset, size_t length = SIZE_MAX) {
+            if (offset >= size()) return;
+            if (length > size() - offset) length = size() - offset;
+            if (length == 0 || erase_in_chunk(_root, offset, length)) {
+                return;
+            }
+
+            node *left = nullptr;
+            node *middle = nullptr;
+            node *right = nullptr;
+            if (!split(_root, offset, left, middle)) {
+                return;
+            }
+
+            if (!split(middle, length, middle, right)) {
+                _root = merge(left, middle);
+                return;
+            }
+
+            destroy(middle);
+            _root = merge(left, right);
+            coalesce(offset);
+        }
+
+        void replace(size_t offset, size_t length, utf8string_view text) {
+            erase(offset, length);
+            insert(offset, text);
+        }
+
+        void clear() {
+            destroy(_root);
+            _root = nullptr;
+        }
+
+        // octet offset of the code point at index, or size() if there are fewer code points
+        size_t offset_of(size_t index) const {
+            const node *n = _root;
+            size_t offset = 0;
+            while (n) {
+                const size_t before = code_points_of(n->left);
+                if (index < before) {
+                    n = n->left;
+                } else if (index < before + n->codePoints) {
+                    offset += octets_of(n->left);
+                    const u8char_t *data = n->data;
+                    return offset + static_cast<size_t>(internal::skip_code_points(data, data + n->octets, index - before) - data);
+                } else {
+                    index -= before + n->codePoints;
+                    offset += octets_of(n->left) + n->octets;
+                    n = n->right;
+                }
+            }
+
+            return size();
+        }
+
+        u32char_t at(size_t index) const {
+            const size_t offset = offset_of(index);
+            size_t start = 0;
+            const node *n = chunk_at(_root, offset, start);
+            if (!n) {
+                return 0;
+            }
+
+            u8char_t *data = const_cast<u8char_t *>(n->data);
+            return internal::peek_next(data + (offset - start), data + n->octets);
+        }
+
+        u32char_t operator[](size_t index) const {
+            return at(index);
+        }
+
+        // octet offset of the first octet of line (counted from 0), or size() if there are fewer lines
+        size_t line_offset(size_t line) const {
+            if (line == 0) {
+                return 0;
+            }
+
+            // right after the line-th newline
+            const node *n = _root;
+            size_t offset = 0;
+            while (n) {
+                const size_t before = newlines_of(n->left);
+                if (line <= before) {
+                    n = n->left;
+                } else if (line <= before + n->newlines) {
+                    offset += octets_of(n->left);
+                    const u8char_t *itr = n->data;
+                    for (size_t i = before; ; ++i) {
+                        itr = static_cast<const u8char_t *>(memchr(itr, '\n', static_cast<size_t>(n->data + n->octets - itr))) + 1;
+                        if (i + 1 == line) {
+                            return offset + static_cast<size_t>(itr - n->data);
+                        }
+                    }
+                } else {
+                    line -= before + n->newlines;
+                    offset += octets_of(n->left) + n->octets;
+                    n = n->right;
+                }
+            }
+
+            return size();
+        }
+
+        // the line the octet at offset is on, counted from 0
+        size_t line_of(size_t offset) const {
+            const node *n = _root;
+            size_t line = 0;
+            while (n) {
+                const size_t before = octets_of(n->left);
+                if (offset < before) {
+                    n = n->left;
+                } else if (offset < before + n->octets) {
+                    return line + newlines_of(n->left) + internal::count_newlines(n->data, n->data + (offset - before));
+                } else {
+                    offset -= before + n->octets;
+                    line += newlines_of(n->left) + n->newlines;
+                    n = n->right;
+                }
+            }
+
+            return line;
+        }
+
+        // calls onChunk with a utf8string_view of every chunk, in order, or the parts of them from first up to last
+        template<typename FUNCTION>
+        void for_each_chunk(FUNCTION &&onChunk, size_t first = 0, size_t last = SIZE_MAX) const {
+            for_each_chunk(_root, first, (last > size()) ? size() : last, onChunk);
+        }
+
+        // the octets from first up to last as a string, allocated once
+        template<typename STRING = utf8string>
+        STRING to_string(size_t first = 0, size_t last = SIZE_MAX, const typename STRING::allocator_type &allocator = typename STRING::allocator_type()) const {
+            STRING result(allocator);
+            if (last > size()) last = size();
+            if (first >= last) {
+                return result;
+            }
+
+            result.reserve(last - first);
+            for_each_chunk([&result](utf8string_view chunk) {
+                result.append(chunk);
+            }, first, last);
+            return result;
+        }
+
+        // the line (counted from 0) with its newline, if it has one
+        template<typename STRING = utf8string>
+        STRING line(size_t line) const {
+            return to_string<STRING>(line_offset(line), line_offset(line + 1));
+        }
+
+        iterator begin() const {
+            return iterator(this, 0);
+        }
+
+        iterator end() const {
+            return iterator(this, size());
+        }
+
+        // the code point that starts at the octet offset
+        iterator iterator_at(size_t offset) const {
+            return iterator(this, offset);
+        }
+    };
+
+    // an interned string, an index into the pool that interned it, or invalid when the pool ran out of memory
+    struct utf8string_handle {
+        uint32_t id = UINT32_MAX;
+
+        bool valid() const {
+            return id != UINT32_MAX;
+        }
+
+        bool operator==(utf8string_handle other) const {
+            return id == other.id;
+        }
+
+        bool operator!=(utf8string_handle other) const {
+            return id != other.id;
+        }
+    };
+
+    /*
+        Deduplicates strings into an arena and hands out 32 bit handles for them. Equal strings get the same handle,
+        and the same octets, so interned strings are compared by comparing handles or the pointers of their views.
+
+        The octets (and a null terminator) are bumped into blocks of block_size octets that never move or get freed
+        before the pool, so views of interned strings stay valid as long as the pool does. Longer strings get a block
+        of their own. Lookups go through an open addressing table of ids, probed linearly, that keeps the hash of every
+        string next to it so growing the table doesn't hash anything again.
+
+        Like the matcher, the pool uses malloc, and an intern() that runs out of memory returns an invalid handle.
+        utf8string_shared_pool shards pools behind locks for interning from many threads.
+    */
+    class utf8string_pool {
+    public:
+        static constexpr size_t block_size = 64 * 1024;
+
+    private:
+        struct entry {
+            const u8char_t *data;
+            uint32_t size;
+            uint32_t hash;
+        };
+
+        // the newest block, every block starts with a pointer to the one before it
+        u8char_t *_blocks = nullptr;
+        size_t _blockUsed = 0;
+        size_t _blockCapacity = 0;
+        size_t _arenaSize = 0;
+        entry *_entries = nullptr;
+        uint32_t _entryCount = 0;
+        uint32_t _entryCapacity = 0;
+        // a power of two of ids plus one, 0 is an empty slot
+        uint32_t *_slots = nullptr;
+        uint32_t _slotCount = 0;
+
+        template<size_t SHARD_BITS>
+        friend class utf8string_shared_pool;
+
+        static constexpr size_t block_header = sizeof(u8char_t *);
+
+        u8char_t *allocate(size_t size) {
+            if (size > block_size / 4) {
+                // behind the newest block, which keeps its free room
+                u8char_t *block = static_cast<u8char_t *>(malloc(block_header + size));
+                if (!block) {
+                    return nullptr;
+                }
+
+                u8char_t *previous = nullptr;
+                if (_blocks) {
+                    memcpy(&previous, _blocks, block_header);
+                    memcpy(_blocks, &block, block_header);
+                } else {
+                    _blocks = block;
+                    _blockUsed = _blockCapacity = size;
+                }
+                memcpy(block, &previous, block_header);
+                _arenaSize += block_header + size;
+                return block + block_header;
+            }
+
+            if (!_blocks || _blockUsed + size > _blockCapacity) {
+                u8char_t *block = static_cast<u8char_t *>(malloc(block_header + block_size));
+                if (!block) {
+                    return nullptr;
+                }
+
+                memcpy(block, &_blocks, block_header);
+                _blocks = block;
+                _blockUsed = 0;
+                _blockCapacity = block_size;
+                _arenaSize += block_header + block_size;
+            }
+
+            u8char_t *result = _blocks + block_header + _blockUsed;
+            _blockUsed += size;
+            return result;
+        }
+
+        bool grow_slots() {
+            const uint32_t slotCount = _slotCount ? _slotCount * 2 : 64;
+            if (slotCount == 0) {
+                return false;
+            }
+
+            uint32_t *slots = static_cast<uint32_t *>(calloc(slotCount, sizeof(uint32_t)));
+            if (!slots) {
+                return false;
+            }
+
+            for (uint32_t id = 0; id < _entryCount; ++id) {
+                uint32_t slot = _entries[id].hash & (slotCount - 1);
+                while (slots[slot]) {
+                    slot = (slot + 1) & (slotCount - 1);
+                }
+                slots[slot] = id + 1;
+            }
+
+            free(_slots);
+            _slots = slots;
+            _slotCount = slotCount;
+            return true;
+        }
+
+        bool reserve_entry() {
+            if (_entryCount < _entryCapacity) {
+                return true;
+            }
+
+            if (_entryCapacity >= UINT32_MAX / 2) {
+                return false;
+            }
+
+            const uint32_t capacity = _entryCapacity ? _entryCapacity * 2 : 64;
+            entry *entries = static_cast<entry *>(realloc(_entries, sizeof(entry) * capacity));
+            if (!entries) {
+                return false;
+            }
+
+            _entries = entries;
+            _entryCapacity = capacity;
+            return true;
+        }
+
+        // the slot of text, or the empty slot where it would go
+        uint32_t *slot_of(utf8string_view text, uint32_t hash) const {
+            uint32_t slot = hash & (_slotCount - 1);
+            while (_slots[slot]) {
+                const entry &candidate = _entries[_slots[slot] - 1];
+                if (candidate.hash == hash && candidate.size == text.size() && memcmp(candidate.data, text.get_raw(), text.size()) == 0) {
+                    break;
+                }
+                slot = (slot + 1) & (_slotCount - 1);
+            }
+
+            return &_slots[slot];
+        }
+
+        utf8string_handle intern(utf8string_view text, uint32_t hash) {
+            utf8string_handle result;
+            // at most three quarters full
+            if ((_entryCount + 1) * 4ull > _slotCount * 3ull && !grow_slots()) {
+                return result;
+            }
+
+            uint32_t *slot = slot_of(text, hash);
+            if (*slot) {
+                result.id = *slot - 1;
+                return result;
+            }
+
+            if (text.size() >= UINT32_MAX || !reserve_entry()) {
+                return result;
+            }
+
+            u8char_t *data = allocate(text.size() + 1);
+            if (!data) {
+                return result;
+            }
+
+            memcpy(data, text.get_raw(), text.size());
+            data[text.size()] = '\0';
+            _entries[_entryCount] = { data, static_cast<uint32_t>(text.size()), hash };
+            result.id = _entryCount++;
+            *slot = result.id + 1;
+            return result;
+        }
+
+        utf8string_handle find(utf8string_view text, uint32_t hash) const {
+            utf8string_handle result;
+            if (_slotCount) {
+                const uint32_t id = *slot_of(text, hash);
+                if (id) {
+                    result.id = id - 1;
+                }
+            }
+
+            return result;
+        }
+
+        void release() {
+            while (_blocks) {
+                u8char_t *previous;
+                memcpy(&previous, _blocks, block_header);
+                free(_blocks);
+                _blocks = previous;
+            }
+
+            free(_entries);
+            free(_slots);
+            _entries = nullptr;
+            _slots = nullptr;
+            _blockUsed = _blockCapacity = _arenaSize = 0;
+            _entryCount = _entryCapacity = _slotCount = 0;
+        }
+
+    public:
+        static uint32_t hash(utf8string_view text) {
+            return static_cast<uint32_t>(internal::hash_octets(text.get_raw(), text.size()));
+        }
+
+        utf8string_pool() = default;
+
+        utf8string_pool(const utf8string_pool &) = delete;
+        utf8string_pool & operator=(const utf8string_pool &) = delete;
+
+        utf8string_pool(utf8string_pool &&other) noexcept {
+            *this = std::move(other);
+        }
+
+        utf8string_pool & operator=(utf8string_pool &&other) noexcept {
+            if (this != &other) {
+                release();
+                _blocks = other._blocks;
+                _blockUsed = other._blockUsed;
+                _blockCapacity = other._blockCapacity;
+                _arenaSize = other._arenaSize;
+                _entries = other._entries;
+                _entryCount = other._entryCount;
+                _entryCapacity = other._entryCapacity;
+                _slots = other._slots;
+                _slotCount = other._slotCount;
+                other._blocks = nullptr;
+                other._entries = nullptr;
+                other._slots = nullptr;
+                other.release();
+            }
+
+            return *this;
+        }
+
+        ~utf8string_pool() {
+            release();
+        }
+
+        // the handle of the copy of text in the pool, text is copied in the first time it's seen
+        utf8string_handle intern(utf8string_view text) {
+            return intern(text, hash(text));
+        }
+
+        // the interned copy of text, equal strings get the same octets
+        utf8string_view intern_view(utf8string_view text) {
+            return view(intern(text));
+        }
+
+        // the handle of text if it was interned, an invalid one otherwise
+        utf8string_handle find(utf8string_view text) const {
+            return find(text, hash(text));
+        }
+
+        // the interned string, null terminated, an invalid handle is an empty string
+        utf8string_view view(utf8string_handle handle) const {
+            if (!handle.valid()) {
+                return utf8string_view();
+            }
+
+            assert(handle.id < _entryCount);
+            return utf8string_view(_entries[handle.id].data, _entries[handle.id].size);
+        }
+
+        // the number of distinct strings
+        size_t size() const {
+            return _entryCount;
+        }
+
+        // the arena blocks and the tables, in octets
+        size_t memory_usage() const {
+            return _arenaSize + sizeof(entry) * _entryCapacity + sizeof(uint32_t) * _slotCount;
+        }
+
+        void clear() {
+            release();
+        }
+    };
+
+    #if defined(RYUK_UTF8_SHARED_POOL)
+    /*
+        1 << SHARD_BITS pools, each behind a mutex, picked by the high bits of the hash, so threads interning
+        different strings rarely wait for each other. The shard is kept in the high bits of the handle, the rest
+        is the id in that shard's pool. Views of interned strings stay valid and can be used without locking.
+    */
+    template<size_t SHARD_BITS = 4>
+    class utf8string_shared_pool {
+    private:
+        static_assert(SHARD_BITS > 0 && SHARD_BITS < 16, "too many shards");
+        static constexpr size_t shard_count = size_t(1) << SHARD_BITS;
+        static constexpr uint32_t id_bits = 32 - SHARD_BITS;
+        static constexpr uint32_t id_mask = (uint32_t(1) << id_bits) - 1;
+
+        struct shard {
+            mutable std::mutex lock;
+            utf8string_pool pool;
+        };
+
+        shard _shards[shard_count];
+
+        static utf8string_handle global(uint32_t shard, utf8string_handle local) {
+            if (local.valid()) {
+                local.id = (local.id < id_mask) ? ((shard << id_bits) | local.id) : UINT32_MAX;
+            }
+
+            return local;
+        }
+
+    public:
+        utf8string_shared_pool() = default;
+        utf8string_shared_pool(const utf8string_shared_pool &) = delete;
+        utf8string_shared_pool & operator=(const utf8string_shared_pool &) = delete;
+
+        utf8string_handle intern(utf8string_view text) {
+            const uint32_t hash = utf8string_pool::hash(text);
+            const uint32_t index = hash >> id_bits;
+            std::lock_guard<std::mutex> guard(_shards[index].lock);
+            return global(index, _shards[index].pool.intern(text, hash));
+        }
+
+        utf8string_view intern_view(utf8string_view text) {
+            const uint32_t hash = utf8string_pool::hash(text);
+            const uint32_t index = hash >> id_bits;
+            std::lock_guard<std::mutex> guard(_shards[index].lock);
+            utf8string_pool &pool = _shards[index].pool;
+            return pool.view(pool.intern(text, hash));
+        }
+
+        utf8string_handle find(utf8string_view text) const {
+            const uint32_t hash = utf8string_pool::hash(text);
+            const uint32_t index = hash >> id_bits;
+            std::lock_guard<std::mutex> guard(_shards[index].lock);
+            return global(index, _shards[index].pool.find(text, hash));
+        }
+
+        utf8string_view view(utf8string_handle handle) const {
+            if (!handle.valid()) {
+                return utf8string_view();
+            }
+
+            const shard &owner = _shards[handle.id >> id_bits];
+            utf8string_handle local;
+            local.id = handle.id & id_mask;
+            // the entries table may be growing
+            std::lock_guard<std::mutex> guard(owner.lock);
+            return owner.pool.view(local);
         }
 
-        bool operator!=(const basic_utf8string_reverse_iterator &other) {
-            return !(operator==(other));
+        size_t size() const {
+            size_t result = 0;
+            for (const shard &owner : _shards) {
+                std::lock_guard<std::mutex> guard(owner.lock);
+                result += owner.pool.size();
+            }
+
+            return result;
+        }
+
+        size_t memory_usage() const {
+            size_t result = 0;
+            for (const shard &owner : _shards) {
+                std::lock_guard<std::mutex> guard(owner.lock);
+                result += owner.pool.memory_usage();
+            }
+
+            return result;
+        }
+    };
+    #endif
+
+    namespace internal {
+        constexpr size_t MAP_GROUP = 16;
+        constexpr u8char_t MAP_EMPTY = 0x80;
+        constexpr u8char_t MAP_ERASED = 0xFE;
+
+        // bit i is set when control octet i of the group is control
+        inline uint32_t match_control(const u8char_t *group, u8char_t control) {
+        #if defined(RYUK_UTF8_SSE2)
+            const __m128i octets = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+            return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(octets, _mm_set1_epi8(static_cast<char>(control)))));
+        #else
+            uint32_t result = 0;
+            for (size_t i = 0; i < MAP_GROUP; ++i) {
+                result |= static_cast<uint32_t>(group[i] == control) << i;
+            }
+            return result;
+        #endif
+        }
+
+        // empty and erased slots are the ones with the high bit set
+        inline uint32_t match_free(const u8char_t *group) {
+        #if defined(RYUK_UTF8_SSE2)
+            return static_cast<uint32_t>(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(group))));
+        #else
+            uint32_t result = 0;
+            for (size_t i = 0; i < MAP_GROUP; ++i) {
+                result |= static_cast<uint32_t>(group[i] >> 7) << i;
+            }
+            return result;
+        #endif
+        }
+
+        inline size_t first_match(uint32_t matches) {
+        #if defined(RYUK_UTF8_X86)
+            return static_cast<size_t>(lowest_set_bit(matches));
+        #else
+            size_t result = 0;
+            while (!(matches & 1)) {
+                matches >>= 1;
+                ++result;
+            }
+            return result;
+        #endif
+        }
+    };
+
+    /*
+        An open addressing hash map from strings to VALUE, laid out like a swiss table: every slot has a control
+        octet that is empty, erased or the low 7 bits of the hash of its key (the tag), and a lookup compares the
+        tags of 16 slots at once, with one sse2 compare, before it compares any key. A key is compared with a key
+        that isn't the one looked up about once in 128 slots. Groups are probed quadratically, the map grows at
+        7/8 full, erased slots included.
+
+        The keys are STRINGs kept in the slots, so short keys live in their sso buffer and take no allocation of
+        their own. Lookups take a utf8string_view, so a const char *, a view or a string of any policies finds a
+        key without a temporary string, they all hash the same. Growing hashes the keys again with hash(), which
+        is free for keys with utf8string_cached_hash.
+
+        Like the rest of the library it doesn't throw, an insert that runs out of memory returns nullptr and
+        leaves the map as it was. Pointers to values stay valid until the map grows or the value is erased.
+    */
+    template<typename VALUE, typename STRING = utf8string>
+    class utf8string_map {
+    public:
+        using key_type = STRING;
+        using mapped_type = VALUE;
+
+    private:
+        struct slot {
+            STRING key;
+            VALUE value;
+        };
+
+        static_assert(alignof(slot) <= internal::MAP_GROUP, "the slots are allocated right after the control octets");
+
+        // capacity control octets, a multiple of MAP_GROUP, then capacity slots
+        u8char_t *_control = nullptr;
+        slot *_slots = nullptr;
+        size_t _capacity = 0;
+        size_t _size = 0;
+        // how many more keys fit before the map has to grow, erased slots use it up too
+        size_t _growthLeft = 0;
+
+        static size_t max_load(size_t capacity) {
+            return capacity - capacity / 8;
+        }
+
+        static u8char_t tag_of(size_t hash) {
+            return static_cast<u8char_t>(hash & 0x7F);
+        }
+
+        // the slot of key, or nullptr
+        slot *find_slot(utf8string_view key, size_t hash) const {
+            if (!_capacity) {
+                return nullptr;
+            }
+
+            const size_t groupMask = _capacity / internal::MAP_GROUP - 1;
+            const u8char_t tag = tag_of(hash);
+            size_t group = (hash >> 7) & groupMask;
+            for (size_t probe = 1; ; ++probe) {
+                const u8char_t *control = _control + group * internal::MAP_GROUP;
+                for (uint32_t matches = internal::match_control(control, tag); matches; matches &= matches - 1) {
+                    slot *candidate = &_slots[group * internal::MAP_GROUP + internal::first_match(matches)];
+                    if (utf8string_view(candidate->key) == key) {
+                        return candidate;
+                    }
+                }
+
+                // the key would have been put in the first free slot of its probe sequence
+                if (internal::match_control(control, internal::MAP_EMPTY)) {
+                    return nullptr;
+                }
+
+                group = (group + probe) & groupMask;
+            }
+        }
+
+        // the first empty or erased slot of the probe sequence of hash, there always is one
+        size_t free_index(size_t hash) const {
+            const size_t groupMask = _capacity / internal::MAP_GROUP - 1;
+            size_t group = (hash >> 7) & groupMask;
+            for (size_t probe = 1; ; ++probe) {
+                const uint32_t matches = internal::match_free(_control + group * internal::MAP_GROUP);
+                if (matches) {
+                    return group * internal::MAP_GROUP + internal::first_match(matches);
+                }
+
+                group = (group + probe) & groupMask;
+            }
+        }
+
+        // strings are trivially relocatable, so growing a map of them copies its slots with memcpy
+        using relocatable = std::integral_constant<bool, is_trivially_relocatable<STRING>::value && is_trivially_relocatable<VALUE>::value>;
+
+        // moves every key to a table of capacity slots, which also drops the erased ones
+        bool rehash(size_t capacity) {
+            const size_t controlSize = capacity;
+            u8char_t *block = static_cast<u8char_t *>(malloc(controlSize + capacity * sizeof(slot)));
+            if (!block) {
+                return false;
+            }
+
+            u8char_t *oldControl = _control;
+            slot *oldSlots = _slots;
+            const size_t oldCapacity = _capacity;
+            _control = block;
+            _slots = reinterpret_cast<slot *>(block + controlSize);
+            _capacity = capacity;
+            _growthLeft = max_load(capacity) - _size;
+            memset(_control, internal::MAP_EMPTY, controlSize);
+
+            for (size_t i = 0; i < oldCapacity; ++i) {
+                if (!(oldControl[i] & 0x80)) {
+                    const size_t hash = oldSlots[i].key.hash();
+                    const size_t index = free_index(hash);
+                    _control[index] = tag_of(hash);
+                    internal::relocate(&oldSlots[i], &oldSlots[i] + 1, &_slots[index], relocatable());
+                }
+            }
+
+            free(oldControl);
+            return true;
+        }
+
+        // room for one more key, growing or dropping erased slots when there's none
+        bool reserve_one() {
+            if (_growthLeft) {
+                return true;
+            }
+
+            // mostly erased slots, rehashing in place of growing gets them back
+            if (_capacity && _size < max_load(_capacity) / 2) {
+                return rehash(_capacity);
+            }
+
+            return rehash(_capacity ? _capacity * 2 : internal::MAP_GROUP);
         }
 
-        basic_utf8string_reverse_iterator & operator++() {
-            internal::previous(_current, _rend);
-            return *this;
-        }
+        template<typename KEY, typename... ARGS>
+        std::pair<VALUE *, bool> emplace_hashed(KEY &&key, size_t hash, ARGS&&... args) {
+            slot *found = find_slot(key, hash);
+            if (found) {
+                return { &found->value, false };
+            }
 
-        basic_utf8string_reverse_iterator operator++(int) {
-            basic_utf8string_reverse_iterator temp = *this;
-            internal::previous(_current, _rend);
-            return temp;
-        }
+            if (!reserve_one()) {
+                return { nullptr, false };
+            }
 
-        basic_utf8string_reverse_iterator & operator--() {
-            internal::next(_current, _rbegin);
-            return *this;
+            const size_t index = free_index(hash);
+            if (_control[index] == internal::MAP_EMPTY) {
+                --_growthLeft;
+            }
+            _control[index] = tag_of(hash);
+            ++_size;
+            slot *result = new (&_slots[index]) slot{ STRING(std::forward<KEY>(key)), VALUE(std::forward<ARGS>(args)...) };
+            return { &result->value, true };
         }
 
-        basic_utf8string_reverse_iterator operator--(int) {
-            basic_utf8string_reverse_iterator temp = *this;
-            internal::next(_current, _rbegin);
-            return temp;
+        void release() {
+            clear();
+            free(_control);
+            _control = nullptr;
+            _slots = nullptr;
+            _capacity = _growthLeft = 0;
         }
 
-        u32char_t operator*() {
-            return internal::peek_next(_current, _rend);
-        }
+    public:
+        utf8string_map() = default;
 
-        bool operator<(const basic_utf8string_reverse_iterator &other) {
-            return (_current > other._current);
+        utf8string_map(const utf8string_map &other) {
+            *this = other;
         }
 
-        bool operator>(const basic_utf8string_reverse_iterator &other) {
-            return (_current < other._current);
+        utf8string_map(utf8string_map &&other) noexcept {
+            *this = std::move(other);
         }
 
-        bool operator<=(const basic_utf8string_reverse_iterator &other) {
-            return (_current >= other._current);
-        }
+        // a copy that runs out of memory is empty
+        utf8string_map & operator=(const utf8string_map &other) {
+            if (this != &other) {
+                release();
+                if (other._size && rehash(other._capacity)) {
+                    for (size_t i = 0; i < other._capacity; ++i) {
+                        if (!(other._control[i] & 0x80)) {
+                            new (&_slots[i]) slot(other._slots[i]);
+                        }
+                    }
+                    memcpy(_control, other._control, _capacity);
+                    _size = other._size;
+                    _growthLeft = other._growthLeft;
+                }
+            }
 
-        bool operator>=(const basic_utf8string_reverse_iterator &other) {
-            return (_current <= other._current);
+            return *this;
         }
 
-        u8char_t *begin() {
-            return _rbegin;
-        }
+        utf8string_map & operator=(utf8string_map &&other) noexcept {
+            if (this != &other) {
+                release();
+                _control = other._control;
+                _slots = other._slots;
+                _capacity = other._capacity;
+                _size = other._size;
+                _growthLeft = other._growthLeft;
+                other._control = nullptr;
+                other._slots = nullptr;
+                other._capacity = other._size = other._growthLeft = 0;
+            }
 
-        u8char_t *end() {
-            return _rend;
+            return *this;
         }
-    };
-
-    template<size_t SSO_SIZE>
-    class basic_utf8string {
-    private:
-        u8char_t *_data = nullptr;
-        u8char_t _ssoData[SSO_SIZE];
-        size_t _capacity = SSO_SIZE;
-        size_t _length = 1;
 
-        u8char_t *get_storage() const {
-            return const_cast<u8char_t *>(_capacity == SSO_SIZE ? _ssoData : _data);
+        ~utf8string_map() {
+            release();
         }
 
-        void grow_buffer(size_t amount) {
-            size_t totalLength = _length + amount - 1;
-            if (_capacity < totalLength) {
-                grow(totalLength - _capacity);
-            }
+        // the value of key if it's there, nullptr otherwise
+        VALUE *find(utf8string_view key) {
+            slot *found = find_slot(key, key.hash());
+            return found ? &found->value : nullptr;
         }
 
-        void init_buffer(size_t capacity) {
-            _data = reinterpret_cast<u8char_t *>(malloc(capacity * sizeof(u8char_t)));
-            _capacity = capacity;
+        const VALUE *find(utf8string_view key) const {
+            const slot *found = find_slot(key, key.hash());
+            return found ? &found->value : nullptr;
         }
 
-        void copy_other(const void *other, size_t otherLength) {
-            assert(_capacity >= otherLength);
-            memcpy_s(_data, _capacity * sizeof(u8char_t), other, otherLength);
-            _length = otherLength;
+        bool contains(utf8string_view key) const {
+            return find_slot(key, key.hash()) != nullptr;
         }
 
-        void copy_other_sso(const void *other, size_t otherLength) {
-            assert(_capacity >= otherLength);
-            assert(sso_capacity >= otherLength);
-            memcpy_s(_ssoData, _capacity * sizeof(u8char_t), other, otherLength);
-            _length = otherLength;
+        /*
+            Constructs the value from args if key isn't there yet, returns the value of key and whether it was
+            inserted, or nullptr if the map ran out of memory. The key is copied from the view only when it's
+            inserted, a STRING is moved in.
+        */
+        template<typename... ARGS>
+        std::pair<VALUE *, bool> emplace(utf8string_view key, ARGS&&... args) {
+            return emplace_hashed(key, key.hash(), std::forward<ARGS>(args)...);
         }
 
-        void move_other(basic_utf8string &&other) {
-            _capacity = other._capacity;
-            _length = other._length;
-            _data = other._data;
-            _ssoData = other._ssoData;
-            other._capacity = 0;
-            other._length = 0;
-            other._data = nullptr;
-        }
-
-        void append_other(const void* other, size_t otherLength) {
-            assert(_capacity >= _length + otherLength);
-            //              remove the null terminator
-            memcpy_s(&_data[--_length], _capacity * sizeof(u8char_t), other, otherLength);
-            _length += otherLength;
-        }
-
-        void append_other_sso(const void* other, size_t otherLength) {
-            assert(_capacity >= _length + otherLength);
-            assert(sso_capacity >= _length + otherLength);
-            //                 remove the null terminator
-            memcpy_s(&_ssoData[--_length], _capacity * sizeof(u8char_t), other, otherLength);
-            _length += otherLength;
-        }
-
-        void append_sso_to_buffer() {
-            if (_capacity == sso_capacity && _length > 1) {
-                ensure_capacity(_length + sso_capacity);
-                size_t oldLength = _length;
-                _length = 1;
-                append_other(_ssoData, oldLength);
-            }
+        template<typename... ARGS>
+        std::pair<VALUE *, bool> emplace(const char *key, ARGS&&... args) {
+            return emplace(utf8string_view(key), std::forward<ARGS>(args)...);
         }
 
-        void ensure_capacity(size_t capacity) {
-            assert(capacity != SIZE_MAX);
-            if (capacity > _capacity && capacity > sso_capacity) {
-                grow(capacity - _capacity);
-            }
+        template<typename... ARGS>
+        std::pair<VALUE *, bool> emplace(STRING &&key, ARGS&&... args) {
+            const size_t hash = key.hash();
+            return emplace_hashed(std::move(key), hash, std::forward<ARGS>(args)...);
         }
 
-        void resize(size_t newCapacity) {
-            if (newCapacity == _capacity) { return; }
+        // the value of key, default constructed if it wasn't there, nullptr if the map ran out of memory
+        VALUE *insert(utf8string_view key) {
+            return emplace(key).first;
+        }
 
-            if (!_data) {
-                _data = reinterpret_cast<u8char_t *>(malloc(newCapacity * sizeof(u8char_t)));
-                if (_data) {
-                    _capacity = newCapacity;
-                }
-                return;
+        // sets the value of key whether it was there or not
+        VALUE *insert_or_assign(utf8string_view key, VALUE value) {
+            std::pair<VALUE *, bool> result = emplace(key, std::move(value));
+            if (result.first && !result.second) {
+                *result.first = std::move(value);
             }
 
-            assert(newCapacity >= _length);
-
-            _data = reinterpret_cast<u8char_t *>(realloc(_data, newCapacity * sizeof(u8char_t)));
+            return result.first;
+        }
 
-            if (_data) {
-                _capacity = newCapacity;
+        // whether key was there, its slot is marked erased unless its group still has an empty slot
+        bool erase(utf8string_view key) {
+            slot *found = find_slot(key, key.hash());
+            if (!found) {
+                return false;
             }
-        }
 
-        void release() {
-            if (_data) {
-                free(_data);
-                _data = nullptr;
+            const size_t index = static_cast<size_t>(found - _slots);
+            found->~slot();
+            --_size;
+            // no probe sequence went past a group with an empty slot, so nothing was put behind this one
+            if (internal::match_control(_control + index / internal::MAP_GROUP * internal::MAP_GROUP, internal::MAP_EMPTY)) {
+                _control[index] = internal::MAP_EMPTY;
+                ++_growthLeft;
+            } else {
+                _control[index] = internal::MAP_ERASED;
             }
 
-            _length = 1;
-            _capacity = 1;
+            return true;
         }
 
-        void reset_to_sso() {
-            if (_capacity > sso_capacity) {
-                release();
-                _capacity = sso_capacity;
+        // f(const STRING &key, VALUE &value) for every key, in no particular order
+        template<typename FUNC>
+        void for_each(FUNC f) {
+            for (size_t i = 0; i < _capacity; ++i) {
+                if (!(_control[i] & 0x80)) {
+                    f(const_cast<const STRING &>(_slots[i].key), _slots[i].value);
+                }
             }
         }
-    public:
-        static constexpr size_t sso_capacity = SSO_SIZE;
 
-        void grow(size_t amount) {
-            assert(amount != SIZE_MAX);
-            size_t newCapacity = _capacity;
-
-            while (newCapacity < _capacity + amount) {
-                newCapacity = newCapacity * 5 / 2 + 8;
+        template<typename FUNC>
+        void for_each(FUNC f) const {
+            for (size_t i = 0; i < _capacity; ++i) {
+                if (!(_control[i] & 0x80)) {
+                    f(const_cast<const STRING &>(_slots[i].key), const_cast<const VALUE &>(_slots[i].value));
+                }
             }
-
-            resize(newCapacity);
         }
 
-        void shrink_to_fit() {
-            if (_length > sso_capacity) {
-                resize(_length);
+        // room for count keys without growing
+        bool reserve(size_t count) {
+            size_t capacity = _capacity ? _capacity : internal::MAP_GROUP;
+            while (max_load(capacity) < count) {
+                capacity *= 2;
             }
-        }
 
-        const u8char_t *get_raw() {
-            return get_storage();
+            return capacity == _capacity || rehash(capacity);
         }
 
-        basic_utf8string_iterator begin() const {
-            u8char_t *data = get_storage();
-            return basic_utf8string_iterator(data, data + size());
+        size_t size() const {
+            return _size;
         }
 
-        basic_utf8string_iterator end() const {
-            u8char_t *end = get_storage() + size();
-            return basic_utf8string_iterator(end, end);
+        bool empty() const {
+            return _size == 0;
         }
 
-        basic_utf8string_reverse_iterator rbegin() const {
-            u8char_t *data = get_storage();
-            return basic_utf8string_reverse_iterator(data + size() - 1, data - 1);
+        size_t capacity() const {
+            return _capacity;
         }
 
-        basic_utf8string_reverse_iterator rend() const {
-            u8char_t *end = get_storage() - 1;
-            return basic_utf8string_reverse_iterator(end, end);
-        }
+        // keeps the table
+        void clear() {
+            for (size_t i = 0; i < _capacity; ++i) {
+                if (!(_control[i] & 0x80)) {
+                    _slots[i].~slot();
+                }
+            }
 
-        size_t size() const {
-            return _length - 1;
+            if (_capacity) {
+                memset(_control, internal::MAP_EMPTY, _capacity);
+            }
+            _size = 0;
+            _growthLeft = max_load(_capacity);
         }
 
-        size_t capacity() const {
-            return _capacity - 1;
+        void swap(utf8string_map &other) noexcept {
+            std::swap(_control, other._control);
+            std::swap(_slots, other._slots);
+            std::swap(_capacity, other._capacity);
+            std::swap(_size, other._size);
+            std::swap(_growthLeft, other._growthLeft);
         }
 
-        size_t count() const {
-            u8char_t *data = get_storage();
-            return internal::distance(data, &data[_length - 1]);
+        friend void swap(utf8string_map &a, utf8string_map &b) noexcept {
+            a.swap(b);
         }
+    };
 
-        void clear() {
-            _length = 1;
+    /*
+        Validates UTF-8 that arrives in chunks, from a socket or a file, which may end in the middle of a sequence.
+        feed() hands the valid octets to a sink as views, straight into the chunk wherever it can: the octets of a
+        sequence that a chunk cut short are kept (at most 3) and validated with the start of the next chunk, so
+        only those few octets are copied and every other octet is validated once, by the same vectorized
+        validation as whole buffers. A BOM at the start of the stream is dropped, even when it's split too.
+
+        The first invalid sequence stops the stream, error() says what was wrong with it and error_offset() where
+        it starts, counted in octets of the whole stream, the way convert_utf8_to_utf32 reports it for a whole
+        buffer. finish() reports a stream that ended in the middle of a sequence.
+    */
+    class utf8string_decoder {
+    private:
+        // the octets of a cut sequence, then room for the rest of it from the next chunk
+        u8char_t _pending[7] = {};
+        size_t _pendingSize = 0;
+        size_t _offset = 0;
+        internal::UTF8Error _error = internal::UTF8Error_None;
+        bool _atStart = true;
+        bool _bom = false;
+
+        bool fail(internal::UTF8Error error, size_t offset) {
+            _error = error;
+            _offset = offset;
+            return false;
         }
 
-        void push(u32char_t c) {
-            // you should not push a null character!
-            assert(c);
-
-            // remove the null terminator
-            --_length;
+        // how many octets of a BOM the stream started with, the chunk is all used up when it may still be one
+        const u8char_t *skip_bom(const u8char_t *itr, const u8char_t *end) {
+            while (_pendingSize < sizeof(internal::BOM) && itr != end && *itr == internal::BOM[_pendingSize]) {
+                _pending[_pendingSize++] = *(itr++);
+            }
 
-            size_t seqlen = internal::sequence_length(c);
-            u8char_t *data = get_storage();
-            ensure_capacity(_length + seqlen + 1);
+            if (internal::starts_with_bom(_pending, _pending + _pendingSize)) {
+                _offset += _pendingSize;
+                _pendingSize = 0;
+                _bom = true;
+                _atStart = false;
+            } else if (itr != end) {
+                // whatever matched is validated with the rest of the stream
+                _atStart = false;
+            }
 
-            internal::append(c, &data[_length]);
-            _length += seqlen;
-            data[_length] = '\0';
-            ++_length;
+            return itr;
         }
 
-        void push(u8char_t c) {
-            push(static_cast<u32char_t>(c));
-        }
+        // completes the sequence the last chunk cut with the first octets of this one, itr moves past the ones it took
+        template<typename SINK>
+        bool complete_pending(const u8char_t *&itr, const u8char_t *end, SINK &sink) {
+            const size_t taken = (static_cast<size_t>(end - itr) < sizeof(_pending) - _pendingSize) ? static_cast<size_t>(end - itr) : sizeof(_pending) - _pendingSize;
+            memcpy(_pending + _pendingSize, itr, taken);
+
+            u8char_t *current = _pending;
+            u8char_t *last = _pending + _pendingSize + taken;
+            while (current < _pending + _pendingSize) {
+                const internal::UTF8Error error = internal::validate_next(current, last);
+                if (error == internal::UTF8Error_NotEnoughRoom) {
+                    // still cut short, all of this chunk joins the pending octets
+                    if (current != _pending) {
+                        sink(utf8string_view(_pending, static_cast<size_t>(current - _pending)));
+                    }
+                    _offset += static_cast<size_t>(current - _pending);
+                    _pendingSize = static_cast<size_t>(last - current);
+                    memmove(_pending, current, _pendingSize);
+                    itr = end;
+                    return true;
+                } else if (error != internal::UTF8Error_None) {
+                    return fail(error, _offset + static_cast<size_t>(current - _pending));
+                }
+            }
 
-        void push(char c) {
-            push(static_cast<u32char_t>(c));
+            const size_t completed = static_cast<size_t>(current - _pending);
+            sink(utf8string_view(_pending, completed));
+            itr += completed - _pendingSize;
+            _offset += completed;
+            _pendingSize = 0;
+            return true;
         }
 
-        u32char_t pop() {
-            // remove the null terminator
-            if (_length == 1) {
-                return 0;
+    public:
+        /*
+            Validates chunk, calls sink(utf8string_view) with the valid octets in order, returns false once the
+            stream turned out to be invalid, whatever is fed after that is ignored.
+        */
+        template<typename SINK>
+        bool feed(const void *chunk, size_t size, SINK sink) {
+            if (_error != internal::UTF8Error_None) {
+                return false;
             }
 
-            --_length;
-
-            u32char_t result = 0;
-            u8char_t *data = get_storage();
-            u8char_t *pos = &data[_length];
-            result = internal::previous(pos, data);
-            if (result != 0) {
-                data[_length - 1] = '\0';
+            const u8char_t *itr = static_cast<const u8char_t *>(chunk);
+            const u8char_t *end = itr + size;
+            if (_atStart) {
+                itr = skip_bom(itr, end);
             }
-            return result;
-        }
 
-        void append(const char *other) {
-            size_t length = strlen(other);
-            if (_length + length < sso_capacity) {
-                append_other_sso(other, length + 1);
-            } else {
-                append_sso_to_buffer();
-                ensure_capacity(_length + length);
-                append_other(other, length + 1);
+            if (_pendingSize && !_atStart && itr != end && !complete_pending(itr, end, sink)) {
+                return false;
             }
-        }
 
-        void append(const basic_utf8string &other) {
-            if (_length + other._length - 1 < sso_capacity) {
-                append_other_sso(other.get_storage(), other._length);
-            } else {
-                append_sso_to_buffer();
-                ensure_capacity(_length + other._length);
-                append_other(other._data, other._length);
+            if (itr == end) {
+                return true;
             }
-        }
-        
-        u8char_t octet_at(size_t index) const {
-            assert(index < _length);
-            return _data[index];
-        }
 
-        u32char_t at(size_t index) const {
-            assert(index < _length);
-            basic_utf8string_iterator itr = begin();
-            basic_utf8string_iterator end = this->end();
+            // a sequence the chunk cuts short waits for the next one, the rest is validated as a whole buffer
+            const u8char_t *cut = internal::sequence_start_before(const_cast<u8char_t *>(itr), const_cast<u8char_t *>(end));
+            const u8char_t *last = (internal::sequence_length(*cut) > end - cut) ? cut : end;
 
-            for (size_t i = 0; i < index; ++i) {
-                if (itr == end) {
-                    return 0;
-                }
+            internal::UTF8Error error;
+            const u8char_t *valid = internal::find_invalid(const_cast<u8char_t *>(itr), const_cast<u8char_t *>(last), error);
+            if (valid != itr) {
+                sink(utf8string_view(itr, static_cast<size_t>(valid - itr)));
+                _offset += static_cast<size_t>(valid - itr);
+            }
 
-                ++itr;
+            // a sequence that ran out before the cut is broken by the octets after it, not by the end of the chunk
+            if (error == internal::UTF8Error_NotEnoughRoom && valid != last) {
+                u8char_t *next = const_cast<u8char_t *>(valid);
+                error = internal::validate_next(next, const_cast<u8char_t *>(end));
+                assert(error != internal::UTF8Error_None && error != internal::UTF8Error_NotEnoughRoom);
+            }
+
+            if (error != internal::UTF8Error_None && error != internal::UTF8Error_NotEnoughRoom) {
+                return fail(error, _offset);
             }
 
-            return *itr;
+            // a sequence is never longer than 4 octets, so at most 3 are left
+            assert(end - valid < 4);
+            _pendingSize = static_cast<size_t>(end - valid);
+            memcpy(_pending, valid, _pendingSize);
+            return true;
         }
 
-        basic_utf8string_iterator find(const char *substring) const {
-            assert(substring);
-            if (_length <= 1) return end();
+        // the end of the stream, the pending octets of a BOM are validated as they are and a cut sequence is an error
+        template<typename SINK>
+        bool finish(SINK sink) {
+            if (_error != internal::UTF8Error_None) {
+                return false;
+            }
 
-            size_t substringLength = strlen(substring);
-            if (substringLength == 0) return end();
-            if (substringLength >= _length) return end();
+            _atStart = false;
+            if (_pendingSize) {
+                const u8char_t *end = _pending + _pendingSize;
+                const u8char_t *itr = end;
+                if (!complete_pending(itr, end, sink)) {
+                    return false;
+                }
 
-            size_t currentSubstringIndex = 0;
-            char currentSubstringChar = substring[currentSubstringIndex];
-            size_t currentCharIndex = 0;
-            u8char_t currentChar = get_storage()[currentCharIndex];
-            size_t foundIndex = 0;
-            while (currentChar != '\0') {
-                if (currentSubstringChar == currentChar) {
-                    if (foundIndex == 0 && currentSubstringIndex == 0) {
-                        foundIndex = currentCharIndex;
-                    }
-                    currentSubstringChar = substring[++currentSubstringIndex];
-                    if (currentSubstringIndex == substringLength) {
-                        break;
-                    }
-                } else {
-                    currentSubstringIndex = foundIndex = 0;
-                    currentSubstringChar = substring[currentSubstringIndex];
+                if (_pendingSize) {
+                    return fail(internal::UTF8Error_NotEnoughRoom, _offset);
                 }
-                ++currentCharIndex;
-                currentChar = get_storage()[currentCharIndex];
             }
 
-            if (currentSubstringIndex == substringLength) {
-                u8char_t *begin = get_storage() + foundIndex;
-                u8char_t *end = begin + currentSubstringIndex;
-                return basic_utf8string_iterator(begin, end);
-            }
+            return true;
+        }
 
-            return end();
+        // a stream that hasn't started, the BOM is looked for again
+        void reset() {
+            *this = utf8string_decoder();
         }
 
-        basic_utf8string_iterator find(const basic_utf8string &other) const {
-            if (_length <= 1 || other._length <= 1) return end();
-            return find(reinterpret_cast<const char *>(other.get_storage()));
+        // UTF8Error_None while the stream is valid
+        internal::UTF8Error error() const {
+            return _error;
         }
 
-        u32char_t operator[](size_t index) const {
-            return at(index);
+        // where the invalid sequence starts, in octets of the stream since the last reset()
+        size_t error_offset() const {
+            return _offset;
         }
 
-        bool operator==(const char *other) const {
-            size_t length = strlen(other) + 1;
-            if (length != _length) { return false; }
+        // whether the stream started with a BOM, which was dropped
+        bool had_bom() const {
+            return _bom;
+        }
+    };
 
-            int result = 0;
-            result = memcmp(get_storage(), other, _length * sizeof(u8char_t));
+    #if defined(RYUK_UTF8_MAPPED_FILE)
+    // what validating a file found, the counts are of the text before the first invalid sequence
+    struct utf8string_file_stats {
+        internal::UTF8Error error = internal::UTF8Error_None;
+        // where the first invalid sequence starts in the file, its size when there's none
+        size_t error_offset = 0;
+        size_t count = 0;
+        size_t newlines = 0;
+    };
 
-            // a result of 0 means identical
-            return result == 0;
-        }
+    /*
+        A read only file as a utf8string_view, without copying it: mapped with mmap where there is one, read into
+        one allocation elsewhere. A BOM at the start of the file isn't part of the view.
+
+        validate() splits the text between threads. Continuation octets can't start a sequence, so a range ends at
+        the first octet that isn't one, and no sequence is ever split between ranges. That's at most 3 octets after
+        where it would end, unless the text has a longer run of continuations, which is invalid and stays whole in
+        the range it starts in. Every thread validates, counts code points and counts newlines in blocks small enough
+        to stay in the cache for all three, and the ranges are merged in order, up to the first one with an error.
+        The error and its offset are the ones validating the whole file on one thread reports.
+    */
+    class utf8string_mapped_file {
+    public:
+        static constexpr size_t max_threads = 64;
+        // smaller ranges aren't worth a thread
+        static constexpr size_t min_range = 1024 * 1024;
+        static constexpr size_t block_size = 64 * 1024;
 
-        bool operator!=(const char *other) const {
-            return !operator==(other);
+    private:
+        static constexpr size_t unknown_count = SIZE_MAX;
+
+        u8char_t *_data = nullptr;
+        size_t _size = 0;
+        size_t _bomSize = 0;
+        bool _open = false;
+        // published by a validate() that found the text valid, so the view knows it, validate() and view() may be
+        // called from any number of threads at once, and the text never changes, so relaxed accesses are enough
+        mutable std::atomic<size_t> _count { unknown_count };
+
+        // the first octet at or after pos that can start a sequence, or end
+        static const u8char_t *range_start(const u8char_t *pos, const u8char_t *end) {
+            while (pos != end && internal::is_trail(*pos)) {
+                ++pos;
+            }
+
+            return pos;
         }
 
-        bool operator==(const basic_utf8string &other) const {
-            if (_length != other._length) { return false; }
+        static utf8string_file_stats validate_range(const u8char_t *first, const u8char_t *last, const u8char_t *end) {
+            utf8string_file_stats result;
+            const u8char_t *block = first;
+            while (block != last) {
+                const u8char_t *blockEnd = (static_cast<size_t>(last - block) > block_size) ? range_start(block + block_size, last) : last;
+                u8char_t *valid = internal::find_invalid(const_cast<u8char_t *>(block), const_cast<u8char_t *>(blockEnd), result.error);
+                result.count += internal::count_code_points(block, valid);
+                result.newlines += internal::count_newlines(block, valid);
+
+                if (result.error != internal::UTF8Error_None) {
+                    // ranges end before an octet that can't continue a sequence, so one that ran out there is as
+                    // invalid as the octets after it say
+                    if (result.error == internal::UTF8Error_NotEnoughRoom) {
+                        u8char_t *itr = valid;
+                        result.error = internal::validate_next(itr, const_cast<u8char_t *>(end));
+                        assert(result.error != internal::UTF8Error_None);
+                    }
+
+                    result.error_offset = static_cast<size_t>(valid - first);
+                    return result;
+                }
 
-            int result = memcmp(get_storage(), other.get_storage(), _length * sizeof(u8char_t));
+                block = blockEnd;
+            }
 
-            // a result of 0 means identical
-            return result == 0;
+            return result;
         }
 
-        bool operator!=(const basic_utf8string &other) const {
-            return !operator==(other);
+        void release() {
+        #if defined(RYUK_UTF8_MMAP)
+            if (_size) {
+                munmap(_data, _size);
+            }
+        #else
+            free(_data);
+        #endif
+            _data = nullptr;
+            _size = _bomSize = 0;
+            _open = false;
+            _count.store(unknown_count, std::memory_order_relaxed);
         }
 
-        basic_utf8string & operator+=(u32char_t c) {
-            push(c);
-            return *this;
+    public:
+        utf8string_mapped_file() = default;
+
+        explicit utf8string_mapped_file(const char *path) {
+            open(path);
         }
 
-        basic_utf8string & operator+=(u8char_t c) {
-            push(static_cast<u32char_t>(c));
-            return *this;
+        utf8string_mapped_file(const utf8string_mapped_file &) = delete;
+        utf8string_mapped_file & operator=(const utf8string_mapped_file &) = delete;
+
+        utf8string_mapped_file(utf8string_mapped_file &&other) noexcept {
+            *this = std::move(other);
         }
 
-        basic_utf8string & operator+=(char c) {
-            push(static_cast<u32char_t>(c));
+        utf8string_mapped_file & operator=(utf8string_mapped_file &&other) noexcept {
+            if (this != &other) {
+                release();
+                _data = other._data;
+                _size = other._size;
+                _bomSize = other._bomSize;
+                _open = other._open;
+                _count.store(other._count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                other._data = nullptr;
+                other._size = 0;
+                other.release();
+            }
+
             return *this;
         }
 
-        basic_utf8string & operator+=(const char *other) {
-            assert(other);
-            append(other);
-            return *this;            
+        ~utf8string_mapped_file() {
+            release();
         }
 
-        basic_utf8string & operator+=(const basic_utf8string &other) {
-            assert(other._data);
-            assert(other._ssoData);
-            append(other);
-            return *this;
-        }
+        // false when the file can't be opened, mapped or read, the view is empty then
+        bool open(const char *path) {
+            release();
 
-        basic_utf8string & operator=(const char *other) {
-            size_t length = strlen(other) + 1;
-            if (length > sso_capacity) {
-                ensure_capacity(length);
-                copy_other(other, length);
-            } else {
-                reset_to_sso();
-                copy_other_sso(other, length);
+        #if defined(RYUK_UTF8_MMAP)
+            const int file = ::open(path, O_RDONLY | O_CLOEXEC);
+            if (file < 0) {
+                return false;
             }
-            return *this;
-        }
 
-        basic_utf8string & operator=(const basic_utf8string &other) {
-            if (other._length > sso_capacity) {
-                ensure_capacity(other._length);
-                copy_other(other._data, other._length);
-            } else {
-                reset_to_sso();
-                copy_other_sso(other.get_storage());
+            struct stat info;
+            if (fstat(file, &info) != 0 || info.st_size < 0) {
+                ::close(file);
+                return false;
             }
-            return *this;
+
+            // an empty file can't be mapped, it's just an empty view
+            if (info.st_size > 0) {
+                void *mapping = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+                if (mapping == MAP_FAILED) {
+                    ::close(file);
+                    return false;
+                }
+
+                // the threads of validate() fault the pages in, reading ahead helps them all
+                madvise(mapping, static_cast<size_t>(info.st_size), MADV_WILLNEED);
+                _data = static_cast<u8char_t *>(mapping);
+                _size = static_cast<size_t>(info.st_size);
+            }
+            ::close(file);
+        #else
+            FILE *file = fopen(path, "rb");
+            if (!file) {
+                return false;
+            }
+
+        #if defined(_MSC_VER)
+            const bool measured = _fseeki64(file, 0, SEEK_END) == 0;
+            const long long size = _ftelli64(file);
+        #else
+            const bool measured = fseek(file, 0, SEEK_END) == 0;
+            const long long size = ftell(file);
+        #endif
+            if (!measured || size < 0 || fseek(file, 0, SEEK_SET) != 0) {
+                fclose(file);
+                return false;
+            }
+
+            if (size > 0) {
+                _data = static_cast<u8char_t *>(malloc(static_cast<size_t>(size)));
+                if (!_data || fread(_data, 1, static_cast<size_t>(size), file) != static_cast<size_t>(size)) {
+                    free(_data);
+                    _data = nullptr;
+                    fclose(file);
+                    return false;
+                }
+                _size = static_cast<size_t>(size);
+            }
+            fclose(file);
+        #endif
+
+            _bomSize = internal::starts_with_bom(_data, _data + _size) ? sizeof(internal::BOM) : 0;
+            _open = true;
+            return true;
         }
 
-        basic_utf8string & operator=(basic_utf8string&& other) {
+        void close() {
             release();
-            move_other(std::move(other));
-            return *this;
         }
 
-        basic_utf8string() = default;
-
-        basic_utf8string(const char *other) {
-            size_t length = strlen(other) + 1;
-            if (length > sso_capacity) {
-                init_buffer(length);
-                copy_other(other, length);
-            } else {
-                copy_other_sso(other, length);
-            }
+        bool is_open() const {
+            return _open;
         }
 
-        basic_utf8string(const basic_utf8string &other) {
-            if (other._length > sso_capacity) {
-                init_buffer(other._length);
-                copy_other(other._data, other._length);
-            } else {
-                copy_other_sso(other.get_storage(), other._length);
+        // the text of the file after a BOM, it stays valid until the file is closed
+        utf8string_view view() const {
+            if (!_size) {
+                return utf8string_view();
             }
+
+            return utf8string_view(_data + _bomSize, _size - _bomSize, _count.load(std::memory_order_relaxed));
         }
 
-        basic_utf8string(basic_utf8string &&other) {
-            move_other(std::move(other));
+        // the size of the file, a BOM included
+        size_t size() const {
+            return _size;
         }
 
-        ~basic_utf8string() {
-            release();
+        bool had_bom() const {
+            return _bomSize != 0;
         }
 
-        friend std::ostream & operator<<(std::ostream &os, const basic_utf8string &str) {
-            if (str._capacity == basic_utf8string::sso_capacity) {
-                return os << reinterpret_cast<const char *>(str._ssoData);
+        // validates the text with up to threads threads, 0 is one per hardware thread, and publishes the count of a
+        // valid text to view(), safe to call on the same file from several threads
+        utf8string_file_stats validate(size_t threads = 0) const {
+            const u8char_t *start = _data + _bomSize;
+            const u8char_t *end = _data + _size;
+            const size_t size = static_cast<size_t>(end - start);
+            if (threads == 0) {
+                threads = std::thread::hardware_concurrency();
+            }
+
+            const size_t worthIt = size / min_range + 1;
+            threads = (threads > worthIt) ? worthIt : threads;
+            threads = (threads > max_threads) ? max_threads : (threads ? threads : 1);
+
+            const u8char_t *ranges[max_threads + 1];
+            ranges[0] = start;
+            ranges[threads] = end;
+            for (size_t i = 1; i < threads; ++i) {
+                ranges[i] = range_start(start + size / threads * i, end);
+            }
+
+            utf8string_file_stats stats[max_threads];
+            std::thread workers[max_threads];
+            for (size_t i = 1; i < threads; ++i) {
+                workers[i] = std::thread([&stats, &ranges, end, i]() {
+                    stats[i] = validate_range(ranges[i], ranges[i + 1], end);
+                });
+            }
+            stats[0] = validate_range(ranges[0], ranges[1], end);
+            for (size_t i = 1; i < threads; ++i) {
+                workers[i].join();
+            }
+
+            utf8string_file_stats result;
+            result.error_offset = _size;
+            for (size_t i = 0; i < threads; ++i) {
+                result.count += stats[i].count;
+                result.newlines += stats[i].newlines;
+                if (stats[i].error != internal::UTF8Error_None) {
+                    result.error = stats[i].error;
+                    result.error_offset = static_cast<size_t>(ranges[i] - _data) + stats[i].error_offset;
+                    return result;
+                }
             }
 
-            return os << reinterpret_cast<const char *>(str._data);
+            _count.store(result.count, std::memory_order_relaxed);
+            return result;
+        }
+    };
+    #endif
+};
+
+// strings and views with the same octets hash the same, so either can look the other up in a heterogeneous container
+// (std::hash comes with <memory>, which hashes the smart pointers, so <functional> isn't needed for it)
+namespace std {
+    template<size_t SSO_SIZE, typename COUNT_POLICY, typename ALLOCATOR, typename LAYOUT, typename GROWTH_POLICY, typename HASH_POLICY>
+    struct hash<ryuk::basic_utf8string<SSO_SIZE, COUNT_POLICY, ALLOCATOR, LAYOUT, GROWTH_POLICY, HASH_POLICY>> {
+        size_t operator()(const ryuk::basic_utf8string<SSO_SIZE, COUNT_POLICY, ALLOCATOR, LAYOUT, GROWTH_POLICY, HASH_POLICY> &string) const {
+            return string.hash();
         }
     };
 
-    using utf8string = basic_utf8string<32>;
-    using utf8string_iterator = basic_utf8string_iterator;
-    using utf8string_reverse_iterator = basic_utf8string_reverse_iterator;
+    template<>
+    struct hash<ryuk::utf8string_view> {
+        size_t operator()(ryuk::utf8string_view view) const {
+            return view.hash();
+        }
+    };
 };
 
 #endif
@@ -0,0 +1,1157 @@
+// Copyright 2020 Suhail Alhegry
+
+/*
+    Permission is hereby granted, free of charge, to any person or organization
+    obtaining a copy of the software and accompanying documentation covered by
+    this license (the "Software") to use, reproduce, display, distribute,
+    execute, and transmit the Software, and to prepare derivative works of the
+    Software, and to permit third-parties to whom the Software is furnished to
+    do so, all subject to the following:
+
+    The copyright notices in the Software and this entire statement, including
+    the above license grant, this restriction and the following disclaimer,
+    must be included in all copies of the Software, in whole or in part, and
+    all derivative works of the Software, unless such copies or derivative
+    works are solely in the form of machine-executable object code generated by
+    a source language processor.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+    SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+    FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+#define RYUK_UTF8_SHARED_POOL
+#define RYUK_UTF8_MAPPED_FILE
+#include "../src/utf8string.h"
+#include "test_commons.h"
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <thread>
+
+using namespace ryuk;
+
+namespace {
+    using corpus = std::vector<u8char_t>;
+
+    enum Corpus {
+        Corpus_Ascii,
+        Corpus_Arabic,
+        Corpus_Mixed,
+    };
+
+    constexpr const char *corpus_names[] = { "ascii", "arabic", "mixed" };
+
+    // random words of random length, so branch predictors can't learn the text
+    corpus make_corpus(Corpus kind, size_t size) {
+        corpus result;
+        std::mt19937 random(42);
+        u8char_t encoded[4];
+
+        while (result.size() + 4 <= size) {
+            u32char_t c;
+            if (random() % 6 == 0) {
+                c = ' ';
+            } else if (kind == Corpus_Ascii) {
+                c = 'a' + random() % 26;
+            } else if (kind == Corpus_Arabic) {
+                c = (random() % 16 == 0) ? ('0' + random() % 10) : (0x621 + random() % 42);
+            } else {
+                switch (random() % 8) {
+                    case 0: case 1: case 2: c = 'a' + random() % 26; break;
+                    case 3: case 4: c = 0x621 + random() % 42; break;
+                    case 5: case 6: c = 0x4E00 + random() % 1000; break;
+                    default: c = 0x1F600 + random() % 64; break;
+                }
+            }
+
+            u8char_t *end = internal::append(c, encoded);
+            result.insert(result.end(), encoded, end);
+        }
+
+        return result;
+    }
+
+    // the length based decoder that validate_next replaced, kept as a baseline
+    namespace legacy {
+        using namespace internal;
+
+        inline UTF8Error increase_safely(u8char_t *&itr, u8char_t *end) {
+            if (++itr == end) {
+                return UTF8Error_NotEnoughRoom;
+            }
+
+            if (!is_trail(*itr)) {
+                return UTF8Error_IncompleteSequence;
+            }
+
+            return UTF8Error_None;
+        }
+
+        #define increase_safely_and_return_on_error(itr, end)\
+                {\
+                    UTF8Error result = increase_safely(itr, end);\
+                    if (result != UTF8Error_None) {\
+                        return result;\
+                    }\
+                }
+
+        inline UTF8Error validate_next(u8char_t *&itr, u8char_t *end, u32char_t &c) {
+            if (itr == end) {
+                return UTF8Error_NotEnoughRoom;
+            }
+
+            u8char_t *original = itr;
+            u32char_t cp = mask(*itr);
+            const uint8_t length = sequence_length(*itr);
+
+            switch (length) {
+                case 0: return UTF8Error_InvalidLead;
+                case 1: break;
+                case 2: {
+                    increase_safely_and_return_on_error(itr, end);
+                    cp = ((cp << 6) & 0x7FF) + ((*itr) & 0x3F);
+                } break;
+                case 3: {
+                    increase_safely_and_return_on_error(itr, end);
+                    cp = ((cp << 12) & 0xFFFF) + ((mask(*itr) << 6) & 0xFFF);
+                    increase_safely_and_return_on_error(itr, end);
+                    cp += (*itr) & 0x3F;
+                } break;
+                case 4: {
+                    increase_safely_and_return_on_error(itr, end);
+                    cp = ((cp << 18) & 0x1FFFFF) + ((mask(*itr) << 12) & 0x3FFFF);
+                    increase_safely_and_return_on_error(itr, end);
+                    cp += (mask(*itr) << 6) & 0xFFF;
+                    increase_safely_and_return_on_error(itr, end);
+                    cp += (*itr) & 0x3F;
+                } break;
+            }
+
+            #undef increase_safely_and_return_on_error
+
+            UTF8Error result = UTF8Error_InvalidCodePoint;
+            if (is_code_point_valid(cp)) {
+                if (!is_overlong_sequence(cp, length)) {
+                    c = cp;
+                    ++itr;
+                    return UTF8Error_None;
+                }
+
+                result = UTF8Error_OverlongSequence;
+            }
+
+            itr = original;
+            return result;
+        }
+    };
+
+    template<typename DECODER>
+    size_t decode_all(corpus &text, DECODER decoder) {
+        u8char_t *itr = text.data();
+        u8char_t *end = itr + text.size();
+        size_t checksum = 0;
+        u32char_t c = 0;
+
+        while (itr != end) {
+            if (decoder(itr, end, c) != internal::UTF8Error_None) {
+                return 0;
+            }
+            checksum += c;
+        }
+
+        return checksum;
+    }
+
+    // a request scoped arena, allocating bumps a pointer, deallocating does nothing and reset() frees everything
+    struct bench_arena {
+        u8char_t *buffer;
+        size_t size;
+        size_t used = 0;
+
+        explicit bench_arena(size_t size) : buffer(static_cast<u8char_t *>(malloc(size))), size(size) {}
+        ~bench_arena() { free(buffer); }
+
+        void reset() { used = 0; }
+    };
+
+    template<typename T>
+    struct arena_allocator {
+        using value_type = T;
+
+        bench_arena *arena;
+
+        explicit arena_allocator(bench_arena *arena) : arena(arena) {}
+
+        template<typename U>
+        arena_allocator(const arena_allocator<U> &other) : arena(other.arena) {}
+
+        T *allocate(size_t count) {
+            size_t offset = (arena->used + alignof(T) - 1) & ~(alignof(T) - 1);
+            if (offset + count * sizeof(T) > arena->size) {
+                return nullptr;
+            }
+
+            arena->used = offset + count * sizeof(T);
+            return reinterpret_cast<T *>(arena->buffer + offset);
+        }
+
+        void deallocate(T *, size_t) {}
+
+        bool operator==(const arena_allocator &other) const { return arena == other.arena; }
+        bool operator!=(const arena_allocator &other) const { return arena != other.arena; }
+    };
+};
+
+void bench_decoder() {
+    std::cout << "decoding one code point at a time\n";
+    for (int kind = Corpus_Ascii; kind <= Corpus_Mixed; ++kind) {
+        corpus text = make_corpus(static_cast<Corpus>(kind), 64 * 1024);
+        std::cout << corpus_names[kind] << '\n';
+        tests::run_benchmark("  legacy validate_next", text.size(), [&]() {
+            return decode_all(text, legacy::validate_next);
+        });
+        tests::run_benchmark("  dfa validate_next", text.size(), [&]() {
+            return decode_all(text, [](u8char_t *&itr, u8char_t *end, u32char_t &c) {
+                return internal::validate_next(itr, end, c);
+            });
+        });
+    }
+}
+
+void bench_count() {
+    std::cout << "counting code points\n";
+    for (int kind = Corpus_Ascii; kind <= Corpus_Mixed; ++kind) {
+        for (size_t size : { 4 * 1024, 64 * 1024 }) {
+            corpus text = make_corpus(static_cast<Corpus>(kind), size);
+            std::cout << corpus_names[kind] << ' ' << size / 1024 << "KiB\n";
+            tests::run_benchmark("  distance (validating)", text.size(), [&]() {
+                return internal::distance(text.data(), text.data() + text.size());
+            });
+            tests::run_benchmark("  count_code_points", text.size(), [&]() {
+                return internal::count_code_points(text.data(), text.data() + text.size());
+            });
+        }
+    }
+}
+
+void bench_cached_count() {
+    std::cout << "count() on a 64KiB string, sizeof(utf8string) = " << sizeof(utf8string) << '\n';
+    corpus text = make_corpus(Corpus_Mixed, 64 * 1024);
+    text.push_back('\0');
+    const char *raw = reinterpret_cast<const char *>(text.data());
+
+    basic_utf8string<32, utf8string_lazy_count> lazy(raw);
+    basic_utf8string<32, utf8string_eager_count> eager(raw);
+    tests::run_benchmark("  lazy, count() after push", text.size(), [&]() {
+        lazy.push(U'a');
+        lazy.pop();
+        return lazy.count();
+    });
+    tests::run_benchmark("  lazy, count() after append", text.size(), [&]() {
+        lazy += "a";
+        lazy.pop();
+        return lazy.count();
+    });
+    tests::run_benchmark("  eager, count() after append", text.size(), [&]() {
+        eager += "a";
+        eager.pop();
+        return eager.count();
+    });
+}
+
+// what at() did before the index, walks from the beginning every time
+u32char_t linear_at(const utf8string &string, size_t index) {
+    utf8string_iterator itr = string.begin();
+    utf8string_iterator end = string.end();
+    for (size_t i = 0; i < index && itr != end; ++i) {
+        ++itr;
+    }
+
+    return itr == end ? 0 : *itr;
+}
+
+void bench_at() {
+    std::cout << "at() on random indices, time per call\n";
+    for (size_t size : { 1024, 64 * 1024, 1024 * 1024, 10 * 1024 * 1024 }) {
+        corpus text = make_corpus(Corpus_Mixed, size);
+        text.push_back('\0');
+        utf8string string(reinterpret_cast<const char *>(text.data()));
+        const size_t count = string.count();
+        std::cout << "mixed " << size / 1024 << "KiB\n";
+
+        std::mt19937 random(7);
+        tests::run_benchmark("  indexed at()", 0, [&]() {
+            return string.at(random() % count);
+        });
+        if (size <= 1024 * 1024) {
+            tests::run_benchmark("  linear at()", 0, [&]() {
+                return linear_at(string, random() % count);
+            });
+        }
+    }
+}
+
+void bench_ascii() {
+    std::cout << "ascii fast paths on 64KiB\n";
+    corpus text = make_corpus(Corpus_Ascii, 64 * 1024);
+    text.push_back('\0');
+    utf8string ascii(reinterpret_cast<const char *>(text.data()));
+    // the same text, but with a non ascii code point at the end, so it takes the general paths
+    utf8string general(ascii);
+    general.push(U'\x645');
+
+    std::mt19937 random(7);
+    const size_t count = ascii.count();
+    tests::run_benchmark("  at(), ascii", 0, [&]() { return ascii.at(random() % count); });
+    tests::run_benchmark("  at(), general", 0, [&]() { return general.at(random() % count); });
+
+    auto reverse = [](const utf8string &string) {
+        size_t checksum = 0;
+        for (auto itr = string.rbegin(); itr != string.rend(); ++itr) {
+            checksum += *itr;
+        }
+        return checksum;
+    };
+    tests::run_benchmark("  reverse iteration, ascii", text.size(), [&]() { return reverse(ascii); });
+    tests::run_benchmark("  reverse iteration, general", text.size(), [&]() { return reverse(general); });
+}
+
+void bench_utf32() {
+    std::cout << "utf-8 <-> utf-32 on 64KiB\n";
+    for (int kind = Corpus_Ascii; kind <= Corpus_Mixed; ++kind) {
+        corpus text = make_corpus(static_cast<Corpus>(kind), 64 * 1024);
+        const u8char_t *start = text.data();
+        const u8char_t *end = start + text.size();
+        std::vector<u32char_t> wide(utf32_length_of(start, end));
+        std::vector<u8char_t> narrow(text.size());
+        std::cout << corpus_names[kind] << '\n';
+
+        tests::run_benchmark("  to utf-32, next() loop", text.size(), [&]() {
+            u8char_t *itr = text.data();
+            u32char_t *result = wide.data();
+            while (itr != text.data() + text.size()) {
+                *(result++) = internal::next(itr, text.data() + text.size());
+            }
+            return static_cast<size_t>(result - wide.data());
+        });
+        tests::run_benchmark("  to utf-32, trusted", text.size(), [&]() {
+            return convert_utf8_to_utf32_trusted(start, end, wide.data());
+        });
+        tests::run_benchmark("  to utf-32, checked", text.size(), [&]() {
+            return convert_utf8_to_utf32(start, end, wide.data()).written;
+        });
+        tests::run_benchmark("  from utf-32, append() loop", text.size(), [&]() {
+            u8char_t *result = narrow.data();
+            for (u32char_t c : wide) {
+                result = internal::append(c, result);
+            }
+            return static_cast<size_t>(result - narrow.data());
+        });
+        tests::run_benchmark("  from utf-32, checked", text.size(), [&]() {
+            return convert_utf32_to_utf8(wide.data(), wide.data() + wide.size(), narrow.data()).written;
+        });
+    }
+}
+
+void bench_append_code_points() {
+    std::cout << "appending 10k code points to a string\n";
+    for (int kind = Corpus_Ascii; kind <= Corpus_Mixed; ++kind) {
+        corpus text = make_corpus(static_cast<Corpus>(kind), 64 * 1024);
+        std::vector<u32char_t> wide(utf32_length_of(text.data(), text.data() + text.size()));
+        convert_utf8_to_utf32_trusted(text.data(), text.data() + text.size(), wide.data());
+        wide.resize(10000);
+        const size_t octets = utf8_length_of(wide.data(), wide.data() + wide.size());
+        std::cout << corpus_names[kind] << '\n';
+
+        tests::run_benchmark("  push() loop", octets, [&]() {
+            utf8string string;
+            for (u32char_t c : wide) {
+                string.push(c);
+            }
+            return string.size();
+        });
+        tests::run_benchmark("  append(pointer, count)", octets, [&]() {
+            utf8string string;
+            string.append(wide.data(), wide.size());
+            return string.size();
+        });
+        tests::run_benchmark("  append(first, last), not pointers", octets, [&]() {
+            utf8string string;
+            string.append(wide.begin(), wide.end());
+            return string.size();
+        });
+    }
+}
+
+void bench_utf16() {
+    std::cout << "utf-8 <-> utf-16 on 64KiB\n";
+    for (int kind = Corpus_Ascii; kind <= Corpus_Mixed; ++kind) {
+        corpus text = make_corpus(static_cast<Corpus>(kind), 64 * 1024);
+        const u8char_t *start = text.data();
+        const u8char_t *end = start + text.size();
+        std::vector<char16_t> wide(utf16_length_of(start, end));
+        std::vector<u8char_t> narrow(text.size());
+        std::cout << corpus_names[kind] << '\n';
+
+        tests::run_benchmark("  to utf-16, next() loop", text.size(), [&]() {
+            u8char_t *itr = text.data();
+            char16_t *result = wide.data();
+            while (itr != text.data() + text.size()) {
+                const u32char_t c = internal::next(itr, text.data() + text.size());
+                if (c < 0x10000) {
+                    *(result++) = static_cast<char16_t>(c);
+                } else {
+                    *(result++) = static_cast<char16_t>(0xD800 + ((c - 0x10000) >> 10));
+                    *(result++) = static_cast<char16_t>(0xDC00 + ((c - 0x10000) & 0x3FF));
+                }
+            }
+            return static_cast<size_t>(result - wide.data());
+        });
+        tests::run_benchmark("  to utf-16, trusted", text.size(), [&]() {
+            return convert_utf8_to_utf16_trusted(start, end, wide.data());
+        });
+        tests::run_benchmark("  to utf-16 big endian, trusted", text.size(), [&]() {
+            return convert_utf8_to_utf16_trusted(start, end, wide.data(), UTF16ByteOrder_BigEndian);
+        });
+        tests::run_benchmark("  utf-16 length", text.size(), [&]() {
+            return utf16_length_of(start, end);
+        });
+
+        convert_utf8_to_utf16_trusted(start, end, wide.data());
+        tests::run_benchmark("  from utf-16, append() loop", text.size(), [&]() {
+            u8char_t *result = narrow.data();
+            for (size_t i = 0; i < wide.size(); ++i) {
+                u32char_t c = wide[i];
+                if (c >= 0xD800 && c < 0xDC00) {
+                    c = 0x10000 + ((c - 0xD800) << 10) + (wide[++i] - 0xDC00);
+                }
+                result = internal::append(c, result);
+            }
+            return static_cast<size_t>(result - narrow.data());
+        });
+        tests::run_benchmark("  from utf-16, checked", text.size(), [&]() {
+            return convert_utf16_to_utf8(wide.data(), wide.data() + wide.size(), narrow.data()).written;
+        });
+        tests::run_benchmark("  utf-8 length", text.size(), [&]() {
+            return utf8_length_of(wide.data(), wide.data() + wide.size());
+        });
+    }
+}
+
+void bench_find() {
+    std::cout << "find a missing 12 code point needle in 64KiB\n";
+    for (int kind = Corpus_Ascii; kind <= Corpus_Mixed; ++kind) {
+        corpus text = make_corpus(static_cast<Corpus>(kind), 64 * 1024);
+        // the first and last code points of the needle appear in the text, the needle as a whole doesn't
+        corpus needle = make_corpus(static_cast<Corpus>(kind), 64);
+        u8char_t *needleEnd = needle.data();
+        for (int i = 0; i < 11; ++i) {
+            internal::next(needleEnd, needle.data() + needle.size());
+        }
+        const size_t needleLength = static_cast<size_t>(needleEnd - needle.data()) + 1;
+        u8char_t *second = needle.data();
+        internal::next(second, needleEnd);
+        needle.insert(needle.begin() + (second - needle.data()), 0x7F);
+        std::cout << corpus_names[kind] << '\n';
+
+        tests::run_benchmark("  std::search", text.size(), [&]() {
+            return static_cast<size_t>(std::search(text.begin(), text.end(), needle.begin(), needle.begin() + needleLength) - text.begin());
+        });
+        tests::run_benchmark("  two-way only", text.size(), [&]() {
+            return static_cast<size_t>(internal::two_way_search<false>(text.data(), static_cast<ptrdiff_t>(text.size()), needle.data(), static_cast<ptrdiff_t>(needleLength)));
+        });
+        tests::run_benchmark("  find_substring", text.size(), [&]() {
+            return reinterpret_cast<size_t>(internal::find_substring(text.data(), text.data() + text.size(), needle.data(), needleLength));
+        });
+    }
+
+    std::cout << "worst case, a^63 b in a^65536\n";
+    corpus repeated(64 * 1024, 'a');
+    corpus needle(64, 'a');
+    needle.back() = 'b';
+    tests::run_benchmark("  std::search", repeated.size(), [&]() {
+        return static_cast<size_t>(std::search(repeated.begin(), repeated.end(), needle.begin(), needle.end()) - repeated.begin());
+    });
+    tests::run_benchmark("  find_substring", repeated.size(), [&]() {
+        return reinterpret_cast<size_t>(internal::find_substring(repeated.data(), repeated.data() + repeated.size(), needle.data(), needle.size()));
+    });
+}
+
+void bench_matcher() {
+    std::cout << "10k patterns against 16KiB\n";
+    for (int kind = Corpus_Ascii; kind <= Corpus_Mixed; ++kind) {
+        corpus text = make_corpus(static_cast<Corpus>(kind), 16 * 1024);
+        utf8string message(reinterpret_cast<const char *>(text.data()), text.size());
+
+        // the words of a bigger corpus of the same kind, 3 code points or longer, so plenty of them occur
+        corpus words = make_corpus(static_cast<Corpus>(kind), 1024 * 1024);
+        std::vector<utf8string> patterns;
+        u8char_t *itr = words.data();
+        u8char_t *end = words.data() + words.size();
+        while (itr != end && patterns.size() < 10000) {
+            u8char_t *word = itr;
+            while (itr != end && *itr != ' ') ++itr;
+            utf8string pattern(reinterpret_cast<const char *>(word), static_cast<size_t>(itr - word));
+            if (pattern.count() >= 3) patterns.push_back(pattern);
+            if (itr != end) ++itr;
+        }
+
+        utf8string_matcher matcher(patterns.data(), patterns.size());
+        std::cout << corpus_names[kind] << ", " << matcher.state_count() << " states\n";
+
+        tests::run_benchmark("  find() per pattern", text.size(), [&]() {
+            size_t found = 0;
+            for (const utf8string &pattern : patterns) {
+                found += message.contains(pattern);
+            }
+            return found;
+        });
+        tests::run_benchmark("  matcher, overlapping", text.size(), [&]() {
+            return matcher.find_all(message, [](const utf8string_match &) {});
+        });
+        tests::run_benchmark("  matcher, leftmost longest", text.size(), [&]() {
+            return matcher.find_leftmost_longest(message, [](const utf8string_match &) {});
+        });
+    }
+}
+
+void bench_allocator() {
+    using arena_utf8string = basic_utf8string<32, utf8string_lazy_count, arena_allocator<u8char_t>>;
+    constexpr size_t strings = 1000000;
+
+    // short strings of 24 to 64 octets, most of them too long for the sso buffer
+    corpus text = make_corpus(Corpus_Mixed, 1024 * 1024);
+    std::vector<utf8string_view> pieces;
+    std::mt19937 random(42);
+    for (size_t i = 0; i < 4096; ++i) {
+        size_t first = random() % (text.size() - 64);
+        size_t last = first + 24 + random() % 40;
+        while (first < last && (text[first] & 0xC0) == 0x80) ++first;
+        while (last > first && (text[last] & 0xC0) == 0x80) --last;
+        pieces.push_back(utf8string_view(text.data() + first, last - first));
+    }
+
+    std::cout << "1M short strings, built and destroyed\n";
+    std::vector<utf8string> mallocStrings;
+    mallocStrings.reserve(strings);
+    tests::run_benchmark("  malloc", 0, [&]() {
+        for (size_t i = 0; i < strings; ++i) {
+            mallocStrings.emplace_back(pieces[i % pieces.size()]);
+        }
+        size_t checksum = mallocStrings.back().size();
+        mallocStrings.clear();
+        return checksum;
+    });
+
+    bench_arena arena(128 * 1024 * 1024);
+    std::vector<arena_utf8string> arenaStrings;
+    arenaStrings.reserve(strings);
+    tests::run_benchmark("  request arena", 0, [&]() {
+        arena_allocator<u8char_t> allocator(&arena);
+        for (size_t i = 0; i < strings; ++i) {
+            arenaStrings.emplace_back(pieces[i % pieces.size()], allocator);
+        }
+        size_t checksum = arenaStrings.back().size();
+        arenaStrings.clear();
+        arena.reset();
+        return checksum;
+    });
+}
+
+template<typename STRING>
+void bench_layout(const char *name, const std::vector<utf8string_view> &pieces) {
+    constexpr size_t strings = 1000000;
+    std::vector<STRING> column;
+    column.reserve(strings);
+    tests::run_benchmark((std::string("  build, ") + name).c_str(), 0, [&]() {
+        column.clear();
+        for (size_t i = 0; i < strings; ++i) {
+            column.emplace_back(pieces[i % pieces.size()]);
+        }
+        return column.size();
+    });
+
+    size_t heap = 0;
+    for (const STRING &string : column) {
+        if (string.capacity() + 1 > STRING::sso_capacity) heap += string.capacity() + 1;
+    }
+    std::cout << "  " << name << ": " << sizeof(STRING) << " octets a string, " << (sizeof(STRING) * strings + heap) / (1024 * 1024) << " MiB in total\n";
+
+    tests::run_benchmark((std::string("  scan, ") + name).c_str(), 0, [&]() {
+        size_t checksum = 0;
+        for (const STRING &string : column) {
+            checksum += string.count() + string.get_raw()[0];
+        }
+        return checksum;
+    });
+}
+
+void bench_layouts() {
+    // a column of short names and ids, 4 to 40 octets, most of them fit in the sso buffer of both layouts
+    corpus text = make_corpus(Corpus_Mixed, 1024 * 1024);
+    std::vector<utf8string_view> pieces;
+    std::mt19937 random(7);
+    for (size_t i = 0; i < 4096; ++i) {
+        size_t first = random() % (text.size() - 64);
+        size_t last = first + 4 + ((random() % 8 == 0) ? random() % 36 : random() % 16);
+        while (first < last && (text[first] & 0xC0) == 0x80) ++first;
+        while (last > first && (text[last] & 0xC0) == 0x80) --last;
+        pieces.push_back(utf8string_view(text.data() + first, last - first));
+    }
+
+    std::cout << "1M short strings in a vector\n";
+    bench_layout<utf8string>("wide", pieces);
+    bench_layout<compact_utf8string>("compact", pieces);
+}
+
+namespace {
+    // moving it might throw as far as std::vector knows, so growing copies every string
+    struct copied_utf8string {
+        utf8string string;
+
+        explicit copied_utf8string(const char *other) : string(other) {}
+        copied_utf8string(const copied_utf8string &other) = default;
+        copied_utf8string(copied_utf8string &&other) noexcept(false) : string(std::move(other.string)) {}
+    };
+
+    // grows with relocate(), a single memcpy for strings
+    template<typename T>
+    struct relocating_array {
+        T *items = nullptr;
+        size_t size = 0;
+        size_t capacity = 0;
+
+        ~relocating_array() {
+            for (size_t i = 0; i < size; ++i) items[i].~T();
+            free(items);
+        }
+
+        template<typename ARGUMENT>
+        void push(ARGUMENT argument) {
+            if (size == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                T *grown = static_cast<T *>(malloc(capacity * sizeof(T)));
+                relocate(items, items + size, grown);
+                free(items);
+                items = grown;
+            }
+
+            new (&items[size++]) T(argument);
+        }
+    };
+};
+
+void bench_vector_growth() {
+    constexpr size_t strings = 10000000;
+    const char *names[] = { "short", "a string too long for the sso buffer" };
+
+    std::cout << "growing a vector to 10M strings, without reserving\n";
+    tests::run_benchmark("  std::vector, copying", 0, [&]() {
+        std::vector<copied_utf8string> column;
+        for (size_t i = 0; i < strings; ++i) column.emplace_back(names[i % 2]);
+        return column.size();
+    });
+    tests::run_benchmark("  std::vector, noexcept move", 0, [&]() {
+        std::vector<utf8string> column;
+        for (size_t i = 0; i < strings; ++i) column.emplace_back(names[i % 2]);
+        return column.size();
+    });
+    tests::run_benchmark("  relocate()", 0, [&]() {
+        relocating_array<utf8string> column;
+        for (size_t i = 0; i < strings; ++i) column.push(names[i % 2]);
+        return column.size;
+    });
+}
+
+void bench_concat() {
+    utf8string timestamp("2020-11-03T17:42:08.512Z");
+    utf8string module("network.session");
+    utf8string user("مستخدم-4821");
+    utf8string message("connection closed by the remote peer after the handshake");
+    utf8string_view level("WARN");
+
+    std::cout << "a log line of 10 fragments\n";
+    tests::run_benchmark("  += one at a time", 0, [&]() {
+        utf8string line(timestamp);
+        line += ' ';
+        line += '[';
+        line += level;
+        line += "] ";
+        line += module;
+        line += ": ";
+        line += message;
+        line += " user=";
+        line += user;
+        return line.size();
+    });
+    tests::run_benchmark("  a + b + c", 0, [&]() {
+        utf8string line = timestamp + ' ' + '[' + level + "] " + module + ": " + message + " user=" + user;
+        return line.size();
+    });
+}
+
+template<typename STRING>
+size_t build_response(STRING &response, const std::vector<utf8string_view> &chunks, size_t size) {
+    for (size_t i = 0; response.size() < size; ++i) {
+        response += chunks[i % chunks.size()];
+    }
+
+    return response.capacity();
+}
+
+void bench_growth() {
+    using paged_utf8string = basic_utf8string<32, utf8string_lazy_count, utf8string_allocator<u8char_t>, utf8string_wide_layout, utf8string_paged_growth<>>;
+    constexpr size_t size = 4 * 1024 * 1024;
+
+    corpus text = make_corpus(Corpus_Mixed, 64 * 1024);
+    std::vector<utf8string_view> chunks;
+    for (size_t first = 0; first + 128 < text.size(); first += 128) {
+        size_t last = first + 128;
+        while (last > first && (text[last] & 0xC0) == 0x80) --last;
+        size_t start = first;
+        while (start < last && (text[start] & 0xC0) == 0x80) ++start;
+        chunks.push_back(utf8string_view(text.data() + start, last - start));
+    }
+
+    size_t capacity = 0;
+    std::cout << "a 4MiB response out of 128 octet chunks\n";
+    tests::run_benchmark("  geometric growth", size, [&]() {
+        utf8string response;
+        return capacity = build_response(response, chunks, size);
+    });
+    std::cout << "    capacity " << capacity << '\n';
+    tests::run_benchmark("  paged growth", size, [&]() {
+        paged_utf8string response;
+        return capacity = build_response(response, chunks, size);
+    });
+    std::cout << "    capacity " << capacity << '\n';
+    tests::run_benchmark("  reserve()", size, [&]() {
+        utf8string response;
+        response.reserve(size + 128);
+        return capacity = build_response(response, chunks, size);
+    });
+    std::cout << "    capacity " << capacity << '\n';
+    tests::run_benchmark("  resize_for_overwrite()", size, [&]() {
+        utf8string response;
+        u8char_t *data = response.resize_for_overwrite(size + 128);
+        size_t written = 0;
+        for (size_t i = 0; written < size; ++i) {
+            const utf8string_view &chunk = chunks[i % chunks.size()];
+            memcpy(data + written, chunk.get_raw(), chunk.size());
+            written += chunk.size();
+        }
+        response.commit_overwrite(written);
+        return capacity = response.capacity();
+    });
+    std::cout << "    capacity " << capacity << '\n';
+}
+
+void bench_replace() {
+    utf8string page;
+    for (int i = 0; i < 2000; ++i) {
+        page += "<tr><td>{name}</td><td>{city}</td><td>مرحباً {name}</td></tr>\n";
+    }
+
+    std::cout << "substituting placeholders in a 150KiB template\n";
+    tests::run_benchmark("  rebuilt with find() and +=", page.size(), [&]() {
+        utf8string result;
+        utf8string_view rest = page;
+        for (utf8string_iterator found = rest.find("{name}"); found != rest.end(); found = rest.find("{name}")) {
+            result += rest.slice(0, static_cast<size_t>(found.begin() - rest.get_raw()));
+            result += "عبد الرحمن الداخل";
+            rest = rest.slice(static_cast<size_t>(found.end() - rest.get_raw()));
+        }
+        result += rest;
+        return result.size();
+    });
+    tests::run_benchmark("  replace_all() with a longer value", page.size(), [&]() {
+        utf8string result(page);
+        result.replace_all("{name}", "عبد الرحمن الداخل");
+        return result.size();
+    });
+    tests::run_benchmark("  replace_all() with a shorter value", page.size(), [&]() {
+        utf8string result(page);
+        result.replace_all("{city}", "دمشق");
+        return result.size();
+    });
+}
+
+void bench_split() {
+    corpus text = make_corpus(Corpus_Mixed, 1024 * 1024);
+    utf8string csv;
+    for (size_t first = 0; first + 24 < text.size(); first += 24) {
+        size_t last = first + 24;
+        while (last > first && (text[last] & 0xC0) == 0x80) --last;
+        size_t start = first;
+        while (start < last && (text[start] & 0xC0) == 0x80) ++start;
+        csv.append(utf8string_view(text.data() + start, last - start));
+        csv += ',';
+    }
+
+    std::cout << "splitting 1MiB of comma separated fields\n";
+    tests::run_benchmark("  memchr() and copies", csv.size(), [&]() {
+        size_t total = 0;
+        const u8char_t *start = csv.get_raw();
+        const u8char_t *end = start + csv.size();
+        for (;;) {
+            const u8char_t *comma = static_cast<const u8char_t *>(memchr(start, ',', end - start));
+            utf8string field(utf8string_view(start, (comma ? comma : end) - start));
+            total += field.size();
+            if (!comma) break;
+            start = comma + 1;
+        }
+        return total;
+    });
+    tests::run_benchmark("  split() views", csv.size(), [&]() {
+        size_t total = 0;
+        for (utf8string_view field : csv.split(',')) {
+            total += field.size();
+        }
+        return total;
+    });
+
+    std::vector<utf8string_view> fields(csv.split(',').begin(), csv.split(',').end());
+    std::cout << "joining them back with \"; \"\n";
+    tests::run_benchmark("  += in a loop", csv.size(), [&]() {
+        utf8string joined;
+        for (size_t i = 0; i < fields.size(); ++i) {
+            if (i) joined += "; ";
+            joined += fields[i];
+        }
+        return joined.size();
+    });
+    tests::run_benchmark("  join()", csv.size(), [&]() {
+        return join(fields, "; ").size();
+    });
+}
+
+void bench_rope() {
+    corpus text = make_corpus(Corpus_Mixed, 4 * 1024 * 1024);
+    utf8string document;
+    for (size_t first = 0; first + 80 < text.size(); first += 80) {
+        size_t last = first + 80;
+        while (last > first && (text[last] & 0xC0) == 0x80) --last;
+        size_t start = first;
+        while (start < last && (text[start] & 0xC0) == 0x80) ++start;
+        document.append(utf8string_view(text.data() + start, last - start));
+        document += '\n';
+    }
+
+    // typing at random places, on code point boundaries
+    std::vector<size_t> offsets;
+    std::mt19937 random(7);
+    for (int i = 0; i < 1000; ++i) {
+        offsets.push_back(document.substr(0, random() % document.count()).size());
+    }
+
+    std::cout << "1000 inserts into a 4MiB document\n";
+    tests::run_benchmark("  utf8string::insert()", 0, [&]() {
+        utf8string edited(document);
+        for (size_t offset : offsets) {
+            edited.insert(offset, "x");
+        }
+        return edited.size();
+    });
+    utf8rope rope(document);
+    tests::run_benchmark("  utf8rope::insert()", 0, [&]() {
+        for (size_t offset : offsets) {
+            rope.insert(offset, "x");
+        }
+        for (size_t offset : offsets) {
+            rope.erase(offset, 1);
+        }
+        return rope.size();
+    });
+    std::cout << "    (and erasing them again)\n";
+    std::cout << "looking up lines\n";
+    tests::run_benchmark("  utf8rope::line_offset() of every 100th line", 0, [&]() {
+        size_t total = 0;
+        for (size_t line = 0; line < rope.line_count(); line += 100) {
+            total += rope.line_offset(line);
+        }
+        return total;
+    });
+    tests::run_benchmark("  utf8rope to and from utf8string", document.size(), [&]() {
+        utf8rope copy(document);
+        return copy.to_string().size();
+    });
+}
+
+void bench_pool() {
+    // a million tags out of 2000 distinct ones, all too long for the sso buffer
+    const char *services[] = { "checkout", "payments", "search", "المدفوعات", "inventory" };
+    const char *regions[] = { "eu-west-1", "us-east-2", "me-central-1", "ap-south-1" };
+    std::vector<utf8string> distinct;
+    for (int i = 0; i < 2000; ++i) {
+        distinct.push_back(utf8string(utf8string("service.") + services[i % 5] + ".region." + regions[i % 4] + ".metric." + utf8string(std::to_string(i).c_str())));
+    }
+
+    std::vector<size_t> picks;
+    std::mt19937 random(11);
+    for (int i = 0; i < 1000000; ++i) {
+        picks.push_back(random() % distinct.size());
+    }
+
+    std::vector<utf8string> strings;
+    strings.reserve(picks.size());
+    size_t stringMemory = sizeof(utf8string) * picks.size();
+    for (size_t pick : picks) {
+        strings.push_back(distinct[pick]);
+        stringMemory += strings.back().capacity() + 1;
+    }
+
+    utf8string_pool pool;
+    std::vector<utf8string_handle> handles;
+    handles.reserve(picks.size());
+    for (size_t pick : picks) {
+        handles.push_back(pool.intern(distinct[pick]));
+    }
+
+    std::cout << "a million tags out of 2000 distinct ones\n";
+    std::cout << "  utf8string each: " << stringMemory / 1024 << " KiB\n";
+    std::cout << "  interned: " << (sizeof(utf8string_handle) * handles.size() + pool.memory_usage()) / 1024 << " KiB\n";
+
+    // the tags to look up, a short cycle of them so the benchmark doesn't measure cache misses on picks
+    size_t next = 0;
+    const size_t lookups = 4096;
+    tests::run_benchmark("  intern() of a known tag", 0, [&]() {
+        return static_cast<size_t>(pool.intern(distinct[picks[next++ % lookups]]).id);
+    });
+    tests::run_benchmark("  find() of a known tag", 0, [&]() {
+        return static_cast<size_t>(pool.find(distinct[picks[next++ % lookups]]).id);
+    });
+    utf8string_shared_pool<> shared;
+    for (const utf8string &tag : distinct) {
+        shared.intern(tag);
+    }
+    tests::run_benchmark("  intern() of a known tag, shared pool", 0, [&]() {
+        return static_cast<size_t>(shared.intern(distinct[picks[next++ % lookups]]).id);
+    });
+    tests::run_benchmark("  1000 comparisons of utf8strings", 0, [&]() {
+        size_t equal = 0;
+        const size_t first = random() % (strings.size() - 1000);
+        for (size_t i = first; i < first + 1000; ++i) {
+            equal += (strings[i] == strings[first]);
+        }
+        return equal;
+    });
+    tests::run_benchmark("  1000 comparisons of handles", 0, [&]() {
+        size_t equal = 0;
+        const size_t first = random() % (handles.size() - 1000);
+        for (size_t i = first; i < first + 1000; ++i) {
+            equal += (handles[i] == handles[first]);
+        }
+        return equal;
+    });
+}
+
+void bench_hash() {
+    corpus text = make_corpus(Corpus_Mixed, 64 * 1024);
+    const size_t lengths[] = { 16, 64, 1024, 64 * 1024 - 4 };
+    for (size_t length : lengths) {
+        std::cout << "hash " << length << " octets\n";
+        std::string copy(reinterpret_cast<const char *>(text.data()), length);
+        tests::run_benchmark("  std::hash<std::string>", length, [&]() {
+            return std::hash<std::string>()(copy);
+        });
+        tests::run_benchmark("  utf8string_view::hash", length, [&]() {
+            return utf8string_view(text.data(), length).hash();
+        });
+    }
+
+    const size_t stripes = (text.size() - 1) / internal::HASH_STRIPE;
+    uint64_t accumulators[8] = {};
+    std::cout << "hash stripes of 64KiB\n";
+    tests::run_benchmark("  scalar", stripes * internal::HASH_STRIPE, [&]() {
+        internal::hash_stripes_scalar(text.data(), stripes, accumulators);
+        return static_cast<size_t>(accumulators[0]);
+    });
+    tests::run_benchmark("  dispatched", stripes * internal::HASH_STRIPE, [&]() {
+        internal::hash_stripes(text.data(), stripes, accumulators);
+        return static_cast<size_t>(accumulators[0]);
+    });
+
+    // the keys are hashed again every time the map rehashes, only the cached ones skip it
+    using cached_string = basic_utf8string<32, utf8string_lazy_count, utf8string_allocator<u8char_t>, utf8string_wide_layout, utf8string_geometric_growth<>, utf8string_cached_hash>;
+    std::vector<utf8string> keys;
+    std::vector<cached_string> cachedKeys;
+    for (int i = 0; i < 10000; ++i) {
+        keys.push_back(utf8string(utf8string("/api/v2/المستخدمين/") + utf8string(std::to_string(i).c_str()) + "/settings/notifications"));
+        cachedKeys.push_back(cached_string(utf8string_view(keys.back())));
+    }
+    std::cout << "hash 10000 keys of about 60 octets, twice\n";
+    tests::run_benchmark("  utf8string", 0, [&]() {
+        size_t result = 0;
+        for (int pass = 0; pass < 2; ++pass) {
+            for (const utf8string &key : keys) {
+                result += key.hash();
+            }
+        }
+        return result;
+    });
+    tests::run_benchmark("  cached hash", 0, [&]() {
+        size_t result = 0;
+        for (int pass = 0; pass < 2; ++pass) {
+            for (const cached_string &key : cachedKeys) {
+                result += key.hash();
+            }
+        }
+        return result;
+    });
+}
+
+void bench_map() {
+    // routes of a web service, short ones fit the sso buffer and long ones don't
+    const char *resources[] = { "users", "orders", "المنتجات", "invoices", "search" };
+    std::vector<utf8string> routes;
+    for (int i = 0; i < 10000; ++i) {
+        utf8string route = utf8string(utf8string("/api/") + resources[i % 5] + "/" + utf8string(std::to_string(i).c_str()));
+        if (i % 3 == 0) {
+            route += "/settings/notifications";
+        }
+        routes.push_back(route);
+    }
+
+    std::vector<size_t> picks;
+    std::mt19937 random(5);
+    for (int i = 0; i < 4096; ++i) {
+        picks.push_back(random() % routes.size());
+    }
+
+    std::unordered_map<std::string, size_t> standard;
+    utf8string_map<size_t> flat;
+    std::vector<std::string> standardRoutes;
+    for (size_t i = 0; i < routes.size(); ++i) {
+        standardRoutes.push_back(std::string(reinterpret_cast<const char *>(routes[i].get_raw()), routes[i].size()));
+        standard.emplace(standardRoutes.back(), i);
+        flat.emplace(routes[i], i);
+    }
+
+    std::cout << "10000 routes\n";
+    tests::run_benchmark("  build std::unordered_map<std::string>", 0, [&]() {
+        std::unordered_map<std::string, size_t> map;
+        for (size_t i = 0; i < standardRoutes.size(); ++i) {
+            map.emplace(standardRoutes[i], i);
+        }
+        return map.size();
+    });
+    tests::run_benchmark("  build utf8string_map", 0, [&]() {
+        utf8string_map<size_t> map;
+        for (size_t i = 0; i < routes.size(); ++i) {
+            map.emplace(routes[i], i);
+        }
+        return map.size();
+    });
+
+    size_t next = 0;
+    tests::run_benchmark("  std::unordered_map lookup of a const char *", 0, [&]() {
+        return standard.find(reinterpret_cast<const char *>(routes[picks[next++ % picks.size()]].get_raw()))->second;
+    });
+    tests::run_benchmark("  std::unordered_map lookup of a std::string", 0, [&]() {
+        return standard.find(standardRoutes[picks[next++ % picks.size()]])->second;
+    });
+    tests::run_benchmark("  utf8string_map lookup of a const char *", 0, [&]() {
+        return *flat.find(reinterpret_cast<const char *>(routes[picks[next++ % picks.size()]].get_raw()));
+    });
+    tests::run_benchmark("  utf8string_map lookup of a utf8string", 0, [&]() {
+        return *flat.find(routes[picks[next++ % picks.size()]]);
+    });
+    tests::run_benchmark("  utf8string_map lookup of a missing key", 0, [&]() {
+        return static_cast<size_t>(flat.contains("/api/users/missing"));
+    });
+}
+
+void bench_stream_decoder() {
+    corpus text = make_corpus(Corpus_Mixed, 1024 * 1024);
+    std::cout << "validate 1MiB of mixed text\n";
+    tests::run_benchmark("  whole buffer", text.size(), [&]() {
+        return static_cast<size_t>(internal::find_invalid(text.data(), text.data() + text.size()) - text.data());
+    });
+
+    // packet and page sized chunks, which cut sequences all the time
+    const size_t chunkSizes[] = { 64, 1500, 4096, 64 * 1024 };
+    for (size_t chunkSize : chunkSizes) {
+        std::cout << "  chunks of " << chunkSize << " octets\n";
+        tests::run_benchmark("    utf8string_decoder", text.size(), [&]() {
+            utf8string_decoder decoder;
+            size_t valid = 0;
+            auto sink = [&valid](utf8string_view octets) { valid += octets.size(); };
+            for (size_t i = 0; i < text.size(); i += chunkSize) {
+                decoder.feed(text.data() + i, std::min(chunkSize, text.size() - i), sink);
+            }
+            decoder.finish(sink);
+            return valid;
+        });
+    }
+}
+
+void bench_mapped_file() {
+    const char *path = "bench_mapped_file.txt";
+    corpus text = make_corpus(Corpus_Mixed, 64 * 1024 * 1024);
+    for (size_t i = 0; i < text.size(); i += 80) {
+        if (text[i] == ' ') {
+            text[i] = '\n';
+        }
+    }
+    FILE *file = fopen(path, "wb");
+    if (!file || fwrite(text.data(), 1, text.size(), file) != text.size()) {
+        std::cout << "failed to write " << path << '\n';
+        return;
+    }
+    fclose(file);
+
+    std::cout << "load and validate a 64MiB file, " << std::thread::hardware_concurrency() << " hardware threads\n";
+    tests::run_benchmark("  read into a utf8string", text.size(), [&]() {
+        FILE *input = fopen(path, "rb");
+        utf8string loaded;
+        u8char_t *data = loaded.resize_for_overwrite(text.size());
+        const size_t read = fread(data, 1, text.size(), input);
+        loaded.commit_overwrite(read);
+        fclose(input);
+        const u8char_t *end = loaded.get_raw() + loaded.size();
+        const u8char_t *valid = internal::find_invalid(data, data + read);
+        return static_cast<size_t>(valid - data) + internal::count_code_points(data, end) + internal::count_newlines(data, end);
+    });
+    tests::run_benchmark("  mapped, one thread", text.size(), [&]() {
+        utf8string_mapped_file mapped(path);
+        return mapped.validate(1).count;
+    });
+    tests::run_benchmark("  mapped, every thread", text.size(), [&]() {
+        utf8string_mapped_file mapped(path);
+        return mapped.validate().count;
+    });
+    remove(path);
+}
+
+int main() {
+    bench_decoder();
+    bench_count();
+    bench_cached_count();
+    bench_at();
+    bench_ascii();
+    bench_utf32();
+    bench_append_code_points();
+    bench_utf16();
+    bench_find();
+    bench_matcher();
+    bench_allocator();
+    bench_layouts();
+    bench_vector_growth();
+    bench_concat();
+    bench_growth();
+    bench_split();
+    bench_replace();
+    bench_rope();
+    bench_pool();
+    bench_hash();
+    bench_map();
+    bench_stream_decoder();
+    bench_mapped_file();
+}
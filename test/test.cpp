@@ -24,8 +24,15 @@
     DEALINGS IN THE SOFTWARE.
 */
 
+#define RYUK_UTF8_SHARED_POOL
+#define RYUK_UTF8_MAPPED_FILE
 #include "../src/utf8string.h"
 #include "test_commons.h"
+#include <string>
+#include <vector>
+#include <thread>
+#include <unordered_map>
+#include <algorithm>
 
 using namespace ryuk;
 
@@ -478,6 +485,1754 @@ const char *utf8_string_find() {
     return nullptr;
 }
 
+const char *utf8_string_find_backtracks() {
+    utf8string string("aaab");
+    basic_utf8string_iterator found = string.find("aab");
+    test_assert(found != string.end(), "failed to find a substring after a partial match");
+    test_assert(found.begin() == string.begin().begin() + 1, "invalid position after a partial match");
+
+    utf8string arabic("مرحبا مرح مرحبا");
+    found = arabic.find("مرحب");
+    test_assert(found == arabic.begin(), "failed to find a multi octet substring");
+    test_assert(*found == U'\x645', "invalid character at a multi octet match");
+    found = arabic.find("مرحب", 1);
+    test_assert(found.begin() == arabic.begin().begin() + 18, "invalid position when searching from an offset");
+    found = arabic.rfind("مرح");
+    test_assert(found.begin() == arabic.begin().begin() + 18, "invalid position of the last match");
+    test_assert(arabic.find("م", arabic.size() + 1) == arabic.end(), "searching past the end should not find anything");
+
+    test_assert(string.starts_with("aa") && !string.starts_with("ab") && string.starts_with(""), "invalid starts_with");
+    test_assert(string.ends_with("ab") && !string.ends_with("aab!") && string.ends_with(utf8string("aaab")), "invalid ends_with");
+    test_assert(string.contains("aab") && !string.contains("ba") && !string.contains(""), "invalid contains");
+    test_assert(arabic.count_occurrences("مرح") == 3, "invalid number of occurrences");
+    test_assert(utf8string("aaaaa").count_occurrences("aa") == 2, "occurrences should not overlap");
+
+    return nullptr;
+}
+
+namespace {
+    // octets from a tiny alphabet, so that partial matches are everywhere
+    void fill_search_text(u8char_t *buffer, size_t length, uint32_t seed, int alphabet) {
+        for (size_t i = 0; i < length; ++i) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            buffer[i] = static_cast<u8char_t>('a' + seed % alphabet);
+        }
+    }
+
+    const u8char_t *find_reference(const u8char_t *start, const u8char_t *end, const u8char_t *needle, size_t length) {
+        for (const u8char_t *itr = start; end - itr >= static_cast<ptrdiff_t>(length); ++itr) {
+            if (memcmp(itr, needle, length) == 0) {
+                return itr;
+            }
+        }
+
+        return nullptr;
+    }
+}
+
+const char *utf8_search_matches_reference() {
+    u8char_t haystack[700];
+    u8char_t needle[80];
+    for (uint32_t seed = 1; seed < 1500; ++seed) {
+        const size_t length = 1 + seed % 700;
+        const size_t needleLength = 1 + (seed * 7) % 80;
+        const int alphabet = 1 + seed % 3;
+        fill_search_text(haystack, length, seed, alphabet);
+        if (seed % 2 == 0 && needleLength <= length) {
+            memcpy(needle, haystack + (seed * 13) % (length - needleLength + 1), needleLength);
+        } else {
+            fill_search_text(needle, needleLength, seed * 31, alphabet);
+        }
+
+        const u8char_t *expected = find_reference(haystack, haystack + length, needle, needleLength);
+        test_assert(internal::find_substring(haystack, haystack + length, needle, needleLength) == expected, "search disagrees with the reference");
+
+        const u8char_t *last = nullptr;
+        for (const u8char_t *itr = expected; itr; itr = find_reference(itr + 1, haystack + length, needle, needleLength)) {
+            last = itr;
+        }
+        test_assert(internal::rfind_substring(haystack, haystack + length, needle, needleLength) == last, "reverse search disagrees with the reference");
+    }
+
+    // the worst case of the first and last octet filter, which has to hand over to Two-Way
+    static u8char_t repeated[100000];
+    memset(repeated, 'a', sizeof(repeated));
+    memset(needle, 'a', sizeof(needle));
+    needle[sizeof(needle) - 2] = 'b';
+    test_assert(internal::find_substring(repeated, repeated + sizeof(repeated), needle, sizeof(needle)) == nullptr, "found a needle that isn't there");
+    repeated[sizeof(repeated) - 2] = 'b';
+    test_assert(internal::find_substring(repeated, repeated + sizeof(repeated), needle, sizeof(needle)) == repeated + sizeof(repeated) - sizeof(needle), "failed to find the needle at the end");
+
+    return nullptr;
+}
+
+namespace {
+    // walks the buffer one code point at a time, this is what find_invalid has to agree with
+    u8char_t *find_invalid_reference(u8char_t *start, u8char_t *end, internal::UTF8Error &error) {
+        u8char_t *result = start;
+        error = internal::UTF8Error_None;
+        while (result != end) {
+            error = internal::validate_next(result, end);
+            if (error != internal::UTF8Error_None) {
+                break;
+            }
+        }
+        return result;
+    }
+};
+
+const char *utf8_validate_long_valid() {
+    u8char_t buffer[1024];
+    u8char_t *end = buffer;
+    for (int i = 0; i < 3; ++i) {
+        memcpy(end, hello_world_long_u8, hello_world_long_u8_length);
+        end = internal::append(U'\x1F600', end + hello_world_long_u8_length);
+        memcpy(end, hello_world_long, hello_world_long_length);
+        end += hello_world_long_length;
+    }
+
+    test_assert(internal::is_valid(buffer, end), "valid string reported as invalid");
+    test_assert(internal::find_invalid(buffer, end) == end, "valid string has an invalid position");
+
+    return nullptr;
+}
+
+const char *utf8_validate_error_positions() {
+    // every kind of error at every position of a buffer long enough to go through the vectorized blocks
+    const u8char_t invalid[][4] = {
+        { 0x80 },                   // stray continuation
+        { 0xFF },                   // invalid lead
+        { 0xC0, 0x80 },             // overlong two byte sequence
+        { 0xE0, 0x80, 0x80 },       // overlong three byte sequence
+        { 0xF0, 0x80, 0x80, 0x80 }, // overlong four byte sequence
+        { 0xF4, 0x90, 0x80, 0x80 }, // beyond U+10FFFF
+        { 0xE2, 0x82, 'a' },        // incomplete sequence
+    };
+    const size_t invalidLength[] = { 1, 1, 2, 3, 4, 4, 3 };
+
+    for (size_t kind = 0; kind < sizeof(invalidLength) / sizeof(invalidLength[0]); ++kind) {
+        for (size_t position = 0; position < 160; ++position) {
+            u8char_t buffer[256];
+            u8char_t *end = buffer;
+            for (int i = 0; end - buffer < 200; ++i) {
+                end = internal::append((i % 3) ? U'\x645' : U'a', end);
+            }
+
+            memcpy(buffer + position, invalid[kind], invalidLength[kind]);
+
+            internal::UTF8Error expected, error;
+            u8char_t *reference = find_invalid_reference(buffer, end, expected);
+            u8char_t *found = internal::find_invalid(buffer, end, error);
+            test_assert(found == reference, "invalid position does not match the scalar validator");
+            test_assert(error == expected, "error kind does not match the scalar validator");
+        }
+    }
+
+    return nullptr;
+}
+
+const char *utf8_validate_truncated() {
+    u8char_t buffer[1024];
+    const size_t length = 5 * hello_world_long_u8_length;
+    for (int i = 0; i < 5; ++i) {
+        memcpy(buffer + i * hello_world_long_u8_length, hello_world_long_u8, hello_world_long_u8_length);
+    }
+
+    for (size_t truncated = 1; truncated < length; ++truncated) {
+        internal::UTF8Error expected, error;
+        u8char_t *reference = find_invalid_reference(buffer, buffer + truncated, expected);
+        u8char_t *found = internal::find_invalid(buffer, buffer + truncated, error);
+        test_assert(found == reference, "truncated position does not match the scalar validator");
+        test_assert(error == expected, "truncated error kind does not match the scalar validator");
+    }
+
+    return nullptr;
+}
+
+const char *utf8_decode_boundaries() {
+    const u32char_t codePoints[] = { 0x01, 0x7F, 0x80, 0x7FF, 0x800, 0xD800, 0xFFFF, 0x10000, 0x10FFFF };
+
+    for (u32char_t expected : codePoints) {
+        u8char_t buffer[4];
+        u8char_t *end = internal::append(expected, buffer);
+        u8char_t *itr = buffer;
+        u32char_t decoded = 0;
+        test_assert(internal::validate_next(itr, end, decoded) == internal::UTF8Error_None, "valid code point failed to decode");
+        test_assert(decoded == expected, "decoded code point does not match");
+        test_assert(itr == end, "decoder did not consume the whole sequence");
+    }
+
+    struct { const char *octets; internal::UTF8Error error; } invalid[] = {
+        { "\x80", internal::UTF8Error_InvalidLead },
+        { "\xF8\x80\x80\x80", internal::UTF8Error_InvalidLead },
+        { "\xC3", internal::UTF8Error_NotEnoughRoom },
+        { "\xE2\x82", internal::UTF8Error_NotEnoughRoom },
+        { "\xC3" "a", internal::UTF8Error_IncompleteSequence },
+        { "\xE0\x80" "a", internal::UTF8Error_IncompleteSequence },
+        { "\xC1\xBF", internal::UTF8Error_OverlongSequence },
+        { "\xE0\x9F\xBF", internal::UTF8Error_OverlongSequence },
+        { "\xF0\x8F\xBF\xBF", internal::UTF8Error_OverlongSequence },
+        { "\xF4\x90\x80\x80", internal::UTF8Error_InvalidCodePoint },
+        { "\xF5\x80\x80\x80", internal::UTF8Error_InvalidCodePoint },
+    };
+
+    for (auto &sequence : invalid) {
+        u8char_t *start = reinterpret_cast<u8char_t *>(const_cast<char *>(sequence.octets));
+        u8char_t *itr = start;
+        u32char_t decoded = 0;
+        test_assert(internal::validate_next(itr, start + strlen(sequence.octets), decoded) == sequence.error, "invalid sequence reported the wrong error");
+        test_assert(itr == start, "decoder moved past an invalid sequence");
+    }
+
+    return nullptr;
+}
+
+const char *utf8_string_iterate_reverse_u8_tail() {
+    utf8string string(hello_world_u8);
+    string.pop();
+
+    size_t count = string.count();
+    size_t itrCount = count;
+    for (auto itr = string.rbegin(); itr != string.rend(); ++itr) {
+        test_assert(*itr == string[itrCount - 1], "iteration character does not match actual character");
+        --itrCount;
+    }
+
+    test_assert(itrCount == 0, "iteration count does not match actual count");
+
+    return nullptr;
+}
+
+const char *utf8_count_code_points() {
+    // long enough for the vectorized per byte counters to be flushed more than once
+    static u8char_t buffer[40000];
+    u8char_t *end = buffer;
+    const u32char_t codePoints[] = { U'a', U'\x645', U'\x4E00', U'\x1F600', U' ' };
+    for (size_t i = 0; buffer + sizeof(buffer) - end >= 4; ++i) {
+        end = internal::append(codePoints[(i * 7 + i / 3) % 5], end);
+    }
+
+    for (size_t offset = 0; offset < 8; ++offset) {
+        for (u8char_t *last = end; last > buffer + offset; last = (last - buffer > 300) ? last - 997 : last - 1) {
+            u8char_t *first = buffer + offset;
+            while (internal::is_trail(*first)) { ++first; }
+            u8char_t *boundary = last;
+            while (boundary != buffer && internal::is_trail(*boundary)) { --boundary; }
+            if (boundary < first) {
+                continue;
+            }
+
+            test_assert(internal::count_code_points(first, boundary) == internal::distance(first, boundary), "code point count does not match the decoded count");
+        }
+    }
+
+    return nullptr;
+}
+
+const char *utf8_string_checked_count() {
+    utf8string string(hello_world_long_u8);
+    test_assert(string.checked_count() == hello_world_long_u8_count, "invalid checked count");
+    test_assert(string.count() == string.checked_count(), "count does not match checked count");
+
+    utf8string invalid("hello \xE2\x82 world");
+    test_assert(invalid.checked_count() == 0, "invalid string should have a checked count of 0");
+
+    return nullptr;
+}
+
+namespace {
+    template<typename STRING>
+    const char *check_count_maintained() {
+        STRING string;
+        test_assert(string.count() == 0, "empty string should have a count of 0");
+
+        // grows past the sso buffer one code point at a time
+        for (size_t i = 0; i < 100; ++i) {
+            string.push((i % 2) ? U'\x645' : U'a');
+        }
+        test_assert(string.count() == 100, "invalid count after push");
+        test_assert(string.size() == 150, "invalid size after push");
+        test_assert(string.checked_count() == 100, "pushed string is not valid");
+
+        test_assert(string.pop() == U'\x645', "invalid popped character");
+        test_assert(string.count() == 99, "invalid count after pop");
+        test_assert(string.size() == 148, "pop should remove the whole sequence");
+
+        string += hello_world_u8;
+        test_assert(string.count() == 99 + hello_world_u8_count, "invalid count after append");
+
+        STRING other(hello_world_long_u8);
+        string += other;
+        test_assert(string.count() == 99 + hello_world_u8_count + hello_world_long_u8_count, "invalid count after appending a string");
+
+        string += string;
+        test_assert(string.count() == 2 * (99 + hello_world_u8_count + hello_world_long_u8_count), "invalid count after appending itself");
+        test_assert(string.count() == string.checked_count(), "count does not match checked count");
+
+        string = hello_world_u8;
+        test_assert(string.count() == hello_world_u8_count, "invalid count after assignment");
+        test_assert(string == hello_world_u8, "invalid string after assignment");
+
+        string = other;
+        test_assert(string.count() == hello_world_long_u8_count, "invalid count after copy assignment");
+
+        STRING moved(std::move(string));
+        test_assert(moved.count() == hello_world_long_u8_count, "invalid count after move");
+        test_assert(moved == other, "invalid string after move");
+        test_assert(string.count() == 0 && string.size() == 0, "moved from string should be empty");
+
+        moved.clear();
+        test_assert(moved.count() == 0, "invalid count after clear");
+
+        return nullptr;
+    }
+};
+
+const char *utf8_string_count_maintained_lazy() {
+    const char *result = check_count_maintained<basic_utf8string<32, utf8string_lazy_count>>();
+    if (result) {
+        return result;
+    }
+
+    // appending a string with no known count only counts what it appends, the prefix isn't scanned again, so it
+    // costs the same as appending a view of it
+    using clock = std::chrono::steady_clock;
+    const utf8string appended(hello_world_u8);
+    test_assert(appended.view().known_count() == utf8string_view::unknown_count, "a non ascii string shouldn't know its count yet");
+    clock::duration elapsed[2];
+    for (int asView = 0; asView < 2; ++asView) {
+        utf8string string(std::string(1 << 20, 'a').c_str());
+        test_assert(string.view().known_count() == string.size(), "an ascii string should know its count");
+        const clock::time_point start = clock::now();
+        for (size_t i = 0; i < 2000; ++i) {
+            if (asView) {
+                string += appended.view();
+            } else {
+                string += appended;
+            }
+        }
+        elapsed[asView] = clock::now() - start;
+        test_assert(string.count() == (1 << 20) + 2000 * hello_world_u8_count, "invalid count after appending strings");
+    }
+    test_assert(elapsed[0] < 20 * elapsed[1] + std::chrono::milliseconds(20), "appending a string shouldn't count the whole string again");
+
+    return nullptr;
+}
+
+const char *utf8_string_count_maintained_eager() {
+    return check_count_maintained<basic_utf8string<32, utf8string_eager_count>>();
+}
+
+const char *utf8_string_count_maintained_compact() {
+    return check_count_maintained<compact_utf8string>();
+}
+
+const char *utf8_string_compact_layout() {
+    test_assert(sizeof(compact_utf8string) == 3 * sizeof(size_t), "a compact string should take three words");
+
+    compact_utf8string string;
+    test_assert(string.size() == 0 && string.get_raw()[0] == '\0', "invalid empty compact string");
+    test_assert(string.capacity() == compact_utf8string::sso_capacity - 1, "invalid sso capacity");
+
+    // fills the sso buffer exactly, then leaves it
+    while (string.size() < compact_utf8string::sso_capacity - 1) {
+        string.push('a');
+    }
+    test_assert(string.capacity() == compact_utf8string::sso_capacity - 1, "a full sso buffer should still be sso");
+    test_assert(string.is_ascii() && string.count() == string.size(), "invalid count of a full sso buffer");
+    string.push(U'\x645');
+    test_assert(string.capacity() > compact_utf8string::sso_capacity - 1, "the string should have left the sso buffer");
+    test_assert(string.count() == compact_utf8string::sso_capacity && !string.is_ascii(), "the count should survive leaving the sso buffer");
+    test_assert(string.pop() == U'\x645' && string.is_ascii(), "invalid pop from a heap string");
+
+    compact_utf8string text(hello_world_long_u8);
+    test_assert(text.at(hello_world_long_u8_count - 1) == U'.' && text.at(15) == U',', "invalid characters through the code point index");
+    test_assert(text.count() == hello_world_long_u8_count, "invalid count of a heap string");
+
+    compact_utf8string copy(text);
+    test_assert(copy == text && copy.get_raw() != text.get_raw(), "invalid copy of a heap string");
+    swap(copy, string);
+    test_assert(string == text && copy.is_ascii() && copy.size() == compact_utf8string::sso_capacity - 1, "invalid swap");
+
+    text = hello_world;
+    text.shrink_to_fit();
+    test_assert(text.capacity() == compact_utf8string::sso_capacity - 1 && text == hello_world, "shrink_to_fit should go back to the sso buffer");
+    test_assert(text.count() == hello_world_length && text.is_ascii(), "the count should survive going back to the sso buffer");
+    text += hello_world_u8;
+    test_assert(text.count() == hello_world_length + hello_world_u8_count, "invalid count after growing again");
+
+    return nullptr;
+}
+
+namespace {
+    template<typename STRING>
+    const char *check_relocate() {
+        static_assert(std::is_nothrow_move_constructible<STRING>::value, "strings should move without throwing");
+        static_assert(std::is_nothrow_move_assignable<STRING>::value, "strings should move assign without throwing");
+        static_assert(is_trivially_relocatable<STRING>::value, "strings should be trivially relocatable");
+
+        // sso and heap strings, the heap ones with a code point index
+        STRING strings[4] = { STRING(hello_world), STRING(hello_world_long_u8), STRING(), STRING(hello_world_long) };
+        test_assert(strings[1].at(hello_world_long_u8_count - 1) == U'.', "invalid character through the code point index");
+
+        alignas(STRING) u8char_t buffer[sizeof(strings)];
+        STRING *moved = reinterpret_cast<STRING *>(buffer);
+        STRING *end = relocate(strings, strings + 4, moved);
+        test_assert(end == moved + 4, "invalid end of relocated strings");
+        test_assert(moved[0] == hello_world && moved[1] == hello_world_long_u8 && moved[2].size() == 0 && moved[3] == hello_world_long, "invalid relocated strings");
+        test_assert(moved[1].at(hello_world_u8_count) == U',' && moved[1].count() == hello_world_long_u8_count, "relocated strings should keep their index and count");
+
+        moved[0] += moved[1];
+        test_assert(moved[0].count() == hello_world_length + hello_world_long_u8_count, "invalid count after appending a relocated string");
+
+        // the originals are gone, they are rebuilt for their destructors
+        for (size_t i = 0; i < 4; ++i) {
+            new (&strings[i]) STRING(std::move(moved[i]));
+            moved[i].~STRING();
+        }
+
+        test_assert(strings[3] == hello_world_long && moved[1].size() == 0, "invalid string after moving back");
+        return nullptr;
+    }
+}
+
+const char *utf8_string_relocate() {
+    return check_relocate<utf8string>();
+}
+
+const char *utf8_string_relocate_compact() {
+    return check_relocate<compact_utf8string>();
+}
+
+const char *utf8_string_relocate_not_trivially() {
+    static_assert(!is_trivially_relocatable<std::string>::value, "std::string isn't opted in");
+    std::string strings[2] = { std::string(hello_world_long), std::string(hello_world) };
+
+    alignas(std::string) u8char_t buffer[sizeof(strings)];
+    std::string *moved = reinterpret_cast<std::string *>(buffer);
+    relocate(strings, strings + 2, moved);
+    test_assert(moved[0] == hello_world_long && moved[1] == hello_world, "invalid relocated std::string");
+
+    relocate(moved, moved + 2, strings);
+    test_assert(strings[0] == hello_world_long, "invalid std::string relocated back");
+    return nullptr;
+}
+
+const char *utf8_string_reserve() {
+    utf8string string(hello_world);
+    string.reserve(1000);
+    test_assert(string.capacity() == 1000 && string == hello_world, "reserve should allocate exactly what it's asked for");
+    const u8char_t *buffer = string.get_raw();
+    for (size_t i = 0; i < 30; ++i) {
+        string += hello_world_u8;
+    }
+    test_assert(string.get_raw() == buffer && string.capacity() == 1000, "appending within the reserved capacity shouldn't grow");
+    string.reserve(10);
+    test_assert(string.capacity() == 1000, "reserve shouldn't shrink");
+
+    // writes straight into the buffer
+    utf8string written(hello_world);
+    u8char_t *data = written.resize_for_overwrite(hello_world_length + 64);
+    test_assert(data && written.capacity() == hello_world_length + 64 && written == hello_world, "the content should stay until it's committed");
+    memcpy(data + hello_world_length, hello_world_u8, hello_world_u8_length);
+    written.commit_overwrite(hello_world_length + hello_world_u8_length);
+    test_assert(written.size() == hello_world_length + hello_world_u8_length && written.ends_with(hello_world_u8), "invalid committed content");
+    test_assert(written.count() == hello_world_length + hello_world_u8_count && written.count() == written.checked_count(), "invalid count of committed content");
+    written.commit_overwrite(5);
+    test_assert(written == "Hello" && written.count() == 5, "committing fewer octets should truncate");
+
+    return nullptr;
+}
+
+const char *utf8_string_growth_policies() {
+    using exact_utf8string = basic_utf8string<32, utf8string_lazy_count, utf8string_allocator<u8char_t>, utf8string_wide_layout, utf8string_exact_growth>;
+    using paged_utf8string = basic_utf8string<32, utf8string_lazy_count, utf8string_allocator<u8char_t>, utf8string_wide_layout, utf8string_paged_growth<>>;
+
+    utf8string geometric(hello_world);
+    geometric += hello_world_long;
+    test_assert(geometric.capacity() + 1 == (32 * 5 / 2 + 8) * 5 / 2 + 8, "the default growth should stay geometric");
+
+    exact_utf8string exact(hello_world);
+    exact += hello_world_long;
+    test_assert(exact.capacity() == hello_world_length + hello_world_long_length, "exact growth should allocate what's required");
+
+    paged_utf8string paged;
+    size_t reallocations = 0;
+    size_t capacity = paged.capacity();
+    while (paged.size() < 1024 * 1024) {
+        paged += hello_world_long;
+        if (paged.capacity() != capacity) {
+            ++reallocations;
+            test_assert(capacity < 64 * 1024 || (paged.capacity() + 1) % 4096 == 0, "large strings should grow by whole pages");
+            capacity = paged.capacity();
+        }
+    }
+    test_assert(paged.capacity() < paged.size() + paged.size() / 2 + 4096, "paged growth should overshoot by at most half");
+    test_assert(reallocations < 20, "paged growth should stay geometric");
+    test_assert(paged.count() == paged.size(), "invalid count after growing");
+
+    return nullptr;
+}
+
+const char *utf8_string_grow_and_shrink() {
+    utf8string string(hello_world);
+    string += hello_world_long;
+    test_assert(string.size() == hello_world_length + hello_world_long_length, "invalid size after growing");
+    test_assert(string.capacity() >= string.size(), "capacity smaller than size");
+
+    while (string.size() > hello_world_length) {
+        string.pop();
+    }
+    string.shrink_to_fit();
+    test_assert(string.capacity() == utf8string::sso_capacity - 1, "short string should move back to the sso buffer");
+    test_assert(string == hello_world, "invalid string after shrinking");
+
+    return nullptr;
+}
+
+namespace {
+    const u32char_t mixed_code_points[] = { U'a', U'\x645', U'\x4E00', U'\x1F600', U' ' };
+
+    u32char_t mixed_code_point(size_t i) {
+        return mixed_code_points[(i * 7 + i / 3) % 5];
+    }
+
+    template<typename STRING>
+    bool matches_mixed(const STRING &string, size_t first, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            if (string[i] != mixed_code_point(first + i)) {
+                return false;
+            }
+        }
+
+        return string.at(count) == 0;
+    }
+};
+
+const char *utf8_string_at_indexed() {
+    utf8string string;
+    for (size_t i = 0; i < 5000; ++i) {
+        string.push(mixed_code_point(i));
+    }
+
+    // backwards first, so the index is built in one go and then used
+    for (size_t i = 5000; i > 0; --i) {
+        test_assert(string.at(i - 1) == mixed_code_point(i - 1), "invalid character at index");
+    }
+    test_assert(string.at(5000) == 0, "index past the end should return 0");
+
+    for (size_t i = 0; i < 1000; ++i) {
+        string.pop();
+    }
+    string.push(U'\x1F600');
+    test_assert(string.at(3999) == mixed_code_point(3999), "invalid character after pop");
+    test_assert(string.at(4000) == U'\x1F600', "invalid character after pop and push");
+    test_assert(string.at(4001) == 0, "index past the end should return 0 after pop");
+
+    string.pop();
+    string += string;
+    test_assert(string.at(4000) == mixed_code_point(0), "invalid character after append");
+    test_assert(string.at(7999) == mixed_code_point(3999), "invalid character after append");
+
+    utf8string copy(string);
+    test_assert(copy.at(6000) == mixed_code_point(2000), "invalid character in copy");
+    utf8string moved(std::move(copy));
+    test_assert(moved.at(6001) == mixed_code_point(2001), "invalid character after move");
+
+    string = hello_world_long_u8;
+    test_assert(string.at(100) == U'.', "invalid character after assignment");
+    test_assert(string.at(101) == 0, "index past the end should return 0 after assignment");
+
+    return nullptr;
+}
+
+const char *utf8_string_substr_by_codepoints() {
+    utf8string string;
+    for (size_t i = 0; i < 1000; ++i) {
+        string.push(mixed_code_point(i));
+    }
+
+    utf8string substring = string.substr_by_codepoints(500, 200);
+    test_assert(substring.count() == 200, "invalid substring count");
+    test_assert(substring.checked_count() == 200, "substring is not valid");
+    test_assert(matches_mixed(substring, 500, 200), "invalid substring");
+
+    substring = string.substr_by_codepoints(900, 200);
+    test_assert(substring.count() == 100, "substring should stop at the end");
+    test_assert(matches_mixed(substring, 900, 100), "invalid substring at the end");
+
+    substring = string.substr_by_codepoints(3, SIZE_MAX);
+    test_assert(substring.count() == 997, "substring should stop at the end");
+
+    substring = string.substr_by_codepoints(1000, 10);
+    test_assert(substring.size() == 0, "substring past the end should be empty");
+
+    utf8string sso(hello_world_u8);
+    substring = sso.substr_by_codepoints(7, 7);
+    test_assert(substring == "بالعالم", "invalid sso substring");
+
+    return nullptr;
+}
+
+const char *utf8_is_ascii() {
+    u8char_t buffer[600];
+    memset(buffer, 'a', sizeof(buffer));
+    test_assert(internal::is_ascii(buffer, buffer + sizeof(buffer)), "ascii buffer reported as non ascii");
+
+    for (size_t position = 0; position < sizeof(buffer); ++position) {
+        buffer[position] = 0x80;
+        test_assert(!internal::is_ascii(buffer, buffer + sizeof(buffer)), "non ascii octet was missed");
+        test_assert(internal::is_ascii(buffer, buffer + position), "octets before the non ascii one are ascii");
+        buffer[position] = 'a';
+    }
+
+    return nullptr;
+}
+
+namespace {
+    template<typename STRING>
+    const char *check_ascii_tracked() {
+        STRING string(hello_world_long);
+        test_assert(string.is_ascii(), "ascii string reported as non ascii");
+
+        string.push(U'\x645');
+        test_assert(!string.is_ascii(), "push of a non ascii code point should clear ascii");
+        test_assert(string.at(hello_world_long_length) == U'\x645', "invalid character after push");
+        test_assert(string.pop() == U'\x645', "invalid popped character");
+        test_assert(string.is_ascii(), "popping the only non ascii code point should make the string ascii again");
+
+        string += hello_world;
+        test_assert(string.is_ascii(), "appending ascii should keep ascii");
+        test_assert(string.count() == hello_world_long_length + hello_world_length, "invalid count after appending ascii");
+        test_assert(string.at(hello_world_long_length) == 'H', "invalid character after appending ascii");
+
+        size_t index = string.size();
+        for (auto itr = string.rbegin(); itr != string.rend(); ++itr) {
+            test_assert(*itr == string[--index], "invalid character while iterating ascii in reverse");
+        }
+        test_assert(index == 0, "reverse iteration did not reach the first character");
+
+        STRING substring = string.substr_by_codepoints(7, 5);
+        test_assert(substring == "world", "invalid ascii substring");
+        test_assert(substring.is_ascii(), "ascii substring reported as non ascii");
+
+        string += hello_world_u8;
+        test_assert(!string.is_ascii(), "appending non ascii should clear ascii");
+        test_assert(string.at(string.count() - 1) == U'!', "invalid last character");
+        test_assert(string.at(hello_world_long_length + hello_world_length) == U'\x645', "invalid first non ascii character");
+
+        string = hello_world;
+        test_assert(string.is_ascii(), "assigning ascii should make the string ascii");
+        string = hello_world_u8;
+        test_assert(!string.is_ascii(), "assigning non ascii should clear ascii");
+
+        return nullptr;
+    }
+};
+
+const char *utf8_string_ascii_lazy() {
+    return check_ascii_tracked<basic_utf8string<32, utf8string_lazy_count>>();
+}
+
+const char *utf8_string_ascii_eager() {
+    return check_ascii_tracked<basic_utf8string<32, utf8string_eager_count>>();
+}
+
+const char *utf8_transcode_utf32() {
+    // long enough for every vectorized block kind, with runs of one, two, three and four octet sequences
+    static u32char_t codePoints[3000];
+    const size_t length = sizeof(codePoints) / sizeof(codePoints[0]);
+    for (size_t i = 0; i < length; ++i) {
+        switch ((i / 20) % 5) {
+            case 0: codePoints[i] = U'a' + i % 26; break;
+            case 1: codePoints[i] = U'\x621' + i % 42; break;
+            case 2: codePoints[i] = U'\x4E00' + i % 1000; break;
+            case 3: codePoints[i] = U'\x1F600' + i % 64; break;
+            default: codePoints[i] = mixed_code_point(i); break;
+        }
+    }
+
+    utf8string string = utf8string::from_utf32(codePoints, codePoints + length);
+    test_assert(string.count() == length, "invalid count after converting from utf-32");
+    test_assert(string.size() == utf8_length_of(codePoints, codePoints + length), "invalid predicted utf-8 length");
+    test_assert(string.checked_count() == length, "converted string is not valid");
+    for (size_t i = 0; i < length; ++i) {
+        test_assert(string[i] == codePoints[i], "invalid character after converting from utf-32");
+    }
+
+    static u32char_t decoded[3001];
+    decoded[length] = U'\xDEAD';
+    test_assert(string.to_utf32(decoded) == length, "invalid utf-32 length");
+    test_assert(memcmp(decoded, codePoints, sizeof(codePoints)) == 0, "invalid code points after converting to utf-32");
+    test_assert(decoded[length] == U'\xDEAD', "converting to utf-32 wrote past the count");
+
+    return nullptr;
+}
+
+const char *utf8_transcode_utf32_errors() {
+    const u32char_t codePoints[] = { U'a', U'\x645', 0x110000, U'b' };
+    utf8string string(hello_world);
+    transcode_result result = string.append_utf32(codePoints, codePoints + 4);
+    test_assert(result.error == internal::UTF8Error_InvalidCodePoint, "invalid code point was not reported");
+    test_assert(result.read == 2 && result.written == 3, "invalid conversion position");
+    test_assert(string.count() == hello_world_length + 2, "invalid count after a failed conversion");
+
+    string.append_utf32_trusted(codePoints, codePoints + 4);
+    test_assert(string.count() == hello_world_length + 5, "trusted conversion should drop invalid code points");
+    test_assert(string.at(string.count() - 1) == U'b', "invalid last character after a trusted conversion");
+
+    utf8string invalid("hello \xE2\x82 world");
+    u32char_t decoded[32];
+    result = invalid.to_utf32_checked(decoded);
+    test_assert(result.error == internal::UTF8Error_IncompleteSequence, "invalid sequence was not reported");
+    test_assert(result.read == 6 && result.written == 6, "invalid conversion position");
+
+    return nullptr;
+}
+
+const char *utf8_string_append_code_points() {
+    static u32char_t codePoints[10000];
+    const size_t length = sizeof(codePoints) / sizeof(codePoints[0]);
+    for (size_t i = 0; i < length; ++i) {
+        codePoints[i] = mixed_code_point(i);
+    }
+
+    utf8string pushed(hello_world);
+    for (size_t i = 0; i < length; ++i) {
+        pushed.push(codePoints[i]);
+    }
+
+    utf8string appended(hello_world);
+    appended.append(codePoints, length);
+    test_assert(appended == pushed, "appending a range should match pushing one at a time");
+    test_assert(appended.count() == hello_world_length + length && appended.count() == appended.checked_count(), "invalid count after appending a range");
+
+    // eagerly counted strings are counted while encoding, invalid code points are dropped
+    const u32char_t invalid[] = { U'a', 0xFFFFFFFF, U'\x645', 0x110000, U'\x1F600' };
+    basic_utf8string<32, utf8string_eager_count> eager(hello_world);
+    eager.append(invalid, 5);
+    test_assert(eager.count() == hello_world_length + 3 && eager.at(eager.count() - 1) == U'\x1F600', "invalid code points should be dropped");
+
+    // iterators that aren't pointers go through blocks
+    std::vector<u32char_t> wide(codePoints, codePoints + length);
+    utf8string fromVector(hello_world);
+    fromVector.append(wide.begin(), wide.end());
+    test_assert(fromVector == pushed, "invalid append of an iterator range");
+
+    utf8string copied;
+    copied.append(pushed.begin(), pushed.end());
+    test_assert(copied == pushed && copied.count() == pushed.count(), "invalid append of another string's code points");
+
+    utf8string empty;
+    empty.append(codePoints, 0);
+    empty.append(wide.begin(), wide.begin());
+    test_assert(empty.size() == 0 && empty.count() == 0, "appending nothing should do nothing");
+
+    return nullptr;
+}
+
+const char *utf8_transcode_utf16() {
+    // the same runs as the utf-32 test, the four octet sequences become surrogate pairs
+    static u32char_t codePoints[3000];
+    const size_t length = sizeof(codePoints) / sizeof(codePoints[0]);
+    for (size_t i = 0; i < length; ++i) {
+        switch ((i / 20) % 5) {
+            case 0: codePoints[i] = U'a' + i % 26; break;
+            case 1: codePoints[i] = U'\x621' + i % 42; break;
+            case 2: codePoints[i] = U'\x4E00' + i % 1000; break;
+            case 3: codePoints[i] = U'\x1F600' + i % 64; break;
+            default: codePoints[i] = mixed_code_point(i); break;
+        }
+    }
+
+    utf8string string = utf8string::from_utf32(codePoints, codePoints + length);
+    const size_t units = string.utf16_length();
+    test_assert(units == utf16_length_of(string.begin().begin(), string.begin().end()), "invalid predicted utf-16 length");
+
+    static char16_t little[6002];
+    static char16_t big[6002];
+    little[units] = u'\xDEAD';
+    test_assert(string.to_utf16(little) == units, "invalid utf-16 length");
+    test_assert(little[units] == u'\xDEAD', "converting to utf-16 wrote past the length");
+    test_assert(string.to_utf16(big, UTF16ByteOrder_BigEndian, true) == units + 1, "invalid utf-16 length with a byte order mark");
+
+    size_t unit = 0;
+    for (size_t i = 0; i < length; ++i) {
+        const u32char_t c = codePoints[i];
+        if (c < 0x10000) {
+            test_assert(little[unit++] == c, "invalid code unit after converting to utf-16");
+        } else {
+            test_assert(little[unit++] == 0xD800 + ((c - 0x10000) >> 10), "invalid lead surrogate");
+            test_assert(little[unit++] == 0xDC00 + ((c - 0x10000) & 0x3FF), "invalid trail surrogate");
+        }
+    }
+
+    test_assert(unit == units, "invalid number of code units");
+    for (size_t i = 0; i < units; ++i) {
+        test_assert(big[i + 1] == static_cast<char16_t>((little[i] >> 8) | (little[i] << 8)), "invalid big endian code unit");
+    }
+
+    test_assert(utf8_length_of(little, little + units) == string.size(), "invalid predicted utf-8 length");
+    test_assert(utf8_length_of(big + 1, big + units + 1, UTF16ByteOrder_BigEndian) == string.size(), "invalid predicted utf-8 length for big endian");
+
+    utf8string fromLittle = utf8string::from_utf16(little, little + units);
+    test_assert(fromLittle == string, "invalid string after converting from utf-16");
+    test_assert(fromLittle.count() == length, "invalid count after converting from utf-16");
+
+    // the byte order mark overrides the default order
+    utf8string fromBig;
+    transcode_result result = fromBig.append_utf16(big, big + units + 1);
+    test_assert(result.error == internal::UTF8Error_None && result.read == units + 1, "invalid big endian conversion");
+    test_assert(fromBig == string, "invalid string after converting from big endian utf-16");
+
+    return nullptr;
+}
+
+const char *utf8_transcode_utf16_errors() {
+    const char16_t strayTrail[] = { u'a', u'\x645', 0xDC00, u'b' };
+    utf8string string(hello_world);
+    transcode_result result = string.append_utf16(strayTrail, strayTrail + 4);
+    test_assert(result.error == internal::UTF8Error_InvalidLead, "stray trail surrogate was not reported");
+    test_assert(result.read == 2 && result.written == 3, "invalid conversion position");
+    test_assert(string.count() == hello_world_length + 2, "invalid count after a failed conversion");
+
+    string.append_utf16_trusted(strayTrail, strayTrail + 4);
+    test_assert(string.count() == hello_world_length + 5, "trusted conversion should drop lone surrogates");
+    test_assert(string.at(string.count() - 1) == U'b', "invalid last character after a trusted conversion");
+
+    u8char_t octets[64];
+    const char16_t unpaired[] = { u'a', 0xD83D, u'b' };
+    result = convert_utf16_to_utf8(unpaired, unpaired + 3, octets);
+    test_assert(result.error == internal::UTF8Error_IncompleteSequence && result.read == 1, "unpaired lead surrogate was not reported");
+    result = convert_utf16_to_utf8(unpaired, unpaired + 2, octets);
+    test_assert(result.error == internal::UTF8Error_NotEnoughRoom && result.read == 1, "truncated surrogate pair was not reported");
+
+    utf8string invalid("hello \xE2\x82 world");
+    char16_t decoded[32];
+    result = invalid.to_utf16_checked(decoded);
+    test_assert(result.error == internal::UTF8Error_IncompleteSequence, "invalid sequence was not reported");
+    test_assert(result.read == 6 && result.written == 6, "invalid conversion position");
+
+    return nullptr;
+}
+
+const char *utf8_matcher_overlapping() {
+    const utf8string patterns[] = { utf8string("he"), utf8string("she"), utf8string("his"), utf8string("hers"), utf8string("مرحب"), utf8string("حبا"), utf8string("") };
+    utf8string_matcher matcher(patterns, 7);
+    test_assert(matcher.pattern_count() == 7, "invalid pattern count");
+
+    utf8string text("ushers مرحباً");
+    size_t expected[][3] = { { 1, 1, 3 }, { 0, 2, 2 }, { 3, 2, 4 }, { 4, 7, 8 }, { 5, 11, 6 } };
+    size_t index = 0;
+    bool ordered = true;
+    const size_t found = matcher.find_all(text, [&](const utf8string_match &match) {
+        ordered = ordered && index < 5 && match.pattern == expected[index][0] && match.offset == expected[index][1] && match.length == expected[index][2];
+        ++index;
+    });
+    test_assert(found == 5 && index == 5, "invalid number of overlapping matches");
+    test_assert(ordered, "invalid overlapping matches");
+
+    // c is passed over while abcx could still make ab lose
+    const utf8string nested[] = { utf8string("ab"), utf8string("c"), utf8string("abcx") };
+    utf8string_matcher nestedMatcher(nested, 3);
+    size_t patternsFound = 0;
+    const size_t leftmost = nestedMatcher.find_leftmost_longest(utf8string("abcy abcx"), [&](const utf8string_match &match) {
+        patternsFound = patternsFound * 10 + match.pattern + 1;
+    });
+    test_assert(leftmost == 3 && patternsFound == 123, "invalid leftmost longest matches");
+
+    return nullptr;
+}
+
+namespace {
+    // the overlapping matches the brute force way, then the leftmost longest ones picked out of them,
+    // duplicate patterns only match once
+    size_t count_matches_reference(const utf8string *patterns, size_t count, const u8char_t *text, size_t length, bool leftmostLongest) {
+        bool duplicates[8] = {};
+        for (size_t p = 0; p < count; ++p) {
+            for (size_t q = 0; q < p; ++q) {
+                duplicates[p] = duplicates[p] || patterns[p] == patterns[q];
+            }
+        }
+
+        size_t result = 0;
+        size_t position = 0;
+        while (position < length) {
+            size_t best = 0;
+            for (size_t p = 0; p < count; ++p) {
+                const size_t size = patterns[p].size();
+                if (duplicates[p] || size == 0 || size > length - position) continue;
+                if (memcmp(text + position, patterns[p].get_raw(), size) == 0) {
+                    if (!leftmostLongest) {
+                        ++result;
+                    } else if (size > best) {
+                        best = size;
+                    }
+                }
+            }
+
+            if (leftmostLongest && best != 0) {
+                ++result;
+                position += best;
+            } else {
+                ++position;
+            }
+        }
+
+        return result;
+    }
+}
+
+const char *utf8_matcher_matches_reference() {
+    const char *words[] = { "a", "ab", "bab", "bc", "abcab", "c", "cca", "م", "مر", "رح", "حب", "باً" };
+    const size_t wordCount = sizeof(words) / sizeof(words[0]);
+
+    utf8string patterns[8];
+    utf8string text;
+    for (uint32_t seed = 1; seed < 300; ++seed) {
+        uint32_t state = seed;
+        auto next = [&state]() {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return state;
+        };
+
+        const size_t count = 1 + next() % 8;
+        for (size_t i = 0; i < count; ++i) {
+            patterns[i] = words[next() % wordCount];
+            if (next() % 2) patterns[i] += words[next() % wordCount];
+        }
+
+        text = "";
+        for (size_t i = next() % 60; i > 0; --i) {
+            text += words[next() % wordCount];
+        }
+
+        utf8string_matcher matcher(patterns, count);
+        const u8char_t *data = text.get_raw();
+        size_t covered = 0;
+        bool disjoint = true;
+        const size_t overlapping = matcher.find_all(text, [](const utf8string_match &) {});
+        const size_t leftmost = matcher.find_leftmost_longest(text, [&](const utf8string_match &match) {
+            disjoint = disjoint && match.offset >= covered && memcmp(data + match.offset, patterns[match.pattern].get_raw(), match.length) == 0;
+            covered = match.offset + match.length;
+        });
+        test_assert(overlapping == count_matches_reference(patterns, count, data, text.size(), false), "invalid number of overlapping matches");
+        test_assert(leftmost == count_matches_reference(patterns, count, data, text.size(), true), "invalid number of leftmost longest matches");
+        test_assert(disjoint, "leftmost longest matches overlap");
+    }
+
+    return nullptr;
+}
+
+const char *utf8_string_view_basics() {
+    utf8string string(hello_world_long_u8);
+    utf8string_view view = string;
+    test_assert(view.get_raw() == string.get_raw() && view.size() == hello_world_long_u8_length, "a view should share the octets of the string");
+    test_assert(view.count() == hello_world_long_u8_count, "invalid view count");
+    test_assert(view == string && view == hello_world_long_u8, "a view should compare equal to what it views");
+    test_assert(string == view, "a string should compare equal to a view of it");
+
+    size_t forward = 0;
+    for (u32char_t c : view) {
+        test_assert(c == string[forward], "invalid character while iterating a view");
+        ++forward;
+    }
+    test_assert(forward == hello_world_long_u8_count, "invalid number of characters while iterating a view");
+
+    size_t backward = 0;
+    for (auto itr = view.rbegin(); itr != view.rend(); ++itr) {
+        ++backward;
+        test_assert(*itr == string[hello_world_long_u8_count - backward], "invalid character while iterating a view in reverse");
+    }
+    test_assert(backward == hello_world_long_u8_count, "invalid number of characters while iterating a view in reverse");
+
+    utf8string_view literal("Hello, world!");
+    test_assert(literal.known_count() == utf8string_view::unknown_count, "a c-string view can't know its count");
+    test_assert(literal.count() == hello_world_length && literal.known_count() == hello_world_length, "a view should remember its count");
+    test_assert(literal.starts_with("Hello") && literal.ends_with("world!") && literal.contains(", w"), "invalid search in a view");
+    test_assert(utf8string_view().empty() && utf8string_view().begin() == utf8string_view().end(), "invalid empty view");
+
+    return nullptr;
+}
+
+const char *utf8_string_view_slicing() {
+    utf8string string(hello_world_long_u8);
+    utf8string_view first = string.substr(0, 15);
+    test_assert(first == hello_world_u8, "invalid substring view");
+    test_assert(first.known_count() == 15, "a substring view should know its count");
+    test_assert(first.get_raw() == string.get_raw(), "a substring view should not copy");
+
+    utf8string_view rest = string.substr(15);
+    test_assert(rest.size() == hello_world_long_u8_length - hello_world_u8_length, "invalid tail view");
+    test_assert(rest.at(0) == U',' && rest[2] == U'\x645', "invalid characters in a tail view");
+    test_assert(rest.substr(2, 15) == hello_world_u8, "invalid substring of a view");
+    test_assert(string.slice(0, hello_world_u8_length) == first, "invalid slice");
+
+    // tokens straight out of the text, no allocations
+    size_t tokens = 0;
+    size_t from = 0;
+    utf8string_view text = string;
+    while (from < text.size()) {
+        basic_utf8string_iterator separator = text.find(", ", from);
+        const size_t to = (separator == text.end()) ? text.size() : static_cast<size_t>(separator.begin() - text.get_raw());
+        test_assert(text.slice(from, to).starts_with("مرحباً"), "invalid token");
+        ++tokens;
+        from = to + 2;
+    }
+    test_assert(tokens == 6, "invalid number of tokens");
+
+    utf8string copy(first);
+    copy += rest.substr(0, 2);
+    copy.append(copy.substr(0, 6));
+    test_assert(copy.starts_with(hello_world_u8) && copy.ends_with(", مرحباً"), "invalid string built from views");
+    test_assert(copy.count() == 15 + 2 + 6 && copy.checked_count() == copy.count(), "invalid count of a string built from views");
+
+    return nullptr;
+}
+
+namespace {
+    // keeps track of what its allocators hand out, so a test can tell whose buffer a string frees
+    struct tracked_arena {
+        size_t allocations = 0;
+        size_t outstanding = 0;
+    };
+
+    // no reallocate member, so growing goes through allocate, copy and deallocate
+    template<typename T, bool PROPAGATE>
+    struct tracked_allocator {
+        using value_type = T;
+        using propagate_on_container_copy_assignment = std::integral_constant<bool, PROPAGATE>;
+        using propagate_on_container_move_assignment = std::integral_constant<bool, PROPAGATE>;
+        using propagate_on_container_swap = std::integral_constant<bool, PROPAGATE>;
+
+        template<typename U>
+        struct rebind {
+            using other = tracked_allocator<U, PROPAGATE>;
+        };
+
+        tracked_arena *arena;
+
+        explicit tracked_allocator(tracked_arena *arena) : arena(arena) {}
+
+        template<typename U>
+        tracked_allocator(const tracked_allocator<U, PROPAGATE> &other) : arena(other.arena) {}
+
+        T *allocate(size_t count) {
+            ++arena->allocations;
+            arena->outstanding += count * sizeof(T);
+            return static_cast<T *>(malloc(count * sizeof(T)));
+        }
+
+        void deallocate(T *block, size_t count) {
+            arena->outstanding -= count * sizeof(T);
+            free(block);
+        }
+
+        bool operator==(const tracked_allocator &other) const {
+            return arena == other.arena;
+        }
+
+        bool operator!=(const tracked_allocator &other) const {
+            return arena != other.arena;
+        }
+    };
+
+    template<bool PROPAGATE>
+    using tracked_utf8string = basic_utf8string<32, utf8string_lazy_count, tracked_allocator<u8char_t, PROPAGATE>>;
+
+    template<bool PROPAGATE>
+    const char *check_allocator_propagation() {
+        using string_type = tracked_utf8string<PROPAGATE>;
+        using allocator_type = tracked_allocator<u8char_t, PROPAGATE>;
+        static_assert(std::is_nothrow_move_assignable<string_type>::value == PROPAGATE, "move assignment may allocate if the allocators can differ and don't propagate");
+        tracked_arena first;
+        tracked_arena second;
+
+        {
+            string_type a(hello_world_long_u8, allocator_type(&first));
+            test_assert(first.allocations == 1 && first.outstanding > 0, "a heap string should allocate from its allocator");
+            test_assert(a.at(hello_world_long_u8_count - 1) == U'.', "invalid character through the code point index");
+            test_assert(first.allocations == 2, "the code point index should allocate from the string's allocator");
+
+            for (size_t i = 0; i < 8; ++i) {
+                a += hello_world_u8;
+            }
+            test_assert(a.count() == hello_world_long_u8_count + 8 * hello_world_u8_count, "invalid count after growing");
+
+            const allocator_type secondAllocator(&second);
+            string_type b(secondAllocator);
+            b = hello_world_long;
+            b = a;
+            test_assert(b == a, "invalid copy");
+            test_assert((b.get_allocator() == a.get_allocator()) == PROPAGATE, "copy assignment should propagate the allocator as the allocator says");
+
+            string_type c(secondAllocator);
+            c = hello_world_long;
+            c = std::move(a);
+            test_assert(c == b && (c.get_allocator().arena == &first) == PROPAGATE, "move assignment should propagate the allocator as the allocator says");
+
+            string_type d(c);
+            test_assert(d == c && d.get_allocator() == c.get_allocator(), "a copy should keep the allocator");
+
+            // strings that don't propagate their allocators can only swap with equal ones
+            const allocator_type other = PROPAGATE ? allocator_type(&second) : d.get_allocator();
+            string_type e(hello_world_long, other);
+            swap(d, e);
+            test_assert(d == hello_world_long && e == c, "invalid swap");
+            test_assert(d.get_allocator() == other && (e.get_allocator() == c.get_allocator()), "swap should propagate the allocator as the allocator says");
+        }
+
+        test_assert(first.outstanding == 0 && second.outstanding == 0, "every buffer should go back to the allocator it came from");
+        return nullptr;
+    }
+}
+
+const char *utf8_string_allocator_propagating() {
+    return check_allocator_propagation<true>();
+}
+
+const char *utf8_string_allocator_not_propagating() {
+    return check_allocator_propagation<false>();
+}
+
+const char *utf8_string_concat() {
+    utf8string hello(hello_world_u8);
+    utf8string_view comma(", ");
+    utf8string line = hello + comma + hello_world + U'\x645' + ' ' + hello;
+    test_assert(line.size() == 2 * hello_world_u8_length + 2 + hello_world_length + 3, "invalid size of a concatenation");
+    test_assert(line.count() == 2 * hello_world_u8_count + 2 + hello_world_length + 2, "invalid count of a concatenation");
+    test_assert(line.count() == line.checked_count(), "count does not match checked count");
+    test_assert(line.starts_with(hello) && line.ends_with(hello) && line.contains("Hello, world!\xd9\x85 "), "invalid concatenation");
+
+    // grouped either way, and starting with a c-string or a code point
+    utf8string grouped = (hello_world + comma) + (hello + U'!');
+    test_assert(grouped == utf8string(utf8string(hello_world) + ", " + hello + '!'), "invalid grouped concatenation");
+    utf8string leading = U'\x645' + hello;
+    test_assert(leading == utf8string("\xd9\x85" + hello), "invalid concatenation starting with a code point");
+
+    // assigning keeps the buffer, appending grows once
+    utf8string reused(hello_world_long);
+    const size_t capacity = reused.capacity();
+    reused = hello + comma;
+    test_assert(reused.capacity() == capacity && reused == utf8string(hello + ", "), "assigning a concatenation should keep the buffer");
+    reused += hello + comma;
+    test_assert(reused.count() == 2 * (hello_world_u8_count + 2), "invalid count after appending a concatenation");
+
+    // the pieces may view the string they go into
+    utf8string self(hello_world);
+    self = self + comma + self;
+    test_assert(self == "Hello, world!, Hello, world!", "invalid concatenation of a string with itself");
+    self += self.substr(0, 5) + '.';
+    test_assert(self.ends_with("world!Hello.") && self.count() == self.checked_count(), "invalid concatenation appended to its own string");
+
+    compact_utf8string compact = hello + comma;
+    test_assert(compact == reused.substr(0, hello_world_u8_count + 2), "invalid concatenation into a compact string");
+
+    return nullptr;
+}
+
+const char *utf8_string_insert_erase() {
+    utf8string string("مرحباً!");
+    string.insert(0, "hello ");
+    string.insert(string.size() - 1, U'\x1F600');
+    test_assert(string == "hello مرحباً\xF0\x9F\x98\x80!" && string.count() == string.checked_count(), "invalid insert");
+
+    // by iterator, before the arabic
+    string.insert(string.find("مرحباً"), "world, ");
+    test_assert(string == "hello world, مرحباً\xF0\x9F\x98\x80!" && string.count() == string.checked_count(), "invalid insert by iterator");
+
+    string.erase(5, 7);
+    test_assert(string == "hello مرحباً\xF0\x9F\x98\x80!" && string.count() == string.checked_count(), "invalid erase");
+    utf8string_iterator first = string.find("مرحباً");
+    utf8string_iterator last = string.find("!");
+    string.erase(first, last);
+    test_assert(string == "hello !" && string.is_ascii(), "invalid erase by iterator");
+    string.erase(5);
+    test_assert(string == "hello" && string.count() == 5, "erasing to the end should truncate");
+
+    // a view of the string itself
+    string.insert(0, string.slice(1, 3));
+    test_assert(string == "elhello" && string.count() == 7, "invalid insert of a view into the string");
+
+    // at() uses the index past the edit
+    utf8string text(hello_world_long_u8);
+    test_assert(text.at(100) != 0, "the index should be built");
+    text.insert(0, "\xD8\xA3");
+    text.erase(text.size() - 4, 4);
+    utf8string expected("\xD8\xA3");
+    expected.append(utf8string_view(hello_world_long_u8, strlen(hello_world_long_u8) - 4));
+    test_assert(text == expected && text.count() == expected.checked_count(), "invalid edit of a long string");
+    for (size_t i = 0; i < text.count(); i += 7) {
+        test_assert(text.at(i) == expected.at(i), "the index should be dropped after an edit");
+    }
+
+    return nullptr;
+}
+
+const char *utf8_string_replace() {
+    utf8string string("Dear {name}, your {item} is ready");
+    string.replace(5, 6, "صديقي");
+    test_assert(string == "Dear صديقي, your {item} is ready" && string.count() == string.checked_count(), "invalid replace");
+    string.replace(string.find("{item}"), string.find(" is"), "order");
+    test_assert(string == "Dear صديقي, your order is ready" && string.count() == string.checked_count(), "invalid replace by iterator");
+
+    // longer, shorter and equal replacements, with the eager policy keeping the count
+    basic_utf8string<32, utf8string_eager_count> page("<p>{x}</p><p>{x}{x}</p>{x}");
+    test_assert(page.replace_all("{x}", "مرحباً بالعالم") == 4, "invalid number of replacements");
+    test_assert(page == "<p>مرحباً بالعالم</p><p>مرحباً بالعالممرحباً بالعالم</p>مرحباً بالعالم" && page.count() == page.checked_count(), "invalid longer replacement");
+    test_assert(page.replace_all("مرحباً بالعالم", "x") == 4 && page == "<p>x</p><p>xx</p>x" && page.count() == page.checked_count(), "invalid shorter replacement");
+    test_assert(page.replace_all("<p>", "<b>") == 2 && page == "<b>x</p><b>xx</p>x", "invalid equal replacement");
+    test_assert(page.replace_all("{y}", "z") == 0 && page.replace_all("", "z") == 0, "nothing should be replaced");
+
+    // occurrences don't overlap, and a view of the string itself can be the replacement
+    utf8string repeated("aaaaa");
+    test_assert(repeated.replace_all("aa", "b") == 2 && repeated == "bba", "overlapping occurrences should be skipped");
+    test_assert(repeated.replace_all("b", repeated.slice(1)) == 2 && repeated == "babaa", "invalid replacement by a view into the string");
+
+    return nullptr;
+}
+
+namespace {
+    template<typename RANGE>
+    std::vector<utf8string> collect(const RANGE &range) {
+        std::vector<utf8string> result;
+        for (utf8string_view piece : range) {
+            result.push_back(utf8string(piece));
+        }
+        return result;
+    }
+}
+
+const char *utf8_string_split() {
+    utf8string csv("a,,b,");
+    std::vector<utf8string> pieces = collect(csv.split(','));
+    test_assert(pieces.size() == 4 && pieces[0] == "a" && pieces[1] == "" && pieces[2] == "b" && pieces[3] == "", "every delimiter should end a piece");
+
+    utf8string text(hello_world_long_u8);
+    pieces = collect(text.split(", "));
+    test_assert(pieces.size() == 6 && pieces[0] == hello_world_u8 && pieces[5] == "مرحباً بالعالم!.", "invalid split by a substring");
+    for (utf8string_view piece : text.split(", ")) {
+        test_assert(piece.get_raw() >= text.get_raw() && piece.get_raw() + piece.size() <= text.get_raw() + text.size(), "pieces should be views into the text");
+    }
+
+    // a multi octet code point, and a substring that starts the text
+    utf8string arabic("واحد،اثنان،ثلاثة");
+    pieces = collect(arabic.split(U'\x60C'));
+    test_assert(pieces.size() == 3 && pieces[1] == "اثنان" && pieces[2] == "ثلاثة", "invalid split by a code point");
+    pieces = collect(arabic.split("واحد"));
+    test_assert(pieces.size() == 2 && pieces[0] == "" && pieces[1] == "،اثنان،ثلاثة", "invalid split by a leading substring");
+
+    pieces = collect(utf8string().split(','));
+    test_assert(pieces.size() == 1 && pieces[0].size() == 0, "an empty text should be a single empty piece");
+    pieces = collect(csv.split(""));
+    test_assert(pieces.size() == 1 && pieces[0] == csv, "an empty delimiter shouldn't split");
+
+    // raw octets, not null terminated
+    const u8char_t raw[] = { 'x', ' ', 'y', ' ', 'z', ' ', 'w' };
+    pieces = collect(split(raw, raw + 5, ' '));
+    test_assert(pieces.size() == 3 && pieces[2] == "z", "invalid split of a raw range");
+
+    return nullptr;
+}
+
+const char *utf8_string_join() {
+    std::vector<utf8string> words = { utf8string("واحد"), utf8string("two"), utf8string(""), utf8string(hello_world_u8) };
+    utf8string joined = join(words, ", ");
+    test_assert(joined == "واحد, two, , مرحباً بالعالم!", "invalid join");
+    test_assert(joined.capacity() == joined.size() && joined.count() == joined.checked_count(), "join should allocate exactly once");
+
+    const char *literals[] = { "a", "b", "c" };
+    test_assert(join(literals, "") == "abc" && join(literals, literals + 1, "-") == "a", "invalid join of c-strings");
+    test_assert(join(words.begin(), words.begin(), ",").size() == 0, "joining nothing should be empty");
+
+    // split and join back is a replace
+    utf8string text(hello_world_long_u8);
+    compact_utf8string replaced = join<compact_utf8string>(text.split(", "), "; ");
+    test_assert(replaced.count() == hello_world_long_u8_count && replaced.count_occurrences("; ") == 5 && !replaced.contains(", "), "invalid split and join");
+
+    return nullptr;
+}
+
+namespace {
+    utf8string make_document(size_t lines) {
+        utf8string document;
+        for (size_t i = 0; i < lines; ++i) {
+            document += hello_world_long_u8;
+            document += (i % 3) ? " hello world" : " \xF0\x9F\x98\x80";
+            document += '\n';
+        }
+
+        return document;
+    }
+}
+
+const char *utf8_rope_basics() {
+    utf8string document = make_document(1000);
+    utf8rope rope(document);
+    test_assert(rope.size() == document.size() && rope.count() == document.count() && rope.line_count() == 1001, "invalid rope sizes");
+    test_assert(rope.to_string() == document, "the rope should hold the text it was built from");
+
+    for (size_t i = 0; i < document.count(); i += 997) {
+        test_assert(rope.at(i) == document.at(i), "invalid code point in the rope");
+    }
+
+    utf8string_iterator expected = document.begin();
+    for (u32char_t c : rope) {
+        test_assert(c == *expected, "invalid code point while iterating the rope");
+        ++expected;
+    }
+    test_assert(expected == document.end(), "the rope should iterate over every code point");
+
+    // lines
+    size_t line = 0;
+    for (utf8string_view text : document.split('\n')) {
+        const size_t offset = static_cast<size_t>(text.get_raw() - document.get_raw());
+        test_assert(rope.line_offset(line) == offset && rope.line_of(offset) == line, "invalid line lookup");
+        if (line % 100 == 0 && !text.empty()) {
+            test_assert(rope.line(line) == utf8string(document.slice(offset, offset + text.size() + 1)), "invalid line");
+        }
+        ++line;
+    }
+    test_assert(rope.line_offset(line) == rope.size(), "lines past the end should start at the end");
+
+    utf8rope copy(rope);
+    rope.clear();
+    test_assert(rope.empty() && rope.begin() == rope.end() && copy.to_string() == document, "copies should be independent");
+    test_assert(copy.to_string<compact_utf8string>(6, 20) == utf8string(document.slice(6, 20)), "invalid part of the rope");
+
+    return nullptr;
+}
+
+const char *utf8_rope_edits() {
+    utf8string document = make_document(300);
+    utf8rope rope(document);
+
+    const char *insertions[] = { "x", "مرحباً\n", "\xF0\x9F\x98\x80", hello_world_long_u8 };
+    utf8string large = make_document(5);
+    uint32_t seed = 12345;
+    for (int i = 0; i < 3000; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        // on code point boundaries
+        const size_t offset = document.substr(0, (seed >> 8) % (document.count() + 1)).size();
+        const int kind = (seed >> 4) % 8;
+        if (kind < 4) {
+            utf8string_view text = (i % 97 == 0) ? utf8string_view(large) : utf8string_view(insertions[kind]);
+            rope.insert(offset, text);
+            document.insert(offset, text);
+        } else {
+            const size_t length = document.substr(offset).substr(0, (kind == 7) ? 3000 : kind).size();
+            rope.erase(offset, length);
+            document.erase(offset, length);
+        }
+
+        if (i % 250 == 0) {
+            test_assert(rope.to_string() == document, "the rope and the string should have the same text");
+            test_assert(rope.is_heap_ordered(), "edits should keep the priorities of the chunks in order");
+        }
+    }
+
+    // a treap of random priorities is about 2 * log2(chunks) deep
+    size_t chunks = 0;
+    rope.for_each_chunk([&chunks](utf8string_view) { ++chunks; });
+    size_t log2Chunks = 0;
+    while ((size_t(1) << log2Chunks) < chunks) {
+        ++log2Chunks;
+    }
+    test_assert(rope.is_heap_ordered() && rope.depth() <= 4 * log2Chunks + 4, "edits should keep the rope balanced");
+
+    // large edits cut chunks in two, the pieces go up in place of the chunk they came from
+    utf8rope cut(make_document(3000));
+    const utf8string pieces = make_document(20);
+    for (int i = 0; i < 20000; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        const size_t index = (seed >> 8) % (cut.count() + 1);
+        const size_t offset = cut.offset_of(index);
+        if ((seed >> 4) % 2) {
+            cut.insert(offset, pieces);
+        } else {
+            cut.erase(offset, cut.offset_of(std::min(index + 300, cut.count())) - offset);
+        }
+
+        if (i % 1000 == 0) {
+            test_assert(cut.is_heap_ordered(), "cutting chunks should keep the priorities in order");
+        }
+    }
+    test_assert(cut.is_heap_ordered() && cut.size() > pieces.size(), "cutting chunks should keep the priorities in order");
+
+    test_assert(rope.to_string() == document && rope.count() == document.count(), "invalid text after edits");
+    test_assert(rope.line_count() == document.count_occurrences("\n") + 1, "invalid line count after edits");
+    for (size_t i = 0; i < document.count(); i += 101) {
+        test_assert(rope.at(i) == document.at(i), "invalid code point after edits");
+    }
+
+    rope.erase(0);
+    test_assert(rope.empty() && rope.count() == 0 && rope.line_count() == 1, "erasing everything should empty the rope");
+
+    return nullptr;
+}
+
+const char *utf8_string_pool() {
+    utf8string_pool pool;
+    utf8string tag("service.checkout.region.eu-west-1.latency");
+    utf8string_handle first = pool.intern(tag);
+    utf8string_handle second = pool.intern(utf8string(tag));
+    utf8string_handle arabic = pool.intern("مرحباً بالعالم");
+    test_assert(first.valid() && first == second && first != arabic && pool.size() == 2, "equal strings should get the same handle");
+    test_assert(pool.view(first) == tag && pool.view(arabic) == "مرحباً بالعالم", "invalid interned string");
+    test_assert(pool.view(first).get_raw() == pool.intern_view(tag).get_raw(), "equal strings should share their octets");
+    test_assert(pool.view(arabic).get_raw()[pool.view(arabic).size()] == '\0', "interned strings should be null terminated");
+    test_assert(pool.find(tag) == first && !pool.find("missing").valid() && pool.size() == 2, "find() shouldn't intern");
+
+    // views stay where they are while the tables and the arena grow, longer strings get their own block
+    utf8string_view stable = pool.view(arabic);
+    utf8string large;
+    while (large.size() <= utf8string_pool::block_size) {
+        large += hello_world_long_u8;
+    }
+    utf8string_handle largeHandle = pool.intern(large);
+    std::vector<utf8string_handle> handles;
+    for (int i = 0; i < 20000; ++i) {
+        handles.push_back(pool.intern(utf8string(utf8string(std::to_string(i % 5000).c_str()) + ".tag")));
+    }
+    test_assert(pool.size() == 5003 && pool.view(largeHandle) == large, "invalid number of interned strings");
+    test_assert(stable.get_raw() == pool.view(arabic).get_raw() && stable == "مرحباً بالعالم", "views should stay valid");
+    for (size_t i = 0; i < handles.size(); ++i) {
+        test_assert(handles[i] == handles[i % 5000], "invalid handle after growing");
+    }
+
+    utf8string_pool moved(std::move(pool));
+    test_assert(moved.view(first) == tag && pool.size() == 0 && !pool.find(tag).valid(), "invalid move");
+    test_assert(pool.intern("").valid() && pool.view(pool.find("")).empty(), "the empty string can be interned");
+
+    return nullptr;
+}
+
+const char *utf8_string_shared_pool() {
+    utf8string_shared_pool<> pool;
+    std::vector<std::thread> threads;
+    std::vector<std::vector<utf8string_handle>> handles(4);
+    for (size_t t = 0; t < handles.size(); ++t) {
+        threads.emplace_back([&pool, &handles, t]() {
+            for (int i = 0; i < 10000; ++i) {
+                handles[t].push_back(pool.intern(utf8string("tag." + utf8string(std::to_string((i * 7 + static_cast<int>(t)) % 3000).c_str()))));
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    test_assert(pool.size() == 3000, "every distinct string should be interned once");
+    for (size_t t = 0; t < handles.size(); ++t) {
+        for (int i = 0; i < 10000; ++i) {
+            utf8string expected = utf8string("tag.") + utf8string(std::to_string((i * 7 + static_cast<int>(t)) % 3000).c_str());
+            test_assert(pool.view(handles[t][i]) == expected && pool.find(expected) == handles[t][i], "invalid handle from another thread");
+        }
+    }
+
+    return nullptr;
+}
+
+const char *utf8_string_hash() {
+    utf8string text(hello_world_long_u8);
+    compact_utf8string compact(hello_world_long_u8);
+    utf8string_view view = text;
+    test_assert(text.hash() == view.hash() && compact.hash() == view.hash(), "equal octets should hash the same");
+    test_assert(std::hash<utf8string>()(text) == std::hash<utf8string_view>()(view), "std::hash should agree with hash()");
+    test_assert(utf8string("").hash() == utf8string_view().hash(), "invalid hash of the empty string");
+
+    // every length across the short and the striped paths, the vectorized stripes have to agree with the scalar ones
+    u8char_t octets[1024];
+    for (size_t i = 0; i < sizeof(octets); ++i) {
+        octets[i] = static_cast<u8char_t>(i * 131 + (i >> 3));
+    }
+    for (size_t length = 0; length <= sizeof(octets); ++length) {
+        const size_t hash = utf8string_view(octets, length).hash();
+        octets[length / 2] ^= 1;
+        test_assert(utf8string_view(octets, length).hash() != hash || length == 0, "flipping a bit should change the hash");
+        octets[length / 2] ^= 1;
+    }
+    uint64_t scalar[8] = {};
+    uint64_t dispatched[8] = {};
+    internal::hash_stripes_scalar(octets, sizeof(octets) / internal::HASH_STRIPE, scalar);
+    internal::hash_stripes(octets, sizeof(octets) / internal::HASH_STRIPE, dispatched);
+    test_assert(memcmp(scalar, dispatched, sizeof(scalar)) == 0, "the vectorized stripes disagree with the scalar ones");
+
+    std::unordered_map<utf8string, int> counts;
+    for (int i = 0; i < 1000; ++i) {
+        ++counts[utf8string(std::to_string(i % 100).c_str())];
+    }
+    test_assert(counts.size() == 100 && counts[utf8string("42")] == 10, "strings should work as unordered_map keys");
+
+    // the cached hash is forgotten by every mutation
+    using cached_string = basic_utf8string<32, utf8string_lazy_count, utf8string_allocator<u8char_t>, utf8string_wide_layout, utf8string_geometric_growth<>, utf8string_cached_hash>;
+    cached_string cached(hello_world);
+    test_assert(cached.hash() == utf8string_view(hello_world).hash(), "the cached hash should be the same hash");
+    cached.push(U'!');
+    test_assert(cached.hash() == utf8string_view("Hello, world!!").hash(), "push() should forget the hash");
+    cached.replace(0, 5, "Bye");
+    test_assert(cached.hash() == utf8string_view("Bye, world!!").hash(), "replace() should forget the hash");
+    cached.replace(0, 3, "Hey");
+    test_assert(cached.hash() == utf8string_view("Hey, world!!").hash(), "a replacement of the same size should forget the hash");
+    cached.insert(0, U'¡');
+    test_assert(cached.hash() == utf8string_view("¡Hey, world!!").hash(), "insert() should forget the hash");
+    u8char_t *data = cached.resize_for_overwrite(cached.size() + 1);
+    data[cached.size()] = '?';
+    cached.commit_overwrite(cached.size() + 1);
+    test_assert(cached.hash() == utf8string_view("¡Hey, world!!?").hash(), "commit_overwrite() should forget the hash");
+
+    cached_string moved(std::move(cached));
+    test_assert(moved.hash() == utf8string_view("¡Hey, world!!?").hash() && cached.hash() == utf8string_view().hash(), "invalid hash after a move");
+    cached = moved;
+    moved.clear();
+    test_assert(moved.hash() == utf8string_view().hash() && cached.hash() == utf8string_view("¡Hey, world!!?").hash(), "clear() should forget the hash");
+    swap(cached, moved);
+    test_assert(moved.hash() == utf8string_view("¡Hey, world!!?").hash() && cached.hash() == utf8string_view().hash(), "invalid hash after a swap");
+
+    return nullptr;
+}
+
+const char *utf8_string_map() {
+    utf8string_map<int> routes;
+    test_assert(routes.find("/") == nullptr && routes.empty() && !routes.erase("/"), "an empty map should have no keys");
+    std::pair<int *, bool> inserted = routes.emplace("/api/users", 1);
+    test_assert(inserted.first && inserted.second && *inserted.first == 1, "invalid emplace");
+    inserted = routes.emplace(utf8string("/api/users"), 2);
+    test_assert(!inserted.second && *inserted.first == 1 && routes.size() == 1, "emplace shouldn't replace a value");
+    *routes.insert_or_assign("/المستخدمين", 3) += 1;
+    test_assert(*routes.insert_or_assign("/api/users", 5) == 5, "insert_or_assign should replace a value");
+
+    // a const char *, a view, a string and a compact string find the same key
+    utf8string users("/api/users");
+    compact_utf8string compactUsers("/api/users");
+    const char *path = "/api/users/42";
+    test_assert(*routes.find("/api/users") == 5 && *routes.find(users) == 5 && *routes.find(compactUsers) == 5, "invalid lookup");
+    test_assert(*routes.find(utf8string_view(path, 10)) == 5 && !routes.contains(path) && *routes.find("/المستخدمين") == 4, "invalid lookup of a slice");
+
+    // enough keys to grow many times, short ones in the sso buffer and long ones on the heap
+    utf8string_map<utf8string> symbols;
+    for (int i = 0; i < 5000; ++i) {
+        utf8string key(std::to_string(i).c_str());
+        if (i % 2) {
+            key += hello_world_long_u8;
+        }
+        *symbols.insert(key) = key;
+    }
+    test_assert(symbols.size() == 5000 && symbols.capacity() * 7 / 8 >= 5000, "invalid size after growing");
+    for (int i = 0; i < 5000; ++i) {
+        utf8string key(std::to_string(i).c_str());
+        if (i % 2) {
+            key += hello_world_long_u8;
+        }
+        const utf8string *value = symbols.find(key);
+        test_assert(value && *value == key, "lost a key while growing");
+    }
+
+    // erased slots are reused, churning keys through the map doesn't grow it forever
+    for (int i = 0; i < 5000; i += 2) {
+        test_assert(symbols.erase(utf8string(std::to_string(i).c_str())), "failed to erase a key");
+    }
+    test_assert(symbols.size() == 2500 && !symbols.contains("42") && symbols.contains(utf8string(utf8string("43") + hello_world_long_u8)), "invalid erase");
+    const size_t capacity = symbols.capacity();
+    for (int i = 0; i < 100000; ++i) {
+        utf8string key(std::to_string(i % 3000 + 100000).c_str());
+        symbols.emplace(key, key);
+        symbols.erase(key);
+    }
+    test_assert(symbols.size() == 2500 && symbols.capacity() == capacity, "erased slots should be reused");
+
+    size_t visited = 0;
+    symbols.for_each([&visited](const utf8string &key, utf8string &value) {
+        visited += (key == value);
+    });
+    test_assert(visited == 2500, "for_each should visit every key once");
+
+    utf8string_map<utf8string> copy(symbols);
+    utf8string_map<utf8string> moved(std::move(symbols));
+    test_assert(copy.size() == 2500 && moved.size() == 2500 && symbols.empty() && symbols.find("1") == nullptr, "invalid copy or move");
+    test_assert(*copy.find(utf8string(utf8string("1") + hello_world_long_u8)) == *moved.find(utf8string(utf8string("1") + hello_world_long_u8)), "a copy should have the same values");
+    copy.clear();
+    test_assert(copy.empty() && !copy.contains("1") && moved.contains(utf8string(utf8string("1") + hello_world_long_u8)), "invalid clear");
+    test_assert(copy.emplace("", "empty").second && copy.contains(""), "the empty string is a key");
+
+    return nullptr;
+}
+
+namespace {
+    // feeds text in chunks of chunkSize octets, the valid octets end up in output
+    bool decode_in_chunks(utf8string_decoder &decoder, const std::string &text, size_t chunkSize, std::string &output) {
+        output.clear();
+        auto sink = [&output](utf8string_view valid) {
+            output.append(reinterpret_cast<const char *>(valid.get_raw()), valid.size());
+        };
+        for (size_t i = 0; i < text.size(); i += chunkSize) {
+            decoder.feed(text.data() + i, std::min(chunkSize, text.size() - i), sink);
+        }
+        return decoder.finish(sink);
+    }
+};
+
+const char *utf8_string_decoder() {
+    const std::string text = std::string("\xEF\xBB\xBF") + hello_world_long_u8 + "😀 🙂 ok";
+    const std::string expected = text.substr(3);
+    std::string output;
+    for (size_t chunkSize = 1; chunkSize <= 9; ++chunkSize) {
+        utf8string_decoder decoder;
+        test_assert(decode_in_chunks(decoder, text, chunkSize, output) && output == expected && decoder.had_bom(), "invalid output of a chunked stream");
+    }
+
+    // the valid octets of a chunk are views into it, only a cut sequence is copied
+    utf8string_decoder decoder;
+    std::vector<utf8string_view> spans;
+    auto collect = [&spans](utf8string_view valid) { spans.push_back(valid); };
+    const char *first = "abc\xD9";
+    const char *second = "\x85" "def";
+    test_assert(decoder.feed(first, 4, collect) && spans.size() == 1 && spans[0].get_raw() == reinterpret_cast<const u8char_t *>(first) && spans[0] == "abc", "valid octets should be views into the chunk");
+    test_assert(decoder.feed(second, 4, collect) && spans.size() == 3 && spans[1] == "م" && spans[2].get_raw() == reinterpret_cast<const u8char_t *>(second) + 1, "a cut sequence should be completed by the next chunk");
+    test_assert(decoder.finish(collect) && !decoder.had_bom(), "invalid end of a valid stream");
+
+    // errors are reported at the same offset as validating the whole stream, wherever the chunks end
+    const std::string invalid[] = {
+        "abc\xE0\x80\x80" "def", "\xEF\xBB\xBF\xEF\xBB", "\xEF\xBB\x41", "ok \xF4\x90\x80\x80", "\xD9\x85\xD9", "\xC0\xAF", "مرحباً\x80", "\xC2\xF0\x80\x80",
+    };
+    for (const std::string &stream : invalid) {
+        internal::UTF8Error expectedError;
+        std::string bomless = internal::starts_with_bom(reinterpret_cast<u8char_t *>(const_cast<char *>(stream.data())), reinterpret_cast<u8char_t *>(const_cast<char *>(stream.data())) + stream.size()) ? stream.substr(3) : stream;
+        u8char_t *start = reinterpret_cast<u8char_t *>(&bomless[0]);
+        const size_t expectedOffset = static_cast<size_t>(internal::find_invalid(start, start + bomless.size(), expectedError) - start) + (stream.size() - bomless.size());
+        for (size_t chunkSize = 1; chunkSize <= stream.size(); ++chunkSize) {
+            utf8string_decoder chunked;
+            test_assert(!decode_in_chunks(chunked, stream, chunkSize, output), "an invalid stream should fail");
+            test_assert(chunked.error() == expectedError && chunked.error_offset() == expectedOffset, "the error should be the one of the whole stream");
+            test_assert(output == bomless.substr(0, expectedOffset - (stream.size() - bomless.size())), "every octet before the error should be handed out");
+        }
+    }
+
+    decoder.reset();
+    test_assert(decoder.finish(collect) && decoder.error() == internal::UTF8Error_None, "an empty stream is valid");
+    decoder.reset();
+    test_assert(decode_in_chunks(decoder, "\xEF\xBB\xBF", 1, output) && output.empty() && decoder.had_bom(), "a stream can be only a BOM");
+
+    return nullptr;
+}
+
+namespace {
+    bool write_file(const char *path, const std::string &content) {
+        FILE *file = fopen(path, "wb");
+        if (!file) {
+            return false;
+        }
+        const bool written = fwrite(content.data(), 1, content.size(), file) == content.size();
+        fclose(file);
+        return written;
+    }
+};
+
+const char *utf8_string_mapped_file() {
+    const char *path = "utf8string_mapped_file_test.txt";
+    // enough text for several ranges, with sequences of every length all over the range boundaries
+    std::string text = "\xEF\xBB\xBF";
+    while (text.size() < 5 * utf8string_mapped_file::min_range) {
+        text += hello_world_long_u8;
+        text += "\n😀 ok\n";
+    }
+    test_assert(write_file(path, text), "failed to write the test file");
+
+    utf8string_mapped_file file(path);
+    test_assert(file.is_open() && file.had_bom() && file.size() == text.size(), "failed to map the file");
+    utf8string_view view = file.view();
+    test_assert(view.size() == text.size() - 3 && memcmp(view.get_raw(), text.data() + 3, view.size()) == 0, "the view should be the file without its BOM");
+
+    const size_t expectedCount = internal::count_code_points(view.get_raw(), view.get_raw() + view.size());
+    const size_t expectedNewlines = static_cast<size_t>(std::count(text.begin(), text.end(), '\n'));
+    for (size_t threads = 1; threads <= 8; threads *= 2) {
+        utf8string_file_stats stats = file.validate(threads);
+        test_assert(stats.error == internal::UTF8Error_None && stats.error_offset == file.size(), "a valid file should have no error");
+        test_assert(stats.count == expectedCount && stats.newlines == expectedNewlines, "invalid merged counts");
+    }
+    test_assert(file.view().known_count() == expectedCount, "a validated view should know its count");
+
+    // a const file can be validated and viewed from several threads at once
+    const utf8string_mapped_file &shared = file;
+    size_t counts[4] = {};
+    std::thread readers[4];
+    for (size_t i = 0; i < 4; ++i) {
+        readers[i] = std::thread([&shared, &counts, i]() {
+            counts[i] = (i % 2) ? shared.validate(1).count : shared.view().count();
+        });
+    }
+    for (size_t i = 0; i < 4; ++i) {
+        readers[i].join();
+        test_assert(counts[i] == expectedCount, "invalid count from another thread");
+    }
+
+    utf8string_mapped_file moved(std::move(file));
+    test_assert(moved.view().size() == text.size() - 3 && moved.view().known_count() == expectedCount && !file.is_open() && file.view().empty(), "invalid move");
+    // the file is written again below, a mapping of it would lose its pages
+    moved.close();
+
+    // the first error wins wherever the ranges end, and the counts stop right before it
+    const size_t positions[] = { text.size() - 1, text.size() / 2, text.size() / 4 + 1, 3 + (text.size() - 3) / 4 * 2, 100 };
+    for (size_t position : positions) {
+        std::string invalid = text;
+        invalid[position] = static_cast<char>(0xFF);
+        invalid[position + 1 < invalid.size() ? position + 1 : position] = static_cast<char>(0xFF);
+        test_assert(write_file(path, invalid), "failed to write the test file");
+        utf8string_mapped_file broken(path);
+        u8char_t *start = reinterpret_cast<u8char_t *>(&invalid[3]);
+        internal::UTF8Error expectedError;
+        u8char_t *expectedAt = internal::find_invalid(start, start + invalid.size() - 3, expectedError);
+        for (size_t threads = 1; threads <= 8; threads *= 2) {
+            utf8string_file_stats stats = broken.validate(threads);
+            test_assert(stats.error == expectedError && stats.error_offset == static_cast<size_t>(expectedAt - start) + 3, "the first error should win");
+            test_assert(stats.count == internal::count_code_points(start, expectedAt), "the count should stop at the error");
+        }
+        test_assert(broken.view().known_count() == utf8string_view::unknown_count, "an invalid view shouldn't know its count");
+    }
+
+    // runs of stray continuations over the end of a block and of a range belong to the sequence before them
+    const size_t runs[] = { utf8string_mapped_file::block_size - 1, utf8string_mapped_file::min_range - 1 };
+    for (size_t run : runs) {
+        std::string invalid(2 * utf8string_mapped_file::min_range, 'a');
+        invalid.replace(run, 5, "\xC2\x80\x80\x80\x80");
+        test_assert(write_file(path, invalid), "failed to write the test file");
+        utf8string_mapped_file broken(path);
+        u8char_t *start = reinterpret_cast<u8char_t *>(&invalid[0]);
+        internal::UTF8Error expectedError;
+        u8char_t *expectedAt = internal::find_invalid(start, start + invalid.size(), expectedError);
+        test_assert(expectedError == internal::UTF8Error_InvalidLead && expectedAt == start + run + 2, "the first stray continuation is the error");
+        for (size_t threads = 1; threads <= 4; threads *= 2) {
+            utf8string_file_stats stats = broken.validate(threads);
+            test_assert(stats.error == expectedError && stats.error_offset == run + 2, "a run of continuations should be an error wherever it is");
+            test_assert(stats.count == run + 1, "the count should stop at the run");
+        }
+        test_assert(broken.view().known_count() == utf8string_view::unknown_count, "an invalid view shouldn't know its count");
+    }
+
+    // a file cut in the middle of a sequence
+    test_assert(write_file(path, "ok \xD9"), "failed to write the test file");
+    {
+        utf8string_mapped_file cut(path);
+        test_assert(cut.validate().error == internal::UTF8Error_NotEnoughRoom && cut.validate().error_offset == 3, "a cut sequence should be reported");
+    }
+
+    test_assert(write_file(path, ""), "failed to write the test file");
+    {
+        utf8string_mapped_file empty(path);
+        test_assert(empty.is_open() && empty.view().empty() && empty.validate().error == internal::UTF8Error_None, "an empty file is valid");
+    }
+    remove(path);
+
+    utf8string_mapped_file missing("utf8string_mapped_file_missing.txt");
+    test_assert(!missing.is_open() && missing.view().empty() && !missing.open("utf8string_mapped_file_missing.txt"), "a missing file shouldn't open");
+
+    return nullptr;
+}
+
 #define run_test(func) tests::run_test((#func), (func))
 
 int main() {
@@ -502,4 +2257,52 @@ int main() {
     run_test(utf8_string_pop_long_u8);
     run_test(utf8_string_find_cstring);
     run_test(utf8_string_find);
+    run_test(utf8_string_find_backtracks);
+    run_test(utf8_search_matches_reference);
+    run_test(utf8_validate_long_valid);
+    run_test(utf8_validate_error_positions);
+    run_test(utf8_validate_truncated);
+    run_test(utf8_decode_boundaries);
+    run_test(utf8_string_iterate_reverse_u8_tail);
+    run_test(utf8_count_code_points);
+    run_test(utf8_string_checked_count);
+    run_test(utf8_string_count_maintained_lazy);
+    run_test(utf8_string_count_maintained_eager);
+    run_test(utf8_string_count_maintained_compact);
+    run_test(utf8_string_compact_layout);
+    run_test(utf8_string_relocate);
+    run_test(utf8_string_relocate_compact);
+    run_test(utf8_string_relocate_not_trivially);
+    run_test(utf8_string_grow_and_shrink);
+    run_test(utf8_string_reserve);
+    run_test(utf8_string_growth_policies);
+    run_test(utf8_string_at_indexed);
+    run_test(utf8_string_substr_by_codepoints);
+    run_test(utf8_is_ascii);
+    run_test(utf8_string_ascii_lazy);
+    run_test(utf8_string_ascii_eager);
+    run_test(utf8_transcode_utf32);
+    run_test(utf8_transcode_utf32_errors);
+    run_test(utf8_string_append_code_points);
+    run_test(utf8_transcode_utf16);
+    run_test(utf8_transcode_utf16_errors);
+    run_test(utf8_matcher_overlapping);
+    run_test(utf8_matcher_matches_reference);
+    run_test(utf8_string_view_basics);
+    run_test(utf8_string_view_slicing);
+    run_test(utf8_string_concat);
+    run_test(utf8_string_insert_erase);
+    run_test(utf8_string_replace);
+    run_test(utf8_string_split);
+    run_test(utf8_string_join);
+    run_test(utf8_rope_basics);
+    run_test(utf8_rope_edits);
+    run_test(utf8_string_pool);
+    run_test(utf8_string_shared_pool);
+    run_test(utf8_string_hash);
+    run_test(utf8_string_map);
+    run_test(utf8_string_decoder);
+    run_test(utf8_string_mapped_file);
+    run_test(utf8_string_allocator_propagating);
+    run_test(utf8_string_allocator_not_propagating);
 }
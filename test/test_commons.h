@@ -29,6 +29,7 @@
 
 #include "../src/utf8string.h"
 #include <iostream>
+#include <chrono>
 
 namespace ryuk {
     namespace tests {
@@ -36,7 +37,7 @@ namespace ryuk {
 
         template<typename T>
         inline void do_not_optimize(T &var) {
-        #if __llvm__
+        #if __llvm__ || __GNUC__
             asm volatile ("": "+r,m" (var) : : "memory");
         #else
             const volatile char *temp = reinterpret_cast<const volatile char *>(var);
@@ -68,6 +69,43 @@ namespace ryuk {
             std::cout << result;
         }
 
+        // runs func in batches for at least a quarter of a second and prints the time per call of the
+        // fastest batch, func returns a checksum so the compiler can't throw the work away
+        template<typename FUNC>
+        void run_benchmark(const char *name, size_t bytes, FUNC func) {
+            using clock = std::chrono::steady_clock;
+            size_t checksum = 0;
+            double best = 0.0;
+            clock::time_point start = clock::now();
+
+            do {
+                size_t iterations = 0;
+                clock::time_point batchStart = clock::now();
+                clock::duration elapsed;
+
+                do {
+                    // the memory clobber keeps the compiler from hoisting func out of the loop
+                    do_not_optimize(iterations);
+                    checksum += func();
+                    ++iterations;
+                    elapsed = clock::now() - batchStart;
+                } while (elapsed < std::chrono::milliseconds(25));
+
+                double seconds = std::chrono::duration<double>(elapsed).count() / iterations;
+                if (best == 0.0 || seconds < best) {
+                    best = seconds;
+                }
+            } while (clock::now() - start < std::chrono::milliseconds(250));
+
+            do_not_optimize(checksum);
+
+            std::cout << name << ": " << best * 1e9 << " ns";
+            if (bytes) {
+                std::cout << ", " << bytes / best / 1e9 << " GB/s";
+            }
+            std::cout << '\n';
+        }
+
         #define test_assert(val, message) { if (!(val)) { return (message); } }
     };
 };